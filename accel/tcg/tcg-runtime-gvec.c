@@ -0,0 +1,275 @@
+/*
+ * Generic vectorized operation runtime
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/host-utils.h"
+#include "cpu.h"
+#include "exec/helper-proto.h"
+#include "tcg-gvec-desc.h"
+
+/*
+ * These are the out-of-line fallbacks for tcg-op-gvec.c, used when the
+ * host backend cannot perform an operation directly and the vector is
+ * too large to expand inline.  The loops are kept simple so that the
+ * compiler is free to vectorize them for the host.
+ */
+
+static inline void clear_high(void *d, intptr_t oprsz, uint32_t desc)
+{
+    intptr_t maxsz = simd_maxsz(desc);
+
+    if (unlikely(maxsz > oprsz)) {
+        memset(d + oprsz, 0, maxsz - oprsz);
+    }
+}
+
+void HELPER(gvec_mov)(void *d, void *a, uint32_t desc)
+{
+    intptr_t oprsz = simd_oprsz(desc);
+
+    memmove(d, a, oprsz);
+    clear_high(d, oprsz, desc);
+}
+
+void HELPER(gvec_not)(void *d, void *a, uint32_t desc)
+{
+    intptr_t oprsz = simd_oprsz(desc);
+    intptr_t i;
+
+    for (i = 0; i < oprsz; i += sizeof(uint64_t)) {
+        *(uint64_t *)(d + i) = ~*(uint64_t *)(a + i);
+    }
+    clear_high(d, oprsz, desc);
+}
+
+#define DO_DUP(SUFF, TYPE, ARGTYPE)                                     \
+void HELPER(glue(gvec_dup, SUFF))(void *d, uint32_t desc, ARGTYPE c)    \
+{                                                                       \
+    intptr_t oprsz = simd_oprsz(desc);                                  \
+    intptr_t i;                                                         \
+                                                                        \
+    for (i = 0; i < oprsz; i += sizeof(TYPE)) {                         \
+        *(TYPE *)(d + i) = c;                                           \
+    }                                                                   \
+    clear_high(d, oprsz, desc);                                         \
+}
+
+DO_DUP(8, uint8_t, uint32_t)
+DO_DUP(16, uint16_t, uint32_t)
+DO_DUP(32, uint32_t, uint32_t)
+DO_DUP(64, uint64_t, uint64_t)
+
+#undef DO_DUP
+
+/* Element-wise operations with two vector inputs.  */
+#define DO_3(NAME, TYPE, OP)                                            \
+void HELPER(NAME)(void *d, void *a, void *b, uint32_t desc)             \
+{                                                                       \
+    intptr_t oprsz = simd_oprsz(desc);                                  \
+    intptr_t i;                                                         \
+                                                                        \
+    for (i = 0; i < oprsz; i += sizeof(TYPE)) {                         \
+        TYPE aa = *(TYPE *)(a + i);                                     \
+        TYPE bb = *(TYPE *)(b + i);                                     \
+        *(TYPE *)(d + i) = OP(aa, bb);                                  \
+    }                                                                   \
+    clear_high(d, oprsz, desc);                                         \
+}
+
+#define DO_ADD(A, B)    ((A) + (B))
+#define DO_SUB(A, B)    ((A) - (B))
+#define DO_AND(A, B)    ((A) & (B))
+#define DO_OR(A, B)     ((A) | (B))
+#define DO_XOR(A, B)    ((A) ^ (B))
+#define DO_ANDC(A, B)   ((A) & ~(B))
+#define DO_ORC(A, B)    ((A) | ~(B))
+
+DO_3(gvec_add8, uint8_t, DO_ADD)
+DO_3(gvec_add16, uint16_t, DO_ADD)
+DO_3(gvec_add32, uint32_t, DO_ADD)
+DO_3(gvec_add64, uint64_t, DO_ADD)
+
+DO_3(gvec_sub8, uint8_t, DO_SUB)
+DO_3(gvec_sub16, uint16_t, DO_SUB)
+DO_3(gvec_sub32, uint32_t, DO_SUB)
+DO_3(gvec_sub64, uint64_t, DO_SUB)
+
+DO_3(gvec_and, uint64_t, DO_AND)
+DO_3(gvec_or, uint64_t, DO_OR)
+DO_3(gvec_xor, uint64_t, DO_XOR)
+DO_3(gvec_andc, uint64_t, DO_ANDC)
+DO_3(gvec_orc, uint64_t, DO_ORC)
+
+/* Saturating arithmetic, computed in a wider type where one exists.  */
+#define DO_SAT(TYPE, WIDE, MIN, MAX, A, OP, B)                          \
+    ({ WIDE r_ = (WIDE)(A) OP (WIDE)(B);                                \
+       (TYPE)(r_ < (MIN) ? (MIN) : r_ > (MAX) ? (MAX) : r_); })
+
+#define DO_SSADD8(A, B)   DO_SAT(int8_t, int, INT8_MIN, INT8_MAX, A, +, B)
+#define DO_SSADD16(A, B)  DO_SAT(int16_t, int, INT16_MIN, INT16_MAX, A, +, B)
+#define DO_SSADD32(A, B) \
+    DO_SAT(int32_t, int64_t, INT32_MIN, INT32_MAX, A, +, B)
+#define DO_SSSUB8(A, B)   DO_SAT(int8_t, int, INT8_MIN, INT8_MAX, A, -, B)
+#define DO_SSSUB16(A, B)  DO_SAT(int16_t, int, INT16_MIN, INT16_MAX, A, -, B)
+#define DO_SSSUB32(A, B) \
+    DO_SAT(int32_t, int64_t, INT32_MIN, INT32_MAX, A, -, B)
+#define DO_USADD8(A, B)   DO_SAT(uint8_t, int, 0, UINT8_MAX, A, +, B)
+#define DO_USADD16(A, B)  DO_SAT(uint16_t, int, 0, UINT16_MAX, A, +, B)
+#define DO_USSUB8(A, B)   DO_SAT(uint8_t, int, 0, UINT8_MAX, A, -, B)
+#define DO_USSUB16(A, B)  DO_SAT(uint16_t, int, 0, UINT16_MAX, A, -, B)
+
+static inline int64_t do_ssadd64(int64_t a, int64_t b)
+{
+    int64_t r = a + b;
+
+    if (((r ^ a) & ~(a ^ b)) < 0) {
+        r = r < 0 ? INT64_MAX : INT64_MIN;
+    }
+    return r;
+}
+
+static inline int64_t do_sssub64(int64_t a, int64_t b)
+{
+    int64_t r = a - b;
+
+    if (((r ^ a) & (a ^ b)) < 0) {
+        r = r < 0 ? INT64_MAX : INT64_MIN;
+    }
+    return r;
+}
+
+static inline uint32_t do_usadd32(uint32_t a, uint32_t b)
+{
+    uint32_t r = a + b;
+    return r < a ? UINT32_MAX : r;
+}
+
+static inline uint64_t do_usadd64(uint64_t a, uint64_t b)
+{
+    uint64_t r = a + b;
+    return r < a ? UINT64_MAX : r;
+}
+
+static inline uint32_t do_ussub32(uint32_t a, uint32_t b)
+{
+    return a < b ? 0 : a - b;
+}
+
+static inline uint64_t do_ussub64(uint64_t a, uint64_t b)
+{
+    return a < b ? 0 : a - b;
+}
+
+DO_3(gvec_ssadd8, int8_t, DO_SSADD8)
+DO_3(gvec_ssadd16, int16_t, DO_SSADD16)
+DO_3(gvec_ssadd32, int32_t, DO_SSADD32)
+DO_3(gvec_ssadd64, int64_t, do_ssadd64)
+
+DO_3(gvec_sssub8, int8_t, DO_SSSUB8)
+DO_3(gvec_sssub16, int16_t, DO_SSSUB16)
+DO_3(gvec_sssub32, int32_t, DO_SSSUB32)
+DO_3(gvec_sssub64, int64_t, do_sssub64)
+
+DO_3(gvec_usadd8, uint8_t, DO_USADD8)
+DO_3(gvec_usadd16, uint16_t, DO_USADD16)
+DO_3(gvec_usadd32, uint32_t, do_usadd32)
+DO_3(gvec_usadd64, uint64_t, do_usadd64)
+
+DO_3(gvec_ussub8, uint8_t, DO_USSUB8)
+DO_3(gvec_ussub16, uint16_t, DO_USSUB16)
+DO_3(gvec_ussub32, uint32_t, do_ussub32)
+DO_3(gvec_ussub64, uint64_t, do_ussub64)
+
+/* Comparisons produce all ones for true, which is -(A OP B).  */
+#define DO_EQ(A, B)     -((A) == (B))
+#define DO_NE(A, B)     -((A) != (B))
+#define DO_LT(A, B)     -((A) < (B))
+#define DO_LE(A, B)     -((A) <= (B))
+
+DO_3(gvec_eq8, uint8_t, DO_EQ)
+DO_3(gvec_eq16, uint16_t, DO_EQ)
+DO_3(gvec_eq32, uint32_t, DO_EQ)
+DO_3(gvec_eq64, uint64_t, DO_EQ)
+
+DO_3(gvec_ne8, uint8_t, DO_NE)
+DO_3(gvec_ne16, uint16_t, DO_NE)
+DO_3(gvec_ne32, uint32_t, DO_NE)
+DO_3(gvec_ne64, uint64_t, DO_NE)
+
+DO_3(gvec_lt8, int8_t, DO_LT)
+DO_3(gvec_lt16, int16_t, DO_LT)
+DO_3(gvec_lt32, int32_t, DO_LT)
+DO_3(gvec_lt64, int64_t, DO_LT)
+
+DO_3(gvec_le8, int8_t, DO_LE)
+DO_3(gvec_le16, int16_t, DO_LE)
+DO_3(gvec_le32, int32_t, DO_LE)
+DO_3(gvec_le64, int64_t, DO_LE)
+
+DO_3(gvec_ltu8, uint8_t, DO_LT)
+DO_3(gvec_ltu16, uint16_t, DO_LT)
+DO_3(gvec_ltu32, uint32_t, DO_LT)
+DO_3(gvec_ltu64, uint64_t, DO_LT)
+
+DO_3(gvec_leu8, uint8_t, DO_LE)
+DO_3(gvec_leu16, uint16_t, DO_LE)
+DO_3(gvec_leu32, uint32_t, DO_LE)
+DO_3(gvec_leu64, uint64_t, DO_LE)
+
+#undef DO_3
+
+/* Element-wise operations with one vector input and an immediate
+   taken from the descriptor.  */
+#define DO_2(NAME, TYPE, OP)                                            \
+void HELPER(NAME)(void *d, void *a, uint32_t desc)                      \
+{                                                                       \
+    intptr_t oprsz = simd_oprsz(desc);                                  \
+    int shift = simd_data(desc);                                        \
+    intptr_t i;                                                         \
+                                                                        \
+    for (i = 0; i < oprsz; i += sizeof(TYPE)) {                         \
+        TYPE aa = *(TYPE *)(a + i);                                     \
+        *(TYPE *)(d + i) = OP(aa, shift);                               \
+    }                                                                   \
+    clear_high(d, oprsz, desc);                                         \
+}
+
+#define DO_NEG(A, S)    (-(A))
+#define DO_SHL(A, S)    ((A) << (S))
+#define DO_SHR(A, S)    ((A) >> (S))
+
+DO_2(gvec_neg8, uint8_t, DO_NEG)
+DO_2(gvec_neg16, uint16_t, DO_NEG)
+DO_2(gvec_neg32, uint32_t, DO_NEG)
+DO_2(gvec_neg64, uint64_t, DO_NEG)
+
+DO_2(gvec_shl8i, uint8_t, DO_SHL)
+DO_2(gvec_shl16i, uint16_t, DO_SHL)
+DO_2(gvec_shl32i, uint32_t, DO_SHL)
+DO_2(gvec_shl64i, uint64_t, DO_SHL)
+
+DO_2(gvec_shr8i, uint8_t, DO_SHR)
+DO_2(gvec_shr16i, uint16_t, DO_SHR)
+DO_2(gvec_shr32i, uint32_t, DO_SHR)
+DO_2(gvec_shr64i, uint64_t, DO_SHR)
+
+DO_2(gvec_sar8i, int8_t, DO_SHR)
+DO_2(gvec_sar16i, int16_t, DO_SHR)
+DO_2(gvec_sar32i, int32_t, DO_SHR)
+DO_2(gvec_sar64i, int64_t, DO_SHR)
+
+#undef DO_2
@@ -27,11 +27,22 @@
 #include "block/accounting.h"
 #include "block/block_int.h"
 #include "qemu/timer.h"
+#include "qemu/host-utils.h"
 #include "sysemu/qtest.h"
 
 static QEMUClockType clock_type = QEMU_CLOCK_REALTIME;
 static const int qtest_latency_ns = NANOSECONDS_PER_SECOND / 1000;
 
+/* Latency histograms are log-linear: latencies below
+ * 1 << (HIST_MIN_SHIFT + precision) ns fall into 1 << precision bins of equal
+ * size, and every following power of two is split into 1 << precision bins
+ * as well.  The relative error is thus at most 2^-precision with a fixed and
+ * small number of bins.  Latencies of 1 << HIST_MAX_SHIFT ns (about a
+ * minute) or more are all counted in the last bin.
+ */
+#define HIST_MIN_SHIFT 10
+#define HIST_MAX_SHIFT 36
+
 void block_acct_init(BlockAcctStats *stats)
 {
     qemu_mutex_init(&stats->lock);
@@ -53,6 +64,7 @@ void block_acct_cleanup(BlockAcctStats *stats)
     QSLIST_FOREACH_SAFE(s, &stats->intervals, entries, next) {
         g_free(s);
     }
+    block_latency_histograms_clear(stats);
     qemu_mutex_destroy(&stats->lock);
 }
 
@@ -94,10 +106,81 @@ void block_acct_start(BlockAcctStats *stats, BlockAcctCookie *cookie,
     cookie->type = type;
 }
 
+/* Returns the bin that @latency_ns is counted in */
+int block_latency_histogram_index(BlockLatencyHistogram *hist,
+                                  int64_t latency_ns)
+{
+    unsigned precision = hist->precision;
+    uint64_t ns = MAX(latency_ns, 0);
+    int msb;
+
+    if (ns < (1ULL << (HIST_MIN_SHIFT + precision))) {
+        return ns >> HIST_MIN_SHIFT;
+    }
+    if (ns >= (1ULL << HIST_MAX_SHIFT)) {
+        return hist->nbins - 1;
+    }
+
+    msb = 63 - clz64(ns);
+    return ((msb - HIST_MIN_SHIFT - precision + 1) << precision) +
+           ((ns >> (msb - precision)) & ((1 << precision) - 1));
+}
+
+/* Returns the lower bound in nanoseconds of @bin */
+uint64_t block_latency_histogram_boundary(BlockLatencyHistogram *hist,
+                                          int bin)
+{
+    unsigned precision = hist->precision;
+    int group = bin >> precision;
+    uint64_t sub = bin & ((1 << precision) - 1);
+
+    assert(bin >= 0 && bin < hist->nbins);
+    if (group == 0) {
+        return sub << HIST_MIN_SHIFT;
+    }
+    return ((1ULL << precision) + sub) << (HIST_MIN_SHIFT + group - 1);
+}
+
+/* (Re)start collecting latency histograms for all request types */
+void block_latency_histograms_set(BlockAcctStats *stats, unsigned precision)
+{
+    int nbins = (HIST_MAX_SHIFT - HIST_MIN_SHIFT - precision + 1) << precision;
+    unsigned i;
+
+    assert(precision <= BLOCK_LATENCY_HISTOGRAM_MAX_PRECISION);
+
+    qemu_mutex_lock(&stats->lock);
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        BlockLatencyHistogram *hist = &stats->latency_histogram[i];
+
+        g_free(hist->bins);
+        hist->precision = precision;
+        hist->nbins = nbins;
+        hist->bins = g_new0(uint64_t, nbins);
+    }
+    qemu_mutex_unlock(&stats->lock);
+}
+
+void block_latency_histograms_clear(BlockAcctStats *stats)
+{
+    unsigned i;
+
+    qemu_mutex_lock(&stats->lock);
+    for (i = 0; i < BLOCK_MAX_IOTYPE; i++) {
+        BlockLatencyHistogram *hist = &stats->latency_histogram[i];
+
+        g_free(hist->bins);
+        hist->bins = NULL;
+        hist->nbins = 0;
+    }
+    qemu_mutex_unlock(&stats->lock);
+}
+
 static void block_account_one_io(BlockAcctStats *stats, BlockAcctCookie *cookie,
                                  bool failed)
 {
     BlockAcctTimedStats *s;
+    BlockLatencyHistogram *hist;
     int64_t time_ns = qemu_clock_get_ns(clock_type);
     int64_t latency_ns = time_ns - cookie->start_time_ns;
 
@@ -123,6 +206,11 @@ static void block_account_one_io(BlockAcctStats *stats, BlockAcctCookie *cookie,
         QSLIST_FOREACH(s, &stats->intervals, entries) {
             timed_average_account(&s->latency[cookie->type], latency_ns);
         }
+
+        hist = &stats->latency_histogram[cookie->type];
+        if (hist->bins) {
+            hist->bins[block_latency_histogram_index(hist, latency_ns)]++;
+        }
     }
 
     qemu_mutex_unlock(&stats->lock);
@@ -27,6 +27,9 @@
 #include "qemu/error-report.h"
 
 #define BACKUP_CLUSTER_SIZE_DEFAULT (1 << 16)
+#define BACKUP_MAX_CHUNK_DEFAULT (1 << 20)
+#define BACKUP_MAX_WORKERS_DEFAULT 16
+#define BACKUP_MAX_WORKERS 64
 #define SLICE_TIME 100000000ULL /* ns */
 
 typedef struct BackupBlockJob {
@@ -43,10 +46,29 @@ typedef struct BackupBlockJob {
     unsigned long *done_bitmap;
     int64_t cluster_size;
     bool compress;
+    /* Try offloaded copies (blk_co_copy_range) until the first failure */
+    bool use_copy_range;
     NotifierWithReturn before_write;
     QLIST_HEAD(, CowRequest) inflight_reqs;
+
+    /* Maximum number of bytes copied by a single request */
+    int64_t max_chunk;
+    /* Background copies run in up to max_workers coroutines */
+    int max_workers;
+    int in_flight;
+    CoQueue in_flight_queue;
+    /* First failed background copy, retried or reported by the main loop */
+    int task_ret;
+    bool task_error_is_read;
+    int64_t task_error_offset;
 } BackupBlockJob;
 
+typedef struct BackupTask {
+    BackupBlockJob *job;
+    int64_t offset;
+    int64_t bytes;
+} BackupTask;
+
 /* See if in-flight requests overlap and wait for them to complete */
 static void coroutine_fn wait_for_overlapping_requests(BackupBlockJob *job,
                                                        int64_t start,
@@ -84,80 +106,141 @@ static void cow_request_end(CowRequest *req)
     qemu_co_queue_restart_all(&req->wait_queue);
 }
 
+/* Copy range to target with a bounce buffer.  Return 0 on success or a
+ * negative error number, with *error_is_read telling which side failed */
+static int coroutine_fn backup_cow_with_bounce_buffer(BackupBlockJob *job,
+                                                      int64_t start,
+                                                      int64_t n,
+                                                      bool is_write_notifier,
+                                                      bool *error_is_read,
+                                                      void **bounce_buffer,
+                                                      int64_t bounce_size)
+{
+    BlockBackend *blk = job->common.blk;
+    struct iovec iov;
+    QEMUIOVector bounce_qiov;
+    int ret;
+
+    assert(n <= bounce_size);
+    if (!*bounce_buffer) {
+        *bounce_buffer = blk_blockalign(blk, bounce_size);
+    }
+    iov.iov_base = *bounce_buffer;
+    iov.iov_len = n;
+    qemu_iovec_init_external(&bounce_qiov, &iov, 1);
+
+    ret = blk_co_preadv(blk, start, bounce_qiov.size, &bounce_qiov,
+                        is_write_notifier ? BDRV_REQ_NO_SERIALISING : 0);
+    if (ret < 0) {
+        trace_backup_do_cow_read_fail(job, start, ret);
+        if (error_is_read) {
+            *error_is_read = true;
+        }
+        return ret;
+    }
+
+    if (buffer_is_zero(iov.iov_base, iov.iov_len)) {
+        ret = blk_co_pwrite_zeroes(job->target, start,
+                                   bounce_qiov.size, BDRV_REQ_MAY_UNMAP);
+    } else {
+        ret = blk_co_pwritev(job->target, start,
+                             bounce_qiov.size, &bounce_qiov,
+                             job->compress ? BDRV_REQ_WRITE_COMPRESSED : 0);
+    }
+    if (ret < 0) {
+        trace_backup_do_cow_write_fail(job, start, ret);
+        if (error_is_read) {
+            *error_is_read = false;
+        }
+        return ret;
+    }
+
+    return 0;
+}
+
+/* Copy range to target without going through userspace.  Return 0 on
+ * success or a negative error number */
+static int coroutine_fn backup_cow_with_offload(BackupBlockJob *job,
+                                                int64_t start,
+                                                int64_t n,
+                                                bool is_write_notifier)
+{
+    int ret;
+
+    ret = blk_co_copy_range(job->common.blk, start, job->target, start, n,
+                            is_write_notifier ? BDRV_REQ_NO_SERIALISING : 0,
+                            0);
+    if (ret < 0) {
+        trace_backup_do_cow_copy_range_fail(job, start, ret);
+    }
+    return ret;
+}
+
 static int coroutine_fn backup_do_cow(BackupBlockJob *job,
                                       int64_t offset, uint64_t bytes,
                                       bool *error_is_read,
                                       bool is_write_notifier)
 {
-    BlockBackend *blk = job->common.blk;
     CowRequest cow_request;
-    struct iovec iov;
-    QEMUIOVector bounce_qiov;
     void *bounce_buffer = NULL;
     int ret = 0;
-    int64_t start, end; /* bytes */
-    int n; /* bytes */
+    int64_t start, end, copy_end; /* bytes */
+    int64_t n, bounce_size; /* bytes */
 
     qemu_co_rwlock_rdlock(&job->flush_rwlock);
 
     start = QEMU_ALIGN_DOWN(offset, job->cluster_size);
     end = QEMU_ALIGN_UP(bytes + offset, job->cluster_size);
+    bounce_size = MIN(end - start, job->max_chunk);
 
     trace_backup_do_cow_enter(job, start, offset, bytes);
 
     wait_for_overlapping_requests(job, start, end);
     cow_request_begin(&cow_request, job, start, end);
 
-    for (; start < end; start += job->cluster_size) {
+    while (start < end) {
         if (test_bit(start / job->cluster_size, job->done_bitmap)) {
             trace_backup_do_cow_skip(job, start);
+            start += job->cluster_size;
             continue; /* already copied */
         }
 
         trace_backup_do_cow_process(job, start);
 
-        n = MIN(job->cluster_size, job->common.len - start);
+        /* Copy all following clusters that still need copying at once */
+        copy_end = find_next_bit(job->done_bitmap, end / job->cluster_size,
+                                 start / job->cluster_size) *
+                   job->cluster_size;
+        copy_end = MIN(copy_end, start + job->max_chunk);
+        n = MIN(copy_end, job->common.len) - start;
 
-        if (!bounce_buffer) {
-            bounce_buffer = blk_blockalign(blk, job->cluster_size);
-        }
-        iov.iov_base = bounce_buffer;
-        iov.iov_len = n;
-        qemu_iovec_init_external(&bounce_qiov, &iov, 1);
-
-        ret = blk_co_preadv(blk, start, bounce_qiov.size, &bounce_qiov,
-                            is_write_notifier ? BDRV_REQ_NO_SERIALISING : 0);
-        if (ret < 0) {
-            trace_backup_do_cow_read_fail(job, start, ret);
-            if (error_is_read) {
-                *error_is_read = true;
+        if (job->use_copy_range) {
+            ret = backup_cow_with_offload(job, start, n, is_write_notifier);
+            if (ret < 0) {
+                /* Fall back to the bounce buffer, which also takes care
+                 * of reporting real I/O errors */
+                job->use_copy_range = false;
             }
-            goto out;
-        }
-
-        if (buffer_is_zero(iov.iov_base, iov.iov_len)) {
-            ret = blk_co_pwrite_zeroes(job->target, start,
-                                       bounce_qiov.size, BDRV_REQ_MAY_UNMAP);
-        } else {
-            ret = blk_co_pwritev(job->target, start,
-                                 bounce_qiov.size, &bounce_qiov,
-                                 job->compress ? BDRV_REQ_WRITE_COMPRESSED : 0);
         }
-        if (ret < 0) {
-            trace_backup_do_cow_write_fail(job, start, ret);
-            if (error_is_read) {
-                *error_is_read = false;
+        if (!job->use_copy_range) {
+            ret = backup_cow_with_bounce_buffer(job, start, n,
+                                                is_write_notifier,
+                                                error_is_read, &bounce_buffer,
+                                                bounce_size);
+            if (ret < 0) {
+                goto out;
             }
-            goto out;
         }
 
-        set_bit(start / job->cluster_size, job->done_bitmap);
+        bitmap_set(job->done_bitmap, start / job->cluster_size,
+                   (copy_end - start) / job->cluster_size);
 
         /* Publish progress, guest I/O counts as progress too.  Note that the
          * offset field is an opaque progress value, it is not a disk offset.
          */
         job->bytes_read += n;
         job->common.offset += n;
+        start = copy_end;
     }
 
 out:
@@ -358,61 +441,156 @@ static bool coroutine_fn yield_and_check(BackupBlockJob *job)
     return false;
 }
 
-static int coroutine_fn backup_run_incremental(BackupBlockJob *job)
+static void coroutine_fn backup_task_entry(void *opaque)
 {
+    BackupTask *task = opaque;
+    BackupBlockJob *job = task->job;
     bool error_is_read;
+    int ret;
+
+    ret = backup_do_cow(job, task->offset, task->bytes, &error_is_read, false);
+    if (ret < 0 &&
+        (job->task_ret == 0 || task->offset < job->task_error_offset)) {
+        job->task_ret = ret;
+        job->task_error_is_read = error_is_read;
+        job->task_error_offset = task->offset;
+    }
+
+    job->in_flight--;
+    qemu_co_queue_restart_all(&job->in_flight_queue);
+    g_free(task);
+}
+
+/* Wait until no more than @limit background copies are in flight */
+static void coroutine_fn backup_wait_for_tasks(BackupBlockJob *job, int limit)
+{
+    while (job->in_flight > limit) {
+        qemu_co_queue_wait(&job->in_flight_queue, NULL);
+    }
+}
+
+/* Copy [@offset, @offset + @bytes) in the background, split into requests of
+ * at most max_chunk bytes.  Waits for a free worker before each request. */
+static void coroutine_fn backup_issue_copy(BackupBlockJob *job,
+                                           int64_t offset, int64_t bytes)
+{
+    while (bytes > 0) {
+        BackupTask *task;
+        int64_t n = MIN(bytes, job->max_chunk);
+
+        backup_wait_for_tasks(job, job->max_workers - 1);
+
+        task = g_new(BackupTask, 1);
+        *task = (BackupTask) {
+            .job    = job,
+            .offset = offset,
+            .bytes  = n,
+        };
+        job->in_flight++;
+        qemu_coroutine_enter(qemu_coroutine_create(backup_task_entry, task));
+
+        offset += n;
+        bytes -= n;
+    }
+}
+
+/* Called after a background copy failed.  Waits for the other copies and
+ * applies the error policy: returns the error if the job must fail, or 0 if
+ * the copy should be retried from *@retry_offset on. */
+static int coroutine_fn backup_handle_task_error(BackupBlockJob *job,
+                                                 int64_t *retry_offset)
+{
+    int ret;
+
+    backup_wait_for_tasks(job, 0);
+
+    ret = job->task_ret;
+    *retry_offset = job->task_error_offset;
+    job->task_ret = 0;
+
+    if (backup_error_action(job, job->task_error_is_read, -ret) ==
+        BLOCK_ERROR_ACTION_REPORT) {
+        return ret;
+    }
+    return 0;
+}
+
+static int coroutine_fn backup_run_incremental(BackupBlockJob *job)
+{
     int ret = 0;
-    int clusters_per_iter;
     uint32_t granularity;
     int64_t offset;
-    int64_t cluster;
-    int64_t end;
-    int64_t last_cluster = -1;
+    int64_t start = -1, end = 0;
+    int64_t last_end = 0;
     BdrvDirtyBitmapIter *dbi;
 
     granularity = bdrv_dirty_bitmap_granularity(job->sync_bitmap);
-    clusters_per_iter = MAX((granularity / job->cluster_size), 1);
     dbi = bdrv_dirty_iter_new(job->sync_bitmap);
 
-    /* Find the next dirty sector(s) */
-    while ((offset = bdrv_dirty_iter_next(dbi)) >= 0) {
-        cluster = offset / job->cluster_size;
+    /* Find the next dirty sector(s), coalescing adjacent dirty clusters */
+    for (;;) {
+        int64_t dirty_start = 0, dirty_end = 0;
 
-        /* Fake progress updates for any clusters we skipped */
-        if (cluster != last_cluster + 1) {
-            job->common.offset += ((cluster - last_cluster - 1) *
-                                   job->cluster_size);
+        if (job->task_ret < 0) {
+            ret = backup_handle_task_error(job, &offset);
+            if (ret < 0) {
+                goto out;
+            }
+            bdrv_set_dirty_iter(dbi, offset);
+            start = -1;
         }
 
-        for (end = cluster + clusters_per_iter; cluster < end; cluster++) {
-            do {
-                if (yield_and_check(job)) {
-                    goto out;
-                }
-                ret = backup_do_cow(job, cluster * job->cluster_size,
-                                    job->cluster_size, &error_is_read,
-                                    false);
-                if ((ret < 0) &&
-                    backup_error_action(job, error_is_read, -ret) ==
-                    BLOCK_ERROR_ACTION_REPORT) {
-                    goto out;
-                }
-            } while (ret < 0);
+        offset = bdrv_dirty_iter_next(dbi);
+        if (offset >= 0) {
+            dirty_start = QEMU_ALIGN_DOWN(offset, job->cluster_size);
+            dirty_end = QEMU_ALIGN_UP(MIN(offset + granularity,
+                                          job->common.len),
+                                      job->cluster_size);
+
+            /* If the bitmap granularity is smaller than the backup
+             * granularity, we need to advance the iterator pointer to the
+             * next cluster. */
+            if (granularity < job->cluster_size &&
+                dirty_end < job->common.len) {
+                bdrv_set_dirty_iter(dbi, dirty_end);
+            }
+
+            if (start >= 0 && dirty_start <= end &&
+                dirty_end - start <= job->max_chunk) {
+                end = MAX(end, dirty_end);
+                continue;
+            }
+        }
+
+        if (start >= 0) {
+            if (yield_and_check(job)) {
+                goto out;
+            }
+
+            /* Fake progress updates for any clusters we skipped */
+            if (start > last_end) {
+                job->common.offset += start - last_end;
+            }
+            last_end = MAX(last_end, MIN(end, job->common.len));
+
+            backup_issue_copy(job, start, end - start);
         }
 
-        /* If the bitmap granularity is smaller than the backup granularity,
-         * we need to advance the iterator pointer to the next cluster. */
-        if (granularity < job->cluster_size) {
-            bdrv_set_dirty_iter(dbi, cluster * job->cluster_size);
+        if (offset < 0) {
+            backup_wait_for_tasks(job, 0);
+            if (job->task_ret < 0) {
+                continue;
+            }
+            break;
         }
 
-        last_cluster = cluster - 1;
+        start = dirty_start;
+        end = dirty_end;
     }
 
     /* Play some final catchup with the progress meter */
-    end = DIV_ROUND_UP(job->common.len, job->cluster_size);
-    if (last_cluster + 1 < end) {
-        job->common.offset += ((end - last_cluster - 1) * job->cluster_size);
+    if (last_end < job->common.len) {
+        job->common.offset += job->common.len - last_end;
     }
 
 out:
@@ -420,6 +598,33 @@ out:
     return ret;
 }
 
+/* For sync=top: returns 1 if the cluster at @offset has data in the top
+ * image, 0 if it doesn't, or a negative error number. */
+static int coroutine_fn backup_cluster_allocated(BackupBlockJob *job,
+                                                 int64_t offset)
+{
+    BlockDriverState *bs = blk_bs(job->common.blk);
+    int alloced = 0;
+    int64_t i, n;
+
+    for (i = 0; i < job->cluster_size;) {
+        /* bdrv_is_allocated() only returns true/false based
+         * on the first set of sectors it comes across that
+         * are are all in the same state.
+         * For that reason we must verify each sector in the
+         * backup cluster length.  We end up copying more than
+         * needed but at some point that is always the case. */
+        alloced = bdrv_is_allocated(bs, offset + i, job->cluster_size - i, &n);
+        i += n;
+
+        if (alloced || n == 0) {
+            break;
+        }
+    }
+
+    return alloced;
+}
+
 static void coroutine_fn backup_run(void *opaque)
 {
     BackupBlockJob *job = opaque;
@@ -430,6 +635,7 @@ static void coroutine_fn backup_run(void *opaque)
 
     QLIST_INIT(&job->inflight_reqs);
     qemu_co_rwlock_init(&job->flush_rwlock);
+    qemu_co_queue_init(&job->in_flight_queue);
 
     job->done_bitmap = bitmap_new(DIV_ROUND_UP(job->common.len,
                                                job->cluster_size));
@@ -447,66 +653,72 @@ static void coroutine_fn backup_run(void *opaque)
         ret = backup_run_incremental(job);
     } else {
         /* Both FULL and TOP SYNC_MODE's require copying.. */
-        for (offset = 0; offset < job->common.len;
-             offset += job->cluster_size) {
-            bool error_is_read;
-            int alloced = 0;
+        offset = 0;
+        for (;;) {
+            int64_t bytes;
+
+            if (job->task_ret < 0) {
+                /* Depending on error action, fail now or retry the copy */
+                ret = backup_handle_task_error(job, &offset);
+                if (ret < 0) {
+                    break;
+                }
+            }
+
+            if (offset >= job->common.len) {
+                backup_wait_for_tasks(job, 0);
+                if (job->task_ret < 0) {
+                    continue;
+                }
+                break;
+            }
 
             if (yield_and_check(job)) {
                 break;
             }
 
             if (job->sync_mode == MIRROR_SYNC_MODE_TOP) {
-                int i;
-                int64_t n;
-
                 /* Check to see if these blocks are already in the
                  * backing file. */
+                int alloced = backup_cluster_allocated(job, offset);
 
-                for (i = 0; i < job->cluster_size;) {
-                    /* bdrv_is_allocated() only returns true/false based
-                     * on the first set of sectors it comes across that
-                     * are are all in the same state.
-                     * For that reason we must verify each sector in the
-                     * backup cluster length.  We end up copying more than
-                     * needed but at some point that is always the case. */
-                    alloced =
-                        bdrv_is_allocated(bs, offset + i,
-                                          job->cluster_size - i, &n);
-                    i += n;
-
-                    if (alloced || n == 0) {
+                if (alloced < 0) {
+                    if (backup_error_action(job, true, -alloced) ==
+                        BLOCK_ERROR_ACTION_REPORT) {
+                        ret = alloced;
                         break;
                     }
+                    continue;
                 }
 
-                /* If the above loop never found any sectors that are in
+                /* If the above check never found any sectors that are in
                  * the topmost image, skip this backup. */
                 if (alloced == 0) {
+                    offset += job->cluster_size;
                     continue;
                 }
-            }
-            /* FULL sync mode we copy the whole drive. */
-            if (alloced < 0) {
-                ret = alloced;
-            } else {
-                ret = backup_do_cow(job, offset, job->cluster_size,
-                                    &error_is_read, false);
-            }
-            if (ret < 0) {
-                /* Depending on error action, fail now or retry cluster */
-                BlockErrorAction action =
-                    backup_error_action(job, error_is_read, -ret);
-                if (action == BLOCK_ERROR_ACTION_REPORT) {
-                    break;
-                } else {
-                    offset -= job->cluster_size;
-                    continue;
+
+                /* Copy following allocated clusters in the same request */
+                bytes = job->cluster_size;
+                while (bytes < job->max_chunk &&
+                       offset + bytes < job->common.len &&
+                       backup_cluster_allocated(job, offset + bytes) > 0) {
+                    bytes += job->cluster_size;
                 }
+            } else {
+                /* FULL sync mode we copy the whole drive. */
+                bytes = job->max_chunk;
             }
+
+            bytes = MIN(bytes, job->common.len - offset);
+            backup_issue_copy(job, offset, bytes);
+            offset += bytes;
         }
     }
 
+    /* Background copies must not outlive the job's loop */
+    backup_wait_for_tasks(job, 0);
+
     notifier_with_return_remove(&job->before_write);
 
     /* wait until pending backup_do_cow() calls have completed */
@@ -534,7 +746,7 @@ static const BlockJobDriver backup_job_driver = {
 BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
                   BlockDriverState *target, int64_t speed,
                   MirrorSyncMode sync_mode, BdrvDirtyBitmap *sync_bitmap,
-                  bool compress,
+                  bool compress, int max_workers, int64_t max_chunk,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   int creation_flags,
@@ -566,6 +778,24 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
         return NULL;
     }
 
+    if (max_workers < 0 || max_workers > BACKUP_MAX_WORKERS) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "max-workers",
+                   "a value between 1 and " stringify(BACKUP_MAX_WORKERS)
+                   ", or 0 for the default");
+        return NULL;
+    }
+
+    if (max_chunk < 0) {
+        error_setg(errp, QERR_INVALID_PARAMETER, "max-chunk");
+        return NULL;
+    }
+
+    if (max_chunk > BDRV_REQUEST_MAX_BYTES) {
+        error_setg(errp, "max-chunk must not exceed %" PRId64 " bytes",
+                   (int64_t)BDRV_REQUEST_MAX_BYTES);
+        return NULL;
+    }
+
     if (compress && target->drv->bdrv_co_pwritev_compressed == NULL) {
         error_setg(errp, "Compression is not supported for this drive %s",
                    bdrv_get_device_name(target));
@@ -631,6 +861,8 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
     job->sync_bitmap = sync_mode == MIRROR_SYNC_MODE_INCREMENTAL ?
                        sync_bitmap : NULL;
     job->compress = compress;
+    /* Compression isn't supported for offloaded copies */
+    job->use_copy_range = !compress;
 
     /* If there is no backing file on the target, we cannot rely on COW if our
      * backup cluster size is smaller than the target cluster size. Even for
@@ -659,6 +891,22 @@ BlockJob *backup_job_create(const char *job_id, BlockDriverState *bs,
         job->cluster_size = MAX(BACKUP_CLUSTER_SIZE_DEFAULT, bdi.cluster_size);
     }
 
+    if (max_chunk % job->cluster_size) {
+        error_setg(errp, "max-chunk must be a multiple of the backup cluster "
+                   "size (%" PRId64 " bytes)", job->cluster_size);
+        goto error;
+    }
+
+    /* Compressed writes are done one cluster at a time */
+    if (compress) {
+        job->max_chunk = job->cluster_size;
+    } else if (max_chunk) {
+        job->max_chunk = max_chunk;
+    } else {
+        job->max_chunk = MAX(BACKUP_MAX_CHUNK_DEFAULT, job->cluster_size);
+    }
+    job->max_workers = max_workers ?: BACKUP_MAX_WORKERS_DEFAULT;
+
     /* Required permissions are already taken with target's blk_new() */
     block_job_add_bdrv(&job->common, "target", target, 0, BLK_PERM_ALL,
                        &error_abort);
@@ -24,6 +24,7 @@
 #include "qemu/osdep.h"
 #include "qapi/error.h"
 #include "qemu-common.h"
+#include "qemu/error-report.h"
 #include "trace.h"
 #include "block/block_int.h"
 #include "block/blockjob.h"
@@ -55,6 +56,13 @@ struct BdrvDirtyBitmap {
     bool autoload;              /* For persistent bitmaps: bitmap must be
                                    autoloaded on image opening */
     bool persistent;            /* bitmap must be saved to owner disk image */
+    HBitmap *unloaded;          /* For lazily loaded bitmaps: chunks whose
+                                   stored data has not been merged yet */
+    HBitmap *changed;           /* For lazily loaded bitmaps: chunks that
+                                   were modified since loading */
+    BdrvDirtyBitmapLoadFunc *load;
+    void *load_opaque;
+    GDestroyNotify load_opaque_free;
     QLIST_ENTRY(BdrvDirtyBitmap) list;
 };
 
@@ -170,6 +178,184 @@ void bdrv_release_meta_dirty_bitmap(BdrvDirtyBitmap *bitmap)
     qemu_mutex_unlock(bitmap->mutex);
 }
 
+/* bdrv_dirty_bitmap_set_lazy_load
+ *
+ * Defer loading the stored content of @bitmap until it is actually needed.
+ * Setting bits does not require the stored data, so the bitmap can track
+ * writes right away; the stored data is merged in chunk by chunk by calling
+ * @load when a chunk is first queried, reset or iterated over.
+ *
+ * If @load fails, the whole chunk is considered dirty, which is safe for all
+ * users of dirty bitmaps.
+ *
+ * @bitmap: the block dirty bitmap to load lazily, must still be empty.
+ * @chunk_size: how many bytes of the disk each call to @load covers.
+ * @load: callback that merges the stored data for one chunk.
+ * @opaque: passed to @load; freed with @opaque_free (if non-NULL) once lazy
+ * loading ends.
+ *
+ * Called with BQL taken.
+ */
+void bdrv_dirty_bitmap_set_lazy_load(BdrvDirtyBitmap *bitmap,
+                                     uint64_t chunk_size,
+                                     BdrvDirtyBitmapLoadFunc *load,
+                                     void *opaque,
+                                     GDestroyNotify opaque_free)
+{
+    assert(!bitmap->load);
+    assert(bitmap->size > 0);
+    assert(is_power_of_2(chunk_size));
+    assert(QEMU_IS_ALIGNED(chunk_size,
+                           bdrv_dirty_bitmap_serialization_align(bitmap)));
+
+    qemu_mutex_lock(bitmap->mutex);
+    bitmap->unloaded = hbitmap_alloc(bitmap->size, ctz64(chunk_size));
+    hbitmap_set(bitmap->unloaded, 0, bitmap->size);
+    bitmap->changed = hbitmap_alloc(bitmap->size, ctz64(chunk_size));
+    bitmap->load = load;
+    bitmap->load_opaque = opaque;
+    bitmap->load_opaque_free = opaque_free;
+    qemu_mutex_unlock(bitmap->mutex);
+}
+
+/* Called with the bitmap lock taken or from the release path.  */
+static void bdrv_dirty_bitmap_free_lazy_load(BdrvDirtyBitmap *bitmap)
+{
+    if (!bitmap->load) {
+        return;
+    }
+
+    hbitmap_free(bitmap->unloaded);
+    hbitmap_free(bitmap->changed);
+    bitmap->unloaded = NULL;
+    bitmap->changed = NULL;
+    if (bitmap->load_opaque_free) {
+        bitmap->load_opaque_free(bitmap->load_opaque);
+    }
+    bitmap->load = NULL;
+    bitmap->load_opaque = NULL;
+    bitmap->load_opaque_free = NULL;
+}
+
+/* Returns the opaque pointer of a lazily loaded bitmap if it was set up with
+ * @load, or NULL otherwise.  */
+void *bdrv_dirty_bitmap_lazy_load_opaque(BdrvDirtyBitmap *bitmap,
+                                         BdrvDirtyBitmapLoadFunc *load)
+{
+    return bitmap->load == load ? bitmap->load_opaque : NULL;
+}
+
+static void bdrv_dirty_bitmap_load_chunk(BdrvDirtyBitmap *bitmap,
+                                         int64_t offset, int64_t bytes)
+{
+    int ret;
+
+    ret = bitmap->load(bitmap, offset, bytes, bitmap->load_opaque);
+
+    qemu_mutex_lock(bitmap->mutex);
+    if (ret < 0) {
+        error_report("Could not load dirty bitmap '%s' at offset %" PRId64
+                     ": %s; treating the range as dirty",
+                     bitmap->name ?: "", offset, strerror(-ret));
+        hbitmap_set(bitmap->bitmap, offset, bytes);
+        hbitmap_set(bitmap->changed, offset, bytes);
+    }
+    hbitmap_reset(bitmap->unloaded, offset, bytes);
+    qemu_mutex_unlock(bitmap->mutex);
+}
+
+/* Merge the stored data for all chunks of a lazily loaded bitmap that
+ * intersect [@offset, @offset + @bytes) and have not been loaded yet.
+ * Must not be called with the bitmap lock taken.  */
+void bdrv_dirty_bitmap_load(BdrvDirtyBitmap *bitmap,
+                            int64_t offset, int64_t bytes)
+{
+    int64_t chunk_size, end;
+
+    if (!bitmap->load || hbitmap_empty(bitmap->unloaded)) {
+        return;
+    }
+
+    chunk_size = INT64_C(1) << hbitmap_granularity(bitmap->unloaded);
+    end = MIN(offset + bytes, bitmap->size);
+    for (offset = QEMU_ALIGN_DOWN(offset, chunk_size); offset < end;
+         offset += chunk_size)
+    {
+        if (hbitmap_get(bitmap->unloaded, offset)) {
+            bdrv_dirty_bitmap_load_chunk(bitmap, offset,
+                                         MIN(chunk_size,
+                                             bitmap->size - offset));
+        }
+    }
+}
+
+/* Load the rest of a lazily loaded bitmap and drop the lazy loading state.
+ * Called with BQL taken.  */
+void bdrv_dirty_bitmap_end_lazy_load(BdrvDirtyBitmap *bitmap)
+{
+    if (!bitmap->load) {
+        return;
+    }
+
+    bdrv_dirty_bitmap_load(bitmap, 0, bitmap->size);
+
+    qemu_mutex_lock(bitmap->mutex);
+    bdrv_dirty_bitmap_free_lazy_load(bitmap);
+    qemu_mutex_unlock(bitmap->mutex);
+}
+
+/* Returns whether the chunk of a lazily loaded bitmap that contains @offset
+ * was modified since loading (or since the last
+ * bdrv_dirty_bitmap_clear_changed() call).  */
+bool bdrv_dirty_bitmap_chunk_changed(BdrvDirtyBitmap *bitmap, int64_t offset)
+{
+    bool changed;
+
+    assert(bitmap->load);
+    qemu_mutex_lock(bitmap->mutex);
+    changed = hbitmap_get(bitmap->changed, offset);
+    qemu_mutex_unlock(bitmap->mutex);
+
+    return changed;
+}
+
+/* Called when the stored data of a lazily loaded bitmap was brought up to
+ * date with its content in memory.  */
+void bdrv_dirty_bitmap_clear_changed(BdrvDirtyBitmap *bitmap)
+{
+    assert(bitmap->load);
+    qemu_mutex_lock(bitmap->mutex);
+    hbitmap_reset_all(bitmap->changed);
+    qemu_mutex_unlock(bitmap->mutex);
+}
+
+/* Record a modification of [@offset, @offset + @bytes) for write-back.
+ * Called within bdrv_dirty_bitmap_lock..unlock */
+static inline void bdrv_dirty_bitmap_mark_changed(BdrvDirtyBitmap *bitmap,
+                                                  int64_t offset,
+                                                  int64_t bytes)
+{
+    if (bitmap->changed && bytes) {
+        hbitmap_set(bitmap->changed, offset, bytes);
+    }
+}
+
+/* Called within bdrv_dirty_bitmap_lock..unlock */
+static inline void bdrv_dirty_bitmap_assert_loaded(
+    const BdrvDirtyBitmap *bitmap, int64_t offset, int64_t bytes)
+{
+    HBitmapIter hbi;
+    int64_t next;
+
+    if (!bitmap->unloaded || !bytes) {
+        return;
+    }
+
+    hbitmap_iter_init(&hbi, bitmap->unloaded, offset);
+    next = hbitmap_iter_next(&hbi);
+    assert(next < 0 || next >= offset + bytes);
+}
+
 int64_t bdrv_dirty_bitmap_size(const BdrvDirtyBitmap *bitmap)
 {
     return bitmap->size;
@@ -289,6 +475,7 @@ BdrvDirtyBitmap *bdrv_reclaim_dirty_bitmap(BlockDriverState *bs,
         error_setg(errp, "Merging of parent and successor bitmap failed");
         return NULL;
     }
+    bdrv_dirty_bitmap_mark_changed(parent, 0, parent->size);
     bdrv_release_dirty_bitmap(bs, successor);
     parent->successor = NULL;
 
@@ -303,6 +490,11 @@ void bdrv_dirty_bitmap_truncate(BlockDriverState *bs, int64_t bytes)
 {
     BdrvDirtyBitmap *bitmap;
 
+    /* The stored data of lazily loaded bitmaps no longer fits the new size */
+    QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
+        bdrv_dirty_bitmap_end_lazy_load(bitmap);
+    }
+
     bdrv_dirty_bitmaps_lock(bs);
     QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
         assert(!bdrv_dirty_bitmap_frozen(bitmap));
@@ -331,6 +523,7 @@ static void bdrv_do_release_matching_dirty_bitmap(
             assert(!bdrv_dirty_bitmap_frozen(bm));
             assert(!bm->meta);
             QLIST_REMOVE(bm, list);
+            bdrv_dirty_bitmap_free_lazy_load(bm);
             hbitmap_free(bm->bitmap);
             g_free(bm->name);
             g_free(bm);
@@ -414,11 +607,19 @@ BlockDirtyInfoList *bdrv_query_dirty_bitmaps(BlockDriverState *bs)
     BlockDirtyInfoList *list = NULL;
     BlockDirtyInfoList **plist = &list;
 
+    /* The dirty count needs the stored data.  Chunks that the image
+     * describes as all zeroes or all ones are merged without any I/O, so
+     * this only reads the bitmap clusters that hold actual data, and only
+     * the first time.  Called with the AioContext of @bs held.  */
+    QLIST_FOREACH(bm, &bs->dirty_bitmaps, list) {
+        bdrv_dirty_bitmap_load(bm, 0, bm->size);
+    }
+
     bdrv_dirty_bitmaps_lock(bs);
     QLIST_FOREACH(bm, &bs->dirty_bitmaps, list) {
         BlockDirtyInfo *info = g_new0(BlockDirtyInfo, 1);
         BlockDirtyInfoList *entry = g_new0(BlockDirtyInfoList, 1);
-        info->count = bdrv_get_dirty_count(bm);
+        info->count = hbitmap_count(bm->bitmap);
         info->granularity = bdrv_dirty_bitmap_granularity(bm);
         info->has_name = !!bm->name;
         info->name = g_strdup(bm->name);
@@ -437,6 +638,7 @@ bool bdrv_get_dirty_locked(BlockDriverState *bs, BdrvDirtyBitmap *bitmap,
                            int64_t offset)
 {
     if (bitmap) {
+        bdrv_dirty_bitmap_assert_loaded(bitmap, offset, 1);
         return hbitmap_get(bitmap->bitmap, offset);
     } else {
         return false;
@@ -470,7 +672,10 @@ uint32_t bdrv_dirty_bitmap_granularity(const BdrvDirtyBitmap *bitmap)
 
 BdrvDirtyBitmapIter *bdrv_dirty_iter_new(BdrvDirtyBitmap *bitmap)
 {
-    BdrvDirtyBitmapIter *iter = g_new(BdrvDirtyBitmapIter, 1);
+    BdrvDirtyBitmapIter *iter;
+
+    bdrv_dirty_bitmap_load(bitmap, 0, bitmap->size);
+    iter = g_new(BdrvDirtyBitmapIter, 1);
     hbitmap_iter_init(&iter->hbi, bitmap->bitmap, 0);
     iter->bitmap = bitmap;
     bitmap->active_iterators++;
@@ -505,9 +710,10 @@ int64_t bdrv_dirty_iter_next(BdrvDirtyBitmapIter *iter)
 void bdrv_set_dirty_bitmap_locked(BdrvDirtyBitmap *bitmap,
                                   int64_t offset, int64_t bytes)
 {
-    assert(bdrv_dirty_bitmap_enabled(bitmap));
+    assert(!bdrv_dirty_bitmap_frozen(bitmap));
     assert(!bdrv_dirty_bitmap_readonly(bitmap));
     hbitmap_set(bitmap->bitmap, offset, bytes);
+    bdrv_dirty_bitmap_mark_changed(bitmap, offset, bytes);
 }
 
 void bdrv_set_dirty_bitmap(BdrvDirtyBitmap *bitmap,
@@ -522,14 +728,17 @@ void bdrv_set_dirty_bitmap(BdrvDirtyBitmap *bitmap,
 void bdrv_reset_dirty_bitmap_locked(BdrvDirtyBitmap *bitmap,
                                     int64_t offset, int64_t bytes)
 {
-    assert(bdrv_dirty_bitmap_enabled(bitmap));
+    assert(!bdrv_dirty_bitmap_frozen(bitmap));
     assert(!bdrv_dirty_bitmap_readonly(bitmap));
+    bdrv_dirty_bitmap_assert_loaded(bitmap, offset, bytes);
     hbitmap_reset(bitmap->bitmap, offset, bytes);
+    bdrv_dirty_bitmap_mark_changed(bitmap, offset, bytes);
 }
 
 void bdrv_reset_dirty_bitmap(BdrvDirtyBitmap *bitmap,
                              int64_t offset, int64_t bytes)
 {
+    bdrv_dirty_bitmap_load(bitmap, offset, bytes);
     bdrv_dirty_bitmap_lock(bitmap);
     bdrv_reset_dirty_bitmap_locked(bitmap, offset, bytes);
     bdrv_dirty_bitmap_unlock(bitmap);
@@ -539,7 +748,16 @@ void bdrv_clear_dirty_bitmap(BdrvDirtyBitmap *bitmap, HBitmap **out)
 {
     assert(bdrv_dirty_bitmap_enabled(bitmap));
     assert(!bdrv_dirty_bitmap_readonly(bitmap));
+    if (out) {
+        /* @out must hold the complete old content */
+        bdrv_dirty_bitmap_load(bitmap, 0, bitmap->size);
+    }
     bdrv_dirty_bitmap_lock(bitmap);
+    if (bitmap->load) {
+        /* Whatever is still stored is cleared as well */
+        hbitmap_reset_all(bitmap->unloaded);
+    }
+    bdrv_dirty_bitmap_mark_changed(bitmap, 0, bitmap->size);
     if (!out) {
         hbitmap_reset_all(bitmap->bitmap);
     } else {
@@ -558,6 +776,7 @@ void bdrv_undo_clear_dirty_bitmap(BdrvDirtyBitmap *bitmap, HBitmap *in)
     assert(!bdrv_dirty_bitmap_readonly(bitmap));
     bitmap->bitmap = in;
     hbitmap_free(tmp);
+    bdrv_dirty_bitmap_mark_changed(bitmap, 0, bitmap->size);
 }
 
 uint64_t bdrv_dirty_bitmap_serialization_size(const BdrvDirtyBitmap *bitmap,
@@ -575,6 +794,7 @@ void bdrv_dirty_bitmap_serialize_part(const BdrvDirtyBitmap *bitmap,
                                       uint8_t *buf, uint64_t offset,
                                       uint64_t bytes)
 {
+    bdrv_dirty_bitmap_assert_loaded(bitmap, offset, bytes);
     hbitmap_serialize_part(bitmap->bitmap, buf, offset, bytes);
 }
 
@@ -585,6 +805,18 @@ void bdrv_dirty_bitmap_deserialize_part(BdrvDirtyBitmap *bitmap,
     hbitmap_deserialize_part(bitmap->bitmap, buf, offset, bytes, finish);
 }
 
+/* Merge stored data into a lazily loaded bitmap, see
+ * bdrv_dirty_bitmap_set_lazy_load().  The merged bits do not count as
+ * changes.  */
+void bdrv_dirty_bitmap_merge_part(BdrvDirtyBitmap *bitmap,
+                                  uint8_t *buf, uint64_t offset,
+                                  uint64_t bytes)
+{
+    bdrv_dirty_bitmap_lock(bitmap);
+    hbitmap_merge_part(bitmap->bitmap, buf, offset, bytes);
+    bdrv_dirty_bitmap_unlock(bitmap);
+}
+
 void bdrv_dirty_bitmap_deserialize_zeroes(BdrvDirtyBitmap *bitmap,
                                           uint64_t offset, uint64_t bytes,
                                           bool finish)
@@ -619,6 +851,7 @@ void bdrv_set_dirty(BlockDriverState *bs, int64_t offset, int64_t bytes)
         }
         assert(!bdrv_dirty_bitmap_readonly(bitmap));
         hbitmap_set(bitmap->bitmap, offset, bytes);
+        bdrv_dirty_bitmap_mark_changed(bitmap, offset, bytes);
     }
     bdrv_dirty_bitmaps_unlock(bs);
 }
@@ -633,6 +866,7 @@ void bdrv_set_dirty_iter(BdrvDirtyBitmapIter *iter, int64_t offset)
 
 int64_t bdrv_get_dirty_count(BdrvDirtyBitmap *bitmap)
 {
+    bdrv_dirty_bitmap_load(bitmap, 0, bitmap->size);
     return hbitmap_count(bitmap->bitmap);
 }
 
@@ -713,5 +947,6 @@ BdrvDirtyBitmap *bdrv_dirty_bitmap_next(BlockDriverState *bs,
 
 char *bdrv_dirty_bitmap_sha256(const BdrvDirtyBitmap *bitmap, Error **errp)
 {
+    bdrv_dirty_bitmap_assert_loaded(bitmap, 0, bitmap->size);
     return hbitmap_sha256(bitmap->bitmap, errp);
 }
@@ -73,8 +73,18 @@ typedef struct MirrorBlockJob {
     int target_cluster_size;
     int max_iov;
     bool initial_zeroing_ongoing;
+    /* Try offloaded copies (bdrv_co_copy_range) until the first failure */
+    bool use_copy_range;
+    MirrorCopyMode copy_mode;
+    /* Number of guest writes currently being copied by the filter node */
+    int active_writes;
 } MirrorBlockJob;
 
+typedef struct MirrorBDSOpaque {
+    /* Set while guest writes are copied synchronously to the target */
+    MirrorBlockJob *job;
+} MirrorBDSOpaque;
+
 typedef struct MirrorOp {
     MirrorBlockJob *s;
     QEMUIOVector qiov;
@@ -174,6 +184,27 @@ static void mirror_read_complete(void *opaque, int ret)
     aio_context_release(blk_get_aio_context(s->common.blk));
 }
 
+static void coroutine_fn mirror_co_copy_range(void *opaque)
+{
+    MirrorOp *op = opaque;
+    MirrorBlockJob *s = op->s;
+    int ret;
+
+    ret = blk_co_copy_range(s->common.blk, op->offset, s->target, op->offset,
+                            op->bytes, 0, 0);
+    if (ret < 0) {
+        /* Copy through the buffers from now on; a real I/O error will be
+         * reported by the regular read/write path */
+        trace_mirror_copy_range_fallback(s, op->offset, op->bytes, ret);
+        s->use_copy_range = false;
+        blk_aio_preadv(s->common.blk, op->offset, &op->qiov, 0,
+                       mirror_read_complete, op);
+        return;
+    }
+
+    mirror_write_complete(op, 0);
+}
+
 /* Clip bytes relative to offset to not exceed end-of-file */
 static inline int64_t mirror_clip_bytes(MirrorBlockJob *s,
                                         int64_t offset,
@@ -291,7 +322,13 @@ static uint64_t mirror_do_read(MirrorBlockJob *s, int64_t offset,
     s->bytes_in_flight += bytes;
     trace_mirror_one_iteration(s, offset, bytes);
 
-    blk_aio_preadv(source, offset, &op->qiov, 0, mirror_read_complete, op);
+    if (s->use_copy_range) {
+        Coroutine *co = qemu_coroutine_create(mirror_co_copy_range, op);
+        bdrv_coroutine_enter(blk_bs(source), co);
+    } else {
+        blk_aio_preadv(source, offset, &op->qiov, 0, mirror_read_complete,
+                       op);
+    }
     return ret;
 }
 
@@ -686,6 +723,35 @@ static int mirror_flush(MirrorBlockJob *s)
     return ret;
 }
 
+/* From now on, the filter node copies guest writes to the target itself.
+ * The dirty bitmap stops tracking writes on its own; the filter node marks
+ * only those chunks dirty that it could not copy synchronously.
+ */
+static void mirror_start_active_mode(MirrorBlockJob *s)
+{
+    MirrorBDSOpaque *bs_opaque = s->mirror_top_bs->opaque;
+
+    bdrv_disable_dirty_bitmap(s->dirty_bitmap);
+    bs_opaque->job = s;
+    trace_mirror_start_active_mode(s);
+}
+
+static void coroutine_fn mirror_stop_active_mode(MirrorBlockJob *s)
+{
+    MirrorBDSOpaque *bs_opaque = s->mirror_top_bs->opaque;
+
+    if (!bs_opaque->job) {
+        return;
+    }
+    bs_opaque->job = NULL;
+    bdrv_enable_dirty_bitmap(s->dirty_bitmap);
+
+    /* Writes that are still being copied use the in-flight bitmap */
+    while (s->active_writes > 0) {
+        mirror_wait_for_io(s);
+    }
+}
+
 static void coroutine_fn mirror_run(void *opaque)
 {
     MirrorBlockJob *s = opaque;
@@ -760,6 +826,7 @@ static void coroutine_fn mirror_run(void *opaque)
         s->cow_bitmap = bitmap_new(length);
     }
     s->max_iov = MIN(bs->bl.max_iov, target_bs->bl.max_iov);
+    s->use_copy_range = true;
 
     s->buf = qemu_try_blockalign(bs, s->buf_size);
     if (s->buf == NULL) {
@@ -777,6 +844,10 @@ static void coroutine_fn mirror_run(void *opaque)
         }
     }
 
+    if (s->copy_mode == MIRROR_COPY_MODE_WRITE_BLOCKING) {
+        mirror_start_active_mode(s);
+    }
+
     assert(!s->dbi);
     s->dbi = bdrv_dirty_iter_new(s->dirty_bitmap);
     for (;;) {
@@ -882,6 +953,7 @@ static void coroutine_fn mirror_run(void *opaque)
     }
 
 immediate_exit:
+    mirror_stop_active_mode(s);
     if (s->in_flight > 0) {
         /* We get here only if something went wrong.  Either the job failed,
          * or it was cancelled prematurely so that we do not guarantee that
@@ -1027,10 +1099,153 @@ static int coroutine_fn bdrv_mirror_top_preadv(BlockDriverState *bs,
     return bdrv_co_preadv(bs->backing, offset, bytes, qiov, flags);
 }
 
+/* Claim the chunks touched by a guest write that are in sync between source
+ * and target, i.e. neither dirty nor being copied.  They are marked in
+ * @clean (relative to @start_chunk) and in s->in_flight_bitmap, so that
+ * neither the background copy nor other guest writes touch them until
+ * mirror_active_write_settle() is called.
+ */
+static void mirror_active_write_prepare(MirrorBlockJob *s,
+                                        unsigned long *clean,
+                                        int64_t start_chunk, int nb_chunks)
+{
+    int i;
+
+    bdrv_dirty_bitmap_lock(s->dirty_bitmap);
+    for (i = 0; i < nb_chunks; i++) {
+        int64_t chunk = start_chunk + i;
+
+        if (s->ret >= 0 && !test_bit(chunk, s->in_flight_bitmap) &&
+            !bdrv_get_dirty_locked(s->source, s->dirty_bitmap,
+                                   chunk * s->granularity)) {
+            set_bit(i, clean);
+        }
+    }
+    bdrv_dirty_bitmap_unlock(s->dirty_bitmap);
+
+    for (i = 0; i < nb_chunks; i++) {
+        if (test_bit(i, clean)) {
+            set_bit(start_chunk + i, s->in_flight_bitmap);
+        }
+    }
+    s->active_writes++;
+}
+
+/* Copy the part of a guest write that lies in the claimed chunks to the
+ * target; @qiov is NULL for write zeroes requests.  The guest request is
+ * completed only after this, so the claimed chunks never become dirty.
+ * Chunks that cannot be copied are left for the background copy.
+ */
+static void coroutine_fn mirror_active_write_settle(MirrorBlockJob *s,
+                                                    int64_t offset,
+                                                    uint64_t bytes,
+                                                    QEMUIOVector *qiov,
+                                                    int flags,
+                                                    unsigned long *clean,
+                                                    int64_t start_chunk,
+                                                    int nb_chunks,
+                                                    bool source_ok)
+{
+    int i = 0;
+
+    while (i < nb_chunks) {
+        int64_t run_offset, run_end, copy_offset, copy_end;
+        int run_chunks, ret = 0;
+
+        if (!test_bit(i, clean)) {
+            /* Not in sync, or already being copied by someone else */
+            bdrv_set_dirty_bitmap(s->dirty_bitmap,
+                                  (start_chunk + i) * s->granularity,
+                                  s->granularity);
+            i++;
+            continue;
+        }
+
+        run_chunks = find_next_zero_bit(clean, nb_chunks, i) - i;
+        run_offset = (start_chunk + i) * s->granularity;
+        run_end = MIN(run_offset + run_chunks * s->granularity,
+                      s->bdev_length);
+        copy_offset = MAX(offset, run_offset);
+        copy_end = MIN(offset + bytes, run_end);
+
+        if (!source_ok) {
+            /* Whatever reached the source must still reach the target */
+            ret = -EIO;
+        } else if (qiov) {
+            QEMUIOVector target_qiov;
+
+            qemu_iovec_init(&target_qiov, qiov->niov);
+            qemu_iovec_concat(&target_qiov, qiov, copy_offset - offset,
+                              copy_end - copy_offset);
+            ret = blk_co_pwritev(s->target, copy_offset,
+                                 copy_end - copy_offset, &target_qiov, flags);
+            qemu_iovec_destroy(&target_qiov);
+        } else {
+            ret = blk_co_pwrite_zeroes(s->target, copy_offset,
+                                       copy_end - copy_offset, flags);
+        }
+        trace_mirror_active_write(s, copy_offset, copy_end - copy_offset, ret);
+
+        if (ret < 0) {
+            bdrv_set_dirty_bitmap(s->dirty_bitmap, run_offset,
+                                  run_end - run_offset);
+            if (source_ok) {
+                BlockErrorAction action;
+
+                action = mirror_error_action(s, false, -ret);
+                if (action == BLOCK_ERROR_ACTION_REPORT && s->ret >= 0) {
+                    s->ret = ret;
+                }
+            }
+        }
+        bitmap_clear(s->in_flight_bitmap, start_chunk + i, run_chunks);
+        i += run_chunks;
+    }
+
+    s->active_writes--;
+    if (s->waiting_for_io) {
+        qemu_coroutine_enter(s->common.co);
+    }
+}
+
+static int coroutine_fn bdrv_mirror_top_do_write(BlockDriverState *bs,
+    uint64_t offset, uint64_t bytes, QEMUIOVector *qiov, int flags)
+{
+    MirrorBDSOpaque *bs_opaque = bs->opaque;
+    MirrorBlockJob *s = bs_opaque->job;
+    unsigned long *clean;
+    int64_t start_chunk, end;
+    int nb_chunks, ret;
+
+    if (!s || offset >= s->bdev_length) {
+        if (qiov) {
+            return bdrv_co_pwritev(bs->backing, offset, bytes, qiov, flags);
+        }
+        return bdrv_co_pwrite_zeroes(bs->backing, offset, bytes, flags);
+    }
+
+    end = MIN(offset + bytes, s->bdev_length);
+    start_chunk = offset / s->granularity;
+    nb_chunks = DIV_ROUND_UP(end, s->granularity) - start_chunk;
+    clean = bitmap_new(nb_chunks);
+
+    mirror_active_write_prepare(s, clean, start_chunk, nb_chunks);
+    if (qiov) {
+        ret = bdrv_co_pwritev(bs->backing, offset, bytes, qiov, flags);
+    } else {
+        ret = bdrv_co_pwrite_zeroes(bs->backing, offset, bytes, flags);
+    }
+    mirror_active_write_settle(s, offset, bytes, qiov, flags, clean,
+                               start_chunk, nb_chunks, ret >= 0);
+
+    g_free(clean);
+    return ret;
+}
+
 static int coroutine_fn bdrv_mirror_top_pwritev(BlockDriverState *bs,
     uint64_t offset, uint64_t bytes, QEMUIOVector *qiov, int flags)
 {
-    return bdrv_co_pwritev(bs->backing, offset, bytes, qiov, flags);
+    return bdrv_mirror_top_do_write(bs, offset, bytes, qiov, flags);
 }
 
 static int coroutine_fn bdrv_mirror_top_flush(BlockDriverState *bs)
@@ -1045,13 +1260,31 @@ static int coroutine_fn bdrv_mirror_top_flush(BlockDriverState *bs)
 static int coroutine_fn bdrv_mirror_top_pwrite_zeroes(BlockDriverState *bs,
     int64_t offset, int bytes, BdrvRequestFlags flags)
 {
-    return bdrv_co_pwrite_zeroes(bs->backing, offset, bytes, flags);
+    return bdrv_mirror_top_do_write(bs, offset, bytes, NULL, flags);
 }
 
 static int coroutine_fn bdrv_mirror_top_pdiscard(BlockDriverState *bs,
     int64_t offset, int bytes)
 {
-    return bdrv_co_pdiscard(bs->backing->bs, offset, bytes);
+    MirrorBDSOpaque *bs_opaque = bs->opaque;
+    int ret;
+
+    ret = bdrv_co_pdiscard(bs->backing->bs, offset, bytes);
+
+    /* Discarded data reads back undefined; let the background copy take
+     * care of it instead of discarding on the target too. */
+    if (bs_opaque->job && ret >= 0) {
+        bdrv_set_dirty_bitmap(bs_opaque->job->dirty_bitmap, offset, bytes);
+    }
+    return ret;
+}
+
+static int coroutine_fn bdrv_mirror_top_copy_range_from(BlockDriverState *bs,
+    BdrvChild *src, uint64_t src_offset, BdrvChild *dst, uint64_t dst_offset,
+    uint64_t bytes, BdrvRequestFlags read_flags, BdrvRequestFlags write_flags)
+{
+    return bdrv_co_copy_range_from(bs->backing, src_offset, dst, dst_offset,
+                                   bytes, read_flags, write_flags);
 }
 
 static void bdrv_mirror_top_refresh_filename(BlockDriverState *bs, QDict *opts)
@@ -1089,10 +1322,12 @@ static void bdrv_mirror_top_child_perm(BlockDriverState *bs, BdrvChild *c,
  * from its backing file and that allows writes on the backing file chain. */
 static BlockDriver bdrv_mirror_top = {
     .format_name                = "mirror_top",
+    .instance_size              = sizeof(MirrorBDSOpaque),
     .bdrv_co_preadv             = bdrv_mirror_top_preadv,
     .bdrv_co_pwritev            = bdrv_mirror_top_pwritev,
     .bdrv_co_pwrite_zeroes      = bdrv_mirror_top_pwrite_zeroes,
     .bdrv_co_pdiscard           = bdrv_mirror_top_pdiscard,
+    .bdrv_co_copy_range_from    = bdrv_mirror_top_copy_range_from,
     .bdrv_co_flush              = bdrv_mirror_top_flush,
     .bdrv_co_get_block_status   = bdrv_co_get_block_status_from_backing,
     .bdrv_refresh_filename      = bdrv_mirror_top_refresh_filename,
@@ -1105,6 +1340,7 @@ static void mirror_start_job(const char *job_id, BlockDriverState *bs,
                              const char *replaces, int64_t speed,
                              uint32_t granularity, int64_t buf_size,
                              BlockMirrorBackingMode backing_mode,
+                             MirrorCopyMode copy_mode,
                              BlockdevOnError on_source_error,
                              BlockdevOnError on_target_error,
                              bool unmap,
@@ -1219,6 +1455,7 @@ static void mirror_start_job(const char *job_id, BlockDriverState *bs,
     s->granularity = granularity;
     s->buf_size = ROUND_UP(buf_size, granularity);
     s->unmap = unmap;
+    s->copy_mode = copy_mode;
     if (auto_complete) {
         s->should_complete = true;
     }
@@ -1276,7 +1513,7 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
                   BlockDriverState *target, const char *replaces,
                   int64_t speed, uint32_t granularity, int64_t buf_size,
                   MirrorSyncMode mode, BlockMirrorBackingMode backing_mode,
-                  BlockdevOnError on_source_error,
+                  MirrorCopyMode copy_mode, BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   bool unmap, const char *filter_node_name, Error **errp)
 {
@@ -1290,7 +1527,7 @@ void mirror_start(const char *job_id, BlockDriverState *bs,
     is_none_mode = mode == MIRROR_SYNC_MODE_NONE;
     base = mode == MIRROR_SYNC_MODE_TOP ? backing_bs(bs) : NULL;
     mirror_start_job(job_id, bs, BLOCK_JOB_DEFAULT, target, replaces,
-                     speed, granularity, buf_size, backing_mode,
+                     speed, granularity, buf_size, backing_mode, copy_mode,
                      on_source_error, on_target_error, unmap, NULL, NULL,
                      &mirror_job_driver, is_none_mode, base, false,
                      filter_node_name, true, errp);
@@ -1313,7 +1550,7 @@ void commit_active_start(const char *job_id, BlockDriverState *bs,
     }
 
     mirror_start_job(job_id, bs, creation_flags, base, NULL, speed, 0, 0,
-                     MIRROR_LEAVE_BACKING_CHAIN,
+                     MIRROR_LEAVE_BACKING_CHAIN, MIRROR_COPY_MODE_BACKGROUND,
                      on_error, on_error, true, cb, opaque,
                      &commit_active_job_driver, false, base, auto_complete,
                      filter_node_name, false, &local_err);
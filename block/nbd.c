@@ -39,6 +39,7 @@
 #include "qapi/qmp/qjson.h"
 #include "qapi/qmp/qstring.h"
 #include "qemu/cutils.h"
+#include "qemu/error-report.h"
 
 #define EN_OPTSTR ":exportname="
 
@@ -48,6 +49,7 @@ typedef struct BDRVNBDState {
     /* For nbd_refresh_filename() */
     SocketAddress *saddr;
     char *export, *tlscredsid;
+    int64_t connections;
 } BDRVNBDState;
 
 static int nbd_parse_uri(const char *filename, QDict *options)
@@ -388,6 +390,11 @@ static QemuOptsList nbd_runtime_opts = {
             .type = QEMU_OPT_STRING,
             .help = "ID of the TLS credentials to use",
         },
+        {
+            .name = "connections",
+            .type = QEMU_OPT_NUMBER,
+            .help = "Number of connections to the server (default: 1)",
+        },
     },
 };
 
@@ -401,6 +408,7 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
     QCryptoTLSCreds *tlscreds = NULL;
     const char *hostname = NULL;
     int ret = -EINVAL;
+    int i;
 
     opts = qemu_opts_create(&nbd_runtime_opts, NULL, 0, &error_abort);
     qemu_opts_absorb_qdict(opts, options, &local_err);
@@ -437,6 +445,13 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
         hostname = s->saddr->u.inet.host;
     }
 
+    s->connections = qemu_opt_get_number(opts, "connections", 1);
+    if (s->connections < 1 || s->connections > NBD_MAX_CONNECTIONS) {
+        error_setg(errp, "connections must be between 1 and %d",
+                   NBD_MAX_CONNECTIONS);
+        goto error;
+    }
+
     /* establish TCP connection, return error if it fails
      * TODO: Configurable retry-until-timeout behaviour.
      */
@@ -449,6 +464,34 @@ static int nbd_open(BlockDriverState *bs, QDict *options, int flags,
     /* NBD handshake */
     ret = nbd_client_init(bs, sioc, s->export,
                           tlscreds, hostname, errp);
+    if (ret < 0) {
+        goto error;
+    }
+
+    /* Spreading requests over several connections is only safe if the
+     * server keeps them coherent, in particular across flushes */
+    if (s->connections > 1 &&
+        !(s->client.info.flags & NBD_FLAG_CAN_MULTI_CONN)) {
+        warn_report("NBD server does not support multiple connections, "
+                    "using a single connection");
+        s->connections = 1;
+    }
+    for (i = 1; i < s->connections; i++) {
+        object_unref(OBJECT(sioc));
+        sioc = nbd_establish_connection(s->saddr, errp);
+        if (!sioc) {
+            nbd_client_close(bs);
+            ret = -ECONNREFUSED;
+            goto error;
+        }
+        ret = nbd_client_add_connection(bs, sioc, s->export,
+                                        tlscreds, hostname, errp);
+        if (ret < 0) {
+            nbd_client_close(bs);
+            goto error;
+        }
+    }
+
  error:
     if (sioc) {
         object_unref(OBJECT(sioc));
@@ -560,6 +603,9 @@ static void nbd_refresh_filename(BlockDriverState *bs, QDict *options)
     if (s->tlscredsid) {
         qdict_put_str(opts, "tls-creds", s->tlscredsid);
     }
+    if (s->connections > 1) {
+        qdict_put_int(opts, "connections", s->connections);
+    }
 
     qdict_flatten(opts);
     bs->full_open_options = opts;
@@ -577,6 +623,7 @@ static BlockDriver bdrv_nbd = {
     .bdrv_close                 = nbd_close,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_pdiscard           = nbd_client_co_pdiscard,
+    .bdrv_co_get_block_status   = nbd_client_co_get_block_status,
     .bdrv_refresh_limits        = nbd_refresh_limits,
     .bdrv_getlength             = nbd_getlength,
     .bdrv_detach_aio_context    = nbd_detach_aio_context,
@@ -596,6 +643,7 @@ static BlockDriver bdrv_nbd_tcp = {
     .bdrv_close                 = nbd_close,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_pdiscard           = nbd_client_co_pdiscard,
+    .bdrv_co_get_block_status   = nbd_client_co_get_block_status,
     .bdrv_refresh_limits        = nbd_refresh_limits,
     .bdrv_getlength             = nbd_getlength,
     .bdrv_detach_aio_context    = nbd_detach_aio_context,
@@ -615,6 +663,7 @@ static BlockDriver bdrv_nbd_unix = {
     .bdrv_close                 = nbd_close,
     .bdrv_co_flush_to_os        = nbd_co_flush,
     .bdrv_co_pdiscard           = nbd_client_co_pdiscard,
+    .bdrv_co_get_block_status   = nbd_client_co_get_block_status,
     .bdrv_refresh_limits        = nbd_refresh_limits,
     .bdrv_getlength             = nbd_getlength,
     .bdrv_detach_aio_context    = nbd_detach_aio_context,
@@ -364,8 +364,13 @@ static void bdrv_query_info(BlockBackend *blk, BlockInfo **p_info,
     }
 
     if (bs && !QLIST_EMPTY(&bs->dirty_bitmaps)) {
+        AioContext *aio_context = bdrv_get_aio_context(bs);
+
+        /* Counting may read the stored data of persistent bitmaps */
+        aio_context_acquire(aio_context);
         info->has_dirty_bitmaps = true;
         info->dirty_bitmaps = bdrv_query_dirty_bitmaps(bs);
+        aio_context_release(aio_context);
     }
 
     if (bs && bs->drv) {
@@ -383,10 +388,37 @@ static void bdrv_query_info(BlockBackend *blk, BlockInfo **p_info,
     qapi_free_BlockInfo(info);
 }
 
+/* Called with stats->lock held */
+static BlockLatencyHistogramInfo *
+bdrv_latency_histogram_info(BlockLatencyHistogram *hist)
+{
+    BlockLatencyHistogramInfo *info;
+    uint64List **p_boundary, **p_bin;
+    int i;
+
+    info = g_new0(BlockLatencyHistogramInfo, 1);
+    p_boundary = &info->boundaries;
+    p_bin = &info->bins;
+
+    for (i = 0; i < hist->nbins; i++) {
+        if (i > 0) {
+            *p_boundary = g_new0(uint64List, 1);
+            (*p_boundary)->value = block_latency_histogram_boundary(hist, i);
+            p_boundary = &(*p_boundary)->next;
+        }
+        *p_bin = g_new0(uint64List, 1);
+        (*p_bin)->value = hist->bins[i];
+        p_bin = &(*p_bin)->next;
+    }
+
+    return info;
+}
+
 static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
 {
     BlockAcctStats *stats = blk_get_stats(blk);
     BlockAcctTimedStats *ts = NULL;
+    BlockLatencyHistogram *hist = stats->latency_histogram;
 
     ds->rd_bytes = stats->nr_bytes[BLOCK_ACCT_READ];
     ds->wr_bytes = stats->nr_bytes[BLOCK_ACCT_WRITE];
@@ -417,6 +449,20 @@ static void bdrv_query_blk_stats(BlockDeviceStats *ds, BlockBackend *blk)
     ds->account_invalid = stats->account_invalid;
     ds->account_failed = stats->account_failed;
 
+    qemu_mutex_lock(&stats->lock);
+    if (hist[BLOCK_ACCT_READ].bins) {
+        ds->has_x_rd_latency_histogram = true;
+        ds->x_rd_latency_histogram =
+            bdrv_latency_histogram_info(&hist[BLOCK_ACCT_READ]);
+        ds->has_x_wr_latency_histogram = true;
+        ds->x_wr_latency_histogram =
+            bdrv_latency_histogram_info(&hist[BLOCK_ACCT_WRITE]);
+        ds->has_x_flush_latency_histogram = true;
+        ds->x_flush_latency_histogram =
+            bdrv_latency_histogram_info(&hist[BLOCK_ACCT_FLUSH]);
+    }
+    qemu_mutex_unlock(&stats->lock);
+
     while ((ts = block_acct_interval_next(stats, ts))) {
         BlockDeviceTimedStatsList *timed_stats =
             g_malloc0(sizeof(*timed_stats));
@@ -87,11 +87,20 @@ typedef struct Qcow2Bitmap {
     char *name;
 
     BdrvDirtyBitmap *dirty_bitmap;
+    bool store_in_place;
 
     QSIMPLEQ_ENTRY(Qcow2Bitmap) entry;
 } Qcow2Bitmap;
 typedef QSIMPLEQ_HEAD(Qcow2BitmapList, Qcow2Bitmap) Qcow2BitmapList;
 
+/* State of a lazily loaded bitmap, owned by its BdrvDirtyBitmap */
+typedef struct Qcow2LazyBitmap {
+    BlockDriverState *bs;
+    uint64_t table_offset;
+    uint32_t table_size;
+    uint64_t *table;
+} Qcow2LazyBitmap;
+
 typedef enum BitmapType {
     BT_DIRTY_TRACKING_BITMAP = 1
 } BitmapType;
@@ -281,70 +290,67 @@ static uint64_t bytes_covered_by_bitmap_cluster(const BDRVQcow2State *s,
     return limit;
 }
 
-/* load_bitmap_data
- * @bitmap_table entries must satisfy specification constraints.
- * @bitmap must be cleared */
-static int load_bitmap_data(BlockDriverState *bs,
-                            const uint64_t *bitmap_table,
-                            uint32_t bitmap_table_size,
-                            BdrvDirtyBitmap *bitmap)
+static void lazy_bitmap_free(gpointer opaque)
 {
-    int ret = 0;
+    Qcow2LazyBitmap *lb = opaque;
+
+    g_free(lb->table);
+    g_free(lb);
+}
+
+/* load_bitmap_chunk
+ * BdrvDirtyBitmapLoadFunc for lazily loaded bitmaps: merges the data of the
+ * bitmap cluster that covers @offset into @bitmap. */
+static int load_bitmap_chunk(BdrvDirtyBitmap *bitmap, uint64_t offset,
+                             uint64_t bytes, void *opaque)
+{
+    Qcow2LazyBitmap *lb = opaque;
+    BlockDriverState *bs = lb->bs;
     BDRVQcow2State *s = bs->opaque;
-    uint64_t offset, limit;
-    uint64_t bm_size = bdrv_dirty_bitmap_size(bitmap);
-    uint8_t *buf = NULL;
-    uint64_t i, tab_size =
-            size_to_clusters(s,
-                bdrv_dirty_bitmap_serialization_size(bitmap, 0, bm_size));
+    uint64_t limit = bytes_covered_by_bitmap_cluster(s, bitmap);
+    uint64_t entry, data_offset;
+    uint8_t *buf;
+    int ret;
 
-    if (tab_size != bitmap_table_size || tab_size > BME_MAX_TABLE_SIZE) {
-        return -EINVAL;
-    }
+    assert(QEMU_IS_ALIGNED(offset, limit) && bytes <= limit);
+    assert(offset / limit < lb->table_size);
 
-    buf = g_malloc(s->cluster_size);
-    limit = bytes_covered_by_bitmap_cluster(s, bitmap);
-    for (i = 0, offset = 0; i < tab_size; ++i, offset += limit) {
-        uint64_t count = MIN(bm_size - offset, limit);
-        uint64_t entry = bitmap_table[i];
-        uint64_t data_offset = entry & BME_TABLE_ENTRY_OFFSET_MASK;
+    entry = lb->table[offset / limit];
+    data_offset = entry & BME_TABLE_ENTRY_OFFSET_MASK;
+    assert(check_table_entry(entry, s->cluster_size) == 0);
 
-        assert(check_table_entry(entry, s->cluster_size) == 0);
+    if (data_offset == 0 && !(entry & BME_TABLE_ENTRY_FLAG_ALL_ONES)) {
+        /* Nothing to merge, the chunk is all zeroes */
+        return 0;
+    }
 
-        if (data_offset == 0) {
-            if (entry & BME_TABLE_ENTRY_FLAG_ALL_ONES) {
-                bdrv_dirty_bitmap_deserialize_ones(bitmap, offset, count,
-                                                   false);
-            } else {
-                /* No need to deserialize zeros because the dirty bitmap is
-                 * already cleared */
-            }
-        } else {
-            ret = bdrv_pread(bs->file, data_offset, buf, s->cluster_size);
-            if (ret < 0) {
-                goto finish;
-            }
-            bdrv_dirty_bitmap_deserialize_part(bitmap, buf, offset, count,
-                                               false);
+    buf = g_malloc(s->cluster_size);
+    if (data_offset == 0) {
+        memset(buf, 0xff, s->cluster_size);
+    } else {
+        ret = bdrv_pread(bs->file, data_offset, buf, s->cluster_size);
+        if (ret < 0) {
+            g_free(buf);
+            return ret;
         }
     }
-    ret = 0;
-
-    bdrv_dirty_bitmap_deserialize_finish(bitmap);
 
-finish:
+    bdrv_dirty_bitmap_merge_part(bitmap, buf, offset, bytes);
     g_free(buf);
 
-    return ret;
+    return 0;
 }
 
 static BdrvDirtyBitmap *load_bitmap(BlockDriverState *bs,
                                     Qcow2Bitmap *bm, Error **errp)
 {
     int ret;
+    BDRVQcow2State *s = bs->opaque;
     uint64_t *bitmap_table = NULL;
+    uint64_t bm_size, tab_size;
     uint32_t granularity;
     BdrvDirtyBitmap *bitmap = NULL;
+    Qcow2LazyBitmap *lb;
 
     if (bm->flags & BME_FLAG_IN_USE) {
         error_setg(errp, "Bitmap '%s' is in use", bm->name);
@@ -365,14 +371,28 @@ static BdrvDirtyBitmap *load_bitmap(BlockDriverState *bs,
         goto fail;
     }
 
-    ret = load_bitmap_data(bs, bitmap_table, bm->table.size, bitmap);
-    if (ret < 0) {
-        error_setg_errno(errp, -ret, "Could not read bitmap '%s' from image",
+    bm_size = bdrv_dirty_bitmap_size(bitmap);
+    tab_size = size_to_clusters(s,
+        bdrv_dirty_bitmap_serialization_size(bitmap, 0, bm_size));
+    if (tab_size != bm->table.size || tab_size > BME_MAX_TABLE_SIZE) {
+        error_setg_errno(errp, EINVAL, "Could not read bitmap '%s' from image",
                          bm->name);
         goto fail;
     }
 
-    g_free(bitmap_table);
+    /* The bitmap data is only read when it is actually needed, so opening
+     * and closing the image does not scale with the size of the bitmap */
+    lb = g_new(Qcow2LazyBitmap, 1);
+    *lb = (Qcow2LazyBitmap) {
+        .bs             = bs,
+        .table_offset   = bm->table.offset,
+        .table_size     = bm->table.size,
+        .table          = bitmap_table,
+    };
+    bdrv_dirty_bitmap_set_lazy_load(bitmap,
+                                    bytes_covered_by_bitmap_cluster(s, bitmap),
+                                    load_bitmap_chunk, lb, lazy_bitmap_free);
+
     return bitmap;
 
 fail:
@@ -1233,6 +1253,152 @@ fail:
     return ret;
 }
 
+/* store_bitmap_in_place()
+ * Write back a lazily loaded bitmap whose table in the image is still the one
+ * it was loaded from.  Only the bitmap clusters that changed since loading are
+ * rewritten; the bitmap table is reused and only updated if clusters had to be
+ * allocated or could be freed.  Clusters are only freed once the updated table
+ * that no longer refers to them is on disk.
+ */
+static int store_bitmap_in_place(BlockDriverState *bs, Qcow2Bitmap *bm,
+                                 Qcow2LazyBitmap *lb, Error **errp)
+{
+    int ret = 0;
+    BDRVQcow2State *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap = bm->dirty_bitmap;
+    const char *bm_name = bdrv_dirty_bitmap_name(bitmap);
+    uint64_t bm_size = bdrv_dirty_bitmap_size(bitmap);
+    uint64_t limit = bytes_covered_by_bitmap_cluster(s, bitmap);
+    uint64_t offset, *tb, *be_tb = NULL, *freed;
+    uint8_t *buf;
+    bool table_changed = false, table_written = false;
+    uint32_t i, nb_freed = 0;
+
+    assert(lb->table_offset == bm->table.offset &&
+           lb->table_size == bm->table.size);
+
+    tb = g_memdup(lb->table, lb->table_size * sizeof(tb[0]));
+    freed = g_new(uint64_t, lb->table_size);
+    buf = g_malloc(s->cluster_size);
+    for (i = 0, offset = 0; i < lb->table_size; ++i, offset += limit) {
+        uint64_t end = MIN(bm_size, offset + limit);
+        uint64_t data_offset = tb[i] & BME_TABLE_ENTRY_OFFSET_MASK;
+        uint64_t write_size;
+
+        if (!bdrv_dirty_bitmap_chunk_changed(bitmap, offset)) {
+            continue;
+        }
+
+        /* Chunks that were only written to still need their old data */
+        bdrv_dirty_bitmap_load(bitmap, offset, end - offset);
+
+        write_size = bdrv_dirty_bitmap_serialization_size(bitmap, offset,
+                                                          end - offset);
+        assert(write_size <= s->cluster_size);
+        bdrv_dirty_bitmap_serialize_part(bitmap, buf, offset, end - offset);
+        if (write_size < s->cluster_size) {
+            memset(buf + write_size, 0, s->cluster_size - write_size);
+        }
+
+        if (buffer_is_zero(buf, s->cluster_size)) {
+            if (tb[i] != 0) {
+                if (data_offset) {
+                    freed[nb_freed++] = data_offset;
+                }
+                tb[i] = 0;
+                table_changed = true;
+            }
+            continue;
+        }
+
+        if (data_offset == 0) {
+            int64_t off = qcow2_alloc_clusters(bs, s->cluster_size);
+            if (off < 0) {
+                error_setg_errno(errp, -off,
+                                 "Failed to allocate clusters for bitmap '%s'",
+                                 bm_name);
+                ret = off;
+                goto out;
+            }
+            data_offset = off;
+            tb[i] = off;
+            table_changed = true;
+        }
+
+        ret = qcow2_pre_write_overlap_check(bs, 0, data_offset,
+                                            s->cluster_size);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Qcow2 overlap check failed");
+            goto out;
+        }
+
+        ret = bdrv_pwrite(bs->file, data_offset, buf, s->cluster_size);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Failed to write bitmap '%s' to file",
+                             bm_name);
+            goto out;
+        }
+    }
+
+    if (table_changed) {
+        be_tb = g_memdup(tb, lb->table_size * sizeof(tb[0]));
+        bitmap_table_to_be(be_tb, lb->table_size);
+
+        ret = qcow2_pre_write_overlap_check(bs, 0, lb->table_offset,
+                                            lb->table_size * sizeof(tb[0]));
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Qcow2 overlap check failed");
+            goto out;
+        }
+
+        table_written = true;
+        ret = bdrv_pwrite(bs->file, lb->table_offset, be_tb,
+                          lb->table_size * sizeof(tb[0]));
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Failed to write bitmap '%s' to file",
+                             bm_name);
+            goto out;
+        }
+
+        ret = bdrv_flush(bs->file->bs);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Failed to flush bitmap '%s'",
+                             bm_name);
+            goto out;
+        }
+
+        for (i = 0; i < nb_freed; i++) {
+            qcow2_free_clusters(bs, freed[i], s->cluster_size,
+                                QCOW2_DISCARD_OTHER);
+        }
+        memcpy(lb->table, tb, lb->table_size * sizeof(tb[0]));
+    }
+
+    bdrv_dirty_bitmap_clear_changed(bitmap);
+    ret = 0;
+
+out:
+    if (ret < 0 && !table_written) {
+        /* Nothing in the image refers to the clusters allocated above yet.
+         * Once the table may have been written they are leaked instead. */
+        for (i = 0; i < lb->table_size; i++) {
+            uint64_t new_offset = tb[i] & BME_TABLE_ENTRY_OFFSET_MASK;
+
+            if (new_offset &&
+                !(lb->table[i] & BME_TABLE_ENTRY_OFFSET_MASK)) {
+                qcow2_free_clusters(bs, new_offset, s->cluster_size,
+                                    QCOW2_DISCARD_OTHER);
+            }
+        }
+    }
+    g_free(be_tb);
+    g_free(freed);
+    g_free(tb);
+    g_free(buf);
+
+    return ret;
+}
+
 static Qcow2Bitmap *find_bitmap_by_name(Qcow2BitmapList *bm_list,
                                         const char *name)
 {
@@ -1255,6 +1421,7 @@ void qcow2_remove_persistent_dirty_bitmap(BlockDriverState *bs,
     BDRVQcow2State *s = bs->opaque;
     Qcow2Bitmap *bm;
     Qcow2BitmapList *bm_list;
+    BdrvDirtyBitmap *dirty_bitmap;
 
     if (s->nb_bitmaps == 0) {
         /* Absence of the bitmap is not an error: see explanation above
@@ -1281,6 +1448,12 @@ void qcow2_remove_persistent_dirty_bitmap(BlockDriverState *bs,
         goto fail;
     }
 
+    /* The in-memory bitmap must not read the freed clusters later */
+    dirty_bitmap = bdrv_find_dirty_bitmap(bs, name);
+    if (dirty_bitmap != NULL) {
+        bdrv_dirty_bitmap_end_lazy_load(dirty_bitmap);
+    }
+
     free_bitmap_clusters(bs, &bm->table);
 
 fail:
@@ -1359,15 +1532,31 @@ void qcow2_store_persistent_dirty_bitmaps(BlockDriverState *bs, Error **errp)
             bm->name = g_strdup(name);
             QSIMPLEQ_INSERT_TAIL(bm_list, bm, entry);
         } else {
+            Qcow2LazyBitmap *lb;
+
             if (!(bm->flags & BME_FLAG_IN_USE)) {
                 error_setg(errp, "Bitmap '%s' already exists in the image",
                            name);
                 goto fail;
             }
-            tb = g_memdup(&bm->table, sizeof(bm->table));
-            bm->table.offset = 0;
-            bm->table.size = 0;
-            QSIMPLEQ_INSERT_TAIL(&drop_tables, tb, entry);
+
+            lb = bdrv_dirty_bitmap_lazy_load_opaque(bitmap,
+                                                    load_bitmap_chunk);
+            if (lb != NULL && lb->bs == bs &&
+                lb->table_offset == bm->table.offset &&
+                lb->table_size == bm->table.size)
+            {
+                /* Only write back what changed since loading */
+                bm->store_in_place = true;
+            } else {
+                /* The old table is dropped, so the bitmap must not refer to
+                 * it any more */
+                bdrv_dirty_bitmap_end_lazy_load(bitmap);
+                tb = g_memdup(&bm->table, sizeof(bm->table));
+                bm->table.offset = 0;
+                bm->table.size = 0;
+                QSIMPLEQ_INSERT_TAIL(&drop_tables, tb, entry);
+            }
         }
         bm->flags = bdrv_dirty_bitmap_get_autoload(bitmap) ? BME_FLAG_AUTO : 0;
         bm->granularity_bits = ctz32(bdrv_dirty_bitmap_granularity(bitmap));
@@ -1380,7 +1569,14 @@ void qcow2_store_persistent_dirty_bitmaps(BlockDriverState *bs, Error **errp)
             continue;
         }
 
-        ret = store_bitmap(bs, bm, errp);
+        if (bm->store_in_place) {
+            ret = store_bitmap_in_place(bs, bm,
+                bdrv_dirty_bitmap_lazy_load_opaque(bm->dirty_bitmap,
+                                                   load_bitmap_chunk),
+                errp);
+        } else {
+            ret = store_bitmap(bs, bm, errp);
+        }
         if (ret < 0) {
             goto fail;
         }
@@ -1404,7 +1600,9 @@ void qcow2_store_persistent_dirty_bitmaps(BlockDriverState *bs, Error **errp)
 
 fail:
     QSIMPLEQ_FOREACH(bm, bm_list, entry) {
-        if (bm->dirty_bitmap == NULL || bm->table.offset == 0) {
+        if (bm->dirty_bitmap == NULL || bm->table.offset == 0 ||
+            bm->store_in_place)
+        {
             continue;
         }
 
@@ -33,32 +33,41 @@ typedef struct Qcow2CachedTable {
     uint64_t lru_counter;
     int      ref;
     bool     dirty;
+    uint64_t dirty_epoch;   /* flush_epoch of the cache when last dirtied */
 } Qcow2CachedTable;
 
 struct Qcow2Cache {
     Qcow2CachedTable       *entries;
     struct Qcow2Cache      *depends;
     int                     size;
+    int                     table_size;
     bool                    depends_on_flush;
     void                   *table_array;
     uint64_t                lru_counter;
     uint64_t                cache_clean_lru_counter;
+
+    /* Every flush of the dependencies starts a new epoch.  Tables dirtied
+     * in an epoch before stable_epoch depend on nothing that is not on
+     * disk yet. */
+    uint64_t                flush_epoch;
+    uint64_t                stable_epoch;
+    /* Set while a group commit waits for the flush with s->lock dropped */
+    bool                    flushing;
+    CoQueue                 flush_queue;
 };
 
 static inline void *qcow2_cache_get_table_addr(BlockDriverState *bs,
                     Qcow2Cache *c, int table)
 {
-    BDRVQcow2State *s = bs->opaque;
-    return (uint8_t *) c->table_array + (size_t) table * s->cluster_size;
+    return (uint8_t *) c->table_array + (size_t) table * c->table_size;
 }
 
 static inline int qcow2_cache_get_table_idx(BlockDriverState *bs,
                   Qcow2Cache *c, void *table)
 {
-    BDRVQcow2State *s = bs->opaque;
     ptrdiff_t table_offset = (uint8_t *) table - (uint8_t *) c->table_array;
-    int idx = table_offset / s->cluster_size;
-    assert(idx >= 0 && idx < c->size && table_offset % s->cluster_size == 0);
+    int idx = table_offset / c->table_size;
+    assert(idx >= 0 && idx < c->size && table_offset % c->table_size == 0);
     return idx;
 }
 
@@ -67,10 +76,9 @@ static void qcow2_cache_table_release(BlockDriverState *bs, Qcow2Cache *c,
 {
 /* Using MADV_DONTNEED to discard memory is a Linux-specific feature */
 #ifdef CONFIG_LINUX
-    BDRVQcow2State *s = bs->opaque;
     void *t = qcow2_cache_get_table_addr(bs, c, i);
     int align = getpagesize();
-    size_t mem_size = (size_t) s->cluster_size * num_tables;
+    size_t mem_size = (size_t) c->table_size * num_tables;
     size_t offset = QEMU_ALIGN_UP((uintptr_t) t, align) - (uintptr_t) t;
     size_t length = QEMU_ALIGN_DOWN(mem_size - offset, align);
     if (length > 0) {
@@ -79,6 +87,18 @@ static void qcow2_cache_table_release(BlockDriverState *bs, Qcow2Cache *c,
 #endif
 }
 
+static const char *qcow2_cache_get_name(BDRVQcow2State *s, Qcow2Cache *c)
+{
+    if (c == s->refcount_block_cache) {
+        return "refcount block";
+    } else if (c == s->l2_table_cache) {
+        return "L2 table";
+    } else {
+        /* Do not abort, because this is not critical */
+        return "unknown";
+    }
+}
+
 static inline bool can_clean_entry(Qcow2Cache *c, int i)
 {
     Qcow2CachedTable *t = &c->entries[i];
@@ -113,16 +133,24 @@ void qcow2_cache_clean_unused(BlockDriverState *bs, Qcow2Cache *c)
     c->cache_clean_lru_counter = c->lru_counter;
 }
 
-Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables)
+Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
+                               unsigned table_size)
 {
     BDRVQcow2State *s = bs->opaque;
     Qcow2Cache *c;
 
+    assert(num_tables > 0);
+    assert(is_power_of_2(table_size));
+    assert(table_size >= (1 << MIN_CLUSTER_BITS));
+    assert(table_size <= s->cluster_size);
+
     c = g_new0(Qcow2Cache, 1);
     c->size = num_tables;
+    c->table_size = table_size;
     c->entries = g_try_new0(Qcow2CachedTable, num_tables);
+    qemu_co_queue_init(&c->flush_queue);
     c->table_array = qemu_try_blockalign(bs->file->bs,
-                                         (size_t) num_tables * s->cluster_size);
+                                         (size_t) num_tables * c->table_size);
 
     if (!c->entries || !c->table_array) {
         qemu_vfree(c->table_array);
@@ -138,6 +166,7 @@ int qcow2_cache_destroy(BlockDriverState *bs, Qcow2Cache *c)
 {
     int i;
 
+    assert(!c->flushing);
     for (i = 0; i < c->size; i++) {
         assert(c->entries[i].ref == 0);
     }
@@ -149,17 +178,109 @@ int qcow2_cache_destroy(BlockDriverState *bs, Qcow2Cache *c)
     return 0;
 }
 
+/* Whether table i must wait for a flush of the dependencies of the cache
+ * before it can be written */
+static bool qcow2_cache_entry_needs_dependency(Qcow2Cache *c, int i)
+{
+    return c->entries[i].dirty_epoch >= c->stable_epoch &&
+        (c->depends || c->depends_on_flush ||
+         c->flush_epoch != c->stable_epoch);
+}
+
+/* Write back the tables this cache depends on and start a new epoch.
+ * The tables dirtied before become safe to write once the caller has
+ * flushed bs->file and advanced stable_epoch to the returned epoch. */
+static int64_t qcow2_cache_write_dependency(BlockDriverState *bs,
+                                            Qcow2Cache *c)
+{
+    int ret;
+
+    if (c->depends) {
+        ret = qcow2_cache_write(bs, c->depends);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    c->depends = NULL;
+    c->depends_on_flush = false;
+
+    return ++c->flush_epoch;
+}
+
 static int qcow2_cache_flush_dependency(BlockDriverState *bs, Qcow2Cache *c)
 {
+    int64_t epoch;
     int ret;
 
-    ret = qcow2_cache_flush(bs, c->depends);
+    epoch = qcow2_cache_write_dependency(bs, c);
+    if (epoch < 0) {
+        return epoch;
+    }
+
+    /* s->lock is held, so the epoch cannot have changed meanwhile */
+    ret = bdrv_flush(bs->file->bs);
     if (ret < 0) {
         return ret;
     }
 
-    c->depends = NULL;
-    c->depends_on_flush = false;
+    c->stable_epoch = epoch;
+
+    return 0;
+}
+
+/*
+ * Group commit: make sure that the dependencies of every table that is
+ * dirty in @c now are on disk, but flush bs->file with s->lock dropped.
+ * Allocations that run meanwhile only wait for the lock as usual, and
+ * callers that come in during the flush wait for it and then share a
+ * single flush for all of their updates.
+ *
+ * Must be called with s->lock held, and only where dropping it is safe,
+ * i.e. not while holding a cache table or with metadata half updated.
+ */
+int coroutine_fn qcow2_cache_commit_dependency(BlockDriverState *bs,
+                                               Qcow2Cache *c)
+{
+    BDRVQcow2State *s = bs->opaque;
+    /* Tables dirtied so far have a dirty_epoch of at most this */
+    uint64_t epoch = c->flush_epoch;
+    int64_t new_epoch;
+    int ret;
+
+    while (c->stable_epoch <= epoch) {
+        if (c->flushing) {
+            qemu_co_queue_wait(&c->flush_queue, &s->lock);
+            continue;
+        }
+
+        if (!c->depends && !c->depends_on_flush &&
+            c->flush_epoch == c->stable_epoch) {
+            break;
+        }
+
+        new_epoch = qcow2_cache_write_dependency(bs, c);
+        if (new_epoch < 0) {
+            return new_epoch;
+        }
+
+        trace_qcow2_cache_group_commit(qemu_coroutine_self(),
+                                       c == s->l2_table_cache, new_epoch);
+
+        c->flushing = true;
+        qemu_co_mutex_unlock(&s->lock);
+        ret = bdrv_flush(bs->file->bs);
+        qemu_co_mutex_lock(&s->lock);
+        c->flushing = false;
+        qemu_co_queue_restart_all(&c->flush_queue);
+
+        if (ret < 0) {
+            return ret;
+        }
+
+        /* A flush under s->lock may have finished a later epoch already */
+        c->stable_epoch = MAX(c->stable_epoch, new_epoch);
+    }
 
     return 0;
 }
@@ -176,28 +297,30 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
     trace_qcow2_cache_entry_flush(qemu_coroutine_self(),
                                   c == s->l2_table_cache, i);
 
-    if (c->depends) {
+    /* A table last changed before the dependencies were last flushed
+     * cannot refer to anything that is not on disk yet, so it need not
+     * wait for updates that later allocations made.  If a group commit
+     * is still waiting for its flush, this flushes again rather than
+     * dropping s->lock here. */
+    if (qcow2_cache_entry_needs_dependency(c, i)) {
         ret = qcow2_cache_flush_dependency(bs, c);
-    } else if (c->depends_on_flush) {
-        ret = bdrv_flush(bs->file->bs);
-        if (ret >= 0) {
-            c->depends_on_flush = false;
+        if (ret < 0) {
+            return ret;
         }
-    }
-
-    if (ret < 0) {
-        return ret;
+    } else if (c->depends || c->depends_on_flush) {
+        trace_qcow2_cache_entry_flush_nodep(qemu_coroutine_self(),
+                                            c == s->l2_table_cache, i);
     }
 
     if (c == s->refcount_block_cache) {
         ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_REFCOUNT_BLOCK,
-                c->entries[i].offset, s->cluster_size);
+                c->entries[i].offset, c->table_size);
     } else if (c == s->l2_table_cache) {
         ret = qcow2_pre_write_overlap_check(bs, QCOW2_OL_ACTIVE_L2,
-                c->entries[i].offset, s->cluster_size);
+                c->entries[i].offset, c->table_size);
     } else {
         ret = qcow2_pre_write_overlap_check(bs, 0,
-                c->entries[i].offset, s->cluster_size);
+                c->entries[i].offset, c->table_size);
     }
 
     if (ret < 0) {
@@ -211,7 +334,7 @@ static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c, int i)
     }
 
     ret = bdrv_pwrite(bs->file, c->entries[i].offset,
-                      qcow2_cache_get_table_addr(bs, c, i), s->cluster_size);
+                      qcow2_cache_get_table_addr(bs, c, i), c->table_size);
     if (ret < 0) {
         return ret;
     }
@@ -317,8 +440,15 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
     trace_qcow2_cache_get(qemu_coroutine_self(), c == s->l2_table_cache,
                           offset, read_from_disk);
 
+    if (!QEMU_IS_ALIGNED(offset, c->table_size)) {
+        qcow2_signal_corruption(bs, true, -1, -1, "Cannot get entry from %s "
+                                "cache: offset %#" PRIx64 " is unaligned",
+                                qcow2_cache_get_name(s, c), offset);
+        return -EIO;
+    }
+
     /* Check if the table is already cached */
-    i = lookup_index = (offset / s->cluster_size * 4) % c->size;
+    i = lookup_index = (offset / c->table_size * 4) % c->size;
     do {
         const Qcow2CachedTable *t = &c->entries[i];
         if (t->offset == offset) {
@@ -359,7 +489,7 @@ static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c,
 
         ret = bdrv_pread(bs->file, offset,
                          qcow2_cache_get_table_addr(bs, c, i),
-                         s->cluster_size);
+                         c->table_size);
         if (ret < 0) {
             return ret;
         }
@@ -390,6 +520,30 @@ int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     return qcow2_cache_do_get(bs, c, offset, table, false);
 }
 
+/* Whether getting the table at @offset has to replace a table that first
+ * needs a flush of the dependencies of the cache */
+bool qcow2_cache_get_needs_flush(BlockDriverState *bs, Qcow2Cache *c,
+                                 uint64_t offset)
+{
+    uint64_t min_lru_counter = UINT64_MAX;
+    int min_lru_index = -1;
+    int i;
+
+    for (i = 0; i < c->size; i++) {
+        const Qcow2CachedTable *t = &c->entries[i];
+        if (t->offset == offset) {
+            return false;
+        }
+        if (t->ref == 0 && t->lru_counter < min_lru_counter) {
+            min_lru_counter = t->lru_counter;
+            min_lru_index = i;
+        }
+    }
+
+    return min_lru_index >= 0 && c->entries[min_lru_index].dirty &&
+        qcow2_cache_entry_needs_dependency(c, min_lru_index);
+}
+
 void qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
 {
     int i = qcow2_cache_get_table_idx(bs, c, *table);
@@ -410,6 +564,7 @@ void qcow2_cache_entry_mark_dirty(BlockDriverState *bs, Qcow2Cache *c,
     int i = qcow2_cache_get_table_idx(bs, c, table);
     assert(c->entries[i].offset != 0);
     c->entries[i].dirty = true;
+    c->entries[i].dirty_epoch = c->flush_epoch;
 }
 
 void *qcow2_cache_is_table_offset(BlockDriverState *bs, Qcow2Cache *c,
@@ -189,7 +189,11 @@ void qmp_nbd_server_add(const char *device, bool has_writable, bool writable,
         writable = false;
     }
 
-    exp = nbd_export_new(bs, 0, -1, writable ? 0 : NBD_FLAG_READ_ONLY,
+    /* All clients go through the same BlockBackend, so a flush from one
+     * of them also covers writes completed by the others */
+    exp = nbd_export_new(bs, 0, -1,
+                         (writable ? 0 : NBD_FLAG_READ_ONLY) |
+                         NBD_FLAG_CAN_MULTI_CONN,
                          NULL, false, on_eject_blk, errp);
     if (!exp) {
         return;
@@ -370,13 +370,9 @@ static void extract_common_blockdev_options(QemuOpts *opts, int *bdrv_flags,
         }
 
         if ((aio = qemu_opt_get(opts, "aio")) != NULL) {
-            if (!strcmp(aio, "native")) {
-                *bdrv_flags |= BDRV_O_NATIVE_AIO;
-            } else if (!strcmp(aio, "threads")) {
-                /* this is the default */
-            } else {
-               error_setg(errp, "invalid aio option");
-               return;
+            if (bdrv_parse_aio(aio, bdrv_flags) < 0) {
+                error_setg(errp, "invalid aio option");
+                return;
             }
         }
     }
@@ -2026,6 +2022,10 @@ static void block_dirty_bitmap_clear_prepare(BlkActionState *common,
         return;
     }
 
+    /* Filling the backup may read stored bitmap data */
+    state->aio_context = bdrv_get_aio_context(state->bs);
+    aio_context_acquire(state->aio_context);
+
     if (bdrv_dirty_bitmap_frozen(state->bitmap)) {
         error_setg(errp, "Cannot modify a frozen bitmap");
         return;
@@ -2604,6 +2604,39 @@ fail:
     bdrv_unref(medium_bs);
 }
 
+void qmp_x_block_latency_histogram_set(bool has_device, const char *device,
+                                       bool has_id, const char *id,
+                                       bool enable,
+                                       bool has_precision, uint8_t precision,
+                                       Error **errp)
+{
+    BlockBackend *blk;
+    BlockAcctStats *stats;
+
+    blk = qmp_get_blk(has_device ? device : NULL, has_id ? id : NULL, errp);
+    if (!blk) {
+        return;
+    }
+    stats = blk_get_stats(blk);
+
+    if (!enable) {
+        block_latency_histograms_clear(stats);
+        return;
+    }
+
+    if (!has_precision) {
+        precision = BLOCK_LATENCY_HISTOGRAM_DEFAULT_PRECISION;
+    }
+    if (precision > BLOCK_LATENCY_HISTOGRAM_MAX_PRECISION) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "precision",
+                   "a value in range [0, "
+                   stringify(BLOCK_LATENCY_HISTOGRAM_MAX_PRECISION) "]");
+        return;
+    }
+
+    block_latency_histograms_set(stats, precision);
+}
+
 /* throttling disk I/O limits */
 void qmp_block_set_io_throttle(BlockIOThrottle *arg, Error **errp)
 {
@@ -2803,6 +2836,7 @@ void qmp_block_dirty_bitmap_clear(const char *node, const char *name,
 {
     BdrvDirtyBitmap *bitmap;
     BlockDriverState *bs;
+    AioContext *aio_context;
 
     bitmap = block_dirty_bitmap_lookup(node, name, &bs, errp);
     if (!bitmap || !bs) {
@@ -2824,7 +2858,10 @@ void qmp_block_dirty_bitmap_clear(const char *node, const char *name,
         return;
     }
 
+    aio_context = bdrv_get_aio_context(bs);
+    aio_context_acquire(aio_context);
     bdrv_clear_dirty_bitmap(bitmap, NULL);
+    aio_context_release(aio_context);
 }
 
 BlockDirtyBitmapSha256 *qmp_x_debug_block_dirty_bitmap_sha256(const char *node,
@@ -2834,6 +2871,7 @@ BlockDirtyBitmapSha256 *qmp_x_debug_block_dirty_bitmap_sha256(const char *node,
     BdrvDirtyBitmap *bitmap;
     BlockDriverState *bs;
     BlockDirtyBitmapSha256 *ret = NULL;
+    AioContext *aio_context;
     char *sha256;
 
     bitmap = block_dirty_bitmap_lookup(node, name, &bs, errp);
@@ -2841,7 +2879,11 @@ BlockDirtyBitmapSha256 *qmp_x_debug_block_dirty_bitmap_sha256(const char *node,
         return NULL;
     }
 
+    aio_context = bdrv_get_aio_context(bs);
+    aio_context_acquire(aio_context);
+    bdrv_dirty_bitmap_load(bitmap, 0, bdrv_dirty_bitmap_size(bitmap));
     sha256 = bdrv_dirty_bitmap_sha256(bitmap, errp);
+    aio_context_release(aio_context);
     if (sha256 == NULL) {
         return NULL;
     }
@@ -3201,6 +3243,12 @@ static BlockJob *do_drive_backup(DriveBackup *backup, BlockJobTxn *txn,
     if (!backup->has_compress) {
         backup->compress = false;
     }
+    if (!backup->has_max_workers) {
+        backup->max_workers = 0;
+    }
+    if (!backup->has_max_chunk) {
+        backup->max_chunk = 0;
+    }
 
     bs = qmp_get_root_bs(backup->device, errp);
     if (!bs) {
@@ -3292,6 +3340,7 @@ static BlockJob *do_drive_backup(DriveBackup *backup, BlockJobTxn *txn,
 
     job = backup_job_create(backup->job_id, bs, target_bs, backup->speed,
                             backup->sync, bmap, backup->compress,
+                            backup->max_workers, backup->max_chunk,
                             backup->on_source_error, backup->on_target_error,
                             BLOCK_JOB_DEFAULT, NULL, NULL, txn, &local_err);
     bdrv_unref(target_bs);
@@ -3344,6 +3393,12 @@ BlockJob *do_blockdev_backup(BlockdevBackup *backup, BlockJobTxn *txn,
     if (!backup->has_compress) {
         backup->compress = false;
     }
+    if (!backup->has_max_workers) {
+        backup->max_workers = 0;
+    }
+    if (!backup->has_max_chunk) {
+        backup->max_chunk = 0;
+    }
 
     bs = qmp_get_root_bs(backup->device, errp);
     if (!bs) {
@@ -3371,6 +3426,7 @@ BlockJob *do_blockdev_backup(BlockdevBackup *backup, BlockJobTxn *txn,
     }
     job = backup_job_create(backup->job_id, bs, target_bs, backup->speed,
                             backup->sync, NULL, backup->compress,
+                            backup->max_workers, backup->max_chunk,
                             backup->on_source_error, backup->on_target_error,
                             BLOCK_JOB_DEFAULT, NULL, NULL, txn, &local_err);
     if (local_err != NULL) {
@@ -3408,6 +3464,7 @@ static void blockdev_mirror_common(const char *job_id, BlockDriverState *bs,
                                    bool has_unmap, bool unmap,
                                    bool has_filter_node_name,
                                    const char *filter_node_name,
+                                   bool has_copy_mode, MirrorCopyMode copy_mode,
                                    Error **errp)
 {
 
@@ -3432,6 +3489,9 @@ static void blockdev_mirror_common(const char *job_id, BlockDriverState *bs,
     if (!has_filter_node_name) {
         filter_node_name = NULL;
     }
+    if (!has_copy_mode) {
+        copy_mode = MIRROR_COPY_MODE_BACKGROUND;
+    }
 
     if (granularity != 0 && (granularity < 512 || granularity > 1048576 * 64)) {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "granularity",
@@ -3460,7 +3520,7 @@ static void blockdev_mirror_common(const char *job_id, BlockDriverState *bs,
      */
     mirror_start(job_id, bs, target,
                  has_replaces ? replaces : NULL,
-                 speed, granularity, buf_size, sync, backing_mode,
+                 speed, granularity, buf_size, sync, backing_mode, copy_mode,
                  on_source_error, on_target_error, unmap, filter_node_name,
                  errp);
 }
@@ -3603,6 +3663,7 @@ void qmp_drive_mirror(DriveMirror *arg, Error **errp)
                            arg->has_on_target_error, arg->on_target_error,
                            arg->has_unmap, arg->unmap,
                            false, NULL,
+                           arg->has_copy_mode, arg->copy_mode,
                            &local_err);
     bdrv_unref(target_bs);
     error_propagate(errp, local_err);
@@ -3623,6 +3684,7 @@ void qmp_blockdev_mirror(bool has_job_id, const char *job_id,
                          BlockdevOnError on_target_error,
                          bool has_filter_node_name,
                          const char *filter_node_name,
+                         bool has_copy_mode, MirrorCopyMode copy_mode,
                          Error **errp)
 {
     BlockDriverState *bs;
@@ -3655,6 +3717,7 @@ void qmp_blockdev_mirror(bool has_job_id, const char *job_id,
                            has_on_target_error, on_target_error,
                            true, true,
                            has_filter_node_name, filter_node_name,
+                           has_copy_mode, copy_mode,
                            &local_err);
     error_propagate(errp, local_err);
 
@@ -4063,7 +4126,7 @@ QemuOptsList qemu_common_drive_opts = {
         },{
             .name = "aio",
             .type = QEMU_OPT_STRING,
-            .help = "host AIO implementation (threads, native)",
+            .help = "host AIO implementation (threads, native, io_uring)",
         },{
             .name = BDRV_OPT_CACHE_WB,
             .type = QEMU_OPT_BOOL,
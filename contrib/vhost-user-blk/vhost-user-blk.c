@@ -0,0 +1,509 @@
+/*
+ * vhost-user-blk sample application
+ *
+ * Copyright (c) 2017 Intel Corporation. All rights reserved.
+ *
+ * This work is largely based on the "vhost-user-scsi" sample by:
+ *  Felipe Franciosi <felipe@nutanix.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 only.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "standard-headers/linux/virtio_blk.h"
+#include "standard-headers/linux/virtio_config.h"
+#include "contrib/libvhost-user/libvhost-user-glib.h"
+
+#include <glib.h>
+
+#define VUB_SECTOR_SHIFT 9
+#define VUB_SECTOR_SIZE (1 << VUB_SECTOR_SHIFT)
+#define VUB_SIZE_MAX 65536
+#define VUB_SEG_MAX 126
+
+typedef struct VubDev {
+    VugDev parent;
+    int blk_fd;
+    char *blk_name;
+    bool enable_ro;
+    struct virtio_blk_config blkcfg;
+    GMainLoop *loop;
+} VubDev;
+
+typedef struct VubReq {
+    VuVirtqElement *elem;
+    VubDev *vdev_blk;
+    struct virtio_blk_outhdr out;
+    uint8_t *status;
+    struct iovec *in_sg;
+    unsigned int in_num;
+    struct iovec *out_sg;
+    unsigned int out_num;
+} VubReq;
+
+/** raw file backend **/
+
+static ssize_t vub_readv(VubReq *req, uint64_t sector)
+{
+    VubDev *vdev_blk = req->vdev_blk;
+    ssize_t rc;
+
+    if (!req->in_num) {
+        g_warning("Invalid read request without data buffers");
+        return -1;
+    }
+
+    rc = preadv(vdev_blk->blk_fd, req->in_sg, req->in_num,
+                sector << VUB_SECTOR_SHIFT);
+    if (rc < 0) {
+        g_warning("%s, Sector %"PRIu64", Error %s", vdev_blk->blk_name,
+                  sector, strerror(errno));
+        return -1;
+    }
+
+    return rc;
+}
+
+static ssize_t vub_writev(VubReq *req, uint64_t sector)
+{
+    VubDev *vdev_blk = req->vdev_blk;
+    ssize_t rc;
+
+    if (!req->out_num) {
+        g_warning("Invalid write request without data buffers");
+        return -1;
+    }
+
+    rc = pwritev(vdev_blk->blk_fd, req->out_sg, req->out_num,
+                 sector << VUB_SECTOR_SHIFT);
+    if (rc < 0) {
+        g_warning("%s, Sector %"PRIu64", Error %s", vdev_blk->blk_name,
+                  sector, strerror(errno));
+        return -1;
+    }
+
+    /* Write-through mode: the write must be stable before completion */
+    if (!vdev_blk->blkcfg.wce && fdatasync(vdev_blk->blk_fd) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static int vub_flush(VubReq *req)
+{
+    return fdatasync(req->vdev_blk->blk_fd);
+}
+
+static ssize_t vub_get_id(VubReq *req)
+{
+    const char *serial = req->vdev_blk->blk_name;
+    size_t len = MIN(strlen(serial), VIRTIO_BLK_ID_BYTES);
+    size_t done = 0;
+    unsigned int i;
+
+    for (i = 0; i < req->in_num && done < len; i++) {
+        size_t n = MIN(req->in_sg[i].iov_len, len - done);
+
+        memcpy(req->in_sg[i].iov_base, serial + done, n);
+        done += n;
+    }
+
+    return done;
+}
+
+/** virtio-blk request handling **/
+
+static void vub_req_complete(VuDev *vu_dev, VuVirtq *vq, VubReq *req,
+                             uint8_t status, size_t len)
+{
+    *req->status = status;
+
+    /* The status byte is part of the used length as well */
+    vu_queue_push(vu_dev, vq, req->elem, len + 1);
+    vu_queue_notify(vu_dev, vq);
+}
+
+static int vub_virtio_process_req(VubDev *vdev_blk, VuVirtq *vq)
+{
+    VuDev *vu_dev = &vdev_blk->parent.parent;
+    VuVirtqElement *elem;
+    struct iovec *status_iov;
+    uint32_t type;
+    uint64_t sector;
+    ssize_t len = 0;
+    uint8_t status = VIRTIO_BLK_S_OK;
+    VubReq req;
+
+    elem = vu_queue_pop(vu_dev, vq, sizeof(VuVirtqElement));
+    if (!elem) {
+        return -1;
+    }
+
+    /* A request needs at least one out buffer for the header and one in
+     * buffer for the status byte.
+     */
+    if (elem->out_num < 1 || elem->in_num < 1) {
+        g_warning("Invalid descriptor layout");
+        vu_panic(vu_dev, "virtio-blk request missing headers");
+        free(elem);
+        return -1;
+    }
+
+    if (elem->out_sg[0].iov_len < sizeof(struct virtio_blk_outhdr)) {
+        g_warning("Invalid outhdr size");
+        vu_panic(vu_dev, "virtio-blk request with short outhdr");
+        free(elem);
+        return -1;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.elem = elem;
+    req.vdev_blk = vdev_blk;
+    memcpy(&req.out, elem->out_sg[0].iov_base, sizeof(req.out));
+    req.out_sg = &elem->out_sg[1];
+    req.out_num = elem->out_num - 1;
+
+    /* The status byte is the very last byte of the in buffers */
+    status_iov = &elem->in_sg[elem->in_num - 1];
+    if (status_iov->iov_len < 1) {
+        vu_panic(vu_dev, "virtio-blk request with empty status buffer");
+        free(elem);
+        return -1;
+    }
+    req.status = (uint8_t *)status_iov->iov_base + status_iov->iov_len - 1;
+    status_iov->iov_len--;
+    req.in_sg = elem->in_sg;
+    req.in_num = status_iov->iov_len ? elem->in_num : elem->in_num - 1;
+
+    type = le32_to_cpu(req.out.type);
+    sector = le64_to_cpu(req.out.sector);
+
+    switch (type & ~VIRTIO_BLK_T_BARRIER) {
+    case VIRTIO_BLK_T_IN:
+        len = vub_readv(&req, sector);
+        if (len < 0) {
+            status = VIRTIO_BLK_S_IOERR;
+            len = 0;
+        }
+        break;
+    case VIRTIO_BLK_T_OUT:
+        if (vdev_blk->enable_ro || vub_writev(&req, sector) < 0) {
+            status = VIRTIO_BLK_S_IOERR;
+        }
+        break;
+    case VIRTIO_BLK_T_FLUSH:
+        if (vub_flush(&req) < 0) {
+            status = VIRTIO_BLK_S_IOERR;
+        }
+        break;
+    case VIRTIO_BLK_T_GET_ID:
+        len = vub_get_id(&req);
+        break;
+    default:
+        status = VIRTIO_BLK_S_UNSUPP;
+        break;
+    }
+
+    vub_req_complete(vu_dev, vq, &req, status, len);
+    free(elem);
+
+    return 0;
+}
+
+/** libvhost-user callbacks **/
+
+static void vub_panic_cb(VuDev *vu_dev, const char *buf)
+{
+    VugDev *gdev;
+    VubDev *vdev_blk;
+
+    assert(vu_dev);
+
+    gdev = container_of(vu_dev, VugDev, parent);
+    vdev_blk = container_of(gdev, VubDev, parent);
+    if (buf) {
+        g_warning("vu_panic: %s", buf);
+    }
+
+    g_main_loop_quit(vdev_blk->loop);
+}
+
+static void vub_process_vq(VuDev *vu_dev, int idx)
+{
+    VugDev *gdev;
+    VubDev *vdev_blk;
+    VuVirtq *vq;
+
+    assert(vu_dev);
+
+    gdev = container_of(vu_dev, VugDev, parent);
+    vdev_blk = container_of(gdev, VubDev, parent);
+    vq = vu_get_queue(vu_dev, idx);
+    assert(vq);
+
+    while (vub_virtio_process_req(vdev_blk, vq) == 0) {
+        /* keep going until the queue is drained */
+    }
+}
+
+static void vub_queue_set_started(VuDev *vu_dev, int idx, bool started)
+{
+    VuVirtq *vq;
+
+    assert(vu_dev);
+
+    if (idx < 0 || idx >= VHOST_MAX_NR_VIRTQUEUE) {
+        g_warning("VQ Index out of range: %d", idx);
+        vub_panic_cb(vu_dev, NULL);
+        return;
+    }
+
+    /* Every virtqueue is an independent request queue */
+    vq = vu_get_queue(vu_dev, idx);
+    vu_set_queue_handler(vu_dev, vq, started ? vub_process_vq : NULL);
+}
+
+static uint64_t vub_get_features(VuDev *vu_dev)
+{
+    VugDev *gdev = container_of(vu_dev, VugDev, parent);
+    VubDev *vdev_blk = container_of(gdev, VubDev, parent);
+    uint64_t features;
+
+    features = 1ull << VIRTIO_BLK_F_SIZE_MAX |
+               1ull << VIRTIO_BLK_F_SEG_MAX |
+               1ull << VIRTIO_BLK_F_BLK_SIZE |
+               1ull << VIRTIO_BLK_F_FLUSH |
+               1ull << VIRTIO_BLK_F_CONFIG_WCE |
+               1ull << VIRTIO_BLK_F_MQ |
+               1ull << VIRTIO_F_VERSION_1;
+
+    if (vdev_blk->enable_ro) {
+        features |= 1ull << VIRTIO_BLK_F_RO;
+    }
+
+    return features;
+}
+
+static uint64_t vub_get_protocol_features(VuDev *vu_dev)
+{
+    return 1ull << VHOST_USER_PROTOCOL_F_CONFIG;
+}
+
+static int vub_get_config(VuDev *vu_dev, uint8_t *config, uint32_t len)
+{
+    VugDev *gdev = container_of(vu_dev, VugDev, parent);
+    VubDev *vdev_blk = container_of(gdev, VubDev, parent);
+
+    if (len > sizeof(struct virtio_blk_config)) {
+        return -1;
+    }
+
+    memcpy(config, &vdev_blk->blkcfg, len);
+
+    return 0;
+}
+
+static int vub_set_config(VuDev *vu_dev, const uint8_t *data,
+                          uint32_t offset, uint32_t size, uint32_t flags)
+{
+    VugDev *gdev = container_of(vu_dev, VugDev, parent);
+    VubDev *vdev_blk = container_of(gdev, VubDev, parent);
+
+    /* Only the write cache mode may be changed by the guest */
+    if (flags != VHOST_SET_CONFIG_TYPE_MASTER ||
+        offset != offsetof(struct virtio_blk_config, wce) ||
+        size != 1) {
+        return -1;
+    }
+
+    vdev_blk->blkcfg.wce = !!*data;
+
+    return 0;
+}
+
+static const VuDevIface vub_iface = {
+    .get_features = vub_get_features,
+    .get_protocol_features = vub_get_protocol_features,
+    .queue_set_started = vub_queue_set_started,
+    .get_config = vub_get_config,
+    .set_config = vub_set_config,
+};
+
+/** misc helpers **/
+
+static int unix_sock_new(char *unix_fn)
+{
+    int sock;
+    struct sockaddr_un un;
+    size_t len;
+
+    assert(unix_fn);
+
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock <= 0) {
+        perror("socket");
+        return -1;
+    }
+
+    un.sun_family = AF_UNIX;
+    (void)snprintf(un.sun_path, sizeof(un.sun_path), "%s", unix_fn);
+    len = sizeof(un.sun_family) + strlen(un.sun_path);
+
+    (void)unlink(unix_fn);
+    if (bind(sock, (struct sockaddr *)&un, len) < 0) {
+        perror("bind");
+        goto fail;
+    }
+
+    if (listen(sock, 1) < 0) {
+        perror("listen");
+        goto fail;
+    }
+
+    return sock;
+
+fail:
+    (void)close(sock);
+
+    return -1;
+}
+
+static void vub_free(VubDev *vdev_blk)
+{
+    if (!vdev_blk) {
+        return;
+    }
+
+    g_main_loop_unref(vdev_blk->loop);
+    if (vdev_blk->blk_fd >= 0) {
+        close(vdev_blk->blk_fd);
+    }
+    g_free(vdev_blk);
+}
+
+static void vub_initialize_config(VubDev *vdev_blk, off_t size)
+{
+    struct virtio_blk_config *config = &vdev_blk->blkcfg;
+
+    config->capacity = cpu_to_le64(size >> VUB_SECTOR_SHIFT);
+    config->size_max = cpu_to_le32(VUB_SIZE_MAX);
+    config->seg_max = cpu_to_le32(VUB_SEG_MAX);
+    config->blk_size = cpu_to_le32(VUB_SECTOR_SIZE);
+    config->num_queues = cpu_to_le16(VHOST_MAX_NR_VIRTQUEUE);
+    /* Default to writeback, the guest flushes explicitly */
+    config->wce = 1;
+}
+
+static VubDev *vub_new(char *blk_file, bool enable_ro)
+{
+    VubDev *vdev_blk;
+    struct stat st;
+
+    vdev_blk = g_new0(VubDev, 1);
+    vdev_blk->loop = g_main_loop_new(NULL, FALSE);
+    vdev_blk->blk_name = blk_file;
+    vdev_blk->enable_ro = enable_ro;
+
+    vdev_blk->blk_fd = open(blk_file, enable_ro ? O_RDONLY : O_RDWR);
+    if (vdev_blk->blk_fd < 0) {
+        fprintf(stderr, "Failed to open block device %s: %s\n",
+                blk_file, strerror(errno));
+        vub_free(vdev_blk);
+        return NULL;
+    }
+
+    if (fstat(vdev_blk->blk_fd, &st) < 0) {
+        fprintf(stderr, "Failed to stat block device %s: %s\n",
+                blk_file, strerror(errno));
+        vub_free(vdev_blk);
+        return NULL;
+    }
+
+    vub_initialize_config(vdev_blk, st.st_size);
+
+    return vdev_blk;
+}
+
+/** vhost-user-blk **/
+
+int main(int argc, char **argv)
+{
+    VubDev *vdev_blk = NULL;
+    char *unix_fn = NULL;
+    char *blk_file = NULL;
+    bool enable_ro = false;
+    int lsock = -1, csock = -1, opt, err = EXIT_SUCCESS;
+
+    while ((opt = getopt(argc, argv, "b:rs:h")) != -1) {
+        switch (opt) {
+        case 'b':
+            blk_file = g_strdup(optarg);
+            break;
+        case 's':
+            unix_fn = g_strdup(optarg);
+            break;
+        case 'r':
+            enable_ro = true;
+            break;
+        case 'h':
+        default:
+            goto help;
+        }
+    }
+    if (!unix_fn || !blk_file) {
+        goto help;
+    }
+
+    lsock = unix_sock_new(unix_fn);
+    if (lsock < 0) {
+        goto err;
+    }
+
+    csock = accept(lsock, NULL, NULL);
+    if (csock < 0) {
+        perror("accept");
+        goto err;
+    }
+
+    vdev_blk = vub_new(blk_file, enable_ro);
+    if (!vdev_blk) {
+        goto err;
+    }
+
+    vug_init(&vdev_blk->parent, csock, vub_panic_cb, &vub_iface);
+
+    g_main_loop_run(vdev_blk->loop);
+
+    vug_deinit(&vdev_blk->parent);
+
+out:
+    vub_free(vdev_blk);
+    if (csock >= 0) {
+        close(csock);
+    }
+    if (lsock >= 0) {
+        close(lsock);
+        unlink(unix_fn);
+    }
+    g_free(unix_fn);
+    g_free(blk_file);
+
+    return err;
+
+err:
+    err = EXIT_FAILURE;
+    goto out;
+
+help:
+    fprintf(stderr, "Usage: %s [ -b blk_file -s unix_socket ] [ -r ] [ -h ]\n",
+            argv[0]);
+    fprintf(stderr, "          -b path to the raw image served to the guest\n");
+    fprintf(stderr, "          -s path to UNIX domain socket\n");
+    fprintf(stderr, "          -r enable read-only mode\n");
+    fprintf(stderr, "          -h print help and quit\n");
+
+    goto err;
+}
@@ -83,6 +83,8 @@ this code that are retained.
  * target-dependent and needs the TARGET_* macros.
  */
 #include "qemu/osdep.h"
+#include <math.h>
+#include <float.h>
 
 #include "fpu/softfloat.h"
 
@@ -2183,7 +2185,7 @@ static float32 subFloat32Sigs(float32 a, float32 b, flag zSign,
 | Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float32 float32_add(float32 a, float32 b, float_status *status)
+static float32 soft_float32_add(float32 a, float32 b, float_status *status)
 {
     flag aSign, bSign;
     a = float32_squash_input_denormal(a, status);
@@ -2206,7 +2208,7 @@ float32 float32_add(float32 a, float32 b, float_status *status)
 | for Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float32 float32_sub(float32 a, float32 b, float_status *status)
+static float32 soft_float32_sub(float32 a, float32 b, float_status *status)
 {
     flag aSign, bSign;
     a = float32_squash_input_denormal(a, status);
@@ -2229,7 +2231,7 @@ float32 float32_sub(float32 a, float32 b, float_status *status)
 | for Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float32 float32_mul(float32 a, float32 b, float_status *status)
+static float32 soft_float32_mul(float32 a, float32 b, float_status *status)
 {
     flag aSign, bSign, zSign;
     int aExp, bExp, zExp;
@@ -2294,7 +2296,7 @@ float32 float32_mul(float32 a, float32 b, float_status *status)
 | IEC/IEEE Standard for Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float32 float32_div(float32 a, float32 b, float_status *status)
+static float32 soft_float32_div(float32 a, float32 b, float_status *status)
 {
     flag aSign, bSign, zSign;
     int aExp, bExp, zExp;
@@ -2471,8 +2473,8 @@ float32 float32_rem(float32 a, float32 b, float_status *status)
 | externally will flip the sign bit on NaNs.)
 *----------------------------------------------------------------------------*/
 
-float32 float32_muladd(float32 a, float32 b, float32 c, int flags,
-                       float_status *status)
+static float32 soft_float32_muladd(float32 a, float32 b, float32 c,
+                                   int flags, float_status *status)
 {
     flag aSign, bSign, cSign, zSign;
     int aExp, bExp, cExp, pExp, zExp, expDiff;
@@ -2692,7 +2694,7 @@ float32 float32_muladd(float32 a, float32 b, float32 c, int flags,
 | Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float32 float32_sqrt(float32 a, float_status *status)
+static float32 soft_float32_sqrt(float32 a, float_status *status)
 {
     flag aSign;
     int aExp, zExp;
@@ -3978,7 +3980,7 @@ static float64 subFloat64Sigs(float64 a, float64 b, flag zSign,
 | Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float64 float64_add(float64 a, float64 b, float_status *status)
+static float64 soft_float64_add(float64 a, float64 b, float_status *status)
 {
     flag aSign, bSign;
     a = float64_squash_input_denormal(a, status);
@@ -4001,7 +4003,7 @@ float64 float64_add(float64 a, float64 b, float_status *status)
 | for Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float64 float64_sub(float64 a, float64 b, float_status *status)
+static float64 soft_float64_sub(float64 a, float64 b, float_status *status)
 {
     flag aSign, bSign;
     a = float64_squash_input_denormal(a, status);
@@ -4024,7 +4026,7 @@ float64 float64_sub(float64 a, float64 b, float_status *status)
 | for Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float64 float64_mul(float64 a, float64 b, float_status *status)
+static float64 soft_float64_mul(float64 a, float64 b, float_status *status)
 {
     flag aSign, bSign, zSign;
     int aExp, bExp, zExp;
@@ -4087,7 +4089,7 @@ float64 float64_mul(float64 a, float64 b, float_status *status)
 | the IEC/IEEE Standard for Binary Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float64 float64_div(float64 a, float64 b, float_status *status)
+static float64 soft_float64_div(float64 a, float64 b, float_status *status)
 {
     flag aSign, bSign, zSign;
     int aExp, bExp, zExp;
@@ -4258,8 +4260,8 @@ float64 float64_rem(float64 a, float64 b, float_status *status)
 | externally will flip the sign bit on NaNs.)
 *----------------------------------------------------------------------------*/
 
-float64 float64_muladd(float64 a, float64 b, float64 c, int flags,
-                       float_status *status)
+static float64 soft_float64_muladd(float64 a, float64 b, float64 c,
+                                   int flags, float_status *status)
 {
     flag aSign, bSign, cSign, zSign;
     int aExp, bExp, cExp, pExp, zExp, expDiff;
@@ -4500,7 +4502,7 @@ float64 float64_muladd(float64 a, float64 b, float64 c, int flags,
 | Floating-Point Arithmetic.
 *----------------------------------------------------------------------------*/
 
-float64 float64_sqrt(float64 a, float_status *status)
+static float64 soft_float64_sqrt(float64 a, float_status *status)
 {
     flag aSign;
     int aExp, zExp;
@@ -4548,6 +4550,316 @@ float64 float64_sqrt(float64 a, float_status *status)
 
 }
 
+/*----------------------------------------------------------------------------
+| Host FPU fast paths ("hardfloat") for the basic single- and double-precision
+| operations.
+|
+| When every input is zero or normal, the rounding mode is nearest-even and
+| the inexact flag is already set, the host FPU produces exactly the result
+| the soft implementation would, and the only flag that can still be newly
+| raised is overflow, which shows up as an infinite result.  Results that are
+| (or might be) tiny are recomputed in software so that underflow, tininess
+| detection and flush-to-zero keep their target-specific behaviour.  NaNs and
+| infinities never reach the host FPU.
+|
+| This relies on the host evaluating float and double expressions in their
+| own precision (no x87 excess precision) and on the host FPU being left in
+| round-to-nearest mode, which QEMU never changes.
+*----------------------------------------------------------------------------*/
+
+#if defined(FLT_EVAL_METHOD) && FLT_EVAL_METHOD == 0
+#define QEMU_HARDFLOAT 1
+#else
+#define QEMU_HARDFLOAT 0
+#endif
+
+typedef union {
+    float32 s;
+    float h;
+} union_float32;
+
+typedef union {
+    float64 s;
+    double h;
+} union_float64;
+
+static inline bool can_use_fpu(const float_status *status)
+{
+    return QEMU_HARDFLOAT &&
+           likely((status->float_exception_flags & float_flag_inexact) &&
+                  status->float_rounding_mode == float_round_nearest_even);
+}
+
+float32 float32_add(float32 a, float32 b, float_status *status)
+{
+    union_float32 ua, ub, ur;
+
+    if (!can_use_fpu(status)) {
+        return soft_float32_add(a, b, status);
+    }
+    ua.s = float32_squash_input_denormal(a, status);
+    ub.s = float32_squash_input_denormal(b, status);
+    if (unlikely(!float32_is_zero_or_normal(ua.s) ||
+                 !float32_is_zero_or_normal(ub.s))) {
+        return soft_float32_add(ua.s, ub.s, status);
+    }
+    ur.h = ua.h + ub.h;
+    if (unlikely(isinf(ur.h))) {
+        float_raise(float_flag_overflow, status);
+    } else if (unlikely(fabsf(ur.h) <= FLT_MIN) &&
+               !(float32_is_zero(ua.s) && float32_is_zero(ub.s))) {
+        return soft_float32_add(ua.s, ub.s, status);
+    }
+    return ur.s;
+}
+
+float32 float32_sub(float32 a, float32 b, float_status *status)
+{
+    union_float32 ua, ub, ur;
+
+    if (!can_use_fpu(status)) {
+        return soft_float32_sub(a, b, status);
+    }
+    ua.s = float32_squash_input_denormal(a, status);
+    ub.s = float32_squash_input_denormal(b, status);
+    if (unlikely(!float32_is_zero_or_normal(ua.s) ||
+                 !float32_is_zero_or_normal(ub.s))) {
+        return soft_float32_sub(ua.s, ub.s, status);
+    }
+    ur.h = ua.h - ub.h;
+    if (unlikely(isinf(ur.h))) {
+        float_raise(float_flag_overflow, status);
+    } else if (unlikely(fabsf(ur.h) <= FLT_MIN) &&
+               !(float32_is_zero(ua.s) && float32_is_zero(ub.s))) {
+        return soft_float32_sub(ua.s, ub.s, status);
+    }
+    return ur.s;
+}
+
+float32 float32_mul(float32 a, float32 b, float_status *status)
+{
+    union_float32 ua, ub, ur;
+
+    if (!can_use_fpu(status)) {
+        return soft_float32_mul(a, b, status);
+    }
+    ua.s = float32_squash_input_denormal(a, status);
+    ub.s = float32_squash_input_denormal(b, status);
+    if (unlikely(!float32_is_zero_or_normal(ua.s) ||
+                 !float32_is_zero_or_normal(ub.s))) {
+        return soft_float32_mul(ua.s, ub.s, status);
+    }
+    ur.h = ua.h * ub.h;
+    if (unlikely(isinf(ur.h))) {
+        float_raise(float_flag_overflow, status);
+    } else if (unlikely(fabsf(ur.h) <= FLT_MIN) &&
+               !(float32_is_zero(ua.s) || float32_is_zero(ub.s))) {
+        return soft_float32_mul(ua.s, ub.s, status);
+    }
+    return ur.s;
+}
+
+float32 float32_div(float32 a, float32 b, float_status *status)
+{
+    union_float32 ua, ub, ur;
+
+    if (!can_use_fpu(status)) {
+        return soft_float32_div(a, b, status);
+    }
+    ua.s = float32_squash_input_denormal(a, status);
+    ub.s = float32_squash_input_denormal(b, status);
+    /* A zero divisor raises divbyzero or invalid; leave it to softfloat.  */
+    if (unlikely(!float32_is_zero_or_normal(ua.s) ||
+                 !float32_is_normal(ub.s))) {
+        return soft_float32_div(ua.s, ub.s, status);
+    }
+    ur.h = ua.h / ub.h;
+    if (unlikely(isinf(ur.h))) {
+        float_raise(float_flag_overflow, status);
+    } else if (unlikely(fabsf(ur.h) <= FLT_MIN) && !float32_is_zero(ua.s)) {
+        return soft_float32_div(ua.s, ub.s, status);
+    }
+    return ur.s;
+}
+
+float32 float32_muladd(float32 a, float32 b, float32 c, int flags,
+                       float_status *status)
+{
+    union_float32 ua, ub, uc, ur;
+
+    if (flags || !can_use_fpu(status)) {
+        return soft_float32_muladd(a, b, c, flags, status);
+    }
+    ua.s = float32_squash_input_denormal(a, status);
+    ub.s = float32_squash_input_denormal(b, status);
+    uc.s = float32_squash_input_denormal(c, status);
+    if (unlikely(!float32_is_zero_or_normal(ua.s) ||
+                 !float32_is_zero_or_normal(ub.s) ||
+                 !float32_is_zero_or_normal(uc.s))) {
+        return soft_float32_muladd(ua.s, ub.s, uc.s, flags, status);
+    }
+    ur.h = fmaf(ua.h, ub.h, uc.h);
+    if (unlikely(isinf(ur.h))) {
+        float_raise(float_flag_overflow, status);
+    } else if (unlikely(fabsf(ur.h) <= FLT_MIN) &&
+               !((float32_is_zero(ua.s) || float32_is_zero(ub.s)) &&
+                 float32_is_zero(uc.s))) {
+        return soft_float32_muladd(ua.s, ub.s, uc.s, flags, status);
+    }
+    return ur.s;
+}
+
+float32 float32_sqrt(float32 a, float_status *status)
+{
+    union_float32 ua, ur;
+
+    if (!can_use_fpu(status)) {
+        return soft_float32_sqrt(a, status);
+    }
+    ua.s = float32_squash_input_denormal(a, status);
+    /* The square root of a normal is normal, and that of a zero is itself.  */
+    if (unlikely(!float32_is_zero(ua.s) &&
+                 (!float32_is_normal(ua.s) || float32_is_neg(ua.s)))) {
+        return soft_float32_sqrt(ua.s, status);
+    }
+    ur.h = sqrtf(ua.h);
+    return ur.s;
+}
+
+float64 float64_add(float64 a, float64 b, float_status *status)
+{
+    union_float64 ua, ub, ur;
+
+    if (!can_use_fpu(status)) {
+        return soft_float64_add(a, b, status);
+    }
+    ua.s = float64_squash_input_denormal(a, status);
+    ub.s = float64_squash_input_denormal(b, status);
+    if (unlikely(!float64_is_zero_or_normal(ua.s) ||
+                 !float64_is_zero_or_normal(ub.s))) {
+        return soft_float64_add(ua.s, ub.s, status);
+    }
+    ur.h = ua.h + ub.h;
+    if (unlikely(isinf(ur.h))) {
+        float_raise(float_flag_overflow, status);
+    } else if (unlikely(fabs(ur.h) <= DBL_MIN) &&
+               !(float64_is_zero(ua.s) && float64_is_zero(ub.s))) {
+        return soft_float64_add(ua.s, ub.s, status);
+    }
+    return ur.s;
+}
+
+float64 float64_sub(float64 a, float64 b, float_status *status)
+{
+    union_float64 ua, ub, ur;
+
+    if (!can_use_fpu(status)) {
+        return soft_float64_sub(a, b, status);
+    }
+    ua.s = float64_squash_input_denormal(a, status);
+    ub.s = float64_squash_input_denormal(b, status);
+    if (unlikely(!float64_is_zero_or_normal(ua.s) ||
+                 !float64_is_zero_or_normal(ub.s))) {
+        return soft_float64_sub(ua.s, ub.s, status);
+    }
+    ur.h = ua.h - ub.h;
+    if (unlikely(isinf(ur.h))) {
+        float_raise(float_flag_overflow, status);
+    } else if (unlikely(fabs(ur.h) <= DBL_MIN) &&
+               !(float64_is_zero(ua.s) && float64_is_zero(ub.s))) {
+        return soft_float64_sub(ua.s, ub.s, status);
+    }
+    return ur.s;
+}
+
+float64 float64_mul(float64 a, float64 b, float_status *status)
+{
+    union_float64 ua, ub, ur;
+
+    if (!can_use_fpu(status)) {
+        return soft_float64_mul(a, b, status);
+    }
+    ua.s = float64_squash_input_denormal(a, status);
+    ub.s = float64_squash_input_denormal(b, status);
+    if (unlikely(!float64_is_zero_or_normal(ua.s) ||
+                 !float64_is_zero_or_normal(ub.s))) {
+        return soft_float64_mul(ua.s, ub.s, status);
+    }
+    ur.h = ua.h * ub.h;
+    if (unlikely(isinf(ur.h))) {
+        float_raise(float_flag_overflow, status);
+    } else if (unlikely(fabs(ur.h) <= DBL_MIN) &&
+               !(float64_is_zero(ua.s) || float64_is_zero(ub.s))) {
+        return soft_float64_mul(ua.s, ub.s, status);
+    }
+    return ur.s;
+}
+
+float64 float64_div(float64 a, float64 b, float_status *status)
+{
+    union_float64 ua, ub, ur;
+
+    if (!can_use_fpu(status)) {
+        return soft_float64_div(a, b, status);
+    }
+    ua.s = float64_squash_input_denormal(a, status);
+    ub.s = float64_squash_input_denormal(b, status);
+    if (unlikely(!float64_is_zero_or_normal(ua.s) ||
+                 !float64_is_normal(ub.s))) {
+        return soft_float64_div(ua.s, ub.s, status);
+    }
+    ur.h = ua.h / ub.h;
+    if (unlikely(isinf(ur.h))) {
+        float_raise(float_flag_overflow, status);
+    } else if (unlikely(fabs(ur.h) <= DBL_MIN) && !float64_is_zero(ua.s)) {
+        return soft_float64_div(ua.s, ub.s, status);
+    }
+    return ur.s;
+}
+
+float64 float64_muladd(float64 a, float64 b, float64 c, int flags,
+                       float_status *status)
+{
+    union_float64 ua, ub, uc, ur;
+
+    if (flags || !can_use_fpu(status)) {
+        return soft_float64_muladd(a, b, c, flags, status);
+    }
+    ua.s = float64_squash_input_denormal(a, status);
+    ub.s = float64_squash_input_denormal(b, status);
+    uc.s = float64_squash_input_denormal(c, status);
+    if (unlikely(!float64_is_zero_or_normal(ua.s) ||
+                 !float64_is_zero_or_normal(ub.s) ||
+                 !float64_is_zero_or_normal(uc.s))) {
+        return soft_float64_muladd(ua.s, ub.s, uc.s, flags, status);
+    }
+    ur.h = fma(ua.h, ub.h, uc.h);
+    if (unlikely(isinf(ur.h))) {
+        float_raise(float_flag_overflow, status);
+    } else if (unlikely(fabs(ur.h) <= DBL_MIN) &&
+               !((float64_is_zero(ua.s) || float64_is_zero(ub.s)) &&
+                 float64_is_zero(uc.s))) {
+        return soft_float64_muladd(ua.s, ub.s, uc.s, flags, status);
+    }
+    return ur.s;
+}
+
+float64 float64_sqrt(float64 a, float_status *status)
+{
+    union_float64 ua, ur;
+
+    if (!can_use_fpu(status)) {
+        return soft_float64_sqrt(a, status);
+    }
+    ua.s = float64_squash_input_denormal(a, status);
+    if (unlikely(!float64_is_zero(ua.s) &&
+                 (!float64_is_normal(ua.s) || float64_is_neg(ua.s)))) {
+        return soft_float64_sqrt(ua.s, status);
+    }
+    ur.h = sqrt(ua.h);
+    return ur.s;
+}
+
 /*----------------------------------------------------------------------------
 | Returns the binary log of the double-precision floating-point value `a'.
 | The operation is performed according to the IEC/IEEE Standard for Binary
@@ -16,8 +16,10 @@
 #include "hw/virtio/virtio.h"
 #include "net/net.h"
 #include "net/checksum.h"
+#include "net/rsc.h"
 #include "net/tap.h"
 #include "qemu/error-report.h"
+#include "qemu/main-loop.h"
 #include "qemu/timer.h"
 #include "hw/virtio/virtio-net.h"
 #include "net/vhost_net.h"
@@ -26,6 +28,7 @@
 #include "qapi-event.h"
 #include "hw/virtio/virtio-access.h"
 #include "migration/misc.h"
+#include "net_rx_pkt.h"
 
 #define VIRTIO_NET_VM_VERSION    11
 
@@ -40,6 +43,17 @@
 #define VIRTIO_NET_RX_QUEUE_MIN_SIZE VIRTIO_NET_RX_QUEUE_DEFAULT_SIZE
 #define VIRTIO_NET_TX_QUEUE_MIN_SIZE VIRTIO_NET_TX_QUEUE_DEFAULT_SIZE
 
+/* Room for the largest host header in front of coalesced packets */
+#define VIRTIO_NET_RSC_HEADROOM sizeof(struct virtio_net_hdr_v1_hash)
+
+/* Guest offloads needed to take coalesced TCP packets */
+#define VIRTIO_NET_RSC_OFFLOADS ((1ULL << VIRTIO_NET_F_GUEST_CSUM) | \
+                                 (1ULL << VIRTIO_NET_F_GUEST_TSO4) | \
+                                 (1ULL << VIRTIO_NET_F_GUEST_TSO6))
+
+/* Longest time a flow keeps collecting segments, in ns */
+#define VIRTIO_NET_RSC_TIMEOUT 300000
+
 /*
  * Calculate the number of bytes up to and including the given 'field' of
  * 'container'.
@@ -48,19 +62,23 @@
     (offsetof(container, field) + sizeof(((container *)0)->field))
 
 typedef struct VirtIOFeature {
-    uint32_t flags;
+    uint64_t flags;
     size_t end;
 } VirtIOFeature;
 
 static VirtIOFeature feature_sizes[] = {
-    {.flags = 1 << VIRTIO_NET_F_MAC,
+    {.flags = 1ULL << VIRTIO_NET_F_MAC,
      .end = endof(struct virtio_net_config, mac)},
-    {.flags = 1 << VIRTIO_NET_F_STATUS,
+    {.flags = 1ULL << VIRTIO_NET_F_STATUS,
      .end = endof(struct virtio_net_config, status)},
-    {.flags = 1 << VIRTIO_NET_F_MQ,
+    {.flags = 1ULL << VIRTIO_NET_F_MQ,
      .end = endof(struct virtio_net_config, max_virtqueue_pairs)},
-    {.flags = 1 << VIRTIO_NET_F_MTU,
+    {.flags = 1ULL << VIRTIO_NET_F_MTU,
      .end = endof(struct virtio_net_config, mtu)},
+    {.flags = 1ULL << VIRTIO_NET_F_RSS,
+     .end = endof(struct virtio_net_config, supported_hash_types)},
+    {.flags = 1ULL << VIRTIO_NET_F_HASH_REPORT,
+     .end = endof(struct virtio_net_config, supported_hash_types)},
     {}
 };
 
@@ -89,6 +107,14 @@ static void virtio_net_get_config(VirtIODevice *vdev, uint8_t *config)
     virtio_stw_p(vdev, &netcfg.max_virtqueue_pairs, n->max_queues);
     virtio_stw_p(vdev, &netcfg.mtu, n->net_conf.mtu);
     memcpy(netcfg.mac, n->mac, ETH_ALEN);
+    /* Link speed and duplex are unknown */
+    virtio_stl_p(vdev, &netcfg.speed, UINT32_MAX);
+    netcfg.duplex = 0xff;
+    netcfg.rss_max_key_size = VIRTIO_NET_RSS_MAX_KEY_SIZE;
+    virtio_stw_p(vdev, &netcfg.rss_max_indirection_table_length,
+                 VIRTIO_NET_RSS_MAX_TABLE_LEN);
+    virtio_stl_p(vdev, &netcfg.supported_hash_types,
+                 VIRTIO_NET_RSS_SUPPORTED_HASHES);
     memcpy(config, &netcfg, n->config_size);
 }
 
@@ -235,12 +261,162 @@ static void virtio_net_vnet_endian_status(VirtIONet *n, uint8_t status)
     }
 }
 
+static void virtio_net_notify(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+
+    /* The guest notifiers can be triggered from any thread */
+    if (n->dataplane_started) {
+        virtio_notify_irqfd(vdev, vq);
+    } else {
+        virtio_notify(vdev, vq);
+    }
+}
+
 static void virtio_net_drop_tx_queue_data(VirtIODevice *vdev, VirtQueue *vq)
 {
     unsigned int dropped = virtqueue_drop_all(vq);
     if (dropped) {
-        virtio_notify(vdev, vq);
+        virtio_net_notify(vdev, vq);
+    }
+}
+
+static void virtio_net_handle_rx(VirtIODevice *vdev, VirtQueue *vq);
+static void virtio_net_handle_tx_timer(VirtIODevice *vdev, VirtQueue *vq);
+static void virtio_net_handle_tx_bh(VirtIODevice *vdev, VirtQueue *vq);
+
+static bool virtio_net_dataplane_handle_output(VirtIODevice *vdev,
+                                               VirtQueue *vq)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+    int queue_index = virtio_get_queue_index(vq);
+
+    assert(n->dataplane_started);
+
+    aio_context_acquire(n->ctx);
+    if (queue_index % 2 == 0) {
+        virtio_net_handle_rx(vdev, vq);
+    } else if (n->vqs[vq2q(queue_index)].tx_timer) {
+        virtio_net_handle_tx_timer(vdev, vq);
+    } else {
+        virtio_net_handle_tx_bh(vdev, vq);
     }
+    aio_context_release(n->ctx);
+    return true;
+}
+
+/* Move virtqueue processing and the backend into the iothread.
+ * Context: QEMU global mutex held */
+static void virtio_net_dataplane_start(VirtIONet *n)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int nvqs = virtio_get_num_queues(vdev);
+    int i, r;
+
+    if (n->dataplane_started) {
+        return;
+    }
+
+    /* Filters may have been added since realize; they run in the main loop */
+    for (i = 0; i < n->max_queues; i++) {
+        NetClientState *peer = qemu_get_subqueue(n->nic, i)->peer;
+
+        if (peer && !QTAILQ_EMPTY(&peer->filters)) {
+            error_report("virtio-net: netdev '%s' has filters, "
+                         "not using iothread", peer->name);
+            return;
+        }
+    }
+
+    /* Set up guest notifier (irq) */
+    r = k->set_guest_notifiers(qbus->parent, nvqs, true);
+    if (r != 0) {
+        error_report("virtio-net failed to set guest notifier (%d), "
+                     "ensure -enable-kvm is set", r);
+        return;
+    }
+
+    /* Set up virtqueue notify */
+    for (i = 0; i < nvqs; i++) {
+        r = virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, true);
+        if (r != 0) {
+            error_report("virtio-net failed to set host notifier (%d)", r);
+            while (i--) {
+                virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, false);
+            }
+            k->set_guest_notifiers(qbus->parent, nvqs, false);
+            return;
+        }
+    }
+
+    n->dataplane_started = true;
+
+    aio_context_acquire(n->ctx);
+    for (i = 0; i < n->max_queues; i++) {
+        qemu_set_aio_context(qemu_get_subqueue(n->nic, i)->peer, n->ctx);
+    }
+    for (i = 0; i < nvqs; i++) {
+        VirtQueue *vq = virtio_get_queue(vdev, i);
+
+        /* Control commands emit QMP events and may stop the dataplane, so
+         * they stay in the main loop under the BQL */
+        if (vq == n->ctrl_vq) {
+            event_notifier_set_handler(virtio_queue_get_host_notifier(vq),
+                                       virtio_queue_host_notifier_read);
+            continue;
+        }
+        virtio_queue_aio_set_host_notifier_handler(vq, n->ctx,
+                virtio_net_dataplane_handle_output);
+    }
+    aio_context_release(n->ctx);
+
+    /* Kick right away to process buffers already in the rings */
+    for (i = 0; i < nvqs; i++) {
+        VirtQueue *vq = virtio_get_queue(vdev, i);
+
+        event_notifier_set(virtio_queue_get_host_notifier(vq));
+    }
+}
+
+/* Context: QEMU global mutex held */
+static void virtio_net_dataplane_stop(VirtIONet *n)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int nvqs = virtio_get_num_queues(vdev);
+    int i;
+
+    if (!n->dataplane_started) {
+        return;
+    }
+
+    aio_context_acquire(n->ctx);
+    for (i = 0; i < nvqs; i++) {
+        VirtQueue *vq = virtio_get_queue(vdev, i);
+
+        if (vq == n->ctrl_vq) {
+            event_notifier_set_handler(virtio_queue_get_host_notifier(vq),
+                                       NULL);
+            continue;
+        }
+        virtio_queue_aio_set_host_notifier_handler(vq, n->ctx, NULL);
+    }
+    for (i = 0; i < n->max_queues; i++) {
+        qemu_set_aio_context(qemu_get_subqueue(n->nic, i)->peer, NULL);
+    }
+    aio_context_release(n->ctx);
+
+    for (i = 0; i < nvqs; i++) {
+        virtio_bus_set_host_notifier(VIRTIO_BUS(qbus), i, false);
+    }
+
+    /* Clean up guest notifier (irq) */
+    k->set_guest_notifiers(qbus->parent, nvqs, false);
+
+    n->dataplane_started = false;
 }
 
 static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
@@ -253,6 +429,18 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
     virtio_net_vnet_endian_status(n, status);
     virtio_net_vhost_status(n, status);
 
+    /* This does not depend on the link status, so that it only changes
+     * with the QEMU global mutex held */
+    if (n->net_conf.iothread) {
+        if ((status & VIRTIO_CONFIG_S_DRIVER_OK) && vdev->vm_running &&
+            !n->vhost_started) {
+            virtio_net_dataplane_start(n);
+        } else {
+            virtio_net_dataplane_stop(n);
+        }
+    }
+
+    aio_context_acquire(n->ctx);
     for (i = 0; i < n->max_queues; i++) {
         NetClientState *ncs = qemu_get_subqueue(n->nic, i);
         bool queue_started;
@@ -297,6 +485,7 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
             }
         }
     }
+    aio_context_release(n->ctx);
 }
 
 static void virtio_net_set_link_status(NetClientState *nc)
@@ -418,6 +607,12 @@ static RxFilterInfo *virtio_net_query_rxfilter(NetClientState *nc)
     return info;
 }
 
+static void virtio_net_disable_rss(VirtIONet *n)
+{
+    n->rss_data.enabled = false;
+    n->rss_data.redirect = false;
+}
+
 static void virtio_net_reset(VirtIODevice *vdev)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -431,6 +626,7 @@ static void virtio_net_reset(VirtIODevice *vdev)
     n->nobcast = 0;
     /* multiqueue is disabled by default */
     n->curr_queues = 1;
+    virtio_net_disable_rss(n);
     timer_del(n->announce_timer);
     n->announce_counter = 0;
     n->status &= ~VIRTIO_NET_S_ANNOUNCE;
@@ -472,28 +668,39 @@ static int peer_has_ufo(VirtIONet *n)
 }
 
 static void virtio_net_set_mrg_rx_bufs(VirtIONet *n, int mergeable_rx_bufs,
-                                       int version_1)
+                                       int version_1, int hash_report)
 {
-    int i;
+    int i, host_hdr_len;
     NetClientState *nc;
 
     n->mergeable_rx_bufs = mergeable_rx_bufs;
 
     if (version_1) {
-        n->guest_hdr_len = sizeof(struct virtio_net_hdr_mrg_rxbuf);
+        n->guest_hdr_len = hash_report ?
+            sizeof(struct virtio_net_hdr_v1_hash) :
+            sizeof(struct virtio_net_hdr_mrg_rxbuf);
+        n->rss_data.populate_hash = !!hash_report;
     } else {
         n->guest_hdr_len = n->mergeable_rx_bufs ?
             sizeof(struct virtio_net_hdr_mrg_rxbuf) :
             sizeof(struct virtio_net_hdr);
+        n->rss_data.populate_hash = false;
     }
 
+    /*
+     * The backend has no hash to report, so it keeps the 12 byte header
+     * and virtio_net_receive_rcu() fills in the hash fields itself.
+     */
+    host_hdr_len = n->rss_data.populate_hash ?
+        sizeof(struct virtio_net_hdr_mrg_rxbuf) : n->guest_hdr_len;
+
     for (i = 0; i < n->max_queues; i++) {
         nc = qemu_get_subqueue(n->nic, i);
 
         if (peer_has_vnet_hdr(n) &&
-            qemu_has_vnet_hdr_len(nc->peer, n->guest_hdr_len)) {
-            qemu_set_vnet_hdr_len(nc->peer, n->guest_hdr_len);
-            n->host_hdr_len = n->guest_hdr_len;
+            qemu_has_vnet_hdr_len(nc->peer, host_hdr_len)) {
+            qemu_set_vnet_hdr_len(nc->peer, host_hdr_len);
+            n->host_hdr_len = host_hdr_len;
         }
     }
 }
@@ -608,9 +815,19 @@ static uint64_t virtio_net_get_features(VirtIODevice *vdev, uint64_t features,
         virtio_clear_feature(&features, VIRTIO_NET_F_HOST_UFO);
     }
 
+    /* RSS and hash configuration are only reachable via the control vq */
+    if (!virtio_has_feature(features, VIRTIO_NET_F_CTRL_VQ)) {
+        virtio_clear_feature(&features, VIRTIO_NET_F_RSS);
+        virtio_clear_feature(&features, VIRTIO_NET_F_HASH_REPORT);
+    }
+
     if (!get_vhost_net(nc->peer)) {
         return features;
     }
+
+    /* Hashing happens in virtio_net_receive, which vhost bypasses */
+    virtio_clear_feature(&features, VIRTIO_NET_F_RSS);
+    virtio_clear_feature(&features, VIRTIO_NET_F_HASH_REPORT);
     features = vhost_net_get_features(get_vhost_net(nc->peer), features);
     vdev->backend_features = features;
 
@@ -682,7 +899,9 @@ static void virtio_net_set_features(VirtIODevice *vdev, uint64_t features)
                                virtio_has_feature(features,
                                                   VIRTIO_NET_F_MRG_RXBUF),
                                virtio_has_feature(features,
-                                                  VIRTIO_F_VERSION_1));
+                                                  VIRTIO_F_VERSION_1),
+                               virtio_has_feature(features,
+                                                  VIRTIO_NET_F_HASH_REPORT));
 
     if (n->has_vnet_hdr) {
         n->curr_guest_offloads =
@@ -920,6 +1139,97 @@ static int virtio_net_handle_announce(VirtIONet *n, uint8_t cmd,
     }
 }
 
+/*
+ * Parse VIRTIO_NET_CTRL_MQ_RSS_CONFIG or VIRTIO_NET_CTRL_MQ_HASH_CONFIG.
+ * Both share the virtio_net_rss_config layout; the hash variant has a
+ * single zero table entry and no queue count.  Returns the number of
+ * queue pairs to use, or 0 if the command is malformed.
+ */
+static uint16_t virtio_net_handle_rss(VirtIONet *n, uint8_t cmd,
+                                      struct iovec *iov, unsigned int iov_cnt)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    bool do_rss = cmd == VIRTIO_NET_CTRL_MQ_RSS_CONFIG;
+    struct virtio_net_rss_config cfg;
+    uint16_t table[VIRTIO_NET_RSS_MAX_TABLE_LEN];
+    uint8_t key[VIRTIO_NET_RSS_MAX_KEY_SIZE] = {};
+    struct {
+        uint16_t max_tx_vq;
+        uint8_t hash_key_length;
+    } QEMU_PACKED tail;
+    unsigned int table_len = 1, i;
+    uint16_t queues = n->curr_queues, default_queue = 0;
+    uint32_t hash_types;
+    size_t s, offset;
+
+    if (!virtio_vdev_has_feature(vdev, do_rss ? VIRTIO_NET_F_RSS :
+                                                VIRTIO_NET_F_HASH_REPORT)) {
+        return 0;
+    }
+
+    offset = offsetof(struct virtio_net_rss_config, indirection_table);
+    s = iov_to_buf(iov, iov_cnt, 0, &cfg, offset);
+    if (s != offset) {
+        return 0;
+    }
+    hash_types = virtio_ldl_p(vdev, &cfg.hash_types);
+    if (do_rss) {
+        table_len = virtio_lduw_p(vdev, &cfg.indirection_table_mask) + 1;
+        default_queue = virtio_lduw_p(vdev, &cfg.unclassified_queue);
+    }
+    if (table_len > VIRTIO_NET_RSS_MAX_TABLE_LEN ||
+        !is_power_of_2(table_len)) {
+        return 0;
+    }
+
+    s = iov_to_buf(iov, iov_cnt, offset, table, table_len * sizeof(table[0]));
+    if (s != table_len * sizeof(table[0])) {
+        return 0;
+    }
+    offset += s;
+
+    s = iov_to_buf(iov, iov_cnt, offset, &tail, sizeof(tail));
+    if (s != sizeof(tail)) {
+        return 0;
+    }
+    offset += s;
+
+    if (tail.hash_key_length > VIRTIO_NET_RSS_MAX_KEY_SIZE) {
+        return 0;
+    }
+    s = iov_to_buf(iov, iov_cnt, offset, key, tail.hash_key_length);
+    if (s != tail.hash_key_length) {
+        return 0;
+    }
+
+    if (do_rss) {
+        queues = virtio_lduw_p(vdev, &tail.max_tx_vq);
+        if (queues < 1 || queues > (n->multiqueue ? n->max_queues : 1)) {
+            return 0;
+        }
+        if (default_queue >= queues) {
+            return 0;
+        }
+        for (i = 0; i < table_len; i++) {
+            table[i] = virtio_lduw_p(vdev, &table[i]);
+            if (table[i] >= queues) {
+                return 0;
+            }
+        }
+    }
+
+    n->rss_data.hash_types = hash_types & VIRTIO_NET_RSS_SUPPORTED_HASHES;
+    n->rss_data.redirect = do_rss;
+    n->rss_data.enabled = do_rss || n->rss_data.hash_types;
+    n->rss_data.default_queue = default_queue;
+    n->rss_data.indirections_len = table_len;
+    memcpy(n->rss_data.indirections_table, table,
+           table_len * sizeof(table[0]));
+    memcpy(n->rss_data.key, key, sizeof(key));
+
+    return queues;
+}
+
 static int virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
                                 struct iovec *iov, unsigned int iov_cnt)
 {
@@ -928,21 +1238,30 @@ static int virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
     size_t s;
     uint16_t queues;
 
-    s = iov_to_buf(iov, iov_cnt, 0, &mq, sizeof(mq));
-    if (s != sizeof(mq)) {
-        return VIRTIO_NET_ERR;
-    }
+    if (cmd == VIRTIO_NET_CTRL_MQ_RSS_CONFIG ||
+        cmd == VIRTIO_NET_CTRL_MQ_HASH_CONFIG) {
+        queues = virtio_net_handle_rss(n, cmd, iov, iov_cnt);
+        if (!queues) {
+            return VIRTIO_NET_ERR;
+        }
+    } else if (cmd == VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET) {
+        s = iov_to_buf(iov, iov_cnt, 0, &mq, sizeof(mq));
+        if (s != sizeof(mq)) {
+            return VIRTIO_NET_ERR;
+        }
 
-    if (cmd != VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET) {
-        return VIRTIO_NET_ERR;
-    }
+        queues = virtio_lduw_p(vdev, &mq.virtqueue_pairs);
 
-    queues = virtio_lduw_p(vdev, &mq.virtqueue_pairs);
+        if (queues < VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN ||
+            queues > VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MAX ||
+            queues > n->max_queues ||
+            !n->multiqueue) {
+            return VIRTIO_NET_ERR;
+        }
 
-    if (queues < VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN ||
-        queues > VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MAX ||
-        queues > n->max_queues ||
-        !n->multiqueue) {
+        /* Plain queue pair selection turns steering off again */
+        virtio_net_disable_rss(n);
+    } else {
         return VIRTIO_NET_ERR;
     }
 
@@ -965,6 +1284,8 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
     struct iovec *iov, *iov2;
     unsigned int iov_cnt;
 
+    /* Runs in the main loop; the rx path may be in the iothread */
+    aio_context_acquire(n->ctx);
     for (;;) {
         elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
         if (!elem) {
@@ -1002,18 +1323,35 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
         assert(s == sizeof(status));
 
         virtqueue_push(vq, elem, sizeof(status));
-        virtio_notify(vdev, vq);
+        virtio_net_notify(vdev, vq);
         g_free(iov2);
         g_free(elem);
     }
+    aio_context_release(n->ctx);
 }
 
 /* RX */
 
+static bool virtio_net_rsc_retry(VirtIONetQueue *q);
+
 static void virtio_net_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
     int queue_index = vq2q(virtio_get_queue_index(vq));
+    int i;
+
+    /* Coalesced packets held back for lack of buffers go first */
+    if (!virtio_net_rsc_retry(&n->vqs[queue_index])) {
+        return;
+    }
+
+    if (n->rss_data.redirect) {
+        /* Packets steered to this queue may be held back on any subqueue */
+        for (i = 0; i < n->curr_queues; i++) {
+            qemu_flush_queued_packets(qemu_get_subqueue(n->nic, i));
+        }
+        return;
+    }
 
     qemu_flush_queued_packets(qemu_get_subqueue(n->nic, queue_index));
 }
@@ -1023,21 +1361,26 @@ static int virtio_net_can_receive(NetClientState *nc)
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    int ret = 0;
 
+    aio_context_acquire(n->ctx);
     if (!vdev->vm_running) {
-        return 0;
+        goto out;
     }
 
     if (nc->queue_index >= n->curr_queues) {
-        return 0;
+        goto out;
     }
 
     if (!virtio_queue_ready(q->rx_vq) ||
         !(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
-        return 0;
+        goto out;
     }
 
-    return 1;
+    ret = 1;
+out:
+    aio_context_release(n->ctx);
+    return ret;
 }
 
 static int virtio_net_has_buffers(VirtIONetQueue *q, int bufsize)
@@ -1171,8 +1514,187 @@ static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
     return 0;
 }
 
+static bool virtio_net_get_hash_type(VirtIONet *n, NetRxPktRssType *type)
+{
+    uint32_t types = n->rss_data.hash_types;
+    bool isip4, isip6, isudp, istcp;
+
+    net_rx_pkt_get_protocols(n->rx_pkt, &isip4, &isip6, &isudp, &istcp);
+
+    if (isip4) {
+        /* Only the first fragment carries the ports */
+        if (net_rx_pkt_get_ip4_info(n->rx_pkt)->fragment) {
+            istcp = isudp = false;
+        }
+        if (istcp && (types & VIRTIO_NET_RSS_HASH_TYPE_TCPv4)) {
+            *type = NetPktRssIpV4Tcp;
+        } else if (isudp && (types & VIRTIO_NET_RSS_HASH_TYPE_UDPv4)) {
+            *type = NetPktRssIpV4Udp;
+        } else if (types & VIRTIO_NET_RSS_HASH_TYPE_IPv4) {
+            *type = NetPktRssIpV4;
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    if (isip6) {
+        if (net_rx_pkt_get_ip6_info(n->rx_pkt)->fragment) {
+            istcp = isudp = false;
+        }
+        if (istcp && (types & VIRTIO_NET_RSS_HASH_TYPE_TCP_EX)) {
+            *type = NetPktRssIpV6TcpEx;
+        } else if (istcp && (types & VIRTIO_NET_RSS_HASH_TYPE_TCPv6)) {
+            *type = NetPktRssIpV6Tcp;
+        } else if (isudp && (types & VIRTIO_NET_RSS_HASH_TYPE_UDP_EX)) {
+            *type = NetPktRssIpV6UdpEx;
+        } else if (isudp && (types & VIRTIO_NET_RSS_HASH_TYPE_UDPv6)) {
+            *type = NetPktRssIpV6Udp;
+        } else if (types & VIRTIO_NET_RSS_HASH_TYPE_IP_EX) {
+            *type = NetPktRssIpV6Ex;
+        } else if (types & VIRTIO_NET_RSS_HASH_TYPE_IPv6) {
+            *type = NetPktRssIpV6;
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    return false;
+}
+
+/*
+ * Hash a packet, which starts with the host header, with the guest's key.
+ * The hash is stored in @hash for reporting in the rx header.  Returns
+ * false if the guest did not ask for this type of packet to be hashed.
+ */
+static bool virtio_net_calc_hash(VirtIONet *n, const uint8_t *buf,
+                                 size_t size,
+                                 struct virtio_net_hdr_v1_hash *hash,
+                                 uint32_t *value)
+{
+    static const uint16_t reports[] = {
+        [NetPktRssIpV4] = VIRTIO_NET_HASH_REPORT_IPv4,
+        [NetPktRssIpV4Tcp] = VIRTIO_NET_HASH_REPORT_TCPv4,
+        [NetPktRssIpV6Tcp] = VIRTIO_NET_HASH_REPORT_TCPv6,
+        [NetPktRssIpV6] = VIRTIO_NET_HASH_REPORT_IPv6,
+        [NetPktRssIpV6Ex] = VIRTIO_NET_HASH_REPORT_IPv6_EX,
+        [NetPktRssIpV6TcpEx] = VIRTIO_NET_HASH_REPORT_TCPv6_EX,
+        [NetPktRssIpV4Udp] = VIRTIO_NET_HASH_REPORT_UDPv4,
+        [NetPktRssIpV6Udp] = VIRTIO_NET_HASH_REPORT_UDPv6,
+        [NetPktRssIpV6UdpEx] = VIRTIO_NET_HASH_REPORT_UDPv6_EX,
+    };
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    NetRxPktRssType type;
+
+    net_rx_pkt_set_protocols(n->rx_pkt, buf + n->host_hdr_len,
+                             size - n->host_hdr_len);
+    if (!virtio_net_get_hash_type(n, &type)) {
+        return false;
+    }
+
+    *value = net_rx_pkt_calc_rss_hash(n->rx_pkt, type, n->rss_data.key);
+    virtio_stl_p(vdev, &hash->hash_value, *value);
+    virtio_stw_p(vdev, &hash->hash_report, reports[type]);
+    return true;
+}
+
+/*
+ * Hash an incoming packet with the guest's key and pick the subqueue the
+ * indirection table maps it to.
+ */
+static NetClientState *
+virtio_net_process_rss(NetClientState *nc, const uint8_t *buf, size_t size,
+                       struct virtio_net_hdr_v1_hash *hash)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    uint32_t value;
+    uint16_t index;
+
+    if (size < n->host_hdr_len) {
+        return nc;
+    }
+
+    if (!virtio_net_calc_hash(n, buf, size, hash, &value)) {
+        if (!n->rss_data.redirect) {
+            return nc;
+        }
+        index = n->rss_data.default_queue;
+        return qemu_get_subqueue(n->nic, index % n->curr_queues);
+    }
+
+    if (!n->rss_data.redirect) {
+        return nc;
+    }
+    index = n->rss_data.indirections_table[value &
+                                           (n->rss_data.indirections_len - 1)];
+    return qemu_get_subqueue(n->nic, index % n->curr_queues);
+}
+
+static bool virtio_net_rsc_active(VirtIONet *n)
+{
+    return n->has_vnet_hdr && !n->needs_vnet_hdr_swap &&
+           n->mergeable_rx_bufs &&
+           (n->curr_guest_offloads & VIRTIO_NET_RSC_OFFLOADS) ==
+           VIRTIO_NET_RSC_OFFLOADS;
+}
+
+static size_t virtio_net_rsc_pending(VirtIONetQueue *q)
+{
+    if (!q->rsc) {
+        return 0;
+    }
+    return net_rsc_pending(q->rsc, q->n->guest_hdr_len);
+}
+
+/*
+ * Deliver coalesced packets that an earlier flush could not place.
+ * Returns false while some are still held back.
+ */
+static bool virtio_net_rsc_retry(VirtIONetQueue *q)
+{
+    bool ret;
+
+    if (!q->rsc || q->rsc_flushing) {
+        return true;
+    }
+
+    rcu_read_lock();
+    ret = net_rsc_retry(q->rsc);
+    rcu_read_unlock();
+    return ret;
+}
+
+/*
+ * Offer a packet from the backend to the coalescing stage.  Coalescing
+ * only happens inside a backend burst, which guarantees a flush when the
+ * burst ends, and only for packets that carry no offload state yet.
+ * Returns like net_rsc_receive().
+ */
+static int virtio_net_rsc_receive(VirtIONetQueue *q, const uint8_t *buf,
+                                  size_t size)
+{
+    VirtIONet *n = q->n;
+    const struct virtio_net_hdr *hdr = (const void *)buf;
+
+    if (!q->rsc || q->rsc_flushing || !n->rx_batch_depth ||
+        !virtio_net_rsc_active(n) || size < n->host_hdr_len) {
+        return 0;
+    }
+
+    if (hdr->gso_type != VIRTIO_NET_HDR_GSO_NONE ||
+        (hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)) {
+        return 0;
+    }
+
+    return net_rsc_receive(q->rsc, buf + n->host_hdr_len,
+                           size - n->host_hdr_len,
+                           hdr->flags & VIRTIO_NET_HDR_F_DATA_VALID);
+}
+
 static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
-                                      size_t size)
+                                      size_t size,
+                                      const struct virtio_net_hdr_v1_hash *hash)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
@@ -1181,19 +1703,33 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
     struct virtio_net_hdr_mrg_rxbuf mhdr;
     unsigned mhdr_cnt = 0;
     size_t offset, i, guest_offset;
+    int ret;
 
     if (!virtio_net_can_receive(nc)) {
         return -1;
     }
 
-    /* hdr_len refers to the header we supply to the guest */
-    if (!virtio_net_has_buffers(q, size + n->guest_hdr_len - n->host_hdr_len)) {
+    if (!virtio_net_rsc_retry(q)) {
+        return 0;
+    }
+
+    /* hdr_len refers to the header we supply to the guest; coalesced
+     * packets still waiting to be flushed have a claim on the ring too */
+    if (!virtio_net_has_buffers(q, size + n->guest_hdr_len - n->host_hdr_len +
+                                   virtio_net_rsc_pending(q))) {
         return 0;
     }
 
     if (!receive_filter(n, buf, size))
         return size;
 
+    ret = virtio_net_rsc_receive(q, buf, size);
+    if (ret < 0) {
+        return 0;
+    } else if (ret) {
+        return size;
+    }
+
     offset = i = 0;
 
     while (offset < size) {
@@ -1236,6 +1772,12 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
             }
 
             receive_header(n, sg, elem->in_num, buf, size);
+            if (n->rss_data.populate_hash) {
+                offset = offsetof(struct virtio_net_hdr_v1_hash, hash_value);
+                iov_from_buf(sg, elem->in_num, offset,
+                             (const uint8_t *)hash + offset,
+                             sizeof(*hash) - offset);
+            }
             offset = n->host_hdr_len;
             total += n->guest_hdr_len;
             guest_offset = n->guest_hdr_len;
@@ -1270,22 +1812,113 @@ static ssize_t virtio_net_receive_rcu(NetClientState *nc, const uint8_t *buf,
     }
 
     virtqueue_flush(q->rx_vq, i);
-    virtio_notify(vdev, q->rx_vq);
+    if (n->rx_batch_depth) {
+        q->rx_notify_pending = true;
+    } else {
+        virtio_net_notify(vdev, q->rx_vq);
+    }
 
     return size;
 }
 
+static bool virtio_net_rsc_deliver(void *opaque, uint8_t *buf, size_t size,
+                                   const struct virtio_net_hdr *hdr)
+{
+    VirtIONetQueue *q = opaque;
+    VirtIONet *n = q->n;
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    NetClientState *nc = qemu_get_subqueue(n->nic, q - n->vqs);
+    struct virtio_net_hdr_v1_hash hash = {};
+    struct virtio_net_hdr *vhdr;
+    size_t skip = VIRTIO_NET_RSC_HEADROOM - n->host_hdr_len;
+    uint32_t value;
+    ssize_t ret;
+
+    /* Dress the packet up the way the backend would have */
+    buf += skip;
+    size -= skip;
+    memset(buf, 0, n->host_hdr_len);
+    vhdr = (struct virtio_net_hdr *)buf;
+    vhdr->flags = hdr->flags;
+    vhdr->gso_type = hdr->gso_type;
+    virtio_stw_p(vdev, &vhdr->hdr_len, hdr->hdr_len);
+    virtio_stw_p(vdev, &vhdr->gso_size, hdr->gso_size);
+    virtio_stw_p(vdev, &vhdr->csum_start, hdr->csum_start);
+    virtio_stw_p(vdev, &vhdr->csum_offset, hdr->csum_offset);
+
+    /* The segments were steered here by the same hash */
+    if (n->rss_data.enabled) {
+        virtio_net_calc_hash(n, buf, size, &hash, &value);
+    }
+
+    /* With the ring full, keep the packet until virtio_net_handle_rx() */
+    q->rsc_flushing = true;
+    ret = virtio_net_receive_rcu(nc, buf, size, &hash);
+    q->rsc_flushing = false;
+    return ret != 0;
+}
+
+static void virtio_net_rsc_flush(VirtIONet *n)
+{
+    int i;
+
+    rcu_read_lock();
+    for (i = 0; i < n->max_queues; i++) {
+        if (n->vqs[i].rsc) {
+            net_rsc_flush(n->vqs[i].rsc);
+        }
+    }
+    rcu_read_unlock();
+}
+
 static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf,
                                   size_t size)
 {
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    struct virtio_net_hdr_v1_hash hash = {};
     ssize_t r;
 
+    aio_context_acquire(n->ctx);
+    if (n->rss_data.enabled) {
+        nc = virtio_net_process_rss(nc, buf, size, &hash);
+    }
     rcu_read_lock();
-    r = virtio_net_receive_rcu(nc, buf, size);
+    r = virtio_net_receive_rcu(nc, buf, size, &hash);
     rcu_read_unlock();
+    aio_context_release(n->ctx);
     return r;
 }
 
+static void virtio_net_receive_batch(NetClientState *nc, bool batching)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    int i;
+
+    aio_context_acquire(n->ctx);
+    if (batching) {
+        n->rx_batch_depth++;
+    } else {
+        assert(n->rx_batch_depth > 0);
+        if (n->rx_batch_depth == 1) {
+            /* Coalesced packets are part of the burst they came from */
+            virtio_net_rsc_flush(n);
+        }
+        if (--n->rx_batch_depth == 0) {
+            /* RSS may have spread the burst over several queues */
+            for (i = 0; i < n->max_queues; i++) {
+                VirtIONetQueue *q = &n->vqs[i];
+
+                if (q->rx_notify_pending) {
+                    q->rx_notify_pending = false;
+                    virtio_net_notify(vdev, q->rx_vq);
+                }
+            }
+        }
+    }
+    aio_context_release(n->ctx);
+}
+
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
 
 static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
@@ -1294,17 +1927,29 @@ static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
 
+    aio_context_acquire(n->ctx);
     virtqueue_push(q->tx_vq, q->async_tx.elem, 0);
-    virtio_notify(vdev, q->tx_vq);
+    virtio_net_notify(vdev, q->tx_vq);
 
     g_free(q->async_tx.elem);
     q->async_tx.elem = NULL;
 
     virtio_queue_set_notification(q->tx_vq, 1);
     virtio_net_flush_tx(q);
+    aio_context_release(n->ctx);
 }
 
 /* TX */
+
+/* Publish the first @count completions filled by virtio_net_flush_tx */
+static void virtio_net_tx_push(VirtIONetQueue *q, unsigned int count)
+{
+    if (count) {
+        virtqueue_flush(q->tx_vq, count);
+        virtio_net_notify(VIRTIO_DEVICE(q->n), q->tx_vq);
+    }
+}
+
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 {
     VirtIONet *n = q->n;
@@ -1338,6 +1983,7 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
             virtio_error(vdev, "virtio-net header not in first element");
             virtqueue_detach_element(q->tx_vq, elem, 0);
             g_free(elem);
+            virtio_net_tx_push(q, num_packets);
             return -EINVAL;
         }
 
@@ -1347,6 +1993,7 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
                 virtio_error(vdev, "virtio-net header incorrect");
                 virtqueue_detach_element(q->tx_vq, elem, 0);
                 g_free(elem);
+                virtio_net_tx_push(q, num_packets);
                 return -EINVAL;
             }
             if (n->needs_vnet_hdr_swap) {
@@ -1385,18 +2032,20 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
         if (ret == 0) {
             virtio_queue_set_notification(q->tx_vq, 0);
             q->async_tx.elem = elem;
+            virtio_net_tx_push(q, num_packets);
             return -EBUSY;
         }
 
 drop:
-        virtqueue_push(q->tx_vq, elem, 0);
-        virtio_notify(vdev, q->tx_vq);
+        /* Completions are published and signalled once per burst */
+        virtqueue_fill(q->tx_vq, elem, 0, num_packets);
         g_free(elem);
 
         if (++num_packets >= n->tx_burst) {
             break;
         }
     }
+    virtio_net_tx_push(q, num_packets);
     return num_packets;
 }
 
@@ -1465,20 +2114,19 @@ static void virtio_net_tx_timer(void *opaque)
         return;
     }
 
+    aio_context_acquire(n->ctx);
     q->tx_waiting = 0;
 
     /* Just in case the driver is not ready on more */
-    if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
-        return;
+    if (vdev->status & VIRTIO_CONFIG_S_DRIVER_OK) {
+        virtio_queue_set_notification(q->tx_vq, 1);
+        virtio_net_flush_tx(q);
     }
-
-    virtio_queue_set_notification(q->tx_vq, 1);
-    virtio_net_flush_tx(q);
+    aio_context_release(n->ctx);
 }
 
-static void virtio_net_tx_bh(void *opaque)
+static void virtio_net_tx_bh_locked(VirtIONetQueue *q)
 {
-    VirtIONetQueue *q = opaque;
     VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
     int32_t ret;
@@ -1525,6 +2173,15 @@ static void virtio_net_tx_bh(void *opaque)
     }
 }
 
+static void virtio_net_tx_bh(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+
+    aio_context_acquire(q->n->ctx);
+    virtio_net_tx_bh_locked(q);
+    aio_context_release(q->n->ctx);
+}
+
 static void virtio_net_add_queue(VirtIONet *n, int index)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
@@ -1536,18 +2193,33 @@ static void virtio_net_add_queue(VirtIONet *n, int index)
         n->vqs[index].tx_vq =
             virtio_add_queue(vdev, n->net_conf.tx_queue_size,
                              virtio_net_handle_tx_timer);
-        n->vqs[index].tx_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
-                                              virtio_net_tx_timer,
-                                              &n->vqs[index]);
+        if (n->net_conf.iothread) {
+            n->vqs[index].tx_timer = aio_timer_new(n->ctx, QEMU_CLOCK_VIRTUAL,
+                                                   SCALE_NS,
+                                                   virtio_net_tx_timer,
+                                                   &n->vqs[index]);
+        } else {
+            n->vqs[index].tx_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                                  virtio_net_tx_timer,
+                                                  &n->vqs[index]);
+        }
     } else {
         n->vqs[index].tx_vq =
             virtio_add_queue(vdev, n->net_conf.tx_queue_size,
                              virtio_net_handle_tx_bh);
-        n->vqs[index].tx_bh = qemu_bh_new(virtio_net_tx_bh, &n->vqs[index]);
+        n->vqs[index].tx_bh = aio_bh_new(n->ctx, virtio_net_tx_bh,
+                                         &n->vqs[index]);
     }
 
     n->vqs[index].tx_waiting = 0;
     n->vqs[index].n = n;
+
+    if (n->net_conf.rsc) {
+        n->vqs[index].rsc = net_rsc_new(VIRTIO_NET_RSC_HEADROOM,
+                                        VIRTIO_NET_RSC_TIMEOUT,
+                                        virtio_net_rsc_deliver,
+                                        &n->vqs[index]);
+    }
 }
 
 static void virtio_net_del_queue(VirtIONet *n, int index)
@@ -1569,6 +2241,9 @@ static void virtio_net_del_queue(VirtIONet *n, int index)
     }
     q->tx_waiting = 0;
     virtio_del_queue(vdev, index * 2 + 1);
+
+    net_rsc_free(q->rsc);
+    q->rsc = NULL;
 }
 
 static void virtio_net_change_num_queues(VirtIONet *n, int new_max_queues)
@@ -1624,7 +2299,9 @@ static int virtio_net_post_load_device(void *opaque, int version_id)
 
     virtio_net_set_mrg_rx_bufs(n, n->mergeable_rx_bufs,
                                virtio_vdev_has_feature(vdev,
-                                                       VIRTIO_F_VERSION_1));
+                                                       VIRTIO_F_VERSION_1),
+                               virtio_vdev_has_feature(vdev,
+                                                VIRTIO_NET_F_HASH_REPORT));
 
     /* MAC_TABLE_ENTRIES may be different from the saved image */
     if (n->mac_table.in_use > MAC_TABLE_ENTRIES) {
@@ -1823,6 +2500,47 @@ static const VMStateDescription vmstate_virtio_net_has_vnet = {
     },
 };
 
+static bool virtio_net_rss_needed(void *opaque)
+{
+    VirtIONet *n = opaque;
+
+    return n->rss_data.enabled;
+}
+
+static int virtio_net_rss_post_load(void *opaque, int version_id)
+{
+    VirtIONet *n = opaque;
+
+    if (n->rss_data.indirections_len > VIRTIO_NET_RSS_MAX_TABLE_LEN ||
+        !is_power_of_2(n->rss_data.indirections_len)) {
+        error_report("virtio-net: invalid RSS indirection table length %u",
+                     n->rss_data.indirections_len);
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static const VMStateDescription vmstate_virtio_net_rss = {
+    .name = "virtio-net-device/rss",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = virtio_net_rss_needed,
+    .post_load = virtio_net_rss_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_BOOL(rss_data.enabled, VirtIONet),
+        VMSTATE_BOOL(rss_data.redirect, VirtIONet),
+        VMSTATE_UINT32(rss_data.hash_types, VirtIONet),
+        VMSTATE_UINT8_ARRAY(rss_data.key, VirtIONet,
+                            VIRTIO_NET_RSS_MAX_KEY_SIZE),
+        VMSTATE_UINT16(rss_data.indirections_len, VirtIONet),
+        VMSTATE_UINT16_ARRAY(rss_data.indirections_table, VirtIONet,
+                             VIRTIO_NET_RSS_MAX_TABLE_LEN),
+        VMSTATE_UINT16(rss_data.default_queue, VirtIONet),
+        VMSTATE_END_OF_LIST()
+    },
+};
+
 static const VMStateDescription vmstate_virtio_net_device = {
     .name = "virtio-net-device",
     .version_id = VIRTIO_NET_VM_VERSION,
@@ -1873,6 +2591,10 @@ static const VMStateDescription vmstate_virtio_net_device = {
                             has_ctrl_guest_offloads),
         VMSTATE_END_OF_LIST()
    },
+    .subsections = (const VMStateDescription * []) {
+        &vmstate_virtio_net_rss,
+        NULL
+    }
 };
 
 static NetClientInfo net_virtio_info = {
@@ -1882,6 +2604,7 @@ static NetClientInfo net_virtio_info = {
     .receive = virtio_net_receive,
     .link_status_changed = virtio_net_set_link_status,
     .query_rx_filter = virtio_net_query_rxfilter,
+    .receive_batch = virtio_net_receive_batch,
 };
 
 static bool virtio_net_guest_notifier_pending(VirtIODevice *vdev, int idx)
@@ -1933,11 +2656,43 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
     VirtIONet *n = VIRTIO_NET(dev);
+    BusState *qbus = BUS(qdev_get_parent_bus(dev));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
     NetClientState *nc;
     int i;
 
+    if (n->net_conf.iothread) {
+        if (!k->set_guest_notifiers || !k->ioeventfd_assign) {
+            error_setg(errp,
+                       "device is incompatible with iothread "
+                       "(transport does not support notifiers)");
+            return;
+        }
+        if (!virtio_device_ioeventfd_enabled(vdev)) {
+            error_setg(errp, "ioeventfd is required for iothread");
+            return;
+        }
+        for (i = 0; i < n->nic_conf.peers.queues; i++) {
+            NetClientState *peer = n->nic_conf.peers.ncs[i];
+
+            if (peer && !qemu_can_set_aio_context(peer)) {
+                error_setg(errp, "netdev '%s' cannot be used with iothread",
+                           peer->name);
+                return;
+            }
+            if (peer && !QTAILQ_EMPTY(&peer->filters)) {
+                error_setg(errp, "netdev '%s' has filters, which cannot be "
+                           "used with iothread", peer->name);
+                return;
+            }
+        }
+        n->ctx = iothread_get_aio_context(n->net_conf.iothread);
+    } else {
+        n->ctx = qemu_get_aio_context();
+    }
+
     if (n->net_conf.mtu) {
-        n->host_features |= (0x1 << VIRTIO_NET_F_MTU);
+        n->host_features |= (1ULL << VIRTIO_NET_F_MTU);
     }
 
     virtio_net_set_config_size(n, n->host_features);
@@ -2029,7 +2784,7 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
 
     n->vqs[0].tx_waiting = 0;
     n->tx_burst = n->net_conf.txburst;
-    virtio_net_set_mrg_rx_bufs(n, 0, 0);
+    virtio_net_set_mrg_rx_bufs(n, 0, 0, 0);
     n->promisc = 1; /* for compatibility */
 
     n->mac_table.macs = g_malloc0(MAC_TABLE_ENTRIES * ETH_ALEN);
@@ -2039,6 +2794,11 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
     nc = qemu_get_queue(n->nic);
     nc->rxfilter_notify_enabled = 1;
 
+    net_rx_pkt_init(&n->rx_pkt, false);
+
+    if (n->net_conf.iothread) {
+        object_ref(OBJECT(n->net_conf.iothread));
+    }
     n->qdev = dev;
 }
 
@@ -2058,6 +2818,7 @@ static void virtio_net_device_unrealize(DeviceState *dev, Error **errp)
 
     g_free(n->mac_table.macs);
     g_free(n->vlans);
+    net_rx_pkt_uninit(n->rx_pkt);
 
     max_queues = n->multiqueue ? n->max_queues : 1;
     for (i = 0; i < max_queues; i++) {
@@ -2069,6 +2830,10 @@ static void virtio_net_device_unrealize(DeviceState *dev, Error **errp)
     g_free(n->vqs);
     qemu_del_nic(n->nic);
     virtio_cleanup(vdev);
+
+    if (n->net_conf.iothread) {
+        object_unref(OBJECT(n->net_conf.iothread));
+    }
 }
 
 static void virtio_net_instance_init(Object *obj)
@@ -2108,45 +2873,50 @@ static const VMStateDescription vmstate_virtio_net = {
 };
 
 static Property virtio_net_properties[] = {
-    DEFINE_PROP_BIT("csum", VirtIONet, host_features, VIRTIO_NET_F_CSUM, true),
-    DEFINE_PROP_BIT("guest_csum", VirtIONet, host_features,
-                    VIRTIO_NET_F_GUEST_CSUM, true),
-    DEFINE_PROP_BIT("gso", VirtIONet, host_features, VIRTIO_NET_F_GSO, true),
-    DEFINE_PROP_BIT("guest_tso4", VirtIONet, host_features,
-                    VIRTIO_NET_F_GUEST_TSO4, true),
-    DEFINE_PROP_BIT("guest_tso6", VirtIONet, host_features,
-                    VIRTIO_NET_F_GUEST_TSO6, true),
-    DEFINE_PROP_BIT("guest_ecn", VirtIONet, host_features,
-                    VIRTIO_NET_F_GUEST_ECN, true),
-    DEFINE_PROP_BIT("guest_ufo", VirtIONet, host_features,
-                    VIRTIO_NET_F_GUEST_UFO, true),
-    DEFINE_PROP_BIT("guest_announce", VirtIONet, host_features,
-                    VIRTIO_NET_F_GUEST_ANNOUNCE, true),
-    DEFINE_PROP_BIT("host_tso4", VirtIONet, host_features,
-                    VIRTIO_NET_F_HOST_TSO4, true),
-    DEFINE_PROP_BIT("host_tso6", VirtIONet, host_features,
-                    VIRTIO_NET_F_HOST_TSO6, true),
-    DEFINE_PROP_BIT("host_ecn", VirtIONet, host_features,
-                    VIRTIO_NET_F_HOST_ECN, true),
-    DEFINE_PROP_BIT("host_ufo", VirtIONet, host_features,
-                    VIRTIO_NET_F_HOST_UFO, true),
-    DEFINE_PROP_BIT("mrg_rxbuf", VirtIONet, host_features,
-                    VIRTIO_NET_F_MRG_RXBUF, true),
-    DEFINE_PROP_BIT("status", VirtIONet, host_features,
-                    VIRTIO_NET_F_STATUS, true),
-    DEFINE_PROP_BIT("ctrl_vq", VirtIONet, host_features,
-                    VIRTIO_NET_F_CTRL_VQ, true),
-    DEFINE_PROP_BIT("ctrl_rx", VirtIONet, host_features,
-                    VIRTIO_NET_F_CTRL_RX, true),
-    DEFINE_PROP_BIT("ctrl_vlan", VirtIONet, host_features,
-                    VIRTIO_NET_F_CTRL_VLAN, true),
-    DEFINE_PROP_BIT("ctrl_rx_extra", VirtIONet, host_features,
-                    VIRTIO_NET_F_CTRL_RX_EXTRA, true),
-    DEFINE_PROP_BIT("ctrl_mac_addr", VirtIONet, host_features,
-                    VIRTIO_NET_F_CTRL_MAC_ADDR, true),
-    DEFINE_PROP_BIT("ctrl_guest_offloads", VirtIONet, host_features,
-                    VIRTIO_NET_F_CTRL_GUEST_OFFLOADS, true),
-    DEFINE_PROP_BIT("mq", VirtIONet, host_features, VIRTIO_NET_F_MQ, false),
+    DEFINE_PROP_BIT64("csum", VirtIONet, host_features,
+                      VIRTIO_NET_F_CSUM, true),
+    DEFINE_PROP_BIT64("guest_csum", VirtIONet, host_features,
+                      VIRTIO_NET_F_GUEST_CSUM, true),
+    DEFINE_PROP_BIT64("gso", VirtIONet, host_features, VIRTIO_NET_F_GSO, true),
+    DEFINE_PROP_BIT64("guest_tso4", VirtIONet, host_features,
+                      VIRTIO_NET_F_GUEST_TSO4, true),
+    DEFINE_PROP_BIT64("guest_tso6", VirtIONet, host_features,
+                      VIRTIO_NET_F_GUEST_TSO6, true),
+    DEFINE_PROP_BIT64("guest_ecn", VirtIONet, host_features,
+                      VIRTIO_NET_F_GUEST_ECN, true),
+    DEFINE_PROP_BIT64("guest_ufo", VirtIONet, host_features,
+                      VIRTIO_NET_F_GUEST_UFO, true),
+    DEFINE_PROP_BIT64("guest_announce", VirtIONet, host_features,
+                      VIRTIO_NET_F_GUEST_ANNOUNCE, true),
+    DEFINE_PROP_BIT64("host_tso4", VirtIONet, host_features,
+                      VIRTIO_NET_F_HOST_TSO4, true),
+    DEFINE_PROP_BIT64("host_tso6", VirtIONet, host_features,
+                      VIRTIO_NET_F_HOST_TSO6, true),
+    DEFINE_PROP_BIT64("host_ecn", VirtIONet, host_features,
+                      VIRTIO_NET_F_HOST_ECN, true),
+    DEFINE_PROP_BIT64("host_ufo", VirtIONet, host_features,
+                      VIRTIO_NET_F_HOST_UFO, true),
+    DEFINE_PROP_BIT64("mrg_rxbuf", VirtIONet, host_features,
+                      VIRTIO_NET_F_MRG_RXBUF, true),
+    DEFINE_PROP_BIT64("status", VirtIONet, host_features,
+                      VIRTIO_NET_F_STATUS, true),
+    DEFINE_PROP_BIT64("ctrl_vq", VirtIONet, host_features,
+                      VIRTIO_NET_F_CTRL_VQ, true),
+    DEFINE_PROP_BIT64("ctrl_rx", VirtIONet, host_features,
+                      VIRTIO_NET_F_CTRL_RX, true),
+    DEFINE_PROP_BIT64("ctrl_vlan", VirtIONet, host_features,
+                      VIRTIO_NET_F_CTRL_VLAN, true),
+    DEFINE_PROP_BIT64("ctrl_rx_extra", VirtIONet, host_features,
+                      VIRTIO_NET_F_CTRL_RX_EXTRA, true),
+    DEFINE_PROP_BIT64("ctrl_mac_addr", VirtIONet, host_features,
+                      VIRTIO_NET_F_CTRL_MAC_ADDR, true),
+    DEFINE_PROP_BIT64("ctrl_guest_offloads", VirtIONet, host_features,
+                      VIRTIO_NET_F_CTRL_GUEST_OFFLOADS, true),
+    DEFINE_PROP_BIT64("mq", VirtIONet, host_features, VIRTIO_NET_F_MQ, false),
+    DEFINE_PROP_BIT64("rss", VirtIONet, host_features,
+                      VIRTIO_NET_F_RSS, false),
+    DEFINE_PROP_BIT64("hash", VirtIONet, host_features,
+                      VIRTIO_NET_F_HASH_REPORT, false),
     DEFINE_NIC_PROPERTIES(VirtIONet, nic_conf),
     DEFINE_PROP_UINT32("x-txtimer", VirtIONet, net_conf.txtimer,
                        TX_TIMER_INTERVAL),
@@ -2159,6 +2929,9 @@ static Property virtio_net_properties[] = {
     DEFINE_PROP_UINT16("host_mtu", VirtIONet, net_conf.mtu, 0),
     DEFINE_PROP_BOOL("x-mtu-bypass-backend", VirtIONet, mtu_bypass_backend,
                      true),
+    DEFINE_PROP_LINK("iothread", VirtIONet, net_conf.iothread, TYPE_IOTHREAD,
+                     IOThread *),
+    DEFINE_PROP_BOOL("rsc", VirtIONet, net_conf.rsc, false),
     DEFINE_PROP_END_OF_LIST(),
 };
 
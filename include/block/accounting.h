@@ -38,6 +38,17 @@ enum BlockAcctType {
     BLOCK_MAX_IOTYPE,
 };
 
+/* Latency histograms split every power of two of latency into
+ * 1 << precision bins; see block_latency_histograms_set() */
+#define BLOCK_LATENCY_HISTOGRAM_DEFAULT_PRECISION 2
+#define BLOCK_LATENCY_HISTOGRAM_MAX_PRECISION 6
+
+typedef struct BlockLatencyHistogram {
+    unsigned precision;
+    int nbins;
+    uint64_t *bins;         /* NULL if the histogram is disabled */
+} BlockLatencyHistogram;
+
 struct BlockAcctTimedStats {
     BlockAcctStats *stats;
     TimedAverage latency[BLOCK_MAX_IOTYPE];
@@ -55,6 +66,7 @@ struct BlockAcctStats {
     uint64_t merged[BLOCK_MAX_IOTYPE];
     int64_t last_access_time_ns;
     QSLIST_HEAD(, BlockAcctTimedStats) intervals;
+    BlockLatencyHistogram latency_histogram[BLOCK_MAX_IOTYPE];
     bool account_invalid;
     bool account_failed;
 };
@@ -82,5 +94,11 @@ void block_acct_merge_done(BlockAcctStats *stats, enum BlockAcctType type,
 int64_t block_acct_idle_time_ns(BlockAcctStats *stats);
 double block_acct_queue_depth(BlockAcctTimedStats *stats,
                               enum BlockAcctType type);
+void block_latency_histograms_set(BlockAcctStats *stats, unsigned precision);
+void block_latency_histograms_clear(BlockAcctStats *stats);
+int block_latency_histogram_index(BlockLatencyHistogram *hist,
+                                  int64_t latency_ns);
+uint64_t block_latency_histogram_boundary(BlockLatencyHistogram *hist,
+                                          int bin);
 
 #endif
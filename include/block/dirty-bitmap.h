@@ -4,6 +4,11 @@
 #include "qemu-common.h"
 #include "qemu/hbitmap.h"
 
+/* Merges the stored data for [@offset, @offset + @bytes) into @bitmap with
+ * bdrv_dirty_bitmap_merge_part(); returns 0 on success, -errno on failure. */
+typedef int BdrvDirtyBitmapLoadFunc(BdrvDirtyBitmap *bitmap, uint64_t offset,
+                                    uint64_t bytes, void *opaque);
+
 BdrvDirtyBitmap *bdrv_create_dirty_bitmap(BlockDriverState *bs,
                                           uint32_t granularity,
                                           const char *name,
@@ -64,6 +69,22 @@ void bdrv_dirty_bitmap_deserialize_ones(BdrvDirtyBitmap *bitmap,
                                         bool finish);
 void bdrv_dirty_bitmap_deserialize_finish(BdrvDirtyBitmap *bitmap);
 
+void bdrv_dirty_bitmap_set_lazy_load(BdrvDirtyBitmap *bitmap,
+                                     uint64_t chunk_size,
+                                     BdrvDirtyBitmapLoadFunc *load,
+                                     void *opaque,
+                                     GDestroyNotify opaque_free);
+void *bdrv_dirty_bitmap_lazy_load_opaque(BdrvDirtyBitmap *bitmap,
+                                         BdrvDirtyBitmapLoadFunc *load);
+void bdrv_dirty_bitmap_load(BdrvDirtyBitmap *bitmap,
+                            int64_t offset, int64_t bytes);
+void bdrv_dirty_bitmap_end_lazy_load(BdrvDirtyBitmap *bitmap);
+void bdrv_dirty_bitmap_merge_part(BdrvDirtyBitmap *bitmap,
+                                  uint8_t *buf, uint64_t offset,
+                                  uint64_t bytes);
+bool bdrv_dirty_bitmap_chunk_changed(BdrvDirtyBitmap *bitmap, int64_t offset);
+void bdrv_dirty_bitmap_clear_changed(BdrvDirtyBitmap *bitmap);
+
 void bdrv_dirty_bitmap_set_readonly(BdrvDirtyBitmap *bitmap, bool value);
 void bdrv_dirty_bitmap_set_autoload(BdrvDirtyBitmap *bitmap, bool autoload);
 void bdrv_dirty_bitmap_set_persistance(BdrvDirtyBitmap *bitmap,
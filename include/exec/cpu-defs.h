@@ -24,6 +24,7 @@
 #endif
 
 #include "qemu/host-utils.h"
+#include "qemu/thread.h"
 #include "qemu/queue.h"
 #ifdef CONFIG_TCG
 #include "tcg-target.h"
@@ -88,6 +89,21 @@ typedef uint64_t target_ulong;
  * 0x18 (the offset of the addend field in each TLB entry) plus the offset
  * of tlb_table inside env (which is non-trivial but not huge).
  */
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+/* With a dynamic TLB, the TCG backend loads the table pointer and the
+ * index mask for the MMU index from env instead of indexing a fixed
+ * size array, so the size of each table can change at flush time.
+ */
+#define CPU_TLB_DYN_MIN_BITS 6
+#define CPU_TLB_DYN_DEFAULT_BITS 8
+# if HOST_LONG_BITS == 32
+/* Make sure we do not require a double-word shift for the TLB load */
+#  define CPU_TLB_DYN_MAX_BITS (32 - TARGET_PAGE_BITS)
+# else
+/* No point in covering more pages than the guest can address */
+#  define CPU_TLB_DYN_MAX_BITS MIN(22, TARGET_LONG_BITS - TARGET_PAGE_BITS)
+# endif
+#else
 #define CPU_TLB_BITS                                             \
     MIN(8,                                                       \
         TCG_TARGET_TLB_DISPLACEMENT_BITS - CPU_TLB_ENTRY_BITS -  \
@@ -97,6 +113,7 @@ typedef uint64_t target_ulong;
          NB_MMU_MODES <= 8 ? 3 : 4))
 
 #define CPU_TLB_SIZE (1 << CPU_TLB_BITS)
+#endif /* TCG_TARGET_IMPLEMENTS_DYN_TLB */
 
 typedef struct CPUTLBEntry {
     /* bit TARGET_LONG_BITS to TARGET_PAGE_BITS : virtual address
@@ -131,12 +148,40 @@ typedef struct CPUIOTLBEntry {
     MemTxAttrs attrs;
 } CPUIOTLBEntry;
 
+/* Per MMU index occupancy of the TLB, used to pick the size of the
+ * table the next time it is flushed.  window_max_entries is the
+ * largest n_used_entries seen since window_begin_ns.
+ */
+typedef struct CPUTLBDesc {
+    int64_t window_begin_ns;
+    size_t window_max_entries;
+    size_t n_used_entries;
+} CPUTLBDesc;
+
+#if TCG_TARGET_IMPLEMENTS_DYN_TLB
+/* tlb_mask[i] is (number of entries in tlb_table[i] - 1) shifted left
+ * by CPU_TLB_ENTRY_BITS, so that generated code can turn a shifted
+ * address into a byte offset into the table with a single AND.
+ */
+#define CPU_COMMON_TLB_TABLES                                           \
+    uintptr_t tlb_mask[NB_MMU_MODES];                                   \
+    CPUTLBEntry *tlb_table[NB_MMU_MODES];                               \
+    CPUIOTLBEntry *iotlb[NB_MMU_MODES];
+#else
+#define CPU_COMMON_TLB_TABLES                                           \
+    CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];                  \
+    CPUIOTLBEntry iotlb[NB_MMU_MODES][CPU_TLB_SIZE];
+#endif
+
 #define CPU_COMMON_TLB \
     /* The meaning of the MMU modes is defined in the target code. */   \
-    CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];                  \
+    CPU_COMMON_TLB_TABLES                                               \
     CPUTLBEntry tlb_v_table[NB_MMU_MODES][CPU_VTLB_SIZE];               \
-    CPUIOTLBEntry iotlb[NB_MMU_MODES][CPU_TLB_SIZE];                    \
     CPUIOTLBEntry iotlb_v[NB_MMU_MODES][CPU_VTLB_SIZE];                 \
+    CPUTLBDesc tlb_d[NB_MMU_MODES];                                     \
+    /* Taken by other threads walking the TLB, and by the owner     */  \
+    /* vCPU while it resizes the tables.                            */  \
+    QemuSpin tlb_lock;                                                  \
     size_t tlb_flush_count;                                             \
     target_ulong tlb_flush_addr;                                        \
     target_ulong tlb_flush_mask;                                        \
@@ -33,8 +33,8 @@ struct TBContext {
 
     GTree *tb_tree;
     struct qht htable;
-    /* any access to the tbs or the page table must use this lock */
-    QemuMutex tb_lock;
+    /* protects tb_tree; nests inside the per-page locks */
+    QemuMutex tb_tree_lock;
 
     /* statistics */
     unsigned tb_flush_count;
@@ -0,0 +1,59 @@
+/*
+ * Sizing policy of the dynamic softmmu TLB
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+
+#ifndef EXEC_TLB_RESIZE_H
+#define EXEC_TLB_RESIZE_H
+
+#include "qemu/host-utils.h"
+
+/**
+ * tlb_resize_new_size:
+ * @old_size: current number of entries in the table
+ * @max_entries: largest number of entries in use during the window
+ * @window_expired: whether the window is over
+ * @min_size: smallest table allowed, a power of two
+ * @max_size: largest table allowed, a power of two
+ *
+ * The use rate is @max_entries divided by @old_size.  Above 70% the table
+ * is doubled, so that a busy working set stops thrashing the slow path;
+ * below 30% for a whole window it is shrunk to fit, so that idle vCPUs
+ * give memory back and flushes stay cheap.
+ *
+ * Returns: the number of entries the table should have after the flush.
+ */
+static inline size_t tlb_resize_new_size(size_t old_size, size_t max_entries,
+                                         bool window_expired,
+                                         size_t min_size, size_t max_size)
+{
+    size_t rate = max_entries * 100 / old_size;
+    size_t ceil, expected_rate;
+
+    if (rate > 70) {
+        return MIN(old_size << 1, max_size);
+    }
+    if (rate >= 30 || !window_expired) {
+        return old_size;
+    }
+
+    ceil = pow2ceil(max_entries);
+    expected_rate = max_entries * 100 / ceil;
+    /*
+     * Avoid undersizing when the max number of entries seen is just
+     * below a power of two: 1023 entries would give a 99.9% use rate
+     * in a 1024-entry table and we would double it again right away.
+     * Keep the expected rate at or below 70%; since we double, the
+     * lowest rate we can end up with is 35%, which is still within
+     * the range we consider appropriate.
+     */
+    if (expected_rate > 70) {
+        ceil *= 2;
+    }
+    return MAX(ceil, min_size);
+}
+
+#endif
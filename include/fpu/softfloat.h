@@ -472,6 +472,18 @@ static inline int float32_is_zero_or_denormal(float32 a)
     return (float32_val(a) & 0x7f800000) == 0;
 }
 
+static inline int float32_is_normal(float32 a)
+{
+    uint32_t exp = (float32_val(a) >> 23) & 0xff;
+
+    return exp != 0 && exp != 0xff;
+}
+
+static inline int float32_is_zero_or_normal(float32 a)
+{
+    return float32_is_normal(a) || float32_is_zero(a);
+}
+
 static inline float32 float32_set_sign(float32 a, int sign)
 {
     return make_float32((float32_val(a) & 0x7fffffff) | (sign << 31));
@@ -584,6 +596,18 @@ static inline int float64_is_zero_or_denormal(float64 a)
     return (float64_val(a) & 0x7ff0000000000000LL) == 0;
 }
 
+static inline int float64_is_normal(float64 a)
+{
+    uint64_t exp = (float64_val(a) >> 52) & 0x7ff;
+
+    return exp != 0 && exp != 0x7ff;
+}
+
+static inline int float64_is_zero_or_normal(float64 a)
+{
+    return float64_is_normal(a) || float64_is_zero(a);
+}
+
 static inline float64 float64_set_sign(float64 a, int sign)
 {
     return make_float64((float64_val(a) & 0x7fffffffffffffffULL)
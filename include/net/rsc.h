@@ -0,0 +1,89 @@
+/*
+ * Receive segment coalescing for TCP
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_NET_RSC_H
+#define QEMU_NET_RSC_H
+
+#include "standard-headers/linux/virtio_net.h"
+
+typedef struct NetRscState NetRscState;
+
+/**
+ * NetRscDeliver:
+ * @opaque: the value passed to net_rsc_new()
+ * @buf: packet buffer; the first @headroom bytes are free for the caller
+ * @size: size of @buf, including the headroom
+ * @hdr: offload metadata describing the packet, in host byte order
+ *
+ * Called to hand a coalesced packet back to its owner.  @buf stays valid
+ * only until the callback returns.  Returns false if the owner cannot take
+ * the packet right now; it is then kept and offered again by the next
+ * net_rsc_retry(), net_rsc_flush() or net_rsc_receive().
+ */
+typedef bool (NetRscDeliver)(void *opaque, uint8_t *buf, size_t size,
+                             const struct virtio_net_hdr *hdr);
+
+/**
+ * net_rsc_new:
+ * @headroom: bytes to reserve in front of each delivered packet
+ * @timeout_ns: maximum age, in QEMU_CLOCK_VIRTUAL nanoseconds, of a flow
+ *              that still accepts segments; 0 for no limit
+ * @deliver: callback receiving coalesced packets
+ * @opaque: passed to @deliver
+ */
+NetRscState *net_rsc_new(size_t headroom, int64_t timeout_ns,
+                         NetRscDeliver *deliver, void *opaque);
+
+void net_rsc_free(NetRscState *s);
+
+/**
+ * net_rsc_receive:
+ * @s: coalescing state
+ * @data: ethernet frame, without any virtio-net header
+ * @len: length of @data
+ * @csum_valid: whether the TCP checksum has already been verified
+ *
+ * Offer a frame for coalescing.  Returns 1 if the frame was absorbed and
+ * will be delivered later, as part of a larger packet, through the deliver
+ * callback.  Returns 0 if the caller must deliver the frame itself; any
+ * pending data of the same flow has then already been delivered, so
+ * ordering is preserved.  Returns -EBUSY if pending data could not be
+ * delivered; the caller must hold the frame and offer it again later.
+ */
+int net_rsc_receive(NetRscState *s, const uint8_t *data, size_t len,
+                    bool csum_valid);
+
+/**
+ * net_rsc_flush:
+ * @s: coalescing state
+ *
+ * Deliver all pending packets.  Returns false if the deliver callback
+ * refused one; it and the packets after it stay pending.
+ */
+bool net_rsc_flush(NetRscState *s);
+
+/**
+ * net_rsc_retry:
+ * @s: coalescing state
+ *
+ * Flush again if an earlier delivery was refused.  Returns true if nothing
+ * is held back any more.
+ */
+bool net_rsc_retry(NetRscState *s);
+
+/**
+ * net_rsc_pending:
+ * @s: coalescing state
+ * @overhead: per-packet overhead to account for each pending packet
+ *
+ * Returns the number of bytes that net_rsc_flush() would deliver, counting
+ * @overhead extra bytes for each packet.
+ */
+size_t net_rsc_pending(NetRscState *s, size_t overhead);
+
+#endif
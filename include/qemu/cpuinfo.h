@@ -0,0 +1,31 @@
+/*
+ * Host x86 ISA features used by the accelerated utility routines
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_CPUINFO_H
+#define QEMU_CPUINFO_H
+
+/* Set once cpuinfo_init() has run, so that cpuinfo is never zero after */
+#define CPUINFO_ALWAYS      (1u << 0)
+#define CPUINFO_SSE2        (1u << 1)
+#define CPUINFO_SSE4_1      (1u << 2)
+/* AVX2 is only reported if the OS saves the YMM state, i.e. it is usable */
+#define CPUINFO_AVX2        (1u << 3)
+
+extern unsigned cpuinfo;
+
+/**
+ * cpuinfo_init:
+ *
+ * Probe the host with CPUID, once, and cache the result in @cpuinfo.
+ * This runs as a constructor, but constructors of other files may run
+ * first, so those must call it rather than read @cpuinfo directly.
+ *
+ * Returns: the CPUINFO_* bits supported by the host.
+ */
+unsigned cpuinfo_init(void);
+
+#endif
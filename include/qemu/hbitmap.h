@@ -243,6 +243,21 @@ void hbitmap_deserialize_zeroes(HBitmap *hb, uint64_t start, uint64_t count,
 void hbitmap_deserialize_ones(HBitmap *hb, uint64_t start, uint64_t count,
                               bool finish);
 
+/**
+ * hbitmap_merge_part
+ * @hb: HBitmap to operate on.
+ * @buf: Buffer to merge bitmap data from.
+ * @start: First bit to merge.
+ * @count: Number of bits to merge.
+ *
+ * Like hbitmap_deserialize_part, but ORs the data from @buf into the bitmap
+ * instead of replacing it, so bits that are already set stay set.  All
+ * HBitmap layers are kept consistent, no hbitmap_deserialize_finish call is
+ * needed afterwards.
+ */
+void hbitmap_merge_part(HBitmap *hb, uint8_t *buf,
+                        uint64_t start, uint64_t count);
+
 /**
  * hbitmap_deserialize_finish
  * @hb: HBitmap to operate on.
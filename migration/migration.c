@@ -40,6 +40,7 @@
 #include "qapi-event.h"
 #include "exec/target_page.h"
 #include "io/channel-buffer.h"
+#include "io/channel-socket.h"
 #include "migration/colo.h"
 #include "hw/boards.h"
 #include "monitor/monitor.h"
@@ -406,12 +407,32 @@ void migration_fd_process_incoming(QEMUFile *f)
 void migration_ioc_process_incoming(QIOChannel *ioc)
 {
     MigrationIncomingState *mis = migration_incoming_get_current();
+    Error *local_err = NULL;
+    bool start_migration;
 
     if (!mis->from_src_file) {
+        /* The first connection (multifd may have multiple) */
         QEMUFile *f = qemu_fopen_channel_input(ioc);
-        migration_fd_process_incoming(f);
+        migration_incoming_setup(f);
+
+        /*
+         * Common migration only needs one channel, so we can start
+         * right now.  Multifd needs more than one channel, we wait.
+         */
+        start_migration = !migrate_use_multifd();
+    } else {
+        /* Multiple connections */
+        assert(migrate_use_multifd());
+        start_migration = multifd_recv_new_channel(ioc, &local_err);
+        if (local_err) {
+            error_report_err(local_err);
+            return;
+        }
+    }
+
+    if (start_migration) {
+        migration_incoming_process();
     }
-    /* We still only have a single channel.  Nothing to do here yet */
 }
 
 /**
@@ -422,7 +443,12 @@ void migration_ioc_process_incoming(QIOChannel *ioc)
  */
 bool migration_has_all_channels(void)
 {
-    return true;
+    MigrationIncomingState *mis = migration_incoming_get_current();
+    bool all_channels;
+
+    all_channels = multifd_recv_all_channels_created();
+
+    return all_channels && mis->from_src_file != NULL;
 }
 
 /*
@@ -701,6 +727,14 @@ static bool migrate_caps_check(bool *cap_list,
          * set the first time, also it's only the destination that needs
          * special support.
          */
+        if (cap_list[MIGRATION_CAPABILITY_X_MULTIFD]) {
+            /* Pages may still be in flight on a multifd channel when the
+             * destination starts running and faulting them in.
+             */
+            error_setg(errp, "Postcopy is not yet compatible with multifd");
+            return false;
+        }
+
         if (!old_postcopy_cap && runstate_check(RUN_STATE_INMIGRATE) &&
             !postcopy_ram_supported_by_host(mis)) {
             /* postcopy_ram_supported_by_host will have emitted a more
@@ -711,6 +745,18 @@ static bool migrate_caps_check(bool *cap_list,
         }
     }
 
+    if (cap_list[MIGRATION_CAPABILITY_X_ZERO_COPY_SEND]) {
+#ifndef QEMU_MSG_ZEROCOPY
+        error_setg(errp, "Zero copy send is not available on this host");
+        return false;
+#endif
+        /* Only the multifd channels send pages straight from guest RAM */
+        if (!cap_list[MIGRATION_CAPABILITY_X_MULTIFD]) {
+            error_setg(errp, "Zero copy send requires multifd");
+            return false;
+        }
+    }
+
     return true;
 }
 
@@ -1091,6 +1137,7 @@ static void migrate_fd_cleanup(void *opaque)
         if (multifd_save_cleanup(&local_err) != 0) {
             error_report_err(local_err);
         }
+        socket_cleanup_outgoing_migration();
         qemu_fclose(s->to_dst_file);
         s->to_dst_file = NULL;
     }
@@ -1562,6 +1609,15 @@ bool migrate_use_multifd(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_X_MULTIFD];
 }
 
+bool migrate_use_zero_copy_send(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_X_ZERO_COPY_SEND];
+}
+
 bool migrate_pause_before_switchover(void)
 {
     MigrationState *s;
@@ -2440,6 +2496,8 @@ static Property migration_properties[] = {
     DEFINE_PROP_MIG_CAP("x-block", MIGRATION_CAPABILITY_BLOCK),
     DEFINE_PROP_MIG_CAP("x-return-path", MIGRATION_CAPABILITY_RETURN_PATH),
     DEFINE_PROP_MIG_CAP("x-multifd", MIGRATION_CAPABILITY_X_MULTIFD),
+    DEFINE_PROP_MIG_CAP("x-zero-copy-send",
+                        MIGRATION_CAPABILITY_X_ZERO_COPY_SEND),
 
     DEFINE_PROP_END_OF_LIST(),
 };
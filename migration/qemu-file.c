@@ -309,6 +309,17 @@ void qemu_update_position(QEMUFile *f, size_t size)
     f->pos += size;
 }
 
+/*
+ * Account for data that was sent on behalf of this stream through a
+ * different channel, so that rate limiting and the bandwidth estimate
+ * see it.
+ */
+void qemu_file_update_transfer(QEMUFile *f, int64_t len)
+{
+    f->bytes_xfer += len;
+    f->pos += len;
+}
+
 /** Closes the file
  *
  * Returns negative error value if any error happened on previous operations or
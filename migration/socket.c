@@ -55,6 +55,49 @@ static SocketAddress *unix_build_address(const char *path)
 }
 
 
+struct SocketOutgoingArgs {
+    SocketAddress *saddr;
+} outgoing_args;
+
+void socket_send_channel_create(QIOTaskFunc f, void *data)
+{
+    QIOChannelSocket *sioc = qio_channel_socket_new();
+
+    if (!outgoing_args.saddr) {
+        /* Only socket based migration can open more channels */
+        QIOTask *task = qio_task_new(OBJECT(sioc), f, data, NULL);
+        Error *err = NULL;
+
+        error_setg(&err, "multifd is only supported with socket migration");
+        qio_task_set_error(task, err);
+        qio_task_complete(task);
+        return;
+    }
+
+    qio_channel_set_name(QIO_CHANNEL(sioc), "migration-multifd-outgoing");
+    qio_channel_socket_connect_async(sioc, outgoing_args.saddr,
+                                     f, data, NULL);
+}
+
+int socket_send_channel_destroy(QIOChannel *send)
+{
+    /* Remove channel */
+    object_unref(OBJECT(send));
+    return 0;
+}
+
+/*
+ * The address stays around for the whole migration because every multifd
+ * channel connects to it; drop it only once all of them are gone.
+ */
+void socket_cleanup_outgoing_migration(void)
+{
+    if (outgoing_args.saddr) {
+        qapi_free_SocketAddress(outgoing_args.saddr);
+        outgoing_args.saddr = NULL;
+    }
+}
+
 struct SocketConnectData {
     MigrationState *s;
     char *hostname;
@@ -100,13 +143,17 @@ static void socket_start_outgoing_migration(MigrationState *s,
         data->hostname = g_strdup(saddr->u.inet.host);
     }
 
+    if (outgoing_args.saddr) {
+        qapi_free_SocketAddress(outgoing_args.saddr);
+    }
+    outgoing_args.saddr = saddr;
+
     qio_channel_set_name(QIO_CHANNEL(sioc), "migration-socket-outgoing");
     qio_channel_socket_connect_async(sioc,
                                      saddr,
                                      socket_outgoing_migration,
                                      data,
                                      socket_connect_data_free);
-    qapi_free_SocketAddress(saddr);
 }
 
 void tcp_start_outgoing_migration(MigrationState *s,
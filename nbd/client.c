@@ -22,7 +22,7 @@
 #include "trace.h"
 #include "nbd-internal.h"
 
-static int nbd_errno_to_system_errno(int err)
+int nbd_errno_to_system_errno(int err)
 {
     int ret;
     switch (err) {
@@ -508,6 +508,166 @@ static int nbd_opt_go(QIOChannel *ioc, const char *wantname,
     }
 }
 
+/* Request an option that takes no payload and is answered with a plain
+ * NBD_REP_ACK.  Return 1 if the server acknowledged it, 0 if it is
+ * unsupported, and -1 with errp set on any other error. */
+static int nbd_request_simple_option(QIOChannel *ioc, uint32_t opt,
+                                     Error **errp)
+{
+    nbd_opt_reply reply;
+    int error;
+
+    if (nbd_send_option_request(ioc, opt, 0, NULL, errp) < 0) {
+        return -1;
+    }
+
+    if (nbd_receive_option_reply(ioc, opt, &reply, errp) < 0) {
+        return -1;
+    }
+    error = nbd_handle_reply_err(ioc, &reply, errp);
+    if (error <= 0) {
+        return error;
+    }
+
+    if (reply.type != NBD_REP_ACK) {
+        error_setg(errp, "Server answered option %" PRIu32 " (%s) with "
+                   "unexpected reply %" PRIx32 " (%s)", opt,
+                   nbd_opt_lookup(opt), reply.type,
+                   nbd_rep_lookup(reply.type));
+        nbd_send_opt_abort(ioc);
+        return -1;
+    }
+
+    if (reply.length != 0) {
+        error_setg(errp, "Option %" PRIu32 " (%s) response length is %"
+                   PRIu32 " (it should be zero)", opt, nbd_opt_lookup(opt),
+                   reply.length);
+        nbd_send_opt_abort(ioc);
+        return -1;
+    }
+
+    return 1;
+}
+
+/* Select the single meta context @context of export @export with
+ * NBD_OPT_SET_META_CONTEXT.  The server must reply with either no
+ * context (not supported) or exactly @context.
+ * Return 1 if the context was negotiated, with *@context_id set, 0 if
+ * the server does not support it, and -1 with errp set on error. */
+static int nbd_negotiate_simple_meta_context(QIOChannel *ioc,
+                                             const char *export,
+                                             const char *context,
+                                             uint32_t *context_id,
+                                             Error **errp)
+{
+    nbd_opt_reply reply;
+    uint32_t export_len = strlen(export);
+    uint32_t context_len = strlen(context);
+    uint32_t data_len = sizeof(export_len) + export_len +
+                        sizeof(uint32_t) + /* number of queries */
+                        sizeof(context_len) + context_len;
+    uint32_t received_id = 0;
+    bool received = false;
+    char *data = g_malloc(data_len);
+    char *p = data;
+    int ret;
+
+    stl_be_p(p, export_len);
+    p += sizeof(export_len);
+    memcpy(p, export, export_len);
+    p += export_len;
+    stl_be_p(p, 1);
+    p += sizeof(uint32_t);
+    stl_be_p(p, context_len);
+    p += sizeof(context_len);
+    memcpy(p, context, context_len);
+
+    ret = nbd_send_option_request(ioc, NBD_OPT_SET_META_CONTEXT, data_len,
+                                  data, errp);
+    g_free(data);
+    if (ret < 0) {
+        return -1;
+    }
+
+    while (1) {
+        char *name;
+        uint32_t len;
+
+        if (nbd_receive_option_reply(ioc, NBD_OPT_SET_META_CONTEXT, &reply,
+                                     errp) < 0) {
+            return -1;
+        }
+        ret = nbd_handle_reply_err(ioc, &reply, errp);
+        if (ret <= 0) {
+            return ret;
+        }
+
+        if (reply.type == NBD_REP_ACK) {
+            if (reply.length) {
+                error_setg(errp, "server sent invalid NBD_REP_ACK");
+                nbd_send_opt_abort(ioc);
+                return -1;
+            }
+            break;
+        }
+        if (reply.type != NBD_REP_META_CONTEXT) {
+            error_setg(errp, "unexpected reply type %" PRIx32
+                       " (%s), expected %x",
+                       reply.type, nbd_rep_lookup(reply.type),
+                       NBD_REP_META_CONTEXT);
+            nbd_send_opt_abort(ioc);
+            return -1;
+        }
+        if (received) {
+            error_setg(errp, "server replied with more than one context");
+            nbd_send_opt_abort(ioc);
+            return -1;
+        }
+        if (reply.length < sizeof(received_id) ||
+            reply.length > sizeof(received_id) + NBD_MAX_NAME_SIZE) {
+            error_setg(errp, "NBD_REP_META_CONTEXT length %" PRIu32
+                       " is invalid", reply.length);
+            nbd_send_opt_abort(ioc);
+            return -1;
+        }
+
+        if (nbd_read(ioc, &received_id, sizeof(received_id), errp) < 0) {
+            error_prepend(errp, "failed to read context id");
+            nbd_send_opt_abort(ioc);
+            return -1;
+        }
+        be32_to_cpus(&received_id);
+
+        len = reply.length - sizeof(received_id);
+        name = g_malloc(len + 1);
+        if (nbd_read(ioc, name, len, errp) < 0) {
+            error_prepend(errp, "failed to read context name");
+            g_free(name);
+            nbd_send_opt_abort(ioc);
+            return -1;
+        }
+        name[len] = '\0';
+        trace_nbd_opt_meta_context_reply(name, received_id);
+        if (strcmp(context, name)) {
+            error_setg(errp, "Failed to negotiate meta context '%s', server "
+                       "answered with different context '%s'", context,
+                       name);
+            g_free(name);
+            nbd_send_opt_abort(ioc);
+            return -1;
+        }
+        g_free(name);
+        received = true;
+    }
+
+    if (received) {
+        *context_id = received_id;
+        return 1;
+    }
+
+    return 0;
+}
+
 /* Return -1 on failure, 0 if wantname is an available export. */
 static int nbd_receive_query_exports(QIOChannel *ioc,
                                      const char *wantname,
@@ -608,9 +768,15 @@ int nbd_receive_negotiate(QIOChannel *ioc, const char *name,
     uint64_t magic;
     int rc;
     bool zeroes = true;
+    bool structured_reply;
+    bool base_allocation;
 
     trace_nbd_receive_negotiate(tlscreds, hostname ? hostname : "<null>");
 
+    structured_reply = info->structured_reply;
+    base_allocation = info->base_allocation;
+    info->structured_reply = false;
+    info->base_allocation = false;
     rc = -EINVAL;
 
     if (outioc) {
@@ -691,6 +857,26 @@ int nbd_receive_negotiate(QIOChannel *ioc, const char *name,
         if (fixedNewStyle) {
             int result;
 
+            if (structured_reply) {
+                result = nbd_request_simple_option(ioc,
+                                                   NBD_OPT_STRUCTURED_REPLY,
+                                                   errp);
+                if (result < 0) {
+                    goto fail;
+                }
+                info->structured_reply = result == 1;
+            }
+
+            if (info->structured_reply && base_allocation) {
+                result = nbd_negotiate_simple_meta_context(
+                        ioc, name, "base:allocation",
+                        &info->meta_base_allocation_id, errp);
+                if (result < 0) {
+                    goto fail;
+                }
+                info->base_allocation = result == 1;
+            }
+
             /* Try NBD_OPT_GO first - if it works, we are done (it
              * also gives us a good message if the server requires
              * TLS).  If it is not available, fall back to
@@ -914,43 +1100,112 @@ int nbd_send_request(QIOChannel *ioc, NBDRequest *request)
     return nbd_write(ioc, buf, sizeof(buf), NULL);
 }
 
-/* nbd_receive_reply
- * Returns 1 on success
- *         0 on eof, when no data was read (errp is not set)
- *         negative errno on failure (errp is set)
+/* nbd_receive_simple_reply
+ * Read simple reply except magic field (which should be already read).
+ * The error is converted to a system errno.
  */
-int nbd_receive_reply(QIOChannel *ioc, NBDReply *reply, Error **errp)
+static int nbd_receive_simple_reply(QIOChannel *ioc, NBDSimpleReply *reply,
+                                    Error **errp)
 {
-    uint8_t buf[NBD_REPLY_SIZE];
-    uint32_t magic;
     int ret;
 
-    ret = nbd_read_eof(ioc, buf, sizeof(buf), errp);
-    if (ret <= 0) {
-        return ret;
-    }
+    assert(reply->magic == NBD_SIMPLE_REPLY_MAGIC);
 
     /* Reply
        [ 0 ..  3]    magic   (NBD_SIMPLE_REPLY_MAGIC)
        [ 4 ..  7]    error   (0 == no error)
        [ 7 .. 15]    handle
      */
+    ret = nbd_read(ioc, (uint8_t *)reply + sizeof(reply->magic),
+                   sizeof(*reply) - sizeof(reply->magic), errp);
+    if (ret < 0) {
+        return ret;
+    }
 
-    magic = ldl_be_p(buf);
-    reply->error  = ldl_be_p(buf + 4);
-    reply->handle = ldq_be_p(buf + 8);
-
+    be32_to_cpus(&reply->error);
+    be64_to_cpus(&reply->handle);
     reply->error = nbd_errno_to_system_errno(reply->error);
 
-    if (reply->error == ESHUTDOWN) {
-        /* This works even on mingw which lacks a native ESHUTDOWN */
-        error_setg(errp, "server shutting down");
-        return -EINVAL;
+    return 0;
+}
+
+/* nbd_receive_structured_reply_chunk
+ * Read structured reply chunk except magic field (which should be already
+ * read).  The payload is not read.
+ */
+static int nbd_receive_structured_reply_chunk(QIOChannel *ioc,
+                                              NBDStructuredReplyChunk *chunk,
+                                              Error **errp)
+{
+    int ret;
+
+    assert(chunk->magic == NBD_STRUCTURED_REPLY_MAGIC);
+
+    /* Chunk
+       [ 0 ..  3]    magic   (NBD_STRUCTURED_REPLY_MAGIC)
+       [ 4 ..  5]    flags   (NBD_REPLY_FLAG_DONE, ...)
+       [ 6 ..  7]    type    (NBD_REPLY_TYPE_*)
+       [ 8 .. 15]    handle
+       [16 .. 19]    length  (of payload)
+     */
+    ret = nbd_read(ioc, (uint8_t *)chunk + sizeof(chunk->magic),
+                   sizeof(*chunk) - sizeof(chunk->magic), errp);
+    if (ret < 0) {
+        return ret;
     }
-    trace_nbd_receive_reply(magic, reply->error, reply->handle);
 
-    if (magic != NBD_SIMPLE_REPLY_MAGIC) {
-        error_setg(errp, "invalid magic (got 0x%" PRIx32 ")", magic);
+    be16_to_cpus(&chunk->flags);
+    be16_to_cpus(&chunk->type);
+    be64_to_cpus(&chunk->handle);
+    be32_to_cpus(&chunk->length);
+
+    return 0;
+}
+
+/* nbd_receive_reply
+ * Read a simple reply or the header of a structured reply chunk; the
+ * payload of a structured chunk is left for the caller.
+ * Returns 1 on success
+ *         0 on eof, when no data was read (errp is not set)
+ *         negative errno on failure (errp is set)
+ */
+int nbd_receive_reply(QIOChannel *ioc, NBDReply *reply, Error **errp)
+{
+    int ret;
+
+    ret = nbd_read_eof(ioc, &reply->magic, sizeof(reply->magic), errp);
+    if (ret <= 0) {
+        return ret;
+    }
+
+    be32_to_cpus(&reply->magic);
+
+    switch (reply->magic) {
+    case NBD_SIMPLE_REPLY_MAGIC:
+        ret = nbd_receive_simple_reply(ioc, &reply->simple, errp);
+        if (ret < 0) {
+            return ret;
+        }
+        trace_nbd_receive_simple_reply(reply->simple.error, reply->handle);
+        if (reply->simple.error == ESHUTDOWN) {
+            /* This works even on mingw which lacks a native ESHUTDOWN */
+            error_setg(errp, "server shutting down");
+            return -EINVAL;
+        }
+        break;
+    case NBD_STRUCTURED_REPLY_MAGIC:
+        ret = nbd_receive_structured_reply_chunk(ioc, &reply->structured,
+                                                 errp);
+        if (ret < 0) {
+            return ret;
+        }
+        trace_nbd_receive_structured_reply_chunk(
+            reply->structured.flags, reply->structured.type,
+            nbd_reply_type_lookup(reply->structured.type),
+            reply->structured.handle, reply->structured.length);
+        break;
+    default:
+        error_setg(errp, "invalid magic (got 0x%" PRIx32 ")", reply->magic);
         return -EINVAL;
     }
 
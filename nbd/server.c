@@ -22,6 +22,11 @@
 #include "trace.h"
 #include "nbd-internal.h"
 
+#define NBD_META_ID_BASE_ALLOCATION 0
+
+/* Maximum number of extents sent in a single BLOCK_STATUS reply chunk */
+#define NBD_MAX_BLOCK_STATUS_EXTENTS (64 * 1024 / sizeof(NBDExtent))
+
 static int system_errno_to_nbd_errno(int err)
 {
     switch (err) {
@@ -80,6 +85,16 @@ struct NBDExport {
 
 static QTAILQ_HEAD(, NBDExport) exports = QTAILQ_HEAD_INITIALIZER(exports);
 
+/* NBDExportMetaContexts represents a list of contexts to be exported,
+ * as selected by NBD_OPT_SET_META_CONTEXT. Also used for
+ * NBD_OPT_LIST_META_CONTEXT. */
+typedef struct NBDExportMetaContexts {
+    char export_name[NBD_MAX_NAME_SIZE + 1];
+    bool valid; /* means that negotiation of the option finished without
+                   errors */
+    bool base_allocation; /* export base:allocation context (block status) */
+} NBDExportMetaContexts;
+
 struct NBDClient {
     int refcount;
     void (*close_fn)(NBDClient *client, bool negotiated);
@@ -98,6 +113,9 @@ struct NBDClient {
     QTAILQ_ENTRY(NBDClient) next;
     int nb_requests;
     bool closing;
+
+    bool structured_reply;
+    NBDExportMetaContexts export_meta;
 };
 
 /* That's all folks */
@@ -582,6 +600,195 @@ static QIOChannel *nbd_negotiate_handle_starttls(NBDClient *client,
     return QIO_CHANNEL(tioc);
 }
 
+/* nbd_negotiate_send_meta_context
+ *
+ * Send one NBD_REP_META_CONTEXT reply to NBD_OPT_{LIST,SET}_META_CONTEXT.
+ * For NBD_OPT_LIST_META_CONTEXT the context id is always sent as 0.
+ * Return -errno on error, 0 on success. */
+static int nbd_negotiate_send_meta_context(NBDClient *client,
+                                           const char *context,
+                                           uint32_t context_id,
+                                           uint32_t opt, Error **errp)
+{
+    size_t len = strlen(context);
+    uint32_t id;
+    int ret;
+
+    if (opt == NBD_OPT_LIST_META_CONTEXT) {
+        context_id = 0;
+    }
+    trace_nbd_negotiate_meta_query_reply(context, context_id);
+    ret = nbd_negotiate_send_rep_len(client->ioc, NBD_REP_META_CONTEXT, opt,
+                                     sizeof(id) + len, errp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    id = cpu_to_be32(context_id);
+    if (nbd_write(client->ioc, &id, sizeof(id), errp) < 0) {
+        error_prepend(errp, "write failed (context id): ");
+        return -EIO;
+    }
+
+    if (nbd_write(client->ioc, context, len, errp) < 0) {
+        error_prepend(errp, "write failed (context name): ");
+        return -EIO;
+    }
+
+    return 0;
+}
+
+/* nbd_negotiate_meta_queries
+ * Handle NBD_OPT_LIST_META_CONTEXT and NBD_OPT_SET_META_CONTEXT.
+ * The only context we know about is "base:allocation"; for
+ * NBD_OPT_LIST_META_CONTEXT, an empty query list or the query "base:"
+ * also select it.
+ * Return -errno on error, 0 if ready for next option. */
+static int nbd_negotiate_meta_queries(NBDClient *client, uint32_t length,
+                                      uint32_t opt, Error **errp)
+{
+    NBDExportMetaContexts meta = { 0 };
+    char query[NBD_MAX_NAME_SIZE + 1];
+    uint32_t namelen;
+    uint32_t nb_queries;
+    uint32_t query_len;
+    const char *msg;
+    int ret;
+
+    /* Client sends:
+        4 bytes: L, name length (can be 0)
+        L bytes: export name
+        4 bytes: N, number of queries (can be 0)
+        N times:
+          4 bytes: Q, query length
+          Q bytes: query
+    */
+    if (opt == NBD_OPT_SET_META_CONTEXT) {
+        /* A new SET replaces whatever was negotiated before */
+        client->export_meta.valid = false;
+    }
+
+    if (!client->structured_reply) {
+        if (nbd_drop(client->ioc, length, errp) < 0) {
+            return -EIO;
+        }
+        return nbd_negotiate_send_rep_err(client->ioc, NBD_REP_ERR_INVALID,
+                                          opt, errp,
+                                          "request option '%s' when "
+                                          "structured reply is not "
+                                          "negotiated", nbd_opt_lookup(opt));
+    }
+
+    if (length < sizeof(namelen) + sizeof(nb_queries)) {
+        msg = "overall request too short";
+        goto invalid;
+    }
+    if (nbd_read(client->ioc, &namelen, sizeof(namelen), errp) < 0) {
+        return -EIO;
+    }
+    be32_to_cpus(&namelen);
+    length -= sizeof(namelen);
+    if (namelen > NBD_MAX_NAME_SIZE ||
+        namelen > length - sizeof(nb_queries)) {
+        msg = "name length is incorrect";
+        goto invalid;
+    }
+    if (nbd_read(client->ioc, meta.export_name, namelen, errp) < 0) {
+        return -EIO;
+    }
+    meta.export_name[namelen] = '\0';
+    length -= namelen;
+
+    if (nbd_read(client->ioc, &nb_queries, sizeof(nb_queries), errp) < 0) {
+        return -EIO;
+    }
+    be32_to_cpus(&nb_queries);
+    length -= sizeof(nb_queries);
+    trace_nbd_negotiate_meta_context(nbd_opt_lookup(opt), meta.export_name,
+                                     nb_queries);
+
+    if (!nbd_export_find(meta.export_name)) {
+        if (nbd_drop(client->ioc, length, errp) < 0) {
+            return -EIO;
+        }
+        return nbd_negotiate_send_rep_err(client->ioc, NBD_REP_ERR_UNKNOWN,
+                                          opt, errp, "export '%s' not present",
+                                          meta.export_name);
+    }
+
+    if (opt == NBD_OPT_LIST_META_CONTEXT && !nb_queries) {
+        /* An empty list asks for all contexts the server knows */
+        meta.base_allocation = true;
+    }
+
+    while (nb_queries--) {
+        if (length < sizeof(query_len)) {
+            msg = "query list is truncated";
+            goto invalid;
+        }
+        if (nbd_read(client->ioc, &query_len, sizeof(query_len), errp) < 0) {
+            return -EIO;
+        }
+        be32_to_cpus(&query_len);
+        length -= sizeof(query_len);
+        if (query_len > length) {
+            msg = "query length is incorrect";
+            goto invalid;
+        }
+        if (query_len > NBD_MAX_NAME_SIZE) {
+            /* Too long to be anything we know about */
+            trace_nbd_negotiate_meta_query_skip("query too long");
+            if (nbd_drop(client->ioc, query_len, errp) < 0) {
+                return -EIO;
+            }
+            length -= query_len;
+            continue;
+        }
+        if (nbd_read(client->ioc, query, query_len, errp) < 0) {
+            return -EIO;
+        }
+        query[query_len] = '\0';
+        length -= query_len;
+
+        trace_nbd_negotiate_meta_query_parse(query);
+        if (!strcmp(query, "base:allocation") ||
+            (opt == NBD_OPT_LIST_META_CONTEXT && !strcmp(query, "base:"))) {
+            meta.base_allocation = true;
+        } else {
+            trace_nbd_negotiate_meta_query_skip("unknown context");
+        }
+    }
+
+    if (length) {
+        msg = "unexpected trailing data";
+        goto invalid;
+    }
+
+    if (meta.base_allocation) {
+        ret = nbd_negotiate_send_meta_context(client, "base:allocation",
+                                              NBD_META_ID_BASE_ALLOCATION,
+                                              opt, errp);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    ret = nbd_negotiate_send_rep(client->ioc, NBD_REP_ACK, opt, errp);
+    if (ret == 0 && opt == NBD_OPT_SET_META_CONTEXT) {
+        meta.valid = true;
+        client->export_meta = meta;
+    }
+
+    return ret;
+
+ invalid:
+    if (nbd_drop(client->ioc, length, errp) < 0) {
+        return -EIO;
+    }
+    return nbd_negotiate_send_rep_err(client->ioc, NBD_REP_ERR_INVALID, opt,
+                                      errp, "%s", msg);
+}
+
 /* nbd_negotiate_options
  * Process all NBD_OPT_* client option commands, during fixed newstyle
  * negotiation.
@@ -760,6 +967,39 @@ static int nbd_negotiate_options(NBDClient *client, uint16_t myflags,
                     return ret;
                 }
                 break;
+
+            case NBD_OPT_STRUCTURED_REPLY:
+                if (length) {
+                    if (nbd_drop(client->ioc, length, errp) < 0) {
+                        return -EIO;
+                    }
+                    ret = nbd_negotiate_send_rep_err(
+                        client->ioc, NBD_REP_ERR_INVALID, option, errp,
+                        "OPT_STRUCTURED_REPLY should not have length");
+                } else if (client->structured_reply) {
+                    ret = nbd_negotiate_send_rep_err(
+                        client->ioc, NBD_REP_ERR_INVALID, option, errp,
+                        "structured reply already negotiated");
+                } else {
+                    ret = nbd_negotiate_send_rep(client->ioc, NBD_REP_ACK,
+                                                 option, errp);
+                    client->structured_reply = true;
+                    myflags |= NBD_FLAG_SEND_DF;
+                }
+                if (ret < 0) {
+                    return ret;
+                }
+                break;
+
+            case NBD_OPT_LIST_META_CONTEXT:
+            case NBD_OPT_SET_META_CONTEXT:
+                ret = nbd_negotiate_meta_queries(client, length, option,
+                                                 errp);
+                if (ret < 0) {
+                    return ret;
+                }
+                break;
+
             default:
                 if (nbd_drop(client->ioc, length, errp) < 0) {
                     return -EIO;
@@ -1233,6 +1473,247 @@ static int nbd_co_send_simple_reply(NBDClient *client,
     return nbd_co_send_iov(client, iov, len ? 2 : 1, errp);
 }
 
+static inline void set_be_chunk(NBDStructuredReplyChunk *chunk, uint16_t flags,
+                                uint16_t type, uint64_t handle,
+                                uint32_t length)
+{
+    stl_be_p(&chunk->magic, NBD_STRUCTURED_REPLY_MAGIC);
+    stw_be_p(&chunk->flags, flags);
+    stw_be_p(&chunk->type, type);
+    stq_be_p(&chunk->handle, handle);
+    stl_be_p(&chunk->length, length);
+}
+
+static int coroutine_fn nbd_co_send_structured_done(NBDClient *client,
+                                                    uint64_t handle,
+                                                    Error **errp)
+{
+    NBDStructuredReplyChunk chunk;
+    struct iovec iov[] = {
+        {.iov_base = &chunk, .iov_len = sizeof(chunk)},
+    };
+
+    trace_nbd_co_send_structured_done(handle);
+    set_be_chunk(&chunk, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_NONE, handle, 0);
+
+    return nbd_co_send_iov(client, iov, 1, errp);
+}
+
+static int coroutine_fn nbd_co_send_structured_read(NBDClient *client,
+                                                    uint64_t handle,
+                                                    uint64_t offset,
+                                                    void *data,
+                                                    size_t size,
+                                                    bool final,
+                                                    Error **errp)
+{
+    NBDStructuredReadData chunk;
+    struct iovec iov[] = {
+        {.iov_base = &chunk, .iov_len = sizeof(chunk)},
+        {.iov_base = data, .iov_len = size}
+    };
+
+    assert(size);
+    trace_nbd_co_send_structured_read(handle, offset, data, size);
+    set_be_chunk(&chunk.h, final ? NBD_REPLY_FLAG_DONE : 0,
+                 NBD_REPLY_TYPE_OFFSET_DATA, handle,
+                 sizeof(chunk) - sizeof(chunk.h) + size);
+    stq_be_p(&chunk.offset, offset);
+
+    return nbd_co_send_iov(client, iov, 2, errp);
+}
+
+static int coroutine_fn nbd_co_send_structured_hole(NBDClient *client,
+                                                    uint64_t handle,
+                                                    uint64_t offset,
+                                                    uint32_t size,
+                                                    bool final,
+                                                    Error **errp)
+{
+    NBDStructuredReadHole chunk;
+    struct iovec iov[] = {
+        {.iov_base = &chunk, .iov_len = sizeof(chunk)},
+    };
+
+    trace_nbd_co_send_structured_read_hole(handle, offset, size);
+    set_be_chunk(&chunk.h, final ? NBD_REPLY_FLAG_DONE : 0,
+                 NBD_REPLY_TYPE_OFFSET_HOLE, handle,
+                 sizeof(chunk) - sizeof(chunk.h));
+    stq_be_p(&chunk.offset, offset);
+    stl_be_p(&chunk.length, size);
+
+    return nbd_co_send_iov(client, iov, 1, errp);
+}
+
+static int coroutine_fn nbd_co_send_structured_error(NBDClient *client,
+                                                     uint64_t handle,
+                                                     uint32_t error,
+                                                     const char *msg,
+                                                     Error **errp)
+{
+    NBDStructuredError chunk;
+    int nbd_err = system_errno_to_nbd_errno(error);
+    struct iovec iov[] = {
+        {.iov_base = &chunk, .iov_len = sizeof(chunk)},
+        {.iov_base = (char *)msg, .iov_len = msg ? strlen(msg) : 0},
+    };
+
+    assert(nbd_err);
+    trace_nbd_co_send_structured_error(handle, nbd_err, msg ? msg : "");
+    set_be_chunk(&chunk.h, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_ERROR, handle,
+                 sizeof(chunk) - sizeof(chunk.h) + iov[1].iov_len);
+    stl_be_p(&chunk.error, nbd_err);
+    stw_be_p(&chunk.message_length, iov[1].iov_len);
+
+    return nbd_co_send_iov(client, iov, 1 + !!iov[1].iov_len, errp);
+}
+
+/* Reply to NBD_CMD_READ with a series of OFFSET_DATA and OFFSET_HOLE
+ * chunks, so that areas reading as zero are not sent over the wire.
+ * @offset is the offset seen by the client; @data must have room for
+ * @size bytes.  Return -errno with @errp set on failure; the caller
+ * then reports the error to the client. */
+static int coroutine_fn nbd_co_send_sparse_read(NBDClient *client,
+                                                uint64_t handle,
+                                                uint64_t offset,
+                                                uint8_t *data,
+                                                size_t size,
+                                                Error **errp)
+{
+    int ret = 0;
+    NBDExport *exp = client->exp;
+    size_t progress = 0;
+
+    while (progress < size) {
+        int64_t pnum;
+        int status = bdrv_block_status_above(blk_bs(exp->blk), NULL,
+                                             offset + progress +
+                                             exp->dev_offset,
+                                             size - progress, &pnum, NULL,
+                                             NULL);
+        bool final;
+
+        if (status < 0) {
+            error_setg_errno(errp, -status, "unable to check for holes");
+            return status;
+        }
+        assert(pnum && pnum <= size - progress);
+        final = progress + pnum == size;
+        if (status & BDRV_BLOCK_ZERO) {
+            ret = nbd_co_send_structured_hole(client, handle,
+                                              offset + progress, pnum, final,
+                                              errp);
+        } else {
+            ret = blk_pread(exp->blk, offset + progress + exp->dev_offset,
+                            data + progress, pnum);
+            if (ret < 0) {
+                error_setg_errno(errp, -ret, "reading from file failed");
+                break;
+            }
+            ret = nbd_co_send_structured_read(client, handle,
+                                              offset + progress,
+                                              data + progress, pnum, final,
+                                              errp);
+        }
+
+        if (ret < 0) {
+            break;
+        }
+        progress += pnum;
+    }
+    return ret;
+}
+
+/* Describe the allocation status of @bytes at @offset in @bs as at most
+ * *@nb_extents extents for the base:allocation context, merging
+ * neighbouring areas with the same status.  On return, *@nb_extents holds
+ * the number of extents filled in (in big endian); they may cover less
+ * than @bytes if the array is too small.  Return -errno on failure. */
+static int blockstatus_to_extents_be(BlockDriverState *bs, uint64_t offset,
+                                     uint64_t bytes, NBDExtent *extents,
+                                     unsigned int *nb_extents)
+{
+    uint64_t remaining_bytes = bytes;
+    unsigned int i, count = 0;
+
+    while (remaining_bytes) {
+        uint32_t flags;
+        int64_t num;
+        int ret = bdrv_block_status_above(bs, NULL, offset, remaining_bytes,
+                                          &num, NULL, NULL);
+        if (ret < 0) {
+            return ret;
+        }
+        if (!num) {
+            /* Past the end of the image; report what we have */
+            break;
+        }
+
+        flags = (ret & BDRV_BLOCK_ALLOCATED ? 0 : NBD_STATE_HOLE) |
+                (ret & BDRV_BLOCK_ZERO      ? NBD_STATE_ZERO : 0);
+
+        if (count && extents[count - 1].flags == flags) {
+            extents[count - 1].length += num;
+        } else if (count < *nb_extents) {
+            extents[count].flags = flags;
+            extents[count].length = num;
+            count++;
+        } else {
+            break;
+        }
+
+        offset += num;
+        remaining_bytes -= num;
+    }
+
+    for (i = 0; i < count; i++) {
+        cpu_to_be32s(&extents[i].length);
+        cpu_to_be32s(&extents[i].flags);
+    }
+    *nb_extents = count;
+
+    return 0;
+}
+
+/* Reply to NBD_CMD_BLOCK_STATUS for the base:allocation context.
+ * @offset is the offset in @bs.  Return -errno with @errp set on
+ * failure; the caller then reports the error to the client. */
+static int coroutine_fn nbd_co_send_block_status(NBDClient *client,
+                                                 uint64_t handle,
+                                                 BlockDriverState *bs,
+                                                 uint64_t offset,
+                                                 uint32_t length,
+                                                 bool only_one,
+                                                 Error **errp)
+{
+    int ret;
+    unsigned int nb_extents = only_one ? 1 : NBD_MAX_BLOCK_STATUS_EXTENTS;
+    NBDExtent *extents = g_new(NBDExtent, nb_extents);
+    NBDStructuredMeta chunk;
+    struct iovec iov[] = {
+        {.iov_base = &chunk, .iov_len = sizeof(chunk)},
+        {.iov_base = extents, .iov_len = 0},
+    };
+
+    ret = blockstatus_to_extents_be(bs, offset, length, extents, &nb_extents);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "can't get block status");
+        goto out;
+    }
+
+    trace_nbd_co_send_block_status(handle, offset, length, nb_extents);
+    iov[1].iov_len = nb_extents * sizeof(NBDExtent);
+    set_be_chunk(&chunk.h, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_BLOCK_STATUS,
+                 handle, sizeof(chunk) - sizeof(chunk.h) + iov[1].iov_len);
+    stl_be_p(&chunk.context_id, NBD_META_ID_BASE_ALLOCATION);
+
+    ret = nbd_co_send_iov(client, iov, 2, errp);
+
+out:
+    g_free(extents);
+    return ret;
+}
+
 /* nbd_co_receive_request
  * Collect a client request. Return 0 if request looks valid, -EIO to drop
  * connection right away, and any other negative value to report an error to
@@ -1243,6 +1724,7 @@ static int nbd_co_receive_request(NBDRequestData *req, NBDRequest *request,
                                   Error **errp)
 {
     NBDClient *client = req->client;
+    int valid_flags;
 
     g_assert(qemu_in_coroutine());
     assert(client->recv_coroutine == qemu_coroutine_self());
@@ -1304,13 +1786,17 @@ static int nbd_co_receive_request(NBDRequestData *req, NBDRequest *request,
                    (uint64_t)client->exp->size);
         return request->type == NBD_CMD_WRITE ? -ENOSPC : -EINVAL;
     }
-    if (request->flags & ~(NBD_CMD_FLAG_FUA | NBD_CMD_FLAG_NO_HOLE)) {
-        error_setg(errp, "unsupported flags (got 0x%x)", request->flags);
-        return -EINVAL;
-    }
-    if (request->type != NBD_CMD_WRITE_ZEROES &&
-        (request->flags & NBD_CMD_FLAG_NO_HOLE)) {
-        error_setg(errp, "unexpected flags (got 0x%x)", request->flags);
+    valid_flags = NBD_CMD_FLAG_FUA;
+    if (request->type == NBD_CMD_READ && client->structured_reply) {
+        valid_flags |= NBD_CMD_FLAG_DF;
+    } else if (request->type == NBD_CMD_WRITE_ZEROES) {
+        valid_flags |= NBD_CMD_FLAG_NO_HOLE;
+    } else if (request->type == NBD_CMD_BLOCK_STATUS) {
+        valid_flags |= NBD_CMD_FLAG_REQ_ONE;
+    }
+    if (request->flags & ~valid_flags) {
+        error_setg(errp, "unsupported flags for command %s (got 0x%x)",
+                   nbd_cmd_lookup(request->type), request->flags);
         return -EINVAL;
     }
 
@@ -1328,6 +1814,7 @@ static coroutine_fn void nbd_trip(void *opaque)
     int flags;
     int reply_data_len = 0;
     Error *local_err = NULL;
+    char *msg = NULL;
 
     trace_nbd_trip();
     if (client->closing) {
@@ -1366,6 +1853,17 @@ static coroutine_fn void nbd_trip(void *opaque)
             }
         }
 
+        if (client->structured_reply && !(request.flags & NBD_CMD_FLAG_DF) &&
+            request.len) {
+            ret = nbd_co_send_sparse_read(req->client, request.handle,
+                                          request.from, req->data,
+                                          request.len, &local_err);
+            if (ret < 0) {
+                break;
+            }
+            goto done;
+        }
+
         ret = blk_pread(exp->blk, request.from + exp->dev_offset,
                         req->data, request.len);
         if (ret < 0) {
@@ -1433,6 +1931,25 @@ static coroutine_fn void nbd_trip(void *opaque)
         }
 
         break;
+    case NBD_CMD_BLOCK_STATUS:
+        if (!client->export_meta.valid ||
+            !client->export_meta.base_allocation ||
+            !exp->name || strcmp(exp->name, client->export_meta.export_name)) {
+            error_setg(&local_err, "CMD_BLOCK_STATUS not negotiated");
+            ret = -EINVAL;
+            break;
+        }
+
+        ret = nbd_co_send_block_status(req->client, request.handle,
+                                       blk_bs(exp->blk),
+                                       request.from + exp->dev_offset,
+                                       request.len,
+                                       request.flags & NBD_CMD_FLAG_REQ_ONE,
+                                       &local_err);
+        if (ret < 0) {
+            break;
+        }
+        goto done;
     default:
         error_setg(&local_err, "invalid request type (%" PRIu32 ") received",
                    request.type);
@@ -1443,14 +1960,32 @@ reply:
     if (local_err) {
         /* If we get here, local_err was not a fatal error, and should be sent
          * to the client. */
+        msg = g_strdup(error_get_pretty(local_err));
         error_report_err(local_err);
         local_err = NULL;
     }
 
-    if (nbd_co_send_simple_reply(req->client, request.handle,
-                                 ret < 0 ? -ret : 0,
-                                 req->data, reply_data_len, &local_err) < 0)
-    {
+    if (client->structured_reply &&
+        (ret < 0 || request.type == NBD_CMD_READ)) {
+        if (ret < 0) {
+            ret = nbd_co_send_structured_error(req->client, request.handle,
+                                               -ret, msg, &local_err);
+        } else if (reply_data_len) {
+            ret = nbd_co_send_structured_read(req->client, request.handle,
+                                              request.from, req->data,
+                                              reply_data_len, true,
+                                              &local_err);
+        } else {
+            ret = nbd_co_send_structured_done(req->client, request.handle,
+                                              &local_err);
+        }
+    } else {
+        ret = nbd_co_send_simple_reply(req->client, request.handle,
+                                       ret < 0 ? -ret : 0,
+                                       req->data, reply_data_len, &local_err);
+    }
+    g_free(msg);
+    if (ret < 0) {
         error_prepend(&local_err, "Failed to send reply: ");
         goto disconnect;
     }
@@ -20,24 +20,260 @@
 #include "net/checksum.h"
 #include "net/eth.h"
 
-uint32_t net_checksum_add_cont(int len, uint8_t *buf, int seq)
+/*
+ * The helpers below add up the buffer as 16-bit words in host byte order,
+ * into a 64-bit accumulator that is only folded at the end.  Because of
+ * the end-around carry, the one's complement sum of byte-swapped words is
+ * the byte-swapped sum, so the conversion to network order (or to the
+ * odd-offset order asked for by @seq) is done once on the folded result.
+ */
+
+static uint32_t net_checksum_fold(uint64_t sum)
+{
+    sum = (sum & 0xffffffff) + (sum >> 32);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return sum;
+}
+
+static uint64_t net_checksum_add_int(const uint8_t *buf, size_t len)
 {
-    uint32_t sum1 = 0, sum2 = 0;
-    int i;
+    uint64_t sum = 0;
+
+    for (; len >= 8; buf += 8, len -= 8) {
+        uint64_t t = ldq_he_p(buf);
 
-    for (i = 0; i < len - 1; i += 2) {
-        sum1 += (uint32_t)buf[i];
-        sum2 += (uint32_t)buf[i + 1];
+        sum += (t & 0xffffffff) + (t >> 32);
+    }
+    if (len >= 4) {
+        sum += ldl_he_p(buf);
+        buf += 4;
+        len -= 4;
+    }
+    if (len >= 2) {
+        sum += lduw_he_p(buf);
+        buf += 2;
+        len -= 2;
     }
-    if (i < len) {
-        sum1 += (uint32_t)buf[i];
+    if (len) {
+        /* A trailing byte is padded with zero to a full word */
+        uint8_t last[2] = { buf[0], 0 };
+
+        sum += lduw_he_p(last);
     }
+    return sum;
+}
+
+#if defined(CONFIG_AVX2_OPT) || defined(__SSE2__)
+/* Do not use push_options pragmas unnecessarily, because clang
+ * does not support them.
+ */
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("sse2")
+#endif
+#include <emmintrin.h>
+
+/*
+ * Widen the 16-bit words to 32-bit lanes and add them up.  A lane gains
+ * less than 2^17 per iteration, so the lanes are spilled into the 64-bit
+ * sum every NET_CHECKSUM_SPILL iterations, long before they can overflow.
+ */
+#define NET_CHECKSUM_SPILL 4096
+
+static uint64_t net_checksum_add_sse2(const uint8_t *buf, size_t len)
+{
+    const __m128i zero = _mm_setzero_si128();
+    uint64_t sum = 0;
+
+    while (len >= 32) {
+        __m128i lo = zero, hi = zero;
+        uint32_t lanes[8];
+        int i;
+
+        /* Two independent chains per lane keep the adders busy */
+        for (i = 0; i < NET_CHECKSUM_SPILL && len >= 32; i++) {
+            __m128i t0 = _mm_loadu_si128((const __m128i *)buf);
+            __m128i t1 = _mm_loadu_si128((const __m128i *)(buf + 16));
+
+            lo = _mm_add_epi32(lo, _mm_add_epi32(_mm_unpacklo_epi16(t0, zero),
+                                                 _mm_unpacklo_epi16(t1, zero)));
+            hi = _mm_add_epi32(hi, _mm_add_epi32(_mm_unpackhi_epi16(t0, zero),
+                                                 _mm_unpackhi_epi16(t1, zero)));
+            buf += 32;
+            len -= 32;
+        }
+
+        _mm_storeu_si128((__m128i *)lanes, lo);
+        _mm_storeu_si128((__m128i *)(lanes + 4), hi);
+        for (i = 0; i < 8; i++) {
+            sum += lanes[i];
+        }
+    }
+
+    return sum + net_checksum_add_int(buf, len);
+}
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC pop_options
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static uint64_t net_checksum_add_avx2(const uint8_t *buf, size_t len)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    uint64_t sum = 0;
+
+    while (len >= 32) {
+        __m256i lo = zero, hi = zero;
+        uint32_t lanes[16];
+        int i;
+
+        for (i = 0; i < NET_CHECKSUM_SPILL && len >= 32; i++) {
+            __m256i t = _mm256_loadu_si256((const __m256i *)buf);
+
+            lo = _mm256_add_epi32(lo, _mm256_unpacklo_epi16(t, zero));
+            hi = _mm256_add_epi32(hi, _mm256_unpackhi_epi16(t, zero));
+            buf += 32;
+            len -= 32;
+        }
+
+        _mm256_storeu_si256((__m256i *)lanes, lo);
+        _mm256_storeu_si256((__m256i *)(lanes + 8), hi);
+        for (i = 0; i < 16; i++) {
+            sum += lanes[i];
+        }
+    }
+
+    return sum + net_checksum_add_int(buf, len);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX2_OPT */
+
+/* Note that for test_net_checksum_next_accel, the most preferred
+ * ISA must have the least significant bit.
+ */
+#define CACHE_AVX2    1
+#define CACHE_SSE2    2
+
+/* Make sure that these variables are appropriately initialized when
+ * SSE2 is enabled on the compiler command-line, but the compiler is
+ * too old to support CONFIG_AVX2_OPT.
+ */
+#ifdef CONFIG_AVX2_OPT
+# define INIT_CACHE 0
+# define INIT_ACCEL net_checksum_add_int
+#else
+# ifndef __SSE2__
+#  error "ISA selection confusion"
+# endif
+# define INIT_CACHE CACHE_SSE2
+# define INIT_ACCEL net_checksum_add_sse2
+#endif
+
+static unsigned cpuid_cache = INIT_CACHE;
+static uint64_t (*checksum_accel)(const uint8_t *, size_t) = INIT_ACCEL;
+
+static void init_accel(unsigned cache)
+{
+    uint64_t (*fn)(const uint8_t *, size_t) = net_checksum_add_int;
+    if (cache & CACHE_SSE2) {
+        fn = net_checksum_add_sse2;
+    }
+#ifdef CONFIG_AVX2_OPT
+    if (cache & CACHE_AVX2) {
+        fn = net_checksum_add_avx2;
+    }
+#endif
+    checksum_accel = fn;
+}
+
+#ifdef CONFIG_AVX2_OPT
+#include "qemu/cpuinfo.h"
+
+static void __attribute__((constructor)) init_cpuid_cache(void)
+{
+    unsigned info = cpuinfo_init();
+    unsigned cache = 0;
+
+    if (info & CPUINFO_SSE2) {
+        cache |= CACHE_SSE2;
+    }
+    if (info & CPUINFO_AVX2) {
+        cache |= CACHE_AVX2;
+    }
+    cpuid_cache = cache;
+    init_accel(cache);
+}
+#else
+static void init_cpuid_cache(void)
+{
+    cpuid_cache = INIT_CACHE;
+    init_accel(INIT_CACHE);
+}
+#endif /* CONFIG_AVX2_OPT */
+
+void test_net_checksum_reset_accel(void)
+{
+    init_cpuid_cache();
+}
+
+bool test_net_checksum_next_accel(void)
+{
+    /* If no bits set, we just tested net_checksum_add_int, and there
+       are no more acceleration options to test.  */
+    if (cpuid_cache == 0) {
+        return false;
+    }
+    /* Disable the accelerator we used before and select a new one.  */
+    cpuid_cache &= cpuid_cache - 1;
+    init_accel(cpuid_cache);
+    return true;
+}
+
+static uint64_t select_accel_fn(const uint8_t *buf, size_t len)
+{
+    if (likely(len >= 64)) {
+        return checksum_accel(buf, len);
+    }
+    return net_checksum_add_int(buf, len);
+}
+
+#else
+#define select_accel_fn  net_checksum_add_int
+void test_net_checksum_reset_accel(void)
+{
+}
+
+bool test_net_checksum_next_accel(void)
+{
+    return false;
+}
+#endif
+
+uint32_t net_checksum_add_cont(int len, uint8_t *buf, int seq)
+{
+    uint32_t sum;
+
+    if (len <= 0) {
+        return 0;
+    }
+
+    sum = net_checksum_fold(select_accel_fn(buf, len));
 
+    /* Words starting at an even @seq are wanted in network byte order */
+#ifdef HOST_WORDS_BIGENDIAN
     if (seq & 1) {
-        return sum1 + (sum2 << 8);
-    } else {
-        return sum2 + (sum1 << 8);
+#else
+    if (!(seq & 1)) {
+#endif
+        sum = bswap16(sum);
     }
+    return sum;
 }
 
 uint16_t net_checksum_finish(uint32_t sum)
@@ -217,6 +217,11 @@ static void netfilter_complete(UserCreatable *uc, Error **errp)
         return;
     }
 
+    if (ncs[0]->aio_context) {
+        error_setg(errp, "Netdevs used with iothread are not supported");
+        return;
+    }
+
     nf->netdev = ncs[0];
 
     if (nfc->setup) {
@@ -534,6 +534,48 @@ int qemu_set_vnet_be(NetClientState *nc, bool is_be)
 #endif
 }
 
+bool qemu_can_set_aio_context(NetClientState *nc)
+{
+    return nc && nc->info->set_aio_context;
+}
+
+/* Move the I/O handlers of @nc into @ctx, or back into the main loop if @ctx
+ * is NULL.  The clients that @nc delivers packets to must be prepared to be
+ * called from @ctx.
+ */
+void qemu_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    if (!qemu_can_set_aio_context(nc)) {
+        return;
+    }
+
+    nc->info->set_aio_context(nc, ctx);
+    nc->aio_context = ctx;
+}
+
+/* Bracket a burst of packets sent by @sender from one event loop callback.
+ * The receiving peer may defer per-packet work, such as notifying the
+ * guest, until the burst ends.  Calls must be balanced and must not span
+ * a return to the event loop.
+ */
+void qemu_send_batch_begin(NetClientState *sender)
+{
+    NetClientState *peer = sender->peer;
+
+    if (peer && peer->info->receive_batch) {
+        peer->info->receive_batch(peer, true);
+    }
+}
+
+void qemu_send_batch_end(NetClientState *sender)
+{
+    NetClientState *peer = sender->peer;
+
+    if (peer && peer->info->receive_batch) {
+        peer->info->receive_batch(peer, false);
+    }
+}
+
 int qemu_can_send_packet(NetClientState *sender)
 {
     int vm_running = runstate_is_running();
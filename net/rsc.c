@@ -0,0 +1,458 @@
+/*
+ * Receive segment coalescing for TCP
+ *
+ * In-order TCP segments of the same flow that arrive in one burst are
+ * merged into a single large packet.  The result is described by a
+ * virtio-net header (gso_type, gso_size, partial checksum), so a guest
+ * that accepts TSO packets can take it in one descriptor chain.
+ *
+ * Only plain segments are merged: no IP options or IPv6 extension
+ * headers, no fragments, only ACK and PSH flags set, and headers that
+ * match the aggregate except for sequence number and length.  Anything
+ * else flushes the flow and is delivered unchanged by the caller.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "net/eth.h"
+#include "net/checksum.h"
+#include "net/rsc.h"
+#include "qemu/timer.h"
+#include "trace.h"
+
+#define NET_RSC_MAX_FLOWS       8
+
+/* Largest aggregate: the L3 length field must not overflow */
+#define NET_RSC_MAX_FRAME       (ETH_MAX_L2_HDR_LEN + ETH_MAX_IP_DGRAM_LEN)
+
+typedef struct NetRscFlow {
+    bool used;
+    bool ip6;
+    uint8_t *buf;               /* headroom followed by the frame */
+    size_t len;                 /* frame length, without headroom */
+    size_t l3hdr_off;
+    size_t l4hdr_off;
+    size_t l5hdr_off;
+    uint32_t next_seq;
+    uint16_t mss;
+    unsigned int segs;
+    int64_t start;              /* QEMU_CLOCK_VIRTUAL time of first segment */
+} NetRscFlow;
+
+struct NetRscState {
+    size_t headroom;
+    int64_t timeout_ns;
+    NetRscDeliver *deliver;
+    void *opaque;
+    unsigned int next_victim;
+    bool stalled;               /* a flush was refused by the owner */
+    NetRscFlow flows[NET_RSC_MAX_FLOWS];
+};
+
+/* A parsed candidate segment */
+typedef struct NetRscSeg {
+    const uint8_t *data;
+    bool ip6;
+    size_t l3hdr_off;
+    size_t l4hdr_off;
+    size_t l5hdr_off;
+    size_t payload_len;
+    uint32_t seq;
+    uint8_t flags;
+} NetRscSeg;
+
+NetRscState *net_rsc_new(size_t headroom, int64_t timeout_ns,
+                         NetRscDeliver *deliver, void *opaque)
+{
+    NetRscState *s = g_new0(NetRscState, 1);
+
+    s->headroom = headroom;
+    s->timeout_ns = timeout_ns;
+    s->deliver = deliver;
+    s->opaque = opaque;
+    return s;
+}
+
+void net_rsc_free(NetRscState *s)
+{
+    int i;
+
+    if (!s) {
+        return;
+    }
+
+    for (i = 0; i < NET_RSC_MAX_FLOWS; i++) {
+        g_free(s->flows[i].buf);
+    }
+    g_free(s);
+}
+
+static inline uint8_t *net_rsc_frame(NetRscState *s, NetRscFlow *f)
+{
+    return f->buf + s->headroom;
+}
+
+/*
+ * Hand the aggregate of @f to the owner.  The headers are rewritten from
+ * the flow state each time, so a refused flush can simply be repeated.
+ */
+static bool net_rsc_flow_flush(NetRscState *s, NetRscFlow *f)
+{
+    uint8_t *frame = net_rsc_frame(s, f);
+    struct tcp_header *th = (struct tcp_header *)(frame + f->l4hdr_off);
+    size_t l3_len = f->len - f->l3hdr_off;
+    size_t l4_len = f->len - f->l4hdr_off;
+    struct virtio_net_hdr hdr = { 0 };
+    uint32_t cntr, cso;
+
+    assert(f->used);
+
+    if (f->ip6) {
+        struct ip6_header *ip6 = (struct ip6_header *)(frame + f->l3hdr_off);
+
+        ip6->ip6_ctlun.ip6_un1.ip6_un1_plen =
+            cpu_to_be16(l3_len - sizeof(*ip6));
+    } else {
+        struct ip_header *ip = (struct ip_header *)(frame + f->l3hdr_off);
+
+        ip->ip_len = cpu_to_be16(l3_len);
+        eth_fix_ip4_checksum(ip, f->l4hdr_off - f->l3hdr_off);
+    }
+
+    if (f->segs == 1) {
+        /* Nothing was merged; the checksum was verified on the way in */
+        hdr.flags = VIRTIO_NET_HDR_F_DATA_VALID;
+        hdr.gso_type = VIRTIO_NET_HDR_GSO_NONE;
+    } else {
+        /* Leave the pseudo-header sum for the receiver to complete */
+        if (f->ip6) {
+            cntr = eth_calc_ip6_pseudo_hdr_csum(
+                (struct ip6_header *)(frame + f->l3hdr_off),
+                l4_len, IP_PROTO_TCP, &cso);
+        } else {
+            cntr = eth_calc_ip4_pseudo_hdr_csum(
+                (struct ip_header *)(frame + f->l3hdr_off), l4_len, &cso);
+        }
+        th->th_sum = cpu_to_be16(~net_checksum_finish(cntr));
+
+        hdr.flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        hdr.gso_type = f->ip6 ? VIRTIO_NET_HDR_GSO_TCPV6 :
+                                VIRTIO_NET_HDR_GSO_TCPV4;
+        hdr.hdr_len = f->l5hdr_off;
+        hdr.gso_size = f->mss;
+        hdr.csum_start = f->l4hdr_off;
+        hdr.csum_offset = offsetof(struct tcp_header, th_sum);
+    }
+
+    trace_net_rsc_flush(s, f->segs, f->len);
+
+    /* Release the slot before delivery so the table is consistent */
+    f->used = false;
+    if (!s->deliver(s->opaque, f->buf, s->headroom + f->len, &hdr)) {
+        /* Keep the data until the owner has room for it */
+        f->used = true;
+        s->stalled = true;
+        return false;
+    }
+    return true;
+}
+
+bool net_rsc_flush(NetRscState *s)
+{
+    int i;
+
+    for (i = 0; i < NET_RSC_MAX_FLOWS; i++) {
+        if (s->flows[i].used && !net_rsc_flow_flush(s, &s->flows[i])) {
+            return false;
+        }
+    }
+    s->stalled = false;
+    return true;
+}
+
+bool net_rsc_retry(NetRscState *s)
+{
+    return !s->stalled || net_rsc_flush(s);
+}
+
+size_t net_rsc_pending(NetRscState *s, size_t overhead)
+{
+    size_t total = 0;
+    int i;
+
+    for (i = 0; i < NET_RSC_MAX_FLOWS; i++) {
+        if (s->flows[i].used) {
+            total += s->flows[i].len + overhead;
+        }
+    }
+    return total;
+}
+
+static bool net_rsc_csum_ok(const NetRscSeg *seg, size_t l4_len)
+{
+    uint8_t *l3hdr = (uint8_t *)seg->data + seg->l3hdr_off;
+    uint32_t cntr, cso;
+
+    if (seg->ip6) {
+        cntr = eth_calc_ip6_pseudo_hdr_csum((struct ip6_header *)l3hdr,
+                                            l4_len, IP_PROTO_TCP, &cso);
+    } else {
+        cntr = eth_calc_ip4_pseudo_hdr_csum((struct ip_header *)l3hdr,
+                                            l4_len, &cso);
+    }
+    cntr += net_checksum_add_cont(l4_len,
+                                  (uint8_t *)seg->data + seg->l4hdr_off, cso);
+    return net_checksum_finish(cntr) == 0;
+}
+
+/*
+ * Parse @data into @seg.  Returns false for anything that is not a TCP
+ * segment in a form we know how to merge.
+ */
+static bool net_rsc_parse(const uint8_t *data, size_t len, NetRscSeg *seg)
+{
+    struct iovec iov = { .iov_base = (void *)data, .iov_len = len };
+    bool isip4, isip6, isudp, istcp;
+    eth_ip4_hdr_info ip4info;
+    eth_ip6_hdr_info ip6info;
+    eth_l4_hdr_info l4info;
+    size_t l3_len;
+
+    eth_get_protocols(&iov, 1, &isip4, &isip6, &isudp, &istcp,
+                      &seg->l3hdr_off, &seg->l4hdr_off, &seg->l5hdr_off,
+                      &ip6info, &ip4info, &l4info);
+    if (!istcp || seg->l5hdr_off > len) {
+        return false;
+    }
+
+    /* The data offset comes from the wire; everything below relies on a
+     * complete TCP header in front of the payload */
+    if (seg->l4hdr_off + sizeof(struct tcp_header) > len ||
+        seg->l5hdr_off - seg->l4hdr_off < sizeof(struct tcp_header)) {
+        return false;
+    }
+
+    seg->data = data;
+    seg->ip6 = isip6;
+    if (isip4) {
+        if (ip4info.fragment ||
+            seg->l4hdr_off - seg->l3hdr_off != sizeof(struct ip_header)) {
+            return false;
+        }
+        l3_len = be16_to_cpu(ip4info.ip4_hdr.ip_len);
+    } else {
+        if (ip6info.fragment || ip6info.has_ext_hdrs) {
+            return false;
+        }
+        l3_len = sizeof(struct ip6_header) +
+                 be16_to_cpu(ip6info.ip6_hdr.ip6_ctlun.ip6_un1.ip6_un1_plen);
+    }
+
+    /* The frame may carry ethernet padding past the L3 length */
+    if (seg->l3hdr_off + l3_len > len ||
+        seg->l3hdr_off + l3_len < seg->l5hdr_off) {
+        return false;
+    }
+
+    seg->payload_len = seg->l3hdr_off + l3_len - seg->l5hdr_off;
+    seg->seq = be32_to_cpu(l4info.hdr.tcp.th_seq);
+    seg->flags = TCP_HEADER_FLAGS(&l4info.hdr.tcp);
+    return true;
+}
+
+static NetRscFlow *net_rsc_lookup(NetRscState *s, const NetRscSeg *seg)
+{
+    const uint8_t *l3 = seg->data + seg->l3hdr_off;
+    const uint8_t *l4 = seg->data + seg->l4hdr_off;
+    int i;
+
+    for (i = 0; i < NET_RSC_MAX_FLOWS; i++) {
+        NetRscFlow *f = &s->flows[i];
+        const uint8_t *fl3, *fl4;
+
+        if (!f->used || f->ip6 != seg->ip6) {
+            continue;
+        }
+        fl3 = net_rsc_frame(s, f) + f->l3hdr_off;
+        fl4 = net_rsc_frame(s, f) + f->l4hdr_off;
+        if (seg->ip6) {
+            if (memcmp(&((struct ip6_header *)fl3)->ip6_src,
+                       &((struct ip6_header *)l3)->ip6_src,
+                       2 * sizeof(struct in6_address))) {
+                continue;
+            }
+        } else if (memcmp(&((struct ip_header *)fl3)->ip_src,
+                          &((struct ip_header *)l3)->ip_src,
+                          2 * sizeof(uint32_t))) {
+            continue;
+        }
+        /* Source and destination port */
+        if (memcmp(fl4, l4, 2 * sizeof(uint16_t))) {
+            continue;
+        }
+        return f;
+    }
+    return NULL;
+}
+
+/* Whether @seg may be appended to @f */
+static bool net_rsc_can_merge(NetRscState *s, NetRscFlow *f,
+                              const NetRscSeg *seg)
+{
+    const uint8_t *frame = net_rsc_frame(s, f);
+    const struct tcp_header *fth, *th;
+
+    if (seg->seq != f->next_seq || seg->payload_len > f->mss ||
+        f->len + seg->payload_len > NET_RSC_MAX_FRAME ||
+        f->len - f->l3hdr_off + seg->payload_len > ETH_MAX_IP_DGRAM_LEN) {
+        return false;
+    }
+
+    /* Same L2 header and same header lengths */
+    if (seg->l3hdr_off != f->l3hdr_off || seg->l5hdr_off != f->l5hdr_off ||
+        memcmp(frame, seg->data, f->l3hdr_off)) {
+        return false;
+    }
+
+    if (seg->ip6) {
+        const struct ip6_header *fip = (void *)(frame + f->l3hdr_off);
+        const struct ip6_header *ip = (void *)(seg->data + seg->l3hdr_off);
+
+        /* Version, traffic class, flow label and hop limit */
+        if (fip->ip6_ctlun.ip6_un1.ip6_un1_flow !=
+            ip->ip6_ctlun.ip6_un1.ip6_un1_flow ||
+            fip->ip6_ctlun.ip6_un1.ip6_un1_hlim !=
+            ip->ip6_ctlun.ip6_un1.ip6_un1_hlim) {
+            return false;
+        }
+    } else {
+        const struct ip_header *fip = (void *)(frame + f->l3hdr_off);
+        const struct ip_header *ip = (void *)(seg->data + seg->l3hdr_off);
+
+        if (fip->ip_tos != ip->ip_tos || fip->ip_ttl != ip->ip_ttl ||
+            fip->ip_off != ip->ip_off) {
+            return false;
+        }
+    }
+
+    /* Acknowledgment, window and options must not change */
+    fth = (const void *)(frame + f->l4hdr_off);
+    th = (const void *)(seg->data + seg->l4hdr_off);
+    if (fth->th_ack != th->th_ack || fth->th_win != th->th_win ||
+        memcmp(fth + 1, th + 1, f->l5hdr_off - f->l4hdr_off - sizeof(*th))) {
+        return false;
+    }
+
+    return true;
+}
+
+/* Whether @f has been collecting segments for too long */
+static bool net_rsc_expired(NetRscState *s, NetRscFlow *f)
+{
+    return s->timeout_ns &&
+           qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) - f->start >= s->timeout_ns;
+}
+
+static NetRscFlow *net_rsc_alloc(NetRscState *s)
+{
+    NetRscFlow *f;
+    int i;
+
+    for (i = 0; i < NET_RSC_MAX_FLOWS; i++) {
+        if (!s->flows[i].used) {
+            f = &s->flows[i];
+            goto found;
+        }
+    }
+
+    /* All slots busy: evict round-robin */
+    f = &s->flows[s->next_victim];
+    s->next_victim = (s->next_victim + 1) % NET_RSC_MAX_FLOWS;
+    if (!net_rsc_flow_flush(s, f)) {
+        return NULL;
+    }
+
+found:
+    if (!f->buf) {
+        f->buf = g_malloc(s->headroom + NET_RSC_MAX_FRAME);
+    }
+    return f;
+}
+
+int net_rsc_receive(NetRscState *s, const uint8_t *data, size_t len,
+                    bool csum_valid)
+{
+    NetRscSeg seg;
+    NetRscFlow *f;
+    struct tcp_header *th;
+    bool mergeable, push;
+
+    /* Nothing may overtake data that is still waiting for the owner */
+    if (!net_rsc_retry(s)) {
+        return -EBUSY;
+    }
+
+    if (len > NET_RSC_MAX_FRAME || !net_rsc_parse(data, len, &seg)) {
+        return 0;
+    }
+
+    push = seg.flags & TH_PUSH;
+    mergeable = (seg.flags & ~TH_PUSH) == TH_ACK && seg.payload_len &&
+                (csum_valid ||
+                 net_rsc_csum_ok(&seg, seg.l5hdr_off - seg.l4hdr_off +
+                                       seg.payload_len));
+
+    f = net_rsc_lookup(s, &seg);
+    if (f) {
+        if (mergeable && !net_rsc_expired(s, f) &&
+            net_rsc_can_merge(s, f, &seg)) {
+            uint8_t *frame = net_rsc_frame(s, f);
+
+            memcpy(frame + f->len, data + seg.l5hdr_off, seg.payload_len);
+            f->len += seg.payload_len;
+            f->next_seq += seg.payload_len;
+            f->segs++;
+            if (push) {
+                th = (struct tcp_header *)(frame + f->l4hdr_off);
+                th->th_offset_flags |= cpu_to_be16(TH_PUSH);
+            }
+            trace_net_rsc_merge(s, f->segs, seg.payload_len);
+
+            /*
+             * A short or pushed segment ends the run.  If the owner has
+             * no room yet the flow stays stalled and is retried later.
+             */
+            if (push || seg.payload_len < f->mss) {
+                net_rsc_flow_flush(s, f);
+            }
+            return 1;
+        }
+        if (!net_rsc_flow_flush(s, f)) {
+            return -EBUSY;
+        }
+    }
+
+    if (!mergeable || push) {
+        return 0;
+    }
+
+    f = net_rsc_alloc(s);
+    if (!f) {
+        return -EBUSY;
+    }
+    f->used = true;
+    f->ip6 = seg.ip6;
+    f->l3hdr_off = seg.l3hdr_off;
+    f->l4hdr_off = seg.l4hdr_off;
+    f->l5hdr_off = seg.l5hdr_off;
+    f->len = seg.l5hdr_off + seg.payload_len;
+    f->mss = seg.payload_len;
+    f->next_seq = seg.seq + seg.payload_len;
+    f->segs = 1;
+    f->start = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    memcpy(net_rsc_frame(s, f), data, f->len);
+    return 1;
+}
@@ -59,6 +59,7 @@ typedef struct TAPState {
     VHostNetState *vhost_net;
     unsigned host_vnet_hdr_len;
     Notifier exit;
+    AioContext *ctx;        /* NULL if handled by the main loop */
 } TAPState;
 
 static void launch_script(const char *setup_script, const char *ifname,
@@ -69,6 +70,13 @@ static void tap_writable(void *opaque);
 
 static void tap_update_fd_handler(TAPState *s)
 {
+    if (s->ctx) {
+        aio_set_fd_handler(s->ctx, s->fd, false,
+                           s->read_poll && s->enabled ? tap_send : NULL,
+                           s->write_poll && s->enabled ? tap_writable : NULL,
+                           NULL, s);
+        return;
+    }
     qemu_set_fd_handler(s->fd,
                         s->read_poll && s->enabled ? tap_send : NULL,
                         s->write_poll && s->enabled ? tap_writable : NULL,
@@ -87,13 +95,45 @@ static void tap_write_poll(TAPState *s, bool enable)
     tap_update_fd_handler(s);
 }
 
+/* In an IOThread the fd handlers run without any lock held, but the
+ * NetQueue of the peer is also used by the main loop, with the AioContext
+ * of the IOThread held.  Take it here as well.  Returns false if the tap
+ * was moved to another context before the lock could be taken. */
+static bool tap_acquire_ctx(TAPState *s, AioContext *ctx)
+{
+    if (!ctx) {
+        return true;
+    }
+
+    aio_context_acquire(ctx);
+    if (s->ctx != ctx) {
+        aio_context_release(ctx);
+        return false;
+    }
+    return true;
+}
+
+static void tap_release_ctx(AioContext *ctx)
+{
+    if (ctx) {
+        aio_context_release(ctx);
+    }
+}
+
 static void tap_writable(void *opaque)
 {
     TAPState *s = opaque;
+    AioContext *ctx = s->ctx;
+
+    if (!tap_acquire_ctx(s, ctx)) {
+        return;
+    }
 
     tap_write_poll(s, false);
 
     qemu_flush_queued_packets(&s->nc);
+
+    tap_release_ctx(ctx);
 }
 
 static ssize_t tap_write_packet(TAPState *s, const struct iovec *iov, int iovcnt)
@@ -182,9 +222,15 @@ static void tap_send_completed(NetClientState *nc, ssize_t len)
 static void tap_send(void *opaque)
 {
     TAPState *s = opaque;
+    AioContext *ctx = s->ctx;
     int size;
     int packets = 0;
 
+    if (!tap_acquire_ctx(s, ctx)) {
+        return;
+    }
+
+    qemu_send_batch_begin(&s->nc);
     while (true) {
         uint8_t *buf = s->buf;
 
@@ -217,6 +263,9 @@ static void tap_send(void *opaque)
             break;
         }
     }
+    qemu_send_batch_end(&s->nc);
+
+    tap_release_ctx(ctx);
 }
 
 static bool tap_has_ufo(NetClientState *nc)
@@ -334,6 +383,27 @@ static void tap_poll(NetClientState *nc, bool enable)
     tap_write_poll(s, enable);
 }
 
+static void tap_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+    bool read_poll = s->read_poll;
+    bool write_poll = s->write_poll;
+
+    if (s->ctx == ctx) {
+        return;
+    }
+
+    /* Remove the handlers from the old context before adding them to the
+     * new one, so that the fd is never polled by two threads */
+    s->read_poll = s->write_poll = false;
+    tap_update_fd_handler(s);
+
+    s->ctx = ctx;
+    s->read_poll = read_poll;
+    s->write_poll = write_poll;
+    tap_update_fd_handler(s);
+}
+
 int tap_get_fd(NetClientState *nc)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
@@ -359,6 +429,7 @@ static NetClientInfo net_tap_info = {
     .set_vnet_hdr_len = tap_set_vnet_hdr_len,
     .set_vnet_le = tap_set_vnet_le,
     .set_vnet_be = tap_set_vnet_be,
+    .set_aio_context = tap_set_aio_context,
 };
 
 static TAPState *net_tap_fd_init(NetClientState *peer,
@@ -23,6 +23,7 @@
 #include "disas/disas.h"
 #include "exec/exec-all.h"
 #include "tcg-op.h"
+#include "tcg-op-gvec.h"
 #include "exec/cpu_ldst.h"
 #include "exec/translator.h"
 
@@ -3016,6 +3017,73 @@ static const struct SSEOpHelper_eppi sse_op_table7[256] = {
     [0xdf] = AESNI_OP(aeskeygenassist),
 };
 
+/* Expand the simple integer MMX/SSE operations with the generic vector
+   expanders rather than calling a helper.  OP1 is both the destination
+   and the first source.  Return false if B is not such an operation.  */
+static bool gen_sse_gvec(int b, int is_xmm, int op1_offset, int op2_offset)
+{
+    uint32_t oprsz = is_xmm ? 16 : 8;
+    uint32_t d, a;
+
+    if (is_xmm) {
+        /* Operate on the low 128 bits of the ZMMReg.  */
+#ifdef HOST_WORDS_BIGENDIAN
+        op1_offset += offsetof(ZMMReg, ZMM_Q(1));
+        op2_offset += offsetof(ZMMReg, ZMM_Q(1));
+#else
+        op1_offset += offsetof(ZMMReg, ZMM_Q(0));
+        op2_offset += offsetof(ZMMReg, ZMM_Q(0));
+#endif
+    }
+    d = op1_offset;
+    a = op2_offset;
+
+    switch (b) {
+    case 0xfc ... 0xfe: /* paddb, paddw, paddd */
+        tcg_gen_gvec_add(b - 0xfc, d, d, a, oprsz, oprsz);
+        break;
+    case 0xd4: /* paddq */
+        tcg_gen_gvec_add(MO_64, d, d, a, oprsz, oprsz);
+        break;
+    case 0xf8 ... 0xfb: /* psubb, psubw, psubd, psubq */
+        tcg_gen_gvec_sub(b - 0xf8, d, d, a, oprsz, oprsz);
+        break;
+    case 0xec ... 0xed: /* paddsb, paddsw */
+        tcg_gen_gvec_ssadd(b - 0xec, d, d, a, oprsz, oprsz);
+        break;
+    case 0xe8 ... 0xe9: /* psubsb, psubsw */
+        tcg_gen_gvec_sssub(b - 0xe8, d, d, a, oprsz, oprsz);
+        break;
+    case 0xdc ... 0xdd: /* paddusb, paddusw */
+        tcg_gen_gvec_usadd(b - 0xdc, d, d, a, oprsz, oprsz);
+        break;
+    case 0xd8 ... 0xd9: /* psubusb, psubusw */
+        tcg_gen_gvec_ussub(b - 0xd8, d, d, a, oprsz, oprsz);
+        break;
+    case 0xdb: /* pand */
+        tcg_gen_gvec_and(MO_64, d, d, a, oprsz, oprsz);
+        break;
+    case 0xdf: /* pandn */
+        tcg_gen_gvec_andc(MO_64, d, a, d, oprsz, oprsz);
+        break;
+    case 0xeb: /* por */
+        tcg_gen_gvec_or(MO_64, d, d, a, oprsz, oprsz);
+        break;
+    case 0xef: /* pxor */
+        tcg_gen_gvec_xor(MO_64, d, d, a, oprsz, oprsz);
+        break;
+    case 0x74 ... 0x76: /* pcmpeqb, pcmpeqw, pcmpeql */
+        tcg_gen_gvec_cmp(TCG_COND_EQ, b - 0x74, d, d, a, oprsz, oprsz);
+        break;
+    case 0x64 ... 0x66: /* pcmpgtb, pcmpgtw, pcmpgtl */
+        tcg_gen_gvec_cmp(TCG_COND_GT, b - 0x64, d, d, a, oprsz, oprsz);
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
 static void gen_sse(CPUX86State *env, DisasContext *s, int b,
                     target_ulong pc_start, int rex_r)
 {
@@ -4442,6 +4510,9 @@ static void gen_sse(CPUX86State *env, DisasContext *s, int b,
             sse_fn_eppt(cpu_env, cpu_ptr0, cpu_ptr1, cpu_A0);
             break;
         default:
+            if (gen_sse_gvec(b, is_xmm, op1_offset, op2_offset)) {
+                break;
+            }
             tcg_gen_addi_ptr(cpu_ptr0, cpu_env, op1_offset);
             tcg_gen_addi_ptr(cpu_ptr1, cpu_env, op2_offset);
             sse_fn_epp(cpu_env, cpu_ptr0, cpu_ptr1);
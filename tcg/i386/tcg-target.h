@@ -27,6 +27,7 @@
 
 #define TCG_TARGET_INSN_UNIT_SIZE  1
 #define TCG_TARGET_TLB_DISPLACEMENT_BITS 31
+#define TCG_TARGET_IMPLEMENTS_DYN_TLB 1
 
 #ifdef __x86_64__
 # define TCG_TARGET_REG_BITS  64
@@ -77,6 +78,7 @@ typedef enum {
 
 extern bool have_bmi1;
 extern bool have_popcnt;
+extern bool have_sse2;
 
 /* optional instructions */
 #define TCG_TARGET_HAS_div2_i32         1
@@ -110,6 +112,10 @@ extern bool have_popcnt;
 #define TCG_TARGET_HAS_goto_ptr         1
 #define TCG_TARGET_HAS_direct_jump      1
 
+/* Generic vector operations are expanded using SSE2, and AVX2 if present.  */
+#define TCG_TARGET_MAYBE_gvec           1
+#define TCG_TARGET_HAS_gvec             have_sse2
+
 #if TCG_TARGET_REG_BITS == 64
 #define TCG_TARGET_HAS_extrl_i64_i32    0
 #define TCG_TARGET_HAS_extrh_i64_i32    0
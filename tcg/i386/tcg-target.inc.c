@@ -125,6 +125,17 @@ static bool have_cmov;
    it there.  Therefore we always define the variable.  */
 bool have_bmi1;
 bool have_popcnt;
+bool have_sse2;
+
+#ifdef CONFIG_CPUID_H
+static bool have_sse41;
+static bool have_sse42;
+static bool have_avx2;
+#else
+# define have_sse41 0
+# define have_sse42 0
+# define have_avx2 0
+#endif
 
 #ifdef CONFIG_CPUID_H
 static bool have_movbe;
@@ -279,6 +290,7 @@ static inline int tcg_target_const_match(tcg_target_long val, TCGType type,
 #endif
 #define P_SIMDF3        0x10000         /* 0xf3 opcode prefix */
 #define P_SIMDF2        0x20000         /* 0xf2 opcode prefix */
+#define P_VEXL          0x40000         /* Set VEX.L = 1 */
 
 #define OPC_ARITH_EvIz	(0x81)
 #define OPC_ARITH_EvIb	(0x83)
@@ -332,6 +344,48 @@ static inline int tcg_target_const_match(tcg_target_long val, TCGType type,
 #define OPC_TZCNT       (0xbc | P_EXT | P_SIMDF3)
 #define OPC_XCHG_ax_r32	(0x90)
 
+#define OPC_MOVD_VyEy   (0x6e | P_EXT | P_DATA16)
+#define OPC_MOVDQU_VxWx (0x6f | P_EXT | P_SIMDF3)
+#define OPC_MOVDQU_WxVx (0x7f | P_EXT | P_SIMDF3)
+#define OPC_MOVQ_VqWq   (0x7e | P_EXT | P_SIMDF3)
+#define OPC_MOVQ_WqVq   (0xd6 | P_EXT | P_DATA16)
+#define OPC_PADDB       (0xfc | P_EXT | P_DATA16)
+#define OPC_PADDW       (0xfd | P_EXT | P_DATA16)
+#define OPC_PADDD       (0xfe | P_EXT | P_DATA16)
+#define OPC_PADDQ       (0xd4 | P_EXT | P_DATA16)
+#define OPC_PADDSB      (0xec | P_EXT | P_DATA16)
+#define OPC_PADDSW      (0xed | P_EXT | P_DATA16)
+#define OPC_PADDUB      (0xdc | P_EXT | P_DATA16)
+#define OPC_PADDUW      (0xdd | P_EXT | P_DATA16)
+#define OPC_PAND        (0xdb | P_EXT | P_DATA16)
+#define OPC_PANDN       (0xdf | P_EXT | P_DATA16)
+#define OPC_PCMPEQB     (0x74 | P_EXT | P_DATA16)
+#define OPC_PCMPEQW     (0x75 | P_EXT | P_DATA16)
+#define OPC_PCMPEQD     (0x76 | P_EXT | P_DATA16)
+#define OPC_PCMPEQQ     (0x29 | P_EXT38 | P_DATA16)
+#define OPC_PCMPGTB     (0x64 | P_EXT | P_DATA16)
+#define OPC_PCMPGTW     (0x65 | P_EXT | P_DATA16)
+#define OPC_PCMPGTD     (0x66 | P_EXT | P_DATA16)
+#define OPC_PCMPGTQ     (0x37 | P_EXT38 | P_DATA16)
+#define OPC_POR         (0xeb | P_EXT | P_DATA16)
+#define OPC_PSHIFTW_Ib  (0x71 | P_EXT | P_DATA16) /* /2 /6 /4 */
+#define OPC_PSHIFTD_Ib  (0x72 | P_EXT | P_DATA16) /* /2 /6 /4 */
+#define OPC_PSHIFTQ_Ib  (0x73 | P_EXT | P_DATA16) /* /2 /6 */
+#define OPC_PSHUFD      (0x70 | P_EXT | P_DATA16)
+#define OPC_PSHUFLW     (0x70 | P_EXT | P_SIMDF2)
+#define OPC_PSUBB       (0xf8 | P_EXT | P_DATA16)
+#define OPC_PSUBW       (0xf9 | P_EXT | P_DATA16)
+#define OPC_PSUBD       (0xfa | P_EXT | P_DATA16)
+#define OPC_PSUBQ       (0xfb | P_EXT | P_DATA16)
+#define OPC_PSUBSB      (0xe8 | P_EXT | P_DATA16)
+#define OPC_PSUBSW      (0xe9 | P_EXT | P_DATA16)
+#define OPC_PSUBUB      (0xd8 | P_EXT | P_DATA16)
+#define OPC_PSUBUW      (0xd9 | P_EXT | P_DATA16)
+#define OPC_PUNPCKLBW   (0x60 | P_EXT | P_DATA16)
+#define OPC_PUNPCKLQDQ  (0x6c | P_EXT | P_DATA16)
+#define OPC_PXOR        (0xef | P_EXT | P_DATA16)
+#define OPC_VZEROUPPER  (0x77 | P_EXT)
+
 #define OPC_GRP3_Ev	(0xf7)
 #define OPC_GRP5	(0xff)
 
@@ -408,8 +462,9 @@ static void tcg_out_opc(TCGContext *s, int opc, int r, int rm, int x)
         tcg_out8(s, 0x65);
     }
     if (opc & P_DATA16) {
-        /* We should never be asking for both 16 and 64-bit operation.  */
-        tcg_debug_assert((opc & P_REXW) == 0);
+        /* We should never be asking for both 16 and 64-bit operation,
+           except for SSE opcodes where 0x66 is part of the encoding.  */
+        tcg_debug_assert((opc & P_REXW) == 0 || (opc & P_EXT));
         tcg_out8(s, 0x66);
     }
     if (opc & P_ADDR32) {
@@ -479,11 +534,13 @@ static void tcg_out_modrm(TCGContext *s, int opc, int r, int rm)
     tcg_out8(s, 0xc0 | (LOWREGMASK(r) << 3) | LOWREGMASK(rm));
 }
 
-static void tcg_out_vex_modrm(TCGContext *s, int opc, int r, int v, int rm)
+static void tcg_out_vex_opc(TCGContext *s, int opc, int r, int v, int rm)
 {
     int tmp;
 
-    if ((opc & (P_REXW | P_EXT | P_EXT38)) || (rm & 8)) {
+    /* The two byte form can only encode the 0x0f opcode map,
+       and has no room for VEX.W or VEX.B.  */
+    if ((opc & (P_REXW | P_EXT | P_EXT38)) != P_EXT || (rm & 8)) {
         /* Three byte VEX prefix.  */
         tcg_out8(s, 0xc4);
 
@@ -507,6 +564,7 @@ static void tcg_out_vex_modrm(TCGContext *s, int opc, int r, int v, int rm)
 
         tmp = (r & 8 ? 0 : 0x80);          /* VEX.R */
     }
+    tmp |= (opc & P_VEXL ? 0x04 : 0);      /* VEX.L */
     /* VEX.pp */
     if (opc & P_DATA16) {
         tmp |= 1;                          /* 0x66 */
@@ -518,9 +576,46 @@ static void tcg_out_vex_modrm(TCGContext *s, int opc, int r, int v, int rm)
     tmp |= (~v & 15) << 3;                 /* VEX.vvvv */
     tcg_out8(s, tmp);
     tcg_out8(s, opc);
+}
+
+static void tcg_out_vex_modrm(TCGContext *s, int opc, int r, int v, int rm)
+{
+    tcg_out_vex_opc(s, opc, r, v, rm);
     tcg_out8(s, 0xc0 | (LOWREGMASK(r) << 3) | LOWREGMASK(rm));
 }
 
+/* Output a VEX opcode with a "rm + offset" address mode.  Unlike
+   tcg_out_modrm_sib_offset, there is no index and RM must be valid.  */
+static void tcg_out_vex_modrm_offset(TCGContext *s, int opc, int r, int v,
+                                     int rm, intptr_t offset)
+{
+    int mod, len;
+
+    if (offset == 0 && LOWREGMASK(rm) != TCG_REG_EBP) {
+        mod = 0, len = 0;
+    } else if (offset == (int8_t)offset) {
+        mod = 0x40, len = 1;
+    } else {
+        mod = 0x80, len = 4;
+    }
+
+    tcg_out_vex_opc(s, opc, r, v, rm);
+    if (LOWREGMASK(rm) != TCG_REG_ESP) {
+        tcg_out8(s, mod | (LOWREGMASK(r) << 3) | LOWREGMASK(rm));
+    } else {
+        /* The encoding that would be used for %esp is the escape
+           to the two byte form, with %esp as the "no index" value.  */
+        tcg_out8(s, mod | (LOWREGMASK(r) << 3) | 4);
+        tcg_out8(s, (4 << 3) | LOWREGMASK(rm));
+    }
+
+    if (len == 1) {
+        tcg_out8(s, offset);
+    } else if (len == 4) {
+        tcg_out32(s, offset);
+    }
+}
+
 /* Output an opcode with a full "rm + (index<<shift) + offset" address mode.
    We handle either RM and INDEX missing with a negative value.  In 64-bit
    mode for absolute addresses, ~RM is the size of the immediate operand
@@ -1278,7 +1373,7 @@ static inline void tcg_out_tlb_load(TCGContext *s, TCGReg addrlo, TCGReg addrhi,
         }
         if (TCG_TYPE_PTR == TCG_TYPE_I64) {
             hrexw = P_REXW;
-            if (TARGET_PAGE_BITS + CPU_TLB_BITS > 32) {
+            if (TARGET_PAGE_BITS + CPU_TLB_DYN_MAX_BITS > 32) {
                 tlbtype = TCG_TYPE_I64;
                 tlbrexw = P_REXW;
             }
@@ -1300,15 +1395,17 @@ static inline void tcg_out_tlb_load(TCGContext *s, TCGReg addrlo, TCGReg addrhi,
                    TARGET_PAGE_BITS - CPU_TLB_ENTRY_BITS);
 
     tgen_arithi(s, ARITH_AND + trexw, r1, tlb_mask, 0);
-    tgen_arithi(s, ARITH_AND + tlbrexw, r0,
-                (CPU_TLB_SIZE - 1) << CPU_TLB_ENTRY_BITS, 0);
 
-    tcg_out_modrm_sib_offset(s, OPC_LEA + hrexw, r0, TCG_AREG0, r0, 0,
-                             offsetof(CPUArchState, tlb_table[mem_index][0])
-                             + which);
+    /* and tlb_mask[mem_index](env), r0 */
+    tcg_out_modrm_offset(s, OPC_ARITH_GvEv + (ARITH_AND << 3) + hrexw, r0,
+                         TCG_AREG0,
+                         offsetof(CPUArchState, tlb_mask[mem_index]));
+    /* add tlb_table[mem_index](env), r0 */
+    tcg_out_modrm_offset(s, OPC_ADD_GvEv + hrexw, r0, TCG_AREG0,
+                         offsetof(CPUArchState, tlb_table[mem_index]));
 
-    /* cmp 0(r0), r1 */
-    tcg_out_modrm_offset(s, OPC_CMP_GvEv + trexw, r1, r0, 0);
+    /* cmp which(r0), r1 */
+    tcg_out_modrm_offset(s, OPC_CMP_GvEv + trexw, r1, r0, which);
 
     /* Prepare for both the fast path add of the tlb addend, and the slow
        path function argument setup.  There are two cases worth note:
@@ -1324,8 +1421,8 @@ static inline void tcg_out_tlb_load(TCGContext *s, TCGReg addrlo, TCGReg addrhi,
     s->code_ptr += 4;
 
     if (TARGET_LONG_BITS > TCG_TARGET_REG_BITS) {
-        /* cmp 4(r0), addrhi */
-        tcg_out_modrm_offset(s, OPC_CMP_GvEv, addrhi, r0, 4);
+        /* cmp which+4(r0), addrhi */
+        tcg_out_modrm_offset(s, OPC_CMP_GvEv, addrhi, r0, which + 4);
 
         /* jne slow_path */
         tcg_out_opc(s, OPC_JCC_long + JCC_JNE, 0, 0, 0);
@@ -1337,7 +1434,7 @@ static inline void tcg_out_tlb_load(TCGContext *s, TCGReg addrlo, TCGReg addrhi,
 
     /* add addend(r0), r1 */
     tcg_out_modrm_offset(s, OPC_ADD_GvEv + hrexw, r1, r0,
-                         offsetof(CPUTLBEntry, addend) - which);
+                         offsetof(CPUTLBEntry, addend));
 }
 
 /*
@@ -1843,6 +1940,360 @@ static void tcg_out_qemu_st(TCGContext *s, const TCGArg *args, bool is64)
 #endif
 }
 
+/*
+ * Generic vector operations.  The operands live in CPUArchState, so each
+ * INDEX_op_gvec_* opcode is expanded as load, operate, store over chunks
+ * of 8, 16 or (with AVX2) 32 bytes.  The register allocator knows nothing
+ * of the vector registers; %xmm0-2 are call-clobbered in every ABI and
+ * are never live across an opcode, so they are used as scratch.
+ */
+
+#define TCG_VEC_T0  0
+#define TCG_VEC_T1  1
+#define TCG_VEC_T2  2
+
+/* The largest vector we expand inline; bounds the size of the output.  */
+#define GVEC_MAX_OPRSZ  64
+
+typedef struct {
+    bool vex;       /* use VEX encodings throughout */
+    int len;        /* bytes in the current chunk */
+} GVecChunk;
+
+static void gvec_chunk_init(GVecChunk *c, uint32_t oprsz)
+{
+    /* Never mix legacy SSE with 256-bit AVX encodings within one
+       expansion, to avoid the AVX-SSE transition penalty.  */
+    c->vex = have_avx2 && oprsz >= 32;
+}
+
+static void gvec_chunk_next(GVecChunk *c, uint32_t rem)
+{
+    c->len = (rem >= 32 && c->vex ? 32 : rem >= 16 ? 16 : 8);
+}
+
+static void gvec_chunk_fini(TCGContext *s, GVecChunk *c)
+{
+    if (c->vex) {
+        tcg_out_vex_opc(s, OPC_VZEROUPPER, 0, 0, 0);
+    }
+}
+
+static void tcg_out_vld(TCGContext *s, GVecChunk *c, int r, intptr_t ofs)
+{
+    int opc = (c->len == 8 ? OPC_MOVQ_VqWq : OPC_MOVDQU_VxWx);
+
+    if (c->vex) {
+        opc |= (c->len == 32 ? P_VEXL : 0);
+        tcg_out_vex_modrm_offset(s, opc, r, 0, TCG_AREG0, ofs);
+    } else {
+        tcg_out_modrm_offset(s, opc, r, TCG_AREG0, ofs);
+    }
+}
+
+static void tcg_out_vst(TCGContext *s, GVecChunk *c, int r, intptr_t ofs)
+{
+    int opc = (c->len == 8 ? OPC_MOVQ_WqVq : OPC_MOVDQU_WxVx);
+
+    if (c->vex) {
+        opc |= (c->len == 32 ? P_VEXL : 0);
+        tcg_out_vex_modrm_offset(s, opc, r, 0, TCG_AREG0, ofs);
+    } else {
+        tcg_out_modrm_offset(s, opc, r, TCG_AREG0, ofs);
+    }
+}
+
+/* Emit D = A op B.  Without VEX, D must equal A.  */
+static void tcg_out_vop(TCGContext *s, GVecChunk *c, int opc,
+                        int d, int a, int b)
+{
+    if (c->vex) {
+        tcg_out_vex_modrm(s, opc | (c->len == 32 ? P_VEXL : 0), d, a, b);
+    } else {
+        tcg_debug_assert(d == a);
+        tcg_out_modrm(s, opc, d, b);
+    }
+}
+
+/* Emit D = A shifted by the immediate IMM, with EXT the /r opcode field.  */
+static void tcg_out_vshifti(TCGContext *s, GVecChunk *c, int opc, int ext,
+                            int d, int a, int imm)
+{
+    if (c->vex) {
+        tcg_out_vex_modrm(s, opc | (c->len == 32 ? P_VEXL : 0), ext, d, a);
+    } else {
+        tcg_debug_assert(d == a);
+        tcg_out_modrm(s, opc, ext, a);
+    }
+    tcg_out8(s, imm);
+}
+
+bool tcg_can_emit_gvec(TCGOpcode opc, unsigned vece, uint32_t oprsz)
+{
+    if (!have_sse2 || oprsz > GVEC_MAX_OPRSZ
+        || (oprsz != 8 && (oprsz & 15) != 0)) {
+        return false;
+    }
+
+    switch (opc) {
+    case INDEX_op_gvec_mov:
+    case INDEX_op_gvec_not:
+    case INDEX_op_gvec_neg:
+    case INDEX_op_gvec_add:
+    case INDEX_op_gvec_sub:
+    case INDEX_op_gvec_and:
+    case INDEX_op_gvec_or:
+    case INDEX_op_gvec_xor:
+    case INDEX_op_gvec_andc:
+        return true;
+    case INDEX_op_gvec_dup_i32:
+        return vece <= MO_32;
+    case INDEX_op_gvec_dup_i64:
+        return TCG_TARGET_REG_BITS == 64;
+    case INDEX_op_gvec_ssadd:
+    case INDEX_op_gvec_sssub:
+    case INDEX_op_gvec_usadd:
+    case INDEX_op_gvec_ussub:
+        return vece <= MO_16;
+    case INDEX_op_gvec_cmp:
+        /* PCMPEQQ is SSE4.1 and PCMPGTQ is SSE4.2.  */
+        return vece <= MO_32 || (have_sse41 && have_sse42);
+    case INDEX_op_gvec_shli:
+    case INDEX_op_gvec_shri:
+        return vece >= MO_16;
+    case INDEX_op_gvec_sari:
+        return vece == MO_16 || vece == MO_32;
+    default:
+        return false;
+    }
+}
+
+static void tcg_out_gvec_dup(TCGContext *s, TCGOpcode opc, TCGReg r,
+                             intptr_t dofs, uint32_t desc)
+{
+    unsigned vece = simd_data(desc);
+    intptr_t oprsz = simd_oprsz(desc);
+    int rexw = (opc == INDEX_op_gvec_dup_i64 ? P_REXW : 0);
+    GVecChunk c = { .vex = false };
+    intptr_t i;
+
+    /* Replicate within the low 128 bits only; the result is then stored
+       as many times as needed, so no 256-bit encodings are required.  */
+    tcg_out_modrm(s, OPC_MOVD_VyEy + rexw, TCG_VEC_T0, r);
+    switch (vece) {
+    case MO_8:
+        tcg_out_modrm(s, OPC_PUNPCKLBW, TCG_VEC_T0, TCG_VEC_T0);
+        /* fall through */
+    case MO_16:
+        tcg_out_modrm(s, OPC_PSHUFLW, TCG_VEC_T0, TCG_VEC_T0);
+        tcg_out8(s, 0);
+        /* fall through */
+    case MO_32:
+        tcg_out_modrm(s, OPC_PSHUFD, TCG_VEC_T0, TCG_VEC_T0);
+        tcg_out8(s, 0);
+        break;
+    case MO_64:
+        tcg_out_modrm(s, OPC_PUNPCKLQDQ, TCG_VEC_T0, TCG_VEC_T0);
+        break;
+    default:
+        g_assert_not_reached();
+    }
+
+    for (i = 0; i < oprsz; i += c.len) {
+        c.len = (oprsz - i >= 16 ? 16 : 8);
+        tcg_out_vst(s, &c, TCG_VEC_T0, dofs + i);
+    }
+}
+
+static void tcg_out_gvec_2(TCGContext *s, TCGOpcode opc,
+                           intptr_t dofs, intptr_t aofs, uint32_t desc)
+{
+    static const int sub_insn[4] = {
+        OPC_PSUBB, OPC_PSUBW, OPC_PSUBD, OPC_PSUBQ
+    };
+    unsigned vece = simd_data(desc);
+    intptr_t oprsz = simd_oprsz(desc);
+    GVecChunk c;
+    intptr_t i;
+
+    gvec_chunk_init(&c, oprsz);
+    for (i = 0; i < oprsz; i += c.len) {
+        gvec_chunk_next(&c, oprsz - i);
+        switch (opc) {
+        case INDEX_op_gvec_mov:
+            tcg_out_vld(s, &c, TCG_VEC_T0, aofs + i);
+            tcg_out_vst(s, &c, TCG_VEC_T0, dofs + i);
+            break;
+        case INDEX_op_gvec_not:
+            tcg_out_vld(s, &c, TCG_VEC_T0, aofs + i);
+            tcg_out_vop(s, &c, OPC_PCMPEQB, TCG_VEC_T1, TCG_VEC_T1,
+                        TCG_VEC_T1);
+            tcg_out_vop(s, &c, OPC_PXOR, TCG_VEC_T0, TCG_VEC_T0, TCG_VEC_T1);
+            tcg_out_vst(s, &c, TCG_VEC_T0, dofs + i);
+            break;
+        case INDEX_op_gvec_neg:
+            tcg_out_vld(s, &c, TCG_VEC_T0, aofs + i);
+            tcg_out_vop(s, &c, OPC_PXOR, TCG_VEC_T1, TCG_VEC_T1, TCG_VEC_T1);
+            tcg_out_vop(s, &c, sub_insn[vece], TCG_VEC_T1, TCG_VEC_T1,
+                        TCG_VEC_T0);
+            tcg_out_vst(s, &c, TCG_VEC_T1, dofs + i);
+            break;
+        default:
+            g_assert_not_reached();
+        }
+    }
+    gvec_chunk_fini(s, &c);
+}
+
+static void tcg_out_gvec_shift(TCGContext *s, TCGOpcode opc, intptr_t dofs,
+                               intptr_t aofs, int shift, uint32_t desc)
+{
+    static const int shift_insn[4] = {
+        -1, OPC_PSHIFTW_Ib, OPC_PSHIFTD_Ib, OPC_PSHIFTQ_Ib
+    };
+    unsigned vece = simd_data(desc);
+    intptr_t oprsz = simd_oprsz(desc);
+    int ext;
+    GVecChunk c;
+    intptr_t i;
+
+    switch (opc) {
+    case INDEX_op_gvec_shli:
+        ext = 6;
+        break;
+    case INDEX_op_gvec_shri:
+        ext = 2;
+        break;
+    case INDEX_op_gvec_sari:
+        ext = 4;
+        break;
+    default:
+        g_assert_not_reached();
+    }
+
+    gvec_chunk_init(&c, oprsz);
+    for (i = 0; i < oprsz; i += c.len) {
+        gvec_chunk_next(&c, oprsz - i);
+        tcg_out_vld(s, &c, TCG_VEC_T0, aofs + i);
+        tcg_out_vshifti(s, &c, shift_insn[vece], ext,
+                        TCG_VEC_T0, TCG_VEC_T0, shift);
+        tcg_out_vst(s, &c, TCG_VEC_T0, dofs + i);
+    }
+    gvec_chunk_fini(s, &c);
+}
+
+static void tcg_out_gvec_3(TCGContext *s, TCGOpcode opc, intptr_t dofs,
+                           intptr_t aofs, intptr_t bofs, uint32_t desc)
+{
+    static const int add_insn[4] = {
+        OPC_PADDB, OPC_PADDW, OPC_PADDD, OPC_PADDQ
+    };
+    static const int sub_insn[4] = {
+        OPC_PSUBB, OPC_PSUBW, OPC_PSUBD, OPC_PSUBQ
+    };
+    static const int ssadd_insn[2] = { OPC_PADDSB, OPC_PADDSW };
+    static const int sssub_insn[2] = { OPC_PSUBSB, OPC_PSUBSW };
+    static const int usadd_insn[2] = { OPC_PADDUB, OPC_PADDUW };
+    static const int ussub_insn[2] = { OPC_PSUBUB, OPC_PSUBUW };
+    static const int cmpeq_insn[4] = {
+        OPC_PCMPEQB, OPC_PCMPEQW, OPC_PCMPEQD, OPC_PCMPEQQ
+    };
+    static const int cmpgt_insn[4] = {
+        OPC_PCMPGTB, OPC_PCMPGTW, OPC_PCMPGTD, OPC_PCMPGTQ
+    };
+    unsigned vece = extract32(simd_data(desc), 0, 2);
+    intptr_t oprsz = simd_oprsz(desc);
+    bool swap = false, invert = false;
+    int insn, res;
+    GVecChunk c;
+    intptr_t i;
+
+    switch (opc) {
+    case INDEX_op_gvec_add:
+        insn = add_insn[vece];
+        break;
+    case INDEX_op_gvec_sub:
+        insn = sub_insn[vece];
+        break;
+    case INDEX_op_gvec_ssadd:
+        insn = ssadd_insn[vece];
+        break;
+    case INDEX_op_gvec_sssub:
+        insn = sssub_insn[vece];
+        break;
+    case INDEX_op_gvec_usadd:
+        insn = usadd_insn[vece];
+        break;
+    case INDEX_op_gvec_ussub:
+        insn = ussub_insn[vece];
+        break;
+    case INDEX_op_gvec_and:
+        insn = OPC_PAND;
+        break;
+    case INDEX_op_gvec_or:
+        insn = OPC_POR;
+        break;
+    case INDEX_op_gvec_xor:
+        insn = OPC_PXOR;
+        break;
+    case INDEX_op_gvec_andc:
+        /* PANDN computes ~dst & src.  */
+        insn = OPC_PANDN;
+        swap = true;
+        break;
+    case INDEX_op_gvec_cmp:
+        switch ((TCGCond)(simd_data(desc) >> 2)) {
+        case TCG_COND_EQ:
+            insn = cmpeq_insn[vece];
+            break;
+        case TCG_COND_NE:
+            insn = cmpeq_insn[vece];
+            invert = true;
+            break;
+        case TCG_COND_GT:
+            insn = cmpgt_insn[vece];
+            break;
+        case TCG_COND_LT:
+            insn = cmpgt_insn[vece];
+            swap = true;
+            break;
+        case TCG_COND_LE:
+            insn = cmpgt_insn[vece];
+            invert = true;
+            break;
+        case TCG_COND_GE:
+            insn = cmpgt_insn[vece];
+            swap = invert = true;
+            break;
+        default:
+            g_assert_not_reached();
+        }
+        break;
+    default:
+        g_assert_not_reached();
+    }
+
+    res = (swap ? TCG_VEC_T1 : TCG_VEC_T0);
+    gvec_chunk_init(&c, oprsz);
+    for (i = 0; i < oprsz; i += c.len) {
+        gvec_chunk_next(&c, oprsz - i);
+        tcg_out_vld(s, &c, TCG_VEC_T0, aofs + i);
+        tcg_out_vld(s, &c, TCG_VEC_T1, bofs + i);
+        if (swap) {
+            tcg_out_vop(s, &c, insn, TCG_VEC_T1, TCG_VEC_T1, TCG_VEC_T0);
+        } else {
+            tcg_out_vop(s, &c, insn, TCG_VEC_T0, TCG_VEC_T0, TCG_VEC_T1);
+        }
+        if (invert) {
+            tcg_out_vop(s, &c, OPC_PCMPEQB, TCG_VEC_T2, TCG_VEC_T2,
+                        TCG_VEC_T2);
+            tcg_out_vop(s, &c, OPC_PXOR, res, res, TCG_VEC_T2);
+        }
+        tcg_out_vst(s, &c, res, dofs + i);
+    }
+    gvec_chunk_fini(s, &c);
+}
+
 static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
                               const TCGArg *args, const int *const_args)
 {
@@ -2257,6 +2708,35 @@ static inline void tcg_out_op(TCGContext *s, TCGOpcode opc,
     case INDEX_op_mb:
         tcg_out_mb(s, a0);
         break;
+
+    case INDEX_op_gvec_dup_i32:
+    case INDEX_op_gvec_dup_i64:
+        tcg_out_gvec_dup(s, opc, a0, a1, a2);
+        break;
+    case INDEX_op_gvec_mov:
+    case INDEX_op_gvec_not:
+    case INDEX_op_gvec_neg:
+        tcg_out_gvec_2(s, opc, a0, a1, a2);
+        break;
+    case INDEX_op_gvec_shli:
+    case INDEX_op_gvec_shri:
+    case INDEX_op_gvec_sari:
+        tcg_out_gvec_shift(s, opc, a0, a1, a2, args[3]);
+        break;
+    case INDEX_op_gvec_add:
+    case INDEX_op_gvec_sub:
+    case INDEX_op_gvec_ssadd:
+    case INDEX_op_gvec_sssub:
+    case INDEX_op_gvec_usadd:
+    case INDEX_op_gvec_ussub:
+    case INDEX_op_gvec_and:
+    case INDEX_op_gvec_or:
+    case INDEX_op_gvec_xor:
+    case INDEX_op_gvec_andc:
+    case INDEX_op_gvec_cmp:
+        tcg_out_gvec_3(s, opc, a0, a1, a2, args[3]);
+        break;
+
     case INDEX_op_mov_i32:  /* Always emitted via tcg_out_mov.  */
     case INDEX_op_mov_i64:
     case INDEX_op_movi_i32: /* Always emitted via tcg_out_movi.  */
@@ -2295,6 +2775,8 @@ static const TCGTargetOpDef *tcg_target_op_def(TCGOpcode op)
 
     switch (op) {
     case INDEX_op_goto_ptr:
+    case INDEX_op_gvec_dup_i32:
+    case INDEX_op_gvec_dup_i64:
         return &r;
 
     case INDEX_op_ld8u_i32:
@@ -2613,6 +3095,18 @@ static void tcg_target_init(TCGContext *s)
            need to probe for it.  */
         have_movbe = (c & bit_MOVBE) != 0;
         have_popcnt = (c & bit_POPCNT) != 0;
+        have_sse2 = (d & bit_SSE2) != 0;
+        have_sse41 = (c & bit_SSE4_1) != 0;
+        have_sse42 = (c & bit_SSE4_2) != 0;
+
+        /* AVX2 must be not just available, but usable: the OS must
+           also save the upper halves of the %ymm registers.  */
+        if ((c & bit_OSXSAVE) && (c & bit_AVX) && max >= 7) {
+            int bv;
+            __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+            __cpuid_count(7, 0, a, b, c, d);
+            have_avx2 = (bv & 6) == 6 && (b & bit_AVX2) != 0;
+        }
     }
 
     if (max >= 7) {
@@ -2630,6 +3124,11 @@ static void tcg_target_init(TCGContext *s)
     }
 #endif /* CONFIG_CPUID_H */
 
+    /* SSE2 is part of the x86_64 baseline.  */
+    if (TCG_TARGET_REG_BITS == 64) {
+        have_sse2 = true;
+    }
+
     if (TCG_TARGET_REG_BITS == 64) {
         tcg_target_available_regs[TCG_TYPE_I32] = 0xffff;
         tcg_target_available_regs[TCG_TYPE_I64] = 0xffff;
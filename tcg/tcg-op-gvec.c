@@ -0,0 +1,859 @@
+/*
+ * Generic vector operation expansion
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "cpu.h"
+#include "tcg.h"
+#include "tcg-op.h"
+#include "tcg-op-gvec.h"
+#include "tcg-gvec-desc.h"
+
+/* Above this many 64-bit words we prefer a single out-of-line helper call
+   over an inline expansion with integer operations.  */
+#define MAX_UNROLL  4
+
+typedef void gen_helper_gvec_2(TCGv_ptr, TCGv_ptr, TCGv_i32);
+typedef void gen_helper_gvec_3(TCGv_ptr, TCGv_ptr, TCGv_ptr, TCGv_i32);
+
+/* Expand one 64-bit word of a vector operation inline.  */
+typedef void gen_gvec_i64_2(unsigned, TCGv_i64, TCGv_i64);
+typedef void gen_gvec_i64_3(unsigned, TCGv_i64, TCGv_i64, TCGv_i64);
+
+/* Verify vector size and alignment rules.  OFS should be the OR of all
+   of the operand offsets so that we can check them all at once.  */
+static void check_size_align(uint32_t oprsz, uint32_t maxsz, uint32_t ofs)
+{
+    uint32_t align = maxsz > 8 || oprsz > 8 ? 15 : 7;
+
+    tcg_debug_assert(oprsz > 0);
+    tcg_debug_assert(oprsz <= maxsz);
+    tcg_debug_assert(oprsz == 8 || (oprsz & 15) == 0);
+    tcg_debug_assert((maxsz & align) == 0);
+    tcg_debug_assert((ofs & 7) == 0);
+}
+
+/* Verify that two operands either overlap completely or not at all.  */
+static void check_overlap_2(uint32_t d, uint32_t a, uint32_t s)
+{
+    tcg_debug_assert(d == a || d + s <= a || a + s <= d);
+}
+
+static void check_overlap_3(uint32_t d, uint32_t a, uint32_t b, uint32_t s)
+{
+    check_overlap_2(d, a, s);
+    check_overlap_2(d, b, s);
+    check_overlap_2(a, b, s);
+}
+
+/* Create a descriptor from components.  */
+uint32_t simd_desc(uint32_t oprsz, uint32_t maxsz, int32_t data)
+{
+    uint32_t desc = 0;
+
+    assert(oprsz % 8 == 0 && oprsz <= (8 << SIMD_OPRSZ_BITS));
+    assert(maxsz % 8 == 0 && maxsz <= (8 << SIMD_MAXSZ_BITS));
+    assert(data == sextract32(data, 0, SIMD_DATA_BITS));
+
+    oprsz = (oprsz / 8) - 1;
+    maxsz = (maxsz / 8) - 1;
+    desc = deposit32(desc, SIMD_OPRSZ_SHIFT, SIMD_OPRSZ_BITS, oprsz);
+    desc = deposit32(desc, SIMD_MAXSZ_SHIFT, SIMD_MAXSZ_BITS, maxsz);
+    desc = deposit32(desc, SIMD_DATA_SHIFT, SIMD_DATA_BITS, data);
+
+    return desc;
+}
+
+/* Replicate the low 8 << VECE bits of C across 64 bits.  */
+static uint64_t dup_const(unsigned vece, uint64_t c)
+{
+    switch (vece) {
+    case MO_8:
+        return 0x0101010101010101ull * (uint8_t)c;
+    case MO_16:
+        return 0x0001000100010001ull * (uint16_t)c;
+    case MO_32:
+        return 0x0000000100000001ull * (uint32_t)c;
+    case MO_64:
+        return c;
+    default:
+        g_assert_not_reached();
+    }
+}
+
+/* Return true if the host can perform OPC directly on the vector.  */
+static bool gvec_native(TCGOpcode opc, unsigned vece, uint32_t oprsz)
+{
+    return TCG_TARGET_HAS_gvec && tcg_can_emit_gvec(opc, vece, oprsz);
+}
+
+/* Clear MAXSZ bytes at DOFS.  */
+static void expand_clr(uint32_t dofs, uint32_t maxsz)
+{
+    TCGv_i64 zero;
+    uint32_t i;
+
+    if (maxsz == 0) {
+        return;
+    }
+    zero = tcg_const_i64(0);
+    for (i = 0; i < maxsz; i += 8) {
+        tcg_gen_st_i64(zero, cpu_env, dofs + i);
+    }
+    tcg_temp_free_i64(zero);
+}
+
+/* Generate a call to a gvec-style helper with two vector operands.  */
+static void expand_2_ool(uint32_t dofs, uint32_t aofs, uint32_t oprsz,
+                         uint32_t maxsz, int32_t data, gen_helper_gvec_2 *fn)
+{
+    TCGv_ptr a0 = tcg_temp_new_ptr();
+    TCGv_ptr a1 = tcg_temp_new_ptr();
+    TCGv_i32 desc = tcg_const_i32(simd_desc(oprsz, maxsz, data));
+
+    tcg_gen_addi_ptr(a0, cpu_env, dofs);
+    tcg_gen_addi_ptr(a1, cpu_env, aofs);
+
+    fn(a0, a1, desc);
+
+    tcg_temp_free_ptr(a0);
+    tcg_temp_free_ptr(a1);
+    tcg_temp_free_i32(desc);
+}
+
+/* Generate a call to a gvec-style helper with three vector operands.  */
+static void expand_3_ool(uint32_t dofs, uint32_t aofs, uint32_t bofs,
+                         uint32_t oprsz, uint32_t maxsz, int32_t data,
+                         gen_helper_gvec_3 *fn)
+{
+    TCGv_ptr a0 = tcg_temp_new_ptr();
+    TCGv_ptr a1 = tcg_temp_new_ptr();
+    TCGv_ptr a2 = tcg_temp_new_ptr();
+    TCGv_i32 desc = tcg_const_i32(simd_desc(oprsz, maxsz, data));
+
+    tcg_gen_addi_ptr(a0, cpu_env, dofs);
+    tcg_gen_addi_ptr(a1, cpu_env, aofs);
+    tcg_gen_addi_ptr(a2, cpu_env, bofs);
+
+    fn(a0, a1, a2, desc);
+
+    tcg_temp_free_ptr(a0);
+    tcg_temp_free_ptr(a1);
+    tcg_temp_free_ptr(a2);
+    tcg_temp_free_i32(desc);
+}
+
+/* Expand OPSZ bytes worth of two-operand operations using i64 elements.  */
+static void expand_2_i64(unsigned vece, uint32_t dofs, uint32_t aofs,
+                         uint32_t oprsz, gen_gvec_i64_2 *fni)
+{
+    TCGv_i64 t0 = tcg_temp_new_i64();
+    uint32_t i;
+
+    for (i = 0; i < oprsz; i += 8) {
+        tcg_gen_ld_i64(t0, cpu_env, aofs + i);
+        fni(vece, t0, t0);
+        tcg_gen_st_i64(t0, cpu_env, dofs + i);
+    }
+    tcg_temp_free_i64(t0);
+}
+
+/* Expand OPSZ bytes worth of three-operand operations using i64 elements.  */
+static void expand_3_i64(unsigned vece, uint32_t dofs, uint32_t aofs,
+                         uint32_t bofs, uint32_t oprsz, gen_gvec_i64_3 *fni)
+{
+    TCGv_i64 t0 = tcg_temp_new_i64();
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    uint32_t i;
+
+    for (i = 0; i < oprsz; i += 8) {
+        tcg_gen_ld_i64(t0, cpu_env, aofs + i);
+        tcg_gen_ld_i64(t1, cpu_env, bofs + i);
+        fni(vece, t0, t0, t1);
+        tcg_gen_st_i64(t0, cpu_env, dofs + i);
+    }
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t0);
+}
+
+/* Expand a two-operand operation, preferring in turn the host vector
+   opcode OPC, the inline integer expansion FNI and the helper FNO.
+   FNI may be NULL if there is no reasonable integer expansion.  */
+static void do_gvec_2(unsigned vece, uint32_t dofs, uint32_t aofs,
+                      uint32_t oprsz, uint32_t maxsz, TCGOpcode opc,
+                      gen_gvec_i64_2 *fni, gen_helper_gvec_2 *fno)
+{
+    check_size_align(oprsz, maxsz, dofs | aofs);
+    check_overlap_2(dofs, aofs, maxsz);
+
+    if (gvec_native(opc, vece, oprsz)) {
+        tcg_gen_op3(opc, dofs, aofs, simd_desc(oprsz, oprsz, vece));
+    } else if (fni && oprsz <= MAX_UNROLL * 8) {
+        expand_2_i64(vece, dofs, aofs, oprsz, fni);
+    } else {
+        expand_2_ool(dofs, aofs, oprsz, maxsz, 0, fno);
+        return;
+    }
+    expand_clr(dofs + oprsz, maxsz - oprsz);
+}
+
+/* As above, for three-operand operations.  */
+static void do_gvec_3(unsigned vece, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz, uint32_t maxsz,
+                      TCGOpcode opc, gen_gvec_i64_3 *fni,
+                      gen_helper_gvec_3 *fno)
+{
+    check_size_align(oprsz, maxsz, dofs | aofs | bofs);
+    check_overlap_3(dofs, aofs, bofs, maxsz);
+
+    if (gvec_native(opc, vece, oprsz)) {
+        tcg_gen_op4(opc, dofs, aofs, bofs, simd_desc(oprsz, oprsz, vece));
+    } else if (fni && oprsz <= MAX_UNROLL * 8) {
+        expand_3_i64(vece, dofs, aofs, bofs, oprsz, fni);
+    } else {
+        expand_3_ool(dofs, aofs, bofs, oprsz, maxsz, 0, fno);
+        return;
+    }
+    expand_clr(dofs + oprsz, maxsz - oprsz);
+}
+
+/*
+ * Inline expansions on 64-bit words.  For elements narrower than 64 bits
+ * the carries are kept from crossing element boundaries by computing
+ * the most significant bit of each element separately.
+ */
+
+static void gen_mov_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a)
+{
+    tcg_gen_mov_i64(d, a);
+}
+
+static void gen_not_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a)
+{
+    tcg_gen_not_i64(d, a);
+}
+
+static void gen_neg_i64(unsigned vece, TCGv_i64 d, TCGv_i64 b)
+{
+    TCGv_i64 m, t2, t3;
+
+    if (vece == MO_64) {
+        tcg_gen_neg_i64(d, b);
+        return;
+    }
+
+    m = tcg_const_i64(dup_const(vece, 1ull << ((8 << vece) - 1)));
+    t2 = tcg_temp_new_i64();
+    t3 = tcg_temp_new_i64();
+
+    tcg_gen_andc_i64(t3, m, b);
+    tcg_gen_andc_i64(t2, b, m);
+    tcg_gen_sub_i64(d, m, t2);
+    tcg_gen_xor_i64(d, d, t3);
+
+    tcg_temp_free_i64(m);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t3);
+}
+
+static void gen_add_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    TCGv_i64 m, t1, t2, t3;
+
+    if (vece == MO_64) {
+        tcg_gen_add_i64(d, a, b);
+        return;
+    }
+
+    m = tcg_const_i64(dup_const(vece, 1ull << ((8 << vece) - 1)));
+    t1 = tcg_temp_new_i64();
+    t2 = tcg_temp_new_i64();
+    t3 = tcg_temp_new_i64();
+
+    tcg_gen_andc_i64(t1, a, m);
+    tcg_gen_andc_i64(t2, b, m);
+    tcg_gen_xor_i64(t3, a, b);
+    tcg_gen_add_i64(d, t1, t2);
+    tcg_gen_and_i64(t3, t3, m);
+    tcg_gen_xor_i64(d, d, t3);
+
+    tcg_temp_free_i64(m);
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t3);
+}
+
+static void gen_sub_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    TCGv_i64 m, t1, t2, t3;
+
+    if (vece == MO_64) {
+        tcg_gen_sub_i64(d, a, b);
+        return;
+    }
+
+    m = tcg_const_i64(dup_const(vece, 1ull << ((8 << vece) - 1)));
+    t1 = tcg_temp_new_i64();
+    t2 = tcg_temp_new_i64();
+    t3 = tcg_temp_new_i64();
+
+    tcg_gen_or_i64(t1, a, m);
+    tcg_gen_andc_i64(t2, b, m);
+    tcg_gen_eqv_i64(t3, a, b);
+    tcg_gen_sub_i64(d, t1, t2);
+    tcg_gen_and_i64(t3, t3, m);
+    tcg_gen_xor_i64(d, d, t3);
+
+    tcg_temp_free_i64(m);
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t2);
+    tcg_temp_free_i64(t3);
+}
+
+static void gen_and_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_and_i64(d, a, b);
+}
+
+static void gen_or_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_or_i64(d, a, b);
+}
+
+static void gen_xor_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_xor_i64(d, a, b);
+}
+
+static void gen_andc_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_andc_i64(d, a, b);
+}
+
+static void gen_orc_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, TCGv_i64 b)
+{
+    tcg_gen_orc_i64(d, a, b);
+}
+
+void tcg_gen_gvec_mov(unsigned vece, uint32_t dofs, uint32_t aofs,
+                      uint32_t oprsz, uint32_t maxsz)
+{
+    if (dofs == aofs) {
+        check_size_align(oprsz, maxsz, dofs);
+        expand_clr(dofs + oprsz, maxsz - oprsz);
+        return;
+    }
+    do_gvec_2(MO_64, dofs, aofs, oprsz, maxsz, INDEX_op_gvec_mov,
+              gen_mov_i64, gen_helper_gvec_mov);
+}
+
+void tcg_gen_gvec_not(unsigned vece, uint32_t dofs, uint32_t aofs,
+                      uint32_t oprsz, uint32_t maxsz)
+{
+    do_gvec_2(MO_64, dofs, aofs, oprsz, maxsz, INDEX_op_gvec_not,
+              gen_not_i64, gen_helper_gvec_not);
+}
+
+void tcg_gen_gvec_neg(unsigned vece, uint32_t dofs, uint32_t aofs,
+                      uint32_t oprsz, uint32_t maxsz)
+{
+    static gen_helper_gvec_2 * const fns[4] = {
+        gen_helper_gvec_neg8, gen_helper_gvec_neg16,
+        gen_helper_gvec_neg32, gen_helper_gvec_neg64,
+    };
+
+    tcg_debug_assert(vece <= MO_64);
+    do_gvec_2(vece, dofs, aofs, oprsz, maxsz, INDEX_op_gvec_neg,
+              gen_neg_i64, fns[vece]);
+}
+
+void tcg_gen_gvec_add(unsigned vece, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz, uint32_t maxsz)
+{
+    static gen_helper_gvec_3 * const fns[4] = {
+        gen_helper_gvec_add8, gen_helper_gvec_add16,
+        gen_helper_gvec_add32, gen_helper_gvec_add64,
+    };
+
+    tcg_debug_assert(vece <= MO_64);
+    do_gvec_3(vece, dofs, aofs, bofs, oprsz, maxsz, INDEX_op_gvec_add,
+              gen_add_i64, fns[vece]);
+}
+
+void tcg_gen_gvec_sub(unsigned vece, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz, uint32_t maxsz)
+{
+    static gen_helper_gvec_3 * const fns[4] = {
+        gen_helper_gvec_sub8, gen_helper_gvec_sub16,
+        gen_helper_gvec_sub32, gen_helper_gvec_sub64,
+    };
+
+    tcg_debug_assert(vece <= MO_64);
+    do_gvec_3(vece, dofs, aofs, bofs, oprsz, maxsz, INDEX_op_gvec_sub,
+              gen_sub_i64, fns[vece]);
+}
+
+void tcg_gen_gvec_ssadd(unsigned vece, uint32_t dofs, uint32_t aofs,
+                        uint32_t bofs, uint32_t oprsz, uint32_t maxsz)
+{
+    static gen_helper_gvec_3 * const fns[4] = {
+        gen_helper_gvec_ssadd8, gen_helper_gvec_ssadd16,
+        gen_helper_gvec_ssadd32, gen_helper_gvec_ssadd64,
+    };
+
+    tcg_debug_assert(vece <= MO_64);
+    do_gvec_3(vece, dofs, aofs, bofs, oprsz, maxsz, INDEX_op_gvec_ssadd,
+              NULL, fns[vece]);
+}
+
+void tcg_gen_gvec_sssub(unsigned vece, uint32_t dofs, uint32_t aofs,
+                        uint32_t bofs, uint32_t oprsz, uint32_t maxsz)
+{
+    static gen_helper_gvec_3 * const fns[4] = {
+        gen_helper_gvec_sssub8, gen_helper_gvec_sssub16,
+        gen_helper_gvec_sssub32, gen_helper_gvec_sssub64,
+    };
+
+    tcg_debug_assert(vece <= MO_64);
+    do_gvec_3(vece, dofs, aofs, bofs, oprsz, maxsz, INDEX_op_gvec_sssub,
+              NULL, fns[vece]);
+}
+
+void tcg_gen_gvec_usadd(unsigned vece, uint32_t dofs, uint32_t aofs,
+                        uint32_t bofs, uint32_t oprsz, uint32_t maxsz)
+{
+    static gen_helper_gvec_3 * const fns[4] = {
+        gen_helper_gvec_usadd8, gen_helper_gvec_usadd16,
+        gen_helper_gvec_usadd32, gen_helper_gvec_usadd64,
+    };
+
+    tcg_debug_assert(vece <= MO_64);
+    do_gvec_3(vece, dofs, aofs, bofs, oprsz, maxsz, INDEX_op_gvec_usadd,
+              NULL, fns[vece]);
+}
+
+void tcg_gen_gvec_ussub(unsigned vece, uint32_t dofs, uint32_t aofs,
+                        uint32_t bofs, uint32_t oprsz, uint32_t maxsz)
+{
+    static gen_helper_gvec_3 * const fns[4] = {
+        gen_helper_gvec_ussub8, gen_helper_gvec_ussub16,
+        gen_helper_gvec_ussub32, gen_helper_gvec_ussub64,
+    };
+
+    tcg_debug_assert(vece <= MO_64);
+    do_gvec_3(vece, dofs, aofs, bofs, oprsz, maxsz, INDEX_op_gvec_ussub,
+              NULL, fns[vece]);
+}
+
+void tcg_gen_gvec_and(unsigned vece, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz, uint32_t maxsz)
+{
+    do_gvec_3(MO_64, dofs, aofs, bofs, oprsz, maxsz, INDEX_op_gvec_and,
+              gen_and_i64, gen_helper_gvec_and);
+}
+
+void tcg_gen_gvec_or(unsigned vece, uint32_t dofs, uint32_t aofs,
+                     uint32_t bofs, uint32_t oprsz, uint32_t maxsz)
+{
+    do_gvec_3(MO_64, dofs, aofs, bofs, oprsz, maxsz, INDEX_op_gvec_or,
+              gen_or_i64, gen_helper_gvec_or);
+}
+
+void tcg_gen_gvec_xor(unsigned vece, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz, uint32_t maxsz)
+{
+    do_gvec_3(MO_64, dofs, aofs, bofs, oprsz, maxsz, INDEX_op_gvec_xor,
+              gen_xor_i64, gen_helper_gvec_xor);
+}
+
+void tcg_gen_gvec_andc(unsigned vece, uint32_t dofs, uint32_t aofs,
+                       uint32_t bofs, uint32_t oprsz, uint32_t maxsz)
+{
+    do_gvec_3(MO_64, dofs, aofs, bofs, oprsz, maxsz, INDEX_op_gvec_andc,
+              gen_andc_i64, gen_helper_gvec_andc);
+}
+
+void tcg_gen_gvec_orc(unsigned vece, uint32_t dofs, uint32_t aofs,
+                      uint32_t bofs, uint32_t oprsz, uint32_t maxsz)
+{
+    /* There is no host vector orc; INDEX_op_discard is never native.  */
+    do_gvec_3(MO_64, dofs, aofs, bofs, oprsz, maxsz, INDEX_op_discard,
+              gen_orc_i64, gen_helper_gvec_orc);
+}
+
+/* Store the replicated 64-bit value IN to OPRSZ bytes at DOFS.  */
+static void expand_dup_st_i64(uint32_t dofs, uint32_t oprsz, TCGv_i64 in)
+{
+    uint32_t i;
+
+    for (i = 0; i < oprsz; i += 8) {
+        tcg_gen_st_i64(in, cpu_env, dofs + i);
+    }
+}
+
+/* Replicate the low 8 << VECE bits of IN across the 64-bit OUT.  */
+static void gen_dup_i64(unsigned vece, TCGv_i64 out, TCGv_i64 in)
+{
+    switch (vece) {
+    case MO_8:
+        tcg_gen_ext8u_i64(out, in);
+        tcg_gen_muli_i64(out, out, dup_const(MO_8, 1));
+        break;
+    case MO_16:
+        tcg_gen_ext16u_i64(out, in);
+        tcg_gen_muli_i64(out, out, dup_const(MO_16, 1));
+        break;
+    case MO_32:
+        tcg_gen_deposit_i64(out, in, in, 32, 32);
+        break;
+    case MO_64:
+        tcg_gen_mov_i64(out, in);
+        break;
+    default:
+        g_assert_not_reached();
+    }
+}
+
+void tcg_gen_gvec_dup_i64(unsigned vece, uint32_t dofs, uint32_t oprsz,
+                          uint32_t maxsz, TCGv_i64 in)
+{
+    check_size_align(oprsz, maxsz, dofs);
+    tcg_debug_assert(vece <= MO_64);
+
+    if (TCG_TARGET_REG_BITS == 64
+        && gvec_native(INDEX_op_gvec_dup_i64, vece, oprsz)) {
+        tcg_gen_op3(INDEX_op_gvec_dup_i64, tcgv_i64_arg(in), dofs,
+                    simd_desc(oprsz, oprsz, vece));
+    } else if (oprsz <= MAX_UNROLL * 8) {
+        TCGv_i64 t = tcg_temp_new_i64();
+
+        gen_dup_i64(vece, t, in);
+        expand_dup_st_i64(dofs, oprsz, t);
+        tcg_temp_free_i64(t);
+    } else {
+        TCGv_ptr a0 = tcg_temp_new_ptr();
+        TCGv_i32 desc = tcg_const_i32(simd_desc(oprsz, maxsz, 0));
+        TCGv_i64 t = tcg_temp_new_i64();
+
+        gen_dup_i64(vece, t, in);
+        tcg_gen_addi_ptr(a0, cpu_env, dofs);
+        gen_helper_gvec_dup64(a0, desc, t);
+
+        tcg_temp_free_i64(t);
+        tcg_temp_free_i32(desc);
+        tcg_temp_free_ptr(a0);
+        return;
+    }
+    expand_clr(dofs + oprsz, maxsz - oprsz);
+}
+
+void tcg_gen_gvec_dup_i32(unsigned vece, uint32_t dofs, uint32_t oprsz,
+                          uint32_t maxsz, TCGv_i32 in)
+{
+    TCGv_i64 t;
+
+    check_size_align(oprsz, maxsz, dofs);
+    tcg_debug_assert(vece <= MO_32);
+
+    if (gvec_native(INDEX_op_gvec_dup_i32, vece, oprsz)) {
+        tcg_gen_op3(INDEX_op_gvec_dup_i32, tcgv_i32_arg(in), dofs,
+                    simd_desc(oprsz, oprsz, vece));
+        expand_clr(dofs + oprsz, maxsz - oprsz);
+        return;
+    }
+
+    t = tcg_temp_new_i64();
+    tcg_gen_extu_i32_i64(t, in);
+    tcg_gen_gvec_dup_i64(vece, dofs, oprsz, maxsz, t);
+    tcg_temp_free_i64(t);
+}
+
+void tcg_gen_gvec_dup_mem(unsigned vece, uint32_t dofs, uint32_t aofs,
+                          uint32_t oprsz, uint32_t maxsz)
+{
+    TCGv_i64 t = tcg_temp_new_i64();
+
+    switch (vece) {
+    case MO_8:
+        tcg_gen_ld8u_i64(t, cpu_env, aofs);
+        break;
+    case MO_16:
+        tcg_gen_ld16u_i64(t, cpu_env, aofs);
+        break;
+    case MO_32:
+        tcg_gen_ld32u_i64(t, cpu_env, aofs);
+        break;
+    default:
+        tcg_gen_ld_i64(t, cpu_env, aofs);
+        break;
+    }
+    tcg_gen_gvec_dup_i64(vece, dofs, oprsz, maxsz, t);
+    tcg_temp_free_i64(t);
+}
+
+void tcg_gen_gvec_dupi(unsigned vece, uint32_t dofs, uint32_t oprsz,
+                       uint32_t maxsz, uint64_t x)
+{
+    TCGv_i64 t = tcg_const_i64(dup_const(vece, x));
+
+    /* The replicated constant is already built, so only the size of the
+       vector decides between inline stores and the helper.  */
+    tcg_gen_gvec_dup_i64(MO_64, dofs, oprsz, maxsz, t);
+    tcg_temp_free_i64(t);
+}
+
+/* Expand a shift by immediate.  FNI operates on one 64-bit word.  */
+static void do_gvec_shift(unsigned vece, uint32_t dofs, uint32_t aofs,
+                          int64_t shift, uint32_t oprsz, uint32_t maxsz,
+                          TCGOpcode opc,
+                          void (*fni)(unsigned, TCGv_i64, TCGv_i64, int64_t),
+                          gen_helper_gvec_2 *fno)
+{
+    check_size_align(oprsz, maxsz, dofs | aofs);
+    check_overlap_2(dofs, aofs, maxsz);
+    tcg_debug_assert(shift >= 0 && shift < (8 << vece));
+
+    if (shift == 0) {
+        tcg_gen_gvec_mov(vece, dofs, aofs, oprsz, maxsz);
+        return;
+    }
+
+    if (gvec_native(opc, vece, oprsz)) {
+        tcg_gen_op4(opc, dofs, aofs, shift, simd_desc(oprsz, oprsz, vece));
+    } else if (fni && oprsz <= MAX_UNROLL * 8) {
+        TCGv_i64 t0 = tcg_temp_new_i64();
+        uint32_t i;
+
+        for (i = 0; i < oprsz; i += 8) {
+            tcg_gen_ld_i64(t0, cpu_env, aofs + i);
+            fni(vece, t0, t0, shift);
+            tcg_gen_st_i64(t0, cpu_env, dofs + i);
+        }
+        tcg_temp_free_i64(t0);
+    } else {
+        expand_2_ool(dofs, aofs, oprsz, maxsz, shift, fno);
+        return;
+    }
+    expand_clr(dofs + oprsz, maxsz - oprsz);
+}
+
+static void gen_shli_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, int64_t c)
+{
+    int bits = 8 << vece;
+
+    tcg_gen_shli_i64(d, a, c);
+    if (vece != MO_64) {
+        tcg_gen_andi_i64(d, d, dup_const(vece, MAKE_64BIT_MASK(c, bits - c)));
+    }
+}
+
+static void gen_shri_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, int64_t c)
+{
+    int bits = 8 << vece;
+
+    tcg_gen_shri_i64(d, a, c);
+    if (vece != MO_64) {
+        tcg_gen_andi_i64(d, d, dup_const(vece, MAKE_64BIT_MASK(0, bits - c)));
+    }
+}
+
+static void gen_sari_i64(unsigned vece, TCGv_i64 d, TCGv_i64 a, int64_t c)
+{
+    int bits = 8 << vece;
+    uint64_t s_mask, c_mask;
+    TCGv_i64 s;
+
+    if (vece == MO_64) {
+        tcg_gen_sari_i64(d, a, c);
+        return;
+    }
+
+    s_mask = dup_const(vece, (1ull << (bits - 1)) >> c);
+    c_mask = dup_const(vece, MAKE_64BIT_MASK(0, bits - c));
+    s = tcg_temp_new_i64();
+
+    tcg_gen_shri_i64(d, a, c);
+    tcg_gen_andi_i64(s, d, s_mask);         /* isolate (shifted) sign bit */
+    tcg_gen_muli_i64(s, s, (2 << c) - 2);   /* replicate isolated signs */
+    tcg_gen_andi_i64(d, d, c_mask);         /* clear out bits above sign */
+    tcg_gen_or_i64(d, d, s);                /* include sign extension */
+
+    tcg_temp_free_i64(s);
+}
+
+void tcg_gen_gvec_shli(unsigned vece, uint32_t dofs, uint32_t aofs,
+                       int64_t shift, uint32_t oprsz, uint32_t maxsz)
+{
+    static gen_helper_gvec_2 * const fns[4] = {
+        gen_helper_gvec_shl8i, gen_helper_gvec_shl16i,
+        gen_helper_gvec_shl32i, gen_helper_gvec_shl64i,
+    };
+
+    tcg_debug_assert(vece <= MO_64);
+    do_gvec_shift(vece, dofs, aofs, shift, oprsz, maxsz, INDEX_op_gvec_shli,
+                  gen_shli_i64, fns[vece]);
+}
+
+void tcg_gen_gvec_shri(unsigned vece, uint32_t dofs, uint32_t aofs,
+                       int64_t shift, uint32_t oprsz, uint32_t maxsz)
+{
+    static gen_helper_gvec_2 * const fns[4] = {
+        gen_helper_gvec_shr8i, gen_helper_gvec_shr16i,
+        gen_helper_gvec_shr32i, gen_helper_gvec_shr64i,
+    };
+
+    tcg_debug_assert(vece <= MO_64);
+    do_gvec_shift(vece, dofs, aofs, shift, oprsz, maxsz, INDEX_op_gvec_shri,
+                  gen_shri_i64, fns[vece]);
+}
+
+void tcg_gen_gvec_sari(unsigned vece, uint32_t dofs, uint32_t aofs,
+                       int64_t shift, uint32_t oprsz, uint32_t maxsz)
+{
+    static gen_helper_gvec_2 * const fns[4] = {
+        gen_helper_gvec_sar8i, gen_helper_gvec_sar16i,
+        gen_helper_gvec_sar32i, gen_helper_gvec_sar64i,
+    };
+
+    tcg_debug_assert(vece <= MO_64);
+    do_gvec_shift(vece, dofs, aofs, shift, oprsz, maxsz, INDEX_op_gvec_sari,
+                  gen_sari_i64, fns[vece]);
+}
+
+/* Expand a comparison one element at a time.  */
+static void expand_cmp_i64(TCGCond cond, unsigned vece, uint32_t dofs,
+                           uint32_t aofs, uint32_t bofs, uint32_t oprsz)
+{
+    TCGv_i64 t0 = tcg_temp_new_i64();
+    TCGv_i64 t1 = tcg_temp_new_i64();
+    uint32_t i;
+
+    for (i = 0; i < oprsz; i += 1 << vece) {
+        if (vece == MO_64) {
+            tcg_gen_ld_i64(t0, cpu_env, aofs + i);
+            tcg_gen_ld_i64(t1, cpu_env, bofs + i);
+        } else if (is_unsigned_cond(cond)) {
+            tcg_gen_ld32u_i64(t0, cpu_env, aofs + i);
+            tcg_gen_ld32u_i64(t1, cpu_env, bofs + i);
+        } else {
+            tcg_gen_ld32s_i64(t0, cpu_env, aofs + i);
+            tcg_gen_ld32s_i64(t1, cpu_env, bofs + i);
+        }
+        tcg_gen_setcond_i64(cond, t0, t0, t1);
+        tcg_gen_neg_i64(t0, t0);
+        if (vece == MO_64) {
+            tcg_gen_st_i64(t0, cpu_env, dofs + i);
+        } else {
+            tcg_gen_st32_i64(t0, cpu_env, dofs + i);
+        }
+    }
+    tcg_temp_free_i64(t1);
+    tcg_temp_free_i64(t0);
+}
+
+void tcg_gen_gvec_cmp(TCGCond cond, unsigned vece, uint32_t dofs,
+                      uint32_t aofs, uint32_t bofs,
+                      uint32_t oprsz, uint32_t maxsz)
+{
+    static gen_helper_gvec_3 * const eq_fn[4] = {
+        gen_helper_gvec_eq8, gen_helper_gvec_eq16,
+        gen_helper_gvec_eq32, gen_helper_gvec_eq64
+    };
+    static gen_helper_gvec_3 * const ne_fn[4] = {
+        gen_helper_gvec_ne8, gen_helper_gvec_ne16,
+        gen_helper_gvec_ne32, gen_helper_gvec_ne64
+    };
+    static gen_helper_gvec_3 * const lt_fn[4] = {
+        gen_helper_gvec_lt8, gen_helper_gvec_lt16,
+        gen_helper_gvec_lt32, gen_helper_gvec_lt64
+    };
+    static gen_helper_gvec_3 * const le_fn[4] = {
+        gen_helper_gvec_le8, gen_helper_gvec_le16,
+        gen_helper_gvec_le32, gen_helper_gvec_le64
+    };
+    static gen_helper_gvec_3 * const ltu_fn[4] = {
+        gen_helper_gvec_ltu8, gen_helper_gvec_ltu16,
+        gen_helper_gvec_ltu32, gen_helper_gvec_ltu64
+    };
+    static gen_helper_gvec_3 * const leu_fn[4] = {
+        gen_helper_gvec_leu8, gen_helper_gvec_leu16,
+        gen_helper_gvec_leu32, gen_helper_gvec_leu64
+    };
+    gen_helper_gvec_3 * const *fns;
+    uint32_t tmp;
+
+    check_size_align(oprsz, maxsz, dofs | aofs | bofs);
+    check_overlap_3(dofs, aofs, bofs, maxsz);
+    tcg_debug_assert(vece <= MO_64);
+
+    if (cond == TCG_COND_NEVER || cond == TCG_COND_ALWAYS) {
+        tcg_gen_gvec_dupi(MO_8, dofs, oprsz, maxsz,
+                          -(cond == TCG_COND_ALWAYS));
+        return;
+    }
+
+    if (!is_unsigned_cond(cond) && gvec_native(INDEX_op_gvec_cmp,
+                                               vece, oprsz)) {
+        tcg_gen_op4(INDEX_op_gvec_cmp, dofs, aofs, bofs,
+                    simd_desc(oprsz, oprsz, vece | (cond << 2)));
+        expand_clr(dofs + oprsz, maxsz - oprsz);
+        return;
+    }
+
+    if (vece >= MO_32 && (oprsz >> vece) <= MAX_UNROLL) {
+        expand_cmp_i64(cond, vece, dofs, aofs, bofs, oprsz);
+        expand_clr(dofs + oprsz, maxsz - oprsz);
+        return;
+    }
+
+    /* The helpers only implement the "less than" sense of each test.  */
+    switch (cond) {
+    case TCG_COND_GT:
+    case TCG_COND_GE:
+    case TCG_COND_GTU:
+    case TCG_COND_GEU:
+        tmp = aofs, aofs = bofs, bofs = tmp;
+        cond = tcg_swap_cond(cond);
+        break;
+    default:
+        break;
+    }
+
+    switch (cond) {
+    case TCG_COND_EQ:
+        fns = eq_fn;
+        break;
+    case TCG_COND_NE:
+        fns = ne_fn;
+        break;
+    case TCG_COND_LT:
+        fns = lt_fn;
+        break;
+    case TCG_COND_LE:
+        fns = le_fn;
+        break;
+    case TCG_COND_LTU:
+        fns = ltu_fn;
+        break;
+    case TCG_COND_LEU:
+        fns = leu_fn;
+        break;
+    default:
+        g_assert_not_reached();
+    }
+    expand_3_ool(dofs, aofs, bofs, oprsz, maxsz, 0, fns[vece]);
+}
@@ -185,6 +185,32 @@ DEF(muls2_i64, 2, 2, 0, IMPL64 | IMPL(TCG_TARGET_HAS_muls2_i64))
 DEF(muluh_i64, 1, 2, 0, IMPL(TCG_TARGET_HAS_muluh_i64))
 DEF(mulsh_i64, 1, 2, 0, IMPL(TCG_TARGET_HAS_mulsh_i64))
 
+/* Host vector operations on ENV-relative memory, see tcg-op-gvec.c.
+   The constant arguments are the destination offset, the source offsets
+   (or the shift count) and a simd_desc() whose data field holds the
+   element size and, for cmp, the condition shifted left by 2.  */
+#define IMPLGVEC  (TCG_OPF_SIDE_EFFECTS | IMPL(TCG_TARGET_HAS_gvec))
+
+DEF(gvec_mov, 0, 0, 3, IMPLGVEC)
+DEF(gvec_not, 0, 0, 3, IMPLGVEC)
+DEF(gvec_neg, 0, 0, 3, IMPLGVEC)
+DEF(gvec_dup_i32, 0, 1, 2, IMPLGVEC)
+DEF(gvec_dup_i64, 0, 1, 2, IMPLGVEC | IMPL64)
+DEF(gvec_add, 0, 0, 4, IMPLGVEC)
+DEF(gvec_sub, 0, 0, 4, IMPLGVEC)
+DEF(gvec_ssadd, 0, 0, 4, IMPLGVEC)
+DEF(gvec_sssub, 0, 0, 4, IMPLGVEC)
+DEF(gvec_usadd, 0, 0, 4, IMPLGVEC)
+DEF(gvec_ussub, 0, 0, 4, IMPLGVEC)
+DEF(gvec_and, 0, 0, 4, IMPLGVEC)
+DEF(gvec_or, 0, 0, 4, IMPLGVEC)
+DEF(gvec_xor, 0, 0, 4, IMPLGVEC)
+DEF(gvec_andc, 0, 0, 4, IMPLGVEC)
+DEF(gvec_cmp, 0, 0, 4, IMPLGVEC)
+DEF(gvec_shli, 0, 0, 4, IMPLGVEC)
+DEF(gvec_shri, 0, 0, 4, IMPLGVEC)
+DEF(gvec_sari, 0, 0, 4, IMPLGVEC)
+
 #define TLADDR_ARGS  (TARGET_LONG_BITS <= TCG_TARGET_REG_BITS ? 1 : 2)
 #define DATA64_ARGS  (TCG_TARGET_REG_BITS == 64 ? 1 : 2)
 
@@ -208,4 +234,5 @@ DEF(qemu_st_i64, 0, TLADDR_ARGS + DATA64_ARGS, 1,
 #undef DATA64_ARGS
 #undef IMPL
 #undef IMPL64
+#undef IMPLGVEC
 #undef DEF
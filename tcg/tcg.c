@@ -44,6 +44,7 @@
 #include "exec/exec-all.h"
 
 #include "tcg-op.h"
+#include "tcg-gvec-desc.h"
 
 #if UINTPTR_MAX == UINT32_MAX
 # define ELF_CLASS  ELFCLASS32
@@ -284,6 +285,13 @@ TCGLabel *gen_new_label(void)
 
 #include "tcg-target.inc.c"
 
+#if !TCG_TARGET_MAYBE_gvec
+bool tcg_can_emit_gvec(TCGOpcode opc, unsigned vece, uint32_t oprsz)
+{
+    return false;
+}
+#endif
+
 static void tcg_region_bounds(size_t curr_region, void **pstart, void **pend)
 {
     void *start, *end;
@@ -1293,6 +1301,28 @@ bool tcg_op_supported(TCGOpcode op)
     case INDEX_op_mulsh_i64:
         return TCG_TARGET_HAS_mulsh_i64;
 
+    case INDEX_op_gvec_mov:
+    case INDEX_op_gvec_not:
+    case INDEX_op_gvec_neg:
+    case INDEX_op_gvec_dup_i32:
+    case INDEX_op_gvec_add:
+    case INDEX_op_gvec_sub:
+    case INDEX_op_gvec_ssadd:
+    case INDEX_op_gvec_sssub:
+    case INDEX_op_gvec_usadd:
+    case INDEX_op_gvec_ussub:
+    case INDEX_op_gvec_and:
+    case INDEX_op_gvec_or:
+    case INDEX_op_gvec_xor:
+    case INDEX_op_gvec_andc:
+    case INDEX_op_gvec_cmp:
+    case INDEX_op_gvec_shli:
+    case INDEX_op_gvec_shri:
+    case INDEX_op_gvec_sari:
+        return TCG_TARGET_HAS_gvec;
+    case INDEX_op_gvec_dup_i64:
+        return TCG_TARGET_REG_BITS == 64 && TCG_TARGET_HAS_gvec;
+
     case NB_OPS:
         break;
     }
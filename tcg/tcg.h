@@ -137,6 +137,16 @@ typedef uint64_t TCGRegSet;
 #define TCG_TARGET_HAS_sub2_i32         1
 #endif
 
+/* Backends that may expand generic vector operations inline define
+   TCG_TARGET_MAYBE_gvec, and TCG_TARGET_HAS_gvec to a runtime test
+   of the host CPU.  */
+#ifndef TCG_TARGET_MAYBE_gvec
+#define TCG_TARGET_MAYBE_gvec           0
+#endif
+#if !TCG_TARGET_MAYBE_gvec
+#define TCG_TARGET_HAS_gvec             0
+#endif
+
 #ifndef TCG_TARGET_deposit_i32_valid
 #define TCG_TARGET_deposit_i32_valid(ofs, len) 1
 #endif
@@ -797,7 +807,7 @@ static inline bool tcg_op_buf_full(void)
 
 /* pool based memory allocation */
 
-/* user-mode: tb_lock must be held for tcg_malloc_internal. */
+/* user-mode: mmap_lock must be held for tcg_malloc_internal. */
 void *tcg_malloc_internal(TCGContext *s, int size);
 void tcg_pool_reset(TCGContext *s);
 TranslationBlock *tcg_tb_alloc(TCGContext *s);
@@ -808,7 +818,7 @@ void tcg_region_reset_all(void);
 size_t tcg_code_size(void);
 size_t tcg_code_capacity(void);
 
-/* user-mode: Called with tb_lock held.  */
+/* user-mode: Called with mmap_lock held.  */
 static inline void *tcg_malloc(int size)
 {
     TCGContext *s = tcg_ctx;
@@ -974,6 +984,11 @@ static inline TCGv_i64 TCGV_PTR_TO_NAT(TCGv_ptr n) { return (TCGv_i64)n; }
 
 bool tcg_op_supported(TCGOpcode op);
 
+/* Return true if the backend can expand the INDEX_op_gvec_* opcode OPC
+   on OPRSZ bytes with elements of size 1 << VECE.  For INDEX_op_gvec_cmp
+   only the signed and equality conditions are considered.  */
+bool tcg_can_emit_gvec(TCGOpcode opc, unsigned vece, uint32_t oprsz);
+
 void tcg_gen_callN(void *func, TCGTemp *ret, int nargs, TCGTemp **args);
 
 void tcg_op_remove(TCGContext *s, TCGOp *op);
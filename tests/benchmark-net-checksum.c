@@ -0,0 +1,52 @@
+/*
+ * QEMU internet checksum speed benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "net/checksum.h"
+
+static void test_checksum_speed(const void *opaque)
+{
+    size_t chunk_size = (size_t)opaque;
+    uint8_t *in;
+    double total = 0.0;
+    uint32_t sum = 0;
+
+    in = g_new0(uint8_t, chunk_size);
+    memset(in, g_test_rand_int(), chunk_size);
+
+    g_test_timer_start();
+    do {
+        sum += net_checksum_add(chunk_size, in);
+        total += chunk_size;
+    } while (g_test_timer_elapsed() < 5.0);
+
+    total /= 1024 * 1024; /* to MB */
+    g_print("checksum %04x: ", net_checksum_finish(sum));
+    g_print("Testing chunk_size %zu bytes ", chunk_size);
+    g_print("done: %.2f MB in %.2f secs: ", total, g_test_timer_last());
+    g_print("%.2f MB/sec\n", total / g_test_timer_last());
+
+    g_free(in);
+}
+
+int main(int argc, char **argv)
+{
+    size_t i;
+    char name[64];
+
+    g_test_init(&argc, &argv, NULL);
+
+    for (i = 64; i <= 64 * 1024; i *= 4) {
+        snprintf(name, sizeof(name), "/net/checksum/speed-%zu", i);
+        g_test_add_data_func(name, (void *)i, test_checksum_speed);
+    }
+    snprintf(name, sizeof(name), "/net/checksum/speed-%d", 1500);
+    g_test_add_data_func(name, (void *)(size_t)1500, test_checksum_speed);
+
+    return g_test_run();
+}
@@ -0,0 +1,293 @@
+/*
+ * libqos virtio PCI modern (virtio 1.0) driver
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "libqtest.h"
+#include "libqos/virtio.h"
+#include "libqos/virtio-pci.h"
+#include "libqos/pci.h"
+#include "libqos/malloc.h"
+#include "standard-headers/linux/virtio_config.h"
+#include "standard-headers/linux/virtio_ring.h"
+#include "standard-headers/linux/virtio_pci.h"
+
+#include "hw/pci/pci.h"
+#include "hw/pci/pci_regs.h"
+
+/* The device configuration space is always little-endian in virtio 1.0 */
+
+static uint8_t qvirtio_pci_modern_config_readb(QVirtioDevice *d, uint64_t off)
+{
+    QVirtioPCIDevice *dev = (QVirtioPCIDevice *)d;
+    return qpci_io_readb(dev->pdev, dev->bar, dev->device_cfg_offset + off);
+}
+
+static uint16_t qvirtio_pci_modern_config_readw(QVirtioDevice *d, uint64_t off)
+{
+    QVirtioPCIDevice *dev = (QVirtioPCIDevice *)d;
+    return qpci_io_readw(dev->pdev, dev->bar, dev->device_cfg_offset + off);
+}
+
+static uint32_t qvirtio_pci_modern_config_readl(QVirtioDevice *d, uint64_t off)
+{
+    QVirtioPCIDevice *dev = (QVirtioPCIDevice *)d;
+    return qpci_io_readl(dev->pdev, dev->bar, dev->device_cfg_offset + off);
+}
+
+static uint64_t qvirtio_pci_modern_config_readq(QVirtioDevice *d, uint64_t off)
+{
+    QVirtioPCIDevice *dev = (QVirtioPCIDevice *)d;
+    return qpci_io_readq(dev->pdev, dev->bar, dev->device_cfg_offset + off);
+}
+
+static uint64_t qvirtio_pci_modern_get_features(QVirtioDevice *d)
+{
+    QVirtioPCIDevice *dev = (QVirtioPCIDevice *)d;
+    uint64_t lo, hi;
+
+    qpci_io_writel(dev->pdev, dev->bar,
+                   dev->common_cfg_offset + VIRTIO_PCI_COMMON_DFSELECT, 0);
+    lo = qpci_io_readl(dev->pdev, dev->bar,
+                       dev->common_cfg_offset + VIRTIO_PCI_COMMON_DF);
+    qpci_io_writel(dev->pdev, dev->bar,
+                   dev->common_cfg_offset + VIRTIO_PCI_COMMON_DFSELECT, 1);
+    hi = qpci_io_readl(dev->pdev, dev->bar,
+                       dev->common_cfg_offset + VIRTIO_PCI_COMMON_DF);
+
+    return (hi << 32) | lo;
+}
+
+static uint64_t qvirtio_pci_modern_get_guest_features(QVirtioDevice *d)
+{
+    QVirtioPCIDevice *dev = (QVirtioPCIDevice *)d;
+    uint64_t lo, hi;
+
+    qpci_io_writel(dev->pdev, dev->bar,
+                   dev->common_cfg_offset + VIRTIO_PCI_COMMON_GFSELECT, 0);
+    lo = qpci_io_readl(dev->pdev, dev->bar,
+                       dev->common_cfg_offset + VIRTIO_PCI_COMMON_GF);
+    qpci_io_writel(dev->pdev, dev->bar,
+                   dev->common_cfg_offset + VIRTIO_PCI_COMMON_GFSELECT, 1);
+    hi = qpci_io_readl(dev->pdev, dev->bar,
+                       dev->common_cfg_offset + VIRTIO_PCI_COMMON_GF);
+
+    return (hi << 32) | lo;
+}
+
+static uint8_t qvirtio_pci_modern_get_status(QVirtioDevice *d)
+{
+    QVirtioPCIDevice *dev = (QVirtioPCIDevice *)d;
+    return qpci_io_readb(dev->pdev, dev->bar,
+                         dev->common_cfg_offset + VIRTIO_PCI_COMMON_STATUS);
+}
+
+static void qvirtio_pci_modern_set_status(QVirtioDevice *d, uint8_t status)
+{
+    QVirtioPCIDevice *dev = (QVirtioPCIDevice *)d;
+    qpci_io_writeb(dev->pdev, dev->bar,
+                   dev->common_cfg_offset + VIRTIO_PCI_COMMON_STATUS, status);
+}
+
+static void qvirtio_pci_modern_set_features(QVirtioDevice *d,
+                                            uint64_t features)
+{
+    QVirtioPCIDevice *dev = (QVirtioPCIDevice *)d;
+
+    qpci_io_writel(dev->pdev, dev->bar,
+                   dev->common_cfg_offset + VIRTIO_PCI_COMMON_GFSELECT, 0);
+    qpci_io_writel(dev->pdev, dev->bar,
+                   dev->common_cfg_offset + VIRTIO_PCI_COMMON_GF, features);
+    qpci_io_writel(dev->pdev, dev->bar,
+                   dev->common_cfg_offset + VIRTIO_PCI_COMMON_GFSELECT, 1);
+    qpci_io_writel(dev->pdev, dev->bar,
+                   dev->common_cfg_offset + VIRTIO_PCI_COMMON_GF,
+                   features >> 32);
+
+    /* The device must accept the subset before any queue is set up */
+    qvirtio_pci_modern_set_status(d, qvirtio_pci_modern_get_status(d) |
+                                  VIRTIO_CONFIG_S_FEATURES_OK);
+    g_assert(qvirtio_pci_modern_get_status(d) & VIRTIO_CONFIG_S_FEATURES_OK);
+}
+
+static bool qvirtio_pci_modern_get_queue_isr_status(QVirtioDevice *d,
+                                                    QVirtQueue *vq)
+{
+    QVirtioPCIDevice *dev = (QVirtioPCIDevice *)d;
+
+    g_assert(!dev->pdev->msix_enabled);
+    return qpci_io_readb(dev->pdev, dev->bar, dev->isr_cfg_offset) & 1;
+}
+
+static bool qvirtio_pci_modern_get_config_isr_status(QVirtioDevice *d)
+{
+    QVirtioPCIDevice *dev = (QVirtioPCIDevice *)d;
+
+    g_assert(!dev->pdev->msix_enabled);
+    return qpci_io_readb(dev->pdev, dev->bar, dev->isr_cfg_offset) & 2;
+}
+
+static void qvirtio_pci_modern_queue_select(QVirtioDevice *d, uint16_t index)
+{
+    QVirtioPCIDevice *dev = (QVirtioPCIDevice *)d;
+    qpci_io_writew(dev->pdev, dev->bar,
+                   dev->common_cfg_offset + VIRTIO_PCI_COMMON_Q_SELECT, index);
+}
+
+static uint16_t qvirtio_pci_modern_get_queue_size(QVirtioDevice *d)
+{
+    QVirtioPCIDevice *dev = (QVirtioPCIDevice *)d;
+    return qpci_io_readw(dev->pdev, dev->bar,
+                         dev->common_cfg_offset + VIRTIO_PCI_COMMON_Q_SIZE);
+}
+
+static void qvirtio_pci_modern_set_queue_addr(QVirtioPCIDevice *dev,
+                                              uint64_t lo_off, uint64_t addr)
+{
+    qpci_io_writel(dev->pdev, dev->bar, dev->common_cfg_offset + lo_off,
+                   addr);
+    qpci_io_writel(dev->pdev, dev->bar, dev->common_cfg_offset + lo_off + 4,
+                   addr >> 32);
+}
+
+static QVirtQueue *qvirtio_pci_modern_virtqueue_setup(QVirtioDevice *d,
+                                        QGuestAllocator *alloc, uint16_t index)
+{
+    QVirtioPCIDevice *dev = (QVirtioPCIDevice *)d;
+    uint64_t feat;
+    uint64_t addr;
+    QVirtQueuePCI *vqpci;
+
+    vqpci = g_malloc0(sizeof(*vqpci));
+    feat = qvirtio_pci_modern_get_guest_features(d);
+
+    qvirtio_pci_modern_queue_select(d, index);
+    vqpci->vq.index = index;
+    vqpci->vq.size = qvirtio_pci_modern_get_queue_size(d);
+    vqpci->vq.free_head = 0;
+    vqpci->vq.num_free = vqpci->vq.size;
+    vqpci->vq.align = VIRTIO_PCI_VRING_ALIGN;
+    vqpci->vq.indirect = (feat & (1u << VIRTIO_RING_F_INDIRECT_DESC)) != 0;
+    vqpci->vq.event = (feat & (1u << VIRTIO_RING_F_EVENT_IDX)) != 0;
+    vqpci->vq.packed = (feat & (1ull << VIRTIO_F_RING_PACKED)) != 0;
+
+    vqpci->msix_entry = -1;
+    vqpci->msix_addr = 0;
+    vqpci->msix_data = 0x12345678;
+    vqpci->notify_off = qpci_io_readw(dev->pdev, dev->bar,
+                                      dev->common_cfg_offset +
+                                      VIRTIO_PCI_COMMON_Q_NOFF);
+
+    /* Check different than 0 */
+    g_assert_cmpint(vqpci->vq.size, !=, 0);
+
+    /* Check power of 2 */
+    g_assert_cmpint(vqpci->vq.size & (vqpci->vq.size - 1), ==, 0);
+
+    addr = guest_alloc(alloc, qvring_size(vqpci->vq.size,
+                                          VIRTIO_PCI_VRING_ALIGN));
+    qvring_init(alloc, &vqpci->vq, addr);
+
+    qvirtio_pci_modern_set_queue_addr(dev, VIRTIO_PCI_COMMON_Q_DESCLO,
+                                      vqpci->vq.desc);
+    qvirtio_pci_modern_set_queue_addr(dev, VIRTIO_PCI_COMMON_Q_AVAILLO,
+                                      vqpci->vq.avail);
+    qvirtio_pci_modern_set_queue_addr(dev, VIRTIO_PCI_COMMON_Q_USEDLO,
+                                      vqpci->vq.used);
+    qpci_io_writew(dev->pdev, dev->bar,
+                   dev->common_cfg_offset + VIRTIO_PCI_COMMON_Q_ENABLE, 1);
+
+    return &vqpci->vq;
+}
+
+static void qvirtio_pci_modern_virtqueue_cleanup(QVirtQueue *vq,
+                                                 QGuestAllocator *alloc)
+{
+    QVirtQueuePCI *vqpci = container_of(vq, QVirtQueuePCI, vq);
+
+    guest_free(alloc, vq->desc);
+    g_free(vqpci);
+}
+
+static void qvirtio_pci_modern_virtqueue_kick(QVirtioDevice *d,
+                                              QVirtQueue *vq)
+{
+    QVirtioPCIDevice *dev = (QVirtioPCIDevice *)d;
+    QVirtQueuePCI *vqpci = container_of(vq, QVirtQueuePCI, vq);
+
+    qpci_io_writew(dev->pdev, dev->bar,
+                   dev->notify_cfg_offset +
+                   vqpci->notify_off * dev->notify_off_multiplier,
+                   vq->index);
+}
+
+const QVirtioBus qvirtio_pci_modern = {
+    .config_readb = qvirtio_pci_modern_config_readb,
+    .config_readw = qvirtio_pci_modern_config_readw,
+    .config_readl = qvirtio_pci_modern_config_readl,
+    .config_readq = qvirtio_pci_modern_config_readq,
+    .get_features = qvirtio_pci_modern_get_features,
+    .set_features = qvirtio_pci_modern_set_features,
+    .get_guest_features = qvirtio_pci_modern_get_guest_features,
+    .get_status = qvirtio_pci_modern_get_status,
+    .set_status = qvirtio_pci_modern_set_status,
+    .get_queue_isr_status = qvirtio_pci_modern_get_queue_isr_status,
+    .get_config_isr_status = qvirtio_pci_modern_get_config_isr_status,
+    .queue_select = qvirtio_pci_modern_queue_select,
+    .get_queue_size = qvirtio_pci_modern_get_queue_size,
+    .virtqueue_setup = qvirtio_pci_modern_virtqueue_setup,
+    .virtqueue_cleanup = qvirtio_pci_modern_virtqueue_cleanup,
+    .virtqueue_kick = qvirtio_pci_modern_virtqueue_kick,
+};
+
+/*
+ * Walk the vendor capabilities by hand: qpci_find_capability() only
+ * returns the first one, and virtio has one per structure type.
+ */
+static uint8_t qvirtio_pci_find_cfg(QPCIDevice *pdev, uint8_t cfg_type,
+                                    uint8_t *bar, uint32_t *offset)
+{
+    uint8_t addr = qpci_config_readb(pdev, PCI_CAPABILITY_LIST);
+
+    while (addr) {
+        if (qpci_config_readb(pdev, addr) == PCI_CAP_ID_VNDR &&
+            qpci_config_readb(pdev, addr + VIRTIO_PCI_CAP_CFG_TYPE) ==
+            cfg_type) {
+            *bar = qpci_config_readb(pdev, addr + VIRTIO_PCI_CAP_BAR);
+            *offset = qpci_config_readl(pdev, addr + VIRTIO_PCI_CAP_OFFSET);
+            return addr;
+        }
+        addr = qpci_config_readb(pdev, addr + PCI_CAP_LIST_NEXT);
+    }
+
+    g_assert_not_reached();
+}
+
+void qvirtio_pci_device_enable_modern(QVirtioPCIDevice *d)
+{
+    uint8_t common_bar, isr_bar, device_bar, notify_bar;
+    uint8_t notify_cap;
+
+    qvirtio_pci_find_cfg(d->pdev, VIRTIO_PCI_CAP_COMMON_CFG,
+                         &common_bar, &d->common_cfg_offset);
+    qvirtio_pci_find_cfg(d->pdev, VIRTIO_PCI_CAP_ISR_CFG,
+                         &isr_bar, &d->isr_cfg_offset);
+    qvirtio_pci_find_cfg(d->pdev, VIRTIO_PCI_CAP_DEVICE_CFG,
+                         &device_bar, &d->device_cfg_offset);
+    notify_cap = qvirtio_pci_find_cfg(d->pdev, VIRTIO_PCI_CAP_NOTIFY_CFG,
+                                      &notify_bar, &d->notify_cfg_offset);
+    d->notify_off_multiplier =
+        qpci_config_readl(d->pdev, notify_cap + VIRTIO_PCI_NOTIFY_CAP_MULT);
+
+    /* QEMU puts all the modern structures in a single BAR */
+    g_assert_cmpint(isr_bar, ==, common_bar);
+    g_assert_cmpint(device_bar, ==, common_bar);
+    g_assert_cmpint(notify_bar, ==, common_bar);
+
+    qpci_device_enable(d->pdev);
+    d->bar = qpci_iomap(d->pdev, common_bar, NULL);
+    d->vdev.bus = &qvirtio_pci_modern;
+}
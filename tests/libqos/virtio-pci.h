@@ -20,6 +20,13 @@ typedef struct QVirtioPCIDevice {
     uint16_t config_msix_entry;
     uint64_t config_msix_addr;
     uint32_t config_msix_data;
+
+    /* Offsets into bar, set by qvirtio_pci_device_enable_modern() */
+    uint32_t common_cfg_offset;
+    uint32_t isr_cfg_offset;
+    uint32_t device_cfg_offset;
+    uint32_t notify_cfg_offset;
+    uint32_t notify_off_multiplier;
 } QVirtioPCIDevice;
 
 typedef struct QVirtQueuePCI {
@@ -27,9 +34,11 @@ typedef struct QVirtQueuePCI {
     uint16_t msix_entry;
     uint64_t msix_addr;
     uint32_t msix_data;
+    uint16_t notify_off;
 } QVirtQueuePCI;
 
 extern const QVirtioBus qvirtio_pci;
+extern const QVirtioBus qvirtio_pci_modern;
 
 QVirtioPCIDevice *qvirtio_pci_device_find(QPCIBus *bus, uint16_t device_type);
 QVirtioPCIDevice *qvirtio_pci_device_find_slot(QPCIBus *bus,
@@ -38,6 +47,7 @@ void qvirtio_pci_device_free(QVirtioPCIDevice *dev);
 
 void qvirtio_pci_device_enable(QVirtioPCIDevice *d);
 void qvirtio_pci_device_disable(QVirtioPCIDevice *d);
+void qvirtio_pci_device_enable_modern(QVirtioPCIDevice *d);
 
 void qvirtio_pci_set_msix_configuration_vector(QVirtioPCIDevice *d,
                                         QGuestAllocator *alloc, uint16_t entry);
@@ -33,12 +33,12 @@ uint64_t qvirtio_config_readq(QVirtioDevice *d, uint64_t addr)
     return d->bus->config_readq(d, addr);
 }
 
-uint32_t qvirtio_get_features(QVirtioDevice *d)
+uint64_t qvirtio_get_features(QVirtioDevice *d)
 {
     return d->bus->get_features(d);
 }
 
-void qvirtio_set_features(QVirtioDevice *d, uint32_t features)
+void qvirtio_set_features(QVirtioDevice *d, uint64_t features)
 {
     d->bus->set_features(d, features);
 }
@@ -52,6 +52,7 @@ QVirtQueue *qvirtqueue_setup(QVirtioDevice *d,
 void qvirtqueue_cleanup(const QVirtioBus *bus, QVirtQueue *vq,
                         QGuestAllocator *alloc)
 {
+    g_free(vq->chain_len);
     return bus->virtqueue_cleanup(vq, alloc);
 }
 
@@ -76,9 +77,13 @@ void qvirtio_set_driver(QVirtioDevice *d)
 
 void qvirtio_set_driver_ok(QVirtioDevice *d)
 {
+    /* Only virtio 1.0 devices go through FEATURES_OK */
+    uint8_t features_ok = d->bus->get_status(d) & VIRTIO_CONFIG_S_FEATURES_OK;
+
     d->bus->set_status(d, d->bus->get_status(d) | VIRTIO_CONFIG_S_DRIVER_OK);
     g_assert_cmphex(d->bus->get_status(d), ==, VIRTIO_CONFIG_S_DRIVER_OK |
-                    VIRTIO_CONFIG_S_DRIVER | VIRTIO_CONFIG_S_ACKNOWLEDGE);
+                    VIRTIO_CONFIG_S_DRIVER | VIRTIO_CONFIG_S_ACKNOWLEDGE |
+                    features_ok);
 }
 
 void qvirtio_wait_queue_isr(QVirtioDevice *d,
@@ -158,10 +163,45 @@ void qvirtio_wait_config_isr(QVirtioDevice *d, gint64 timeout_us)
     }
 }
 
+static void qvring_packed_init(QVirtQueue *vq, uint64_t addr)
+{
+    int i;
+
+    vq->desc = addr;
+    /* 16 byte descriptors, followed by the 4 byte driver and device event
+     * suppression structures */
+    vq->avail = vq->desc + vq->size * 16;
+    vq->used = vq->avail + 4;
+    vq->avail_wrap_counter = true;
+    vq->used_wrap_counter = true;
+    vq->chain_head = -1;
+    vq->chain_len = g_new0(uint16_t, vq->size);
+
+    for (i = 0; i < vq->size; i++) {
+        /* vq->desc[i].flags */
+        writew(vq->desc + (16 * i) + 14, 0);
+    }
+
+    /* vq->avail->off_wrap */
+    writew(vq->avail, 0);
+    /* vq->avail->flags */
+    writew(vq->avail + 2, VRING_PACKED_EVENT_FLAG_ENABLE);
+
+    /* vq->used->off_wrap */
+    writew(vq->used, 0);
+    /* vq->used->flags */
+    writew(vq->used + 2, VRING_PACKED_EVENT_FLAG_ENABLE);
+}
+
 void qvring_init(const QGuestAllocator *alloc, QVirtQueue *vq, uint64_t addr)
 {
     int i;
 
+    if (vq->packed) {
+        qvring_packed_init(vq, addr);
+        return;
+    }
+
     vq->desc = addr;
     vq->avail = vq->desc + vq->size * sizeof(struct vring_desc);
     vq->used = (uint64_t)((vq->avail + sizeof(uint16_t) * (3 + vq->size)
@@ -232,10 +272,76 @@ void qvring_indirect_desc_add(QVRingIndirectDesc *indirect, uint64_t data,
     indirect->index++;
 }
 
+/* Buffers in a packed ring become available through the flags of their
+ * head descriptor, so those are only written by qvirtqueue_kick(), once the
+ * rest of the chain is in place.  Each buffer must be kicked before the next
+ * one is added.  */
+static uint32_t qvirtqueue_add_packed(QVirtQueue *vq, uint64_t data,
+                                      uint32_t len, bool write, bool next)
+{
+    uint32_t idx = vq->free_head;
+    uint16_t flags = 0;
+
+    g_assert_cmpint(vq->num_free, >, 0);
+    vq->num_free--;
+
+    if (write) {
+        flags |= VRING_DESC_F_WRITE;
+    }
+
+    if (next) {
+        flags |= VRING_DESC_F_NEXT;
+    }
+
+    if (vq->avail_wrap_counter) {
+        flags |= 1 << VRING_PACKED_DESC_F_AVAIL;
+    } else {
+        flags |= 1 << VRING_PACKED_DESC_F_USED;
+    }
+
+    if (vq->chain_head == -1) {
+        vq->chain_head = idx;
+        vq->chain_len[idx] = 0;
+    } else {
+        uint32_t prev = (idx ? idx : vq->size) - 1;
+
+        /* The previous buffer must be kicked before the next one is added */
+        g_assert((prev == vq->chain_head ? vq->chain_head_flags :
+                  readw(vq->desc + (16 * prev) + 14)) & VRING_DESC_F_NEXT);
+    }
+    vq->chain_len[vq->chain_head]++;
+
+    /* vq->desc[idx].addr */
+    writeq(vq->desc + (16 * idx), data);
+    /* vq->desc[idx].len */
+    writel(vq->desc + (16 * idx) + 8, len);
+    /* vq->desc[idx].id */
+    writew(vq->desc + (16 * idx) + 12, vq->chain_head);
+
+    if (idx == vq->chain_head) {
+        vq->chain_head_flags = flags;
+    } else {
+        /* vq->desc[idx].flags */
+        writew(vq->desc + (16 * idx) + 14, flags);
+    }
+
+    if (++vq->free_head == vq->size) {
+        vq->free_head = 0;
+        vq->avail_wrap_counter = !vq->avail_wrap_counter;
+    }
+
+    return idx;
+}
+
 uint32_t qvirtqueue_add(QVirtQueue *vq, uint64_t data, uint32_t len, bool write,
                                                                     bool next)
 {
     uint16_t flags = 0;
+
+    if (vq->packed) {
+        return qvirtqueue_add_packed(vq, data, len, write, next);
+    }
+
     vq->num_free--;
 
     if (write) {
@@ -258,6 +364,7 @@ uint32_t qvirtqueue_add(QVirtQueue *vq, uint64_t data, uint32_t len, bool write,
 
 uint32_t qvirtqueue_add_indirect(QVirtQueue *vq, QVRingIndirectDesc *indirect)
 {
+    g_assert(!vq->packed);
     g_assert(vq->indirect);
     g_assert_cmpint(vq->size, >=, indirect->elem);
     g_assert_cmpint(indirect->index, ==, indirect->elem);
@@ -275,15 +382,37 @@ uint32_t qvirtqueue_add_indirect(QVirtQueue *vq, QVRingIndirectDesc *indirect)
     return vq->free_head++; /* Return and increase, in this order */
 }
 
+static void qvirtqueue_kick_packed(QVirtioDevice *d, QVirtQueue *vq,
+                                   uint32_t free_head)
+{
+    g_assert_cmpint(free_head, ==, vq->chain_head);
+
+    /* vq->desc[free_head].flags */
+    writew(vq->desc + (16 * free_head) + 14, vq->chain_head_flags);
+    vq->chain_head = -1;
+
+    /* vq->used->flags */
+    if (readw(vq->used + 2) != VRING_PACKED_EVENT_FLAG_DISABLE) {
+        d->bus->virtqueue_kick(d, vq);
+    }
+}
+
 void qvirtqueue_kick(QVirtioDevice *d, QVirtQueue *vq, uint32_t free_head)
 {
     /* vq->avail->idx */
-    uint16_t idx = readw(vq->avail + 2);
+    uint16_t idx;
     /* vq->used->flags */
     uint16_t flags;
     /* vq->used->avail_event */
     uint16_t avail_event;
 
+    if (vq->packed) {
+        qvirtqueue_kick_packed(d, vq, free_head);
+        return;
+    }
+
+    idx = readw(vq->avail + 2);
+
     /* vq->avail->ring[idx % vq->size] */
     writew(vq->avail + 4 + (2 * (idx % vq->size)), free_head);
     /* vq->avail->idx */
@@ -309,10 +438,44 @@ void qvirtqueue_kick(QVirtioDevice *d, QVirtQueue *vq, uint32_t free_head)
  *
  * Returns: true if an element was ready, false otherwise
  */
+static bool qvirtqueue_get_buf_packed(QVirtQueue *vq, uint32_t *desc_idx)
+{
+    uint64_t desc = vq->desc + (16 * vq->last_used_idx);
+    uint16_t flags, id;
+    bool avail, used;
+
+    /* vq->desc[vq->last_used_idx].flags */
+    flags = readw(desc + 14);
+    avail = flags & (1 << VRING_PACKED_DESC_F_AVAIL);
+    used = flags & (1 << VRING_PACKED_DESC_F_USED);
+    if (avail != used || used != vq->used_wrap_counter) {
+        return false;
+    }
+
+    /* vq->desc[vq->last_used_idx].id */
+    id = readw(desc + 12);
+    g_assert_cmpint(id, <, vq->size);
+    if (desc_idx) {
+        *desc_idx = id;
+    }
+
+    vq->num_free += vq->chain_len[id];
+    vq->last_used_idx += vq->chain_len[id];
+    if (vq->last_used_idx >= vq->size) {
+        vq->last_used_idx -= vq->size;
+        vq->used_wrap_counter = !vq->used_wrap_counter;
+    }
+    return true;
+}
+
 bool qvirtqueue_get_buf(QVirtQueue *vq, uint32_t *desc_idx)
 {
     uint16_t idx;
 
+    if (vq->packed) {
+        return qvirtqueue_get_buf_packed(vq, desc_idx);
+    }
+
     idx = readw(vq->used + offsetof(struct vring_used, idx));
     if (idx == vq->last_used_idx) {
         return false;
@@ -334,6 +497,7 @@ bool qvirtqueue_get_buf(QVirtQueue *vq, uint32_t *desc_idx)
 
 void qvirtqueue_set_used_event(QVirtQueue *vq, uint16_t idx)
 {
+    g_assert(!vq->packed);
     g_assert(vq->event);
 
     /* vq->avail->used_event */
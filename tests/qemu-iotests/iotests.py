@@ -202,6 +202,11 @@ class VM(qtest.QEMUQtestMachine):
         self._args.append(opts)
         return self
 
+    def add_object(self, opts):
+        self._args.append('-object')
+        self._args.append(opts)
+        return self
+
     def add_drive_raw(self, opts):
         self._args.append('-drive')
         self._args.append(opts)
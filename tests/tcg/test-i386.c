@@ -2125,6 +2125,12 @@ static uint64_t __attribute__((aligned(16))) test_values[4][2] = {
     { 0x0f76255a085427f8, 0xc233e9e8c4c9439a },
 };
 
+/* Lanes at the saturation limits, for the add/sub/compare operations */
+static uint64_t __attribute__((aligned(16))) edge_values[2][2] = {
+    { 0x7fff8000ffff0000, 0x7fffffff80000000 },
+    { 0x0001ffff0001ffff, 0x0000000100000001 },
+};
+
 #define SSE_OP(op)\
 {\
     asm volatile (#op " %2, %0" : "=x" (r.dq) : "0" (a.dq), "x" (b.dq));\
@@ -2163,6 +2169,34 @@ static uint64_t __attribute__((aligned(16))) test_values[4][2] = {
     SSE_OP2(op);\
 }
 
+/* Edge values with register and memory operands, and with the same
+   register as source and destination */
+#define EDGE_OP2(op)\
+{\
+    a.q[0] = edge_values[0][0];\
+    a.q[1] = edge_values[0][1];\
+    b.q[0] = edge_values[1][0];\
+    b.q[1] = edge_values[1][1];\
+    SSE_OP(op);\
+    asm volatile (#op " %2, %0" : "=y" (r.q[0]) : "0" (a.q[0]), "m" (b.q[0]));\
+    printf("%-9s: a=" FMT64X " b=" FMT64X " r=" FMT64X "\n",\
+           #op,\
+           a.q[0],\
+           b.q[0],\
+           r.q[0]);\
+    asm volatile (#op " %2, %0" : "=x" (r.dq) : "0" (a.dq), "m" (b.dq));\
+    printf("%-9s: a=" FMT64X "" FMT64X " b=" FMT64X "" FMT64X " r=" FMT64X "" FMT64X "\n",\
+           #op,\
+           a.q[1], a.q[0],\
+           b.q[1], b.q[0],\
+           r.q[1], r.q[0]);\
+    asm volatile (#op " %0, %0" : "=x" (r.dq) : "0" (a.dq));\
+    printf("%-9s: a=" FMT64X "" FMT64X " r=" FMT64X "" FMT64X "\n",\
+           #op,\
+           a.q[1], a.q[0],\
+           r.q[1], r.q[0]);\
+}
+
 #define SHUF_OP(op, ib)\
 {\
     a.q[0] = test_values[0][0];\
@@ -2448,6 +2482,33 @@ void test_sse(void)
     MMX_OP2(pavgb);
     MMX_OP2(pavgw);
 
+    EDGE_OP2(paddb);
+    EDGE_OP2(paddw);
+    EDGE_OP2(paddd);
+    EDGE_OP2(paddq);
+    EDGE_OP2(psubb);
+    EDGE_OP2(psubw);
+    EDGE_OP2(psubd);
+    EDGE_OP2(psubq);
+    EDGE_OP2(paddsb);
+    EDGE_OP2(paddsw);
+    EDGE_OP2(psubsb);
+    EDGE_OP2(psubsw);
+    EDGE_OP2(paddusb);
+    EDGE_OP2(paddusw);
+    EDGE_OP2(psubusb);
+    EDGE_OP2(psubusw);
+    EDGE_OP2(pand);
+    EDGE_OP2(pandn);
+    EDGE_OP2(por);
+    EDGE_OP2(pxor);
+    EDGE_OP2(pcmpeqb);
+    EDGE_OP2(pcmpeqw);
+    EDGE_OP2(pcmpeqd);
+    EDGE_OP2(pcmpgtb);
+    EDGE_OP2(pcmpgtw);
+    EDGE_OP2(pcmpgtd);
+
     asm volatile ("pinsrw $1, %1, %0" : "=y" (r.q[0]) : "r" (0x12345678));
     printf("%-9s: r=" FMT64X "\n", "pinsrw", r.q[0]);
 
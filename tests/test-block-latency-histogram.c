@@ -0,0 +1,69 @@
+/*
+ * Block latency histogram tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "block/accounting.h"
+
+/* Latencies from 1 << 36 ns up are all counted in the last bin */
+#define TOP_NS  (1ULL << 36)
+
+static void test_precision(const void *opaque)
+{
+    unsigned precision = GPOINTER_TO_UINT(opaque);
+    BlockAcctStats stats = { 0 };
+    BlockLatencyHistogram *hist;
+    uint64_t lo, hi;
+    int bin;
+
+    block_acct_init(&stats);
+    block_latency_histograms_set(&stats, precision);
+    hist = &stats.latency_histogram[BLOCK_ACCT_READ];
+
+    g_assert_cmpint(hist->nbins, ==, (27 - precision) << precision);
+    g_assert_cmpuint(block_latency_histogram_boundary(hist, 0), ==, 0);
+    g_assert_cmpint(block_latency_histogram_index(hist, -1), ==, 0);
+    g_assert_cmpint(block_latency_histogram_index(hist, 0), ==, 0);
+
+    /* Every bin starts at its boundary and ends right before the next one */
+    for (bin = 1; bin < hist->nbins; bin++) {
+        lo = block_latency_histogram_boundary(hist, bin - 1);
+        hi = block_latency_histogram_boundary(hist, bin);
+        g_assert_cmpuint(lo, <, hi);
+        g_assert_cmpint(block_latency_histogram_index(hist, hi), ==, bin);
+        g_assert_cmpint(block_latency_histogram_index(hist, hi - 1), ==,
+                        bin - 1);
+
+        /* Past the linear part, bins are at most 2^-precision wide */
+        if (lo >= 1ULL << (10 + precision)) {
+            g_assert_cmpuint(hi - lo, <=, lo >> precision);
+        }
+    }
+
+    /* The last bin takes everything up to and beyond TOP_NS */
+    lo = block_latency_histogram_boundary(hist, hist->nbins - 1);
+    g_assert_cmpuint(lo, ==, TOP_NS - (TOP_NS >> (precision + 1)));
+    g_assert_cmpint(block_latency_histogram_index(hist, TOP_NS - 1), ==,
+                    hist->nbins - 1);
+    g_assert_cmpint(block_latency_histogram_index(hist, TOP_NS), ==,
+                    hist->nbins - 1);
+    g_assert_cmpint(block_latency_histogram_index(hist, INT64_MAX), ==,
+                    hist->nbins - 1);
+
+    block_acct_cleanup(&stats);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_data_func("/block/latency-histogram/precision-0",
+                         GUINT_TO_POINTER(0), test_precision);
+    g_test_add_data_func("/block/latency-histogram/precision-2",
+                         GUINT_TO_POINTER(2), test_precision);
+    g_test_add_data_func("/block/latency-histogram/precision-6",
+                         GUINT_TO_POINTER(6), test_precision);
+    return g_test_run();
+}
@@ -902,6 +902,68 @@ static void test_hbitmap_serialize_zeroes(TestHBitmapData *data,
     }
 }
 
+static void test_hbitmap_serialize_merge(TestHBitmapData *data,
+                                         const void *unused)
+{
+    int i;
+    size_t buf_size;
+    uint8_t *buf;
+    HBitmapIter iter;
+    uint64_t stored[] = { 0, L1, L2 + 1 };
+    uint64_t live[] = { 1, L1, L3 - 1 };
+
+    hbitmap_test_init(data, L3, 0);
+    buf_size = hbitmap_serialization_size(data->hb, 0, data->size);
+    buf = g_malloc0(buf_size);
+
+    for (i = 0; i < ARRAY_SIZE(stored); i++) {
+        hbitmap_set(data->hb, stored[i], 1);
+    }
+    hbitmap_serialize_part(data->hb, buf, 0, data->size);
+    hbitmap_reset_all(data->hb);
+
+    for (i = 0; i < ARRAY_SIZE(live); i++) {
+        hbitmap_set(data->hb, live[i], 1);
+    }
+    hbitmap_merge_part(data->hb, buf, 0, data->size);
+
+    /* Bits from both sides are set, the shared one is counted once */
+    for (i = 0; i < ARRAY_SIZE(stored); i++) {
+        g_assert(hbitmap_get(data->hb, stored[i]));
+        g_assert(hbitmap_get(data->hb, live[i]));
+    }
+    g_assert_cmpint(hbitmap_count(data->hb), ==, 5);
+
+    /* The upper levels must be consistent without a deserialize_finish */
+    hbitmap_iter_init(&iter, data->hb, 0);
+    g_assert_cmpint(hbitmap_iter_next(&iter), ==, 0);
+    g_assert_cmpint(hbitmap_iter_next(&iter), ==, 1);
+    g_assert_cmpint(hbitmap_iter_next(&iter), ==, L1);
+    g_assert_cmpint(hbitmap_iter_next(&iter), ==, L2 + 1);
+    g_assert_cmpint(hbitmap_iter_next(&iter), ==, L3 - 1);
+    g_assert_cmpint(hbitmap_iter_next(&iter), ==, -1);
+
+    g_free(buf);
+}
+
+static void test_hbitmap_serialize_merge_ones(TestHBitmapData *data,
+                                              const void *unused)
+{
+    size_t buf_size;
+    uint8_t *buf;
+
+    /* Bits beyond the end of the bitmap must not be set */
+    hbitmap_test_init(data, L2 + 3, 0);
+    buf_size = hbitmap_serialization_size(data->hb, 0, data->size);
+    buf = g_malloc(buf_size);
+    memset(buf, 0xff, buf_size);
+
+    hbitmap_merge_part(data->hb, buf, 0, data->size);
+    g_assert_cmpint(hbitmap_count(data->hb), ==, data->size);
+
+    g_free(buf);
+}
+
 static void hbitmap_test_add(const char *testpath,
                                    void (*test_func)(TestHBitmapData *data, const void *user_data))
 {
@@ -982,6 +1044,10 @@ int main(int argc, char **argv)
                      test_hbitmap_serialize_part);
     hbitmap_test_add("/hbitmap/serialize/zeroes",
                      test_hbitmap_serialize_zeroes);
+    hbitmap_test_add("/hbitmap/serialize/merge",
+                     test_hbitmap_serialize_merge);
+    hbitmap_test_add("/hbitmap/serialize/merge_ones",
+                     test_hbitmap_serialize_merge_ones);
 
     hbitmap_test_add("/hbitmap/iter/iter_and_reset",
                      test_hbitmap_iter_and_reset);
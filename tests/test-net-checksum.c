@@ -0,0 +1,84 @@
+/*
+ * QEMU internet checksum test
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "net/checksum.h"
+
+static uint8_t buffer[128 * 1024];
+
+/* The plain byte-pair algorithm, as a reference */
+static uint16_t reference_checksum(const uint8_t *buf, int len, int seq)
+{
+    uint32_t sum = 0;
+    int i;
+
+    for (i = 0; i < len; i++) {
+        sum += (i + seq) & 1 ? buf[i] : buf[i] << 8;
+    }
+    return net_checksum_finish(sum);
+}
+
+static void check(const uint8_t *buf, int len, int seq)
+{
+    uint32_t sum = net_checksum_add_cont(len, (uint8_t *)buf, seq);
+
+    g_assert_cmphex(net_checksum_finish(sum), ==,
+                    reference_checksum(buf, len, seq));
+}
+
+static void test_1(void)
+{
+    int a, len, seq;
+
+    for (a = 0; a < 64; a++) {
+        for (len = 0; len < 1024; len++) {
+            for (seq = 0; seq < 2; seq++) {
+                check(buffer + a, len, seq);
+            }
+        }
+    }
+
+    /* Long enough for the vector lanes to be spilled */
+    check(buffer + 1, sizeof(buffer) - 1, 0);
+    check(buffer + 1, sizeof(buffer) - 1, 1);
+}
+
+/* Run test_1 with every accelerator the host supports */
+static void test_all_accel(void)
+{
+    test_net_checksum_reset_accel();
+    do {
+        test_1();
+    } while (test_net_checksum_next_accel());
+}
+
+static void test_2(void)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(buffer); i++) {
+        buffer[i] = g_test_rand_int();
+    }
+    test_all_accel();
+}
+
+static void test_3(void)
+{
+    /* All-ones data maximizes every carry */
+    memset(buffer, 0xff, sizeof(buffer));
+    test_all_accel();
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/net/checksum/random", test_2);
+    g_test_add_func("/net/checksum/ones", test_3);
+
+    return g_test_run();
+}
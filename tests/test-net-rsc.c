@@ -0,0 +1,320 @@
+/*
+ * TCP receive segment coalescing test
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "net/checksum.h"
+#include "net/eth.h"
+#include "net/rsc.h"
+
+#define HEADROOM        12
+#define TIMEOUT         1000000
+#define MSS             100
+#define SEQ             1000
+#define HDRS_LEN        (ETH_HLEN + sizeof(struct ip_header) + \
+                         sizeof(struct tcp_header))
+
+/* This is the clock for QEMU_CLOCK_VIRTUAL */
+static int64_t my_clock_value;
+
+int64_t cpu_get_clock(void)
+{
+    return my_clock_value;
+}
+
+/* What the deliver callback saw */
+static bool deliver_ok;
+static int attempts;
+static int delivered;
+static struct virtio_net_hdr last_hdr;
+static uint8_t last_frame[ETH_MAX_L2_HDR_LEN + ETH_MAX_IP_DGRAM_LEN];
+static size_t last_len;
+
+static bool deliver(void *opaque, uint8_t *buf, size_t size,
+                    const struct virtio_net_hdr *hdr)
+{
+    attempts++;
+    if (!deliver_ok) {
+        return false;
+    }
+
+    g_assert_cmpuint(size, >=, HEADROOM);
+    g_assert_cmpuint(size - HEADROOM, <=, sizeof(last_frame));
+    delivered++;
+    last_hdr = *hdr;
+    last_len = size - HEADROOM;
+    memcpy(last_frame, buf + HEADROOM, last_len);
+    return true;
+}
+
+static NetRscState *setup(void)
+{
+    deliver_ok = true;
+    attempts = delivered = 0;
+    my_clock_value = 0;
+    return net_rsc_new(HEADROOM, TIMEOUT, deliver, NULL);
+}
+
+/* Build an IPv4/TCP frame carrying @len payload bytes at @seq */
+static size_t build(uint8_t *buf, uint32_t seq, uint8_t flags, size_t len)
+{
+    struct eth_header *eh = (struct eth_header *)buf;
+    struct ip_header *ip = (struct ip_header *)(eh + 1);
+    struct tcp_header *th = (struct tcp_header *)(ip + 1);
+    uint8_t *payload = (uint8_t *)(th + 1);
+    size_t i;
+
+    memset(buf, 0, HDRS_LEN);
+    memset(eh->h_dest, 0x52, ETH_ALEN);
+    memset(eh->h_source, 0x54, ETH_ALEN);
+    eh->h_proto = cpu_to_be16(ETH_P_IP);
+
+    ip->ip_ver_len = 0x45;
+    ip->ip_len = cpu_to_be16(sizeof(*ip) + sizeof(*th) + len);
+    ip->ip_ttl = 64;
+    ip->ip_p = IP_PROTO_TCP;
+    ip->ip_src = cpu_to_be32(0x0a000001);
+    ip->ip_dst = cpu_to_be32(0x0a000002);
+    eth_fix_ip4_checksum(ip, sizeof(*ip));
+
+    th->th_sport = cpu_to_be16(5201);
+    th->th_dport = cpu_to_be16(40000);
+    th->th_seq = cpu_to_be32(seq);
+    th->th_ack = cpu_to_be32(1);
+    th->th_offset_flags = cpu_to_be16((5 << 12) | flags);
+    th->th_win = cpu_to_be16(512);
+
+    for (i = 0; i < len; i++) {
+        payload[i] = seq + i;
+    }
+    return HDRS_LEN + len;
+}
+
+static int offer(NetRscState *s, uint32_t seq, uint8_t flags, size_t len)
+{
+    uint8_t buf[HDRS_LEN + MSS];
+
+    g_assert_cmpuint(len, <=, MSS);
+    return net_rsc_receive(s, buf, build(buf, seq, flags, len), true);
+}
+
+/* Check that the last delivered frame carries @len bytes from @seq */
+static void check_frame(uint32_t seq, size_t len, unsigned int segs)
+{
+    struct ip_header *ip = (struct ip_header *)(last_frame + ETH_HLEN);
+    struct tcp_header *th = (struct tcp_header *)(ip + 1);
+    size_t i;
+
+    g_assert_cmpuint(last_len, ==, HDRS_LEN + len);
+    g_assert_cmpuint(be16_to_cpu(ip->ip_len), ==,
+                     sizeof(*ip) + sizeof(*th) + len);
+    g_assert_cmpuint(net_raw_checksum((uint8_t *)ip, sizeof(*ip)), ==, 0);
+    g_assert_cmpuint(be32_to_cpu(th->th_seq), ==, seq);
+    for (i = 0; i < len; i++) {
+        g_assert_cmpuint(last_frame[HDRS_LEN + i], ==, (uint8_t)(seq + i));
+    }
+
+    if (segs == 1) {
+        g_assert_cmpuint(last_hdr.gso_type, ==, VIRTIO_NET_HDR_GSO_NONE);
+        g_assert_cmpuint(last_hdr.flags, ==, VIRTIO_NET_HDR_F_DATA_VALID);
+        return;
+    }
+    g_assert_cmpuint(last_hdr.gso_type, ==, VIRTIO_NET_HDR_GSO_TCPV4);
+    g_assert_cmpuint(last_hdr.flags, ==, VIRTIO_NET_HDR_F_NEEDS_CSUM);
+    g_assert_cmpuint(last_hdr.gso_size, ==, MSS);
+    g_assert_cmpuint(last_hdr.hdr_len, ==, HDRS_LEN);
+    g_assert_cmpuint(last_hdr.csum_start, ==, ETH_HLEN + sizeof(*ip));
+    g_assert_cmpuint(last_hdr.csum_offset, ==,
+                     offsetof(struct tcp_header, th_sum));
+}
+
+static void test_merge(void)
+{
+    NetRscState *s = setup();
+    uint8_t buf[HDRS_LEN + MSS];
+    size_t len;
+    int i;
+
+    for (i = 0; i < 3; i++) {
+        g_assert_cmpint(offer(s, SEQ + i * MSS, TH_ACK, MSS), ==, 1);
+    }
+    g_assert_cmpint(delivered, ==, 0);
+    g_assert_cmpuint(net_rsc_pending(s, 10), ==, HDRS_LEN + 3 * MSS + 10);
+
+    g_assert_true(net_rsc_flush(s));
+    g_assert_cmpint(delivered, ==, 1);
+    check_frame(SEQ, 3 * MSS, 3);
+    g_assert_cmpuint(net_rsc_pending(s, 10), ==, 0);
+
+    /* A segment that fails the checksum is left to the caller */
+    g_assert_cmpint(offer(s, SEQ, TH_ACK, MSS), ==, 1);
+    len = build(buf, SEQ + MSS, TH_ACK, MSS);
+    g_assert_cmpint(net_rsc_receive(s, buf, len, false), ==, 0);
+    g_assert_cmpint(delivered, ==, 2);
+    check_frame(SEQ, MSS, 1);
+
+    net_rsc_free(s);
+}
+
+static void test_push(void)
+{
+    NetRscState *s = setup();
+    struct tcp_header *th;
+
+    g_assert_cmpint(offer(s, SEQ, TH_ACK, MSS), ==, 1);
+    g_assert_cmpint(offer(s, SEQ + MSS, TH_ACK | TH_PUSH, MSS), ==, 1);
+    g_assert_cmpint(delivered, ==, 1);
+    check_frame(SEQ, 2 * MSS, 2);
+    th = (struct tcp_header *)(last_frame + ETH_HLEN +
+                               sizeof(struct ip_header));
+    g_assert_cmphex(TCP_HEADER_FLAGS(th), ==, TH_ACK | TH_PUSH);
+
+    /* A short segment ends the run as well */
+    g_assert_cmpint(offer(s, SEQ + 2 * MSS, TH_ACK, MSS), ==, 1);
+    g_assert_cmpint(offer(s, SEQ + 3 * MSS, TH_ACK, MSS / 2), ==, 1);
+    g_assert_cmpint(delivered, ==, 2);
+    g_assert_cmpuint(net_rsc_pending(s, 0), ==, 0);
+
+    net_rsc_free(s);
+}
+
+static void test_fin(void)
+{
+    NetRscState *s = setup();
+
+    g_assert_cmpint(offer(s, SEQ, TH_ACK, MSS), ==, 1);
+    g_assert_cmpint(offer(s, SEQ + MSS, TH_ACK | TH_FIN, MSS), ==, 0);
+    g_assert_cmpint(delivered, ==, 1);
+    check_frame(SEQ, MSS, 1);
+    g_assert_cmpuint(net_rsc_pending(s, 0), ==, 0);
+
+    net_rsc_free(s);
+}
+
+static void test_out_of_order(void)
+{
+    NetRscState *s = setup();
+
+    g_assert_cmpint(offer(s, SEQ, TH_ACK, MSS), ==, 1);
+    g_assert_cmpint(offer(s, SEQ + MSS, TH_ACK, MSS), ==, 1);
+
+    /* A hole flushes what came before and starts a new run */
+    g_assert_cmpint(offer(s, SEQ + 3 * MSS, TH_ACK, MSS), ==, 1);
+    g_assert_cmpint(delivered, ==, 1);
+    check_frame(SEQ, 2 * MSS, 2);
+
+    /* So does a retransmission */
+    g_assert_cmpint(offer(s, SEQ + 2 * MSS, TH_ACK, MSS), ==, 1);
+    g_assert_cmpint(delivered, ==, 2);
+    check_frame(SEQ + 3 * MSS, MSS, 1);
+
+    g_assert_true(net_rsc_flush(s));
+    g_assert_cmpint(delivered, ==, 3);
+    check_frame(SEQ + 2 * MSS, MSS, 1);
+
+    net_rsc_free(s);
+}
+
+static void test_timeout(void)
+{
+    NetRscState *s = setup();
+
+    g_assert_cmpint(offer(s, SEQ, TH_ACK, MSS), ==, 1);
+    my_clock_value = TIMEOUT - 1;
+    g_assert_cmpint(offer(s, SEQ + MSS, TH_ACK, MSS), ==, 1);
+    g_assert_cmpint(delivered, ==, 0);
+
+    /* The flow is too old to grow; the next segment starts a new one */
+    my_clock_value = TIMEOUT;
+    g_assert_cmpint(offer(s, SEQ + 2 * MSS, TH_ACK, MSS), ==, 1);
+    g_assert_cmpint(delivered, ==, 1);
+    check_frame(SEQ, 2 * MSS, 2);
+
+    g_assert_true(net_rsc_flush(s));
+    g_assert_cmpint(delivered, ==, 2);
+    check_frame(SEQ + 2 * MSS, MSS, 1);
+
+    net_rsc_free(s);
+}
+
+static void test_bad_doff(void)
+{
+    NetRscState *s = setup();
+    uint8_t buf[HDRS_LEN + MSS];
+    struct tcp_header *th = (struct tcp_header *)(buf + ETH_HLEN +
+                                                  sizeof(struct ip_header));
+    size_t len;
+    int doff;
+
+    g_assert_cmpint(offer(s, SEQ, TH_ACK, MSS), ==, 1);
+
+    /* A data offset below the TCP header size is passed through as is */
+    for (doff = 0; doff < 5; doff++) {
+        len = build(buf, SEQ + MSS, TH_ACK, MSS);
+        th->th_offset_flags = cpu_to_be16((doff << 12) | TH_ACK);
+        g_assert_cmpint(net_rsc_receive(s, buf, len, true), ==, 0);
+        g_assert_cmpuint(net_rsc_pending(s, 0), ==, HDRS_LEN + MSS);
+
+        /* And so is a frame that ends right after such a header */
+        g_assert_cmpint(net_rsc_receive(s, buf, ETH_HLEN +
+                                        sizeof(struct ip_header) +
+                                        doff * 4, true), ==, 0);
+    }
+    g_assert_cmpint(delivered, ==, 0);
+
+    g_assert_true(net_rsc_flush(s));
+    g_assert_cmpint(delivered, ==, 1);
+    check_frame(SEQ, MSS, 1);
+
+    net_rsc_free(s);
+}
+
+static void test_stall(void)
+{
+    NetRscState *s = setup();
+
+    g_assert_cmpint(offer(s, SEQ, TH_ACK, MSS), ==, 1);
+    g_assert_cmpint(offer(s, SEQ + MSS, TH_ACK, MSS), ==, 1);
+
+    /* The owner has no room: the data must stay */
+    deliver_ok = false;
+    g_assert_false(net_rsc_flush(s));
+    g_assert_cmpint(attempts, ==, 1);
+    g_assert_cmpuint(net_rsc_pending(s, 0), ==, HDRS_LEN + 2 * MSS);
+
+    /* Nothing may overtake it */
+    g_assert_cmpint(offer(s, SEQ + 2 * MSS, TH_ACK, MSS), ==, -EBUSY);
+    g_assert_false(net_rsc_retry(s));
+    g_assert_cmpint(delivered, ==, 0);
+
+    deliver_ok = true;
+    g_assert_true(net_rsc_retry(s));
+    g_assert_cmpint(delivered, ==, 1);
+    check_frame(SEQ, 2 * MSS, 2);
+    g_assert_true(net_rsc_retry(s));
+    g_assert_cmpint(attempts, ==, 4);
+
+    g_assert_cmpint(offer(s, SEQ + 2 * MSS, TH_ACK, MSS), ==, 1);
+    g_assert_true(net_rsc_flush(s));
+    g_assert_cmpint(delivered, ==, 2);
+    check_frame(SEQ + 2 * MSS, MSS, 1);
+
+    net_rsc_free(s);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/net/rsc/merge", test_merge);
+    g_test_add_func("/net/rsc/push", test_push);
+    g_test_add_func("/net/rsc/fin", test_fin);
+    g_test_add_func("/net/rsc/out-of-order", test_out_of_order);
+    g_test_add_func("/net/rsc/timeout", test_timeout);
+    g_test_add_func("/net/rsc/bad-doff", test_bad_doff);
+    g_test_add_func("/net/rsc/stall", test_stall);
+    return g_test_run();
+}
@@ -0,0 +1,180 @@
+/*
+ * RSS Toeplitz hash test
+ *
+ * The vectors are the ones Microsoft publishes for verifying RSS hash
+ * implementations.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "net/eth.h"
+#include "hw/net/net_rx_pkt.h"
+
+static uint8_t rss_key[] = {
+    0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+    0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+    0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+    0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+    0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+
+typedef struct RssVector {
+    uint8_t src[16];
+    uint8_t dst[16];
+    uint16_t sport;
+    uint16_t dport;
+    uint32_t hash_ip;
+    uint32_t hash_ip_tcp;
+} RssVector;
+
+static const RssVector rss_ip4_vectors[] = {
+    {
+        { 66, 9, 149, 187 }, { 161, 142, 100, 80 }, 2794, 1766,
+        0x323e8fc2, 0x51ccc178,
+    }, {
+        { 199, 92, 111, 2 }, { 65, 69, 140, 83 }, 14230, 4739,
+        0xd718262a, 0xc626b0ea,
+    }, {
+        { 24, 19, 198, 95 }, { 12, 22, 207, 184 }, 12898, 38024,
+        0xd2d0a5de, 0x5c2b394a,
+    }, {
+        { 38, 27, 205, 30 }, { 209, 142, 163, 6 }, 48228, 2217,
+        0x82989176, 0xafc7327f,
+    }, {
+        { 153, 39, 163, 191 }, { 202, 188, 127, 2 }, 44251, 1303,
+        0x5d1809c5, 0x10e828a2,
+    },
+};
+
+static const RssVector rss_ip6_vectors[] = {
+    {
+        /* 3ffe:2501:200:1fff::7 -> 3ffe:2501:200:3::1 */
+        { 0x3f, 0xfe, 0x25, 0x01, 0x02, 0x00, 0x1f, 0xff,
+          0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x07 },
+        { 0x3f, 0xfe, 0x25, 0x01, 0x02, 0x00, 0x00, 0x03,
+          0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01 },
+        2794, 1766, 0x2cc18cd5, 0x40207d3d,
+    }, {
+        /* 3ffe:501:8::260:97ff:fe40:efab -> ff02::1 */
+        { 0x3f, 0xfe, 0x05, 0x01, 0x00, 0x08, 0x00, 0x00,
+          0x02, 0x60, 0x97, 0xff, 0xfe, 0x40, 0xef, 0xab },
+        { 0xff, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+          0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01 },
+        14230, 4739, 0x0f0c461c, 0xdde51bbf,
+    }, {
+        /* 3ffe:1900:4545:3:200:f8ff:fe21:67cf -> fe80::200:f8ff:fe21:67cf */
+        { 0x3f, 0xfe, 0x19, 0x00, 0x45, 0x45, 0x00, 0x03,
+          0x02, 0x00, 0xf8, 0xff, 0xfe, 0x21, 0x67, 0xcf },
+        { 0xfe, 0x80, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+          0x02, 0x00, 0xf8, 0xff, 0xfe, 0x21, 0x67, 0xcf },
+        44251, 38024, 0x4b61e985, 0x02d1feef,
+    },
+};
+
+/* Fill in the TCP header at @th and return the frame length */
+static size_t build_tcp(uint8_t *buf, struct tcp_header *th,
+                        const RssVector *v)
+{
+    memset(th, 0, sizeof(*th));
+    th->th_sport = cpu_to_be16(v->sport);
+    th->th_dport = cpu_to_be16(v->dport);
+    th->th_offset_flags = cpu_to_be16((5 << 12) | TH_ACK);
+    th->th_win = cpu_to_be16(65535);
+    return (uint8_t *)(th + 1) - buf;
+}
+
+static size_t build_ip4(uint8_t *buf, const RssVector *v)
+{
+    struct eth_header *eh = (struct eth_header *)buf;
+    struct ip_header *ip = (struct ip_header *)(eh + 1);
+
+    memset(eh, 0, sizeof(*eh) + sizeof(*ip));
+    eh->h_proto = cpu_to_be16(ETH_P_IP);
+    ip->ip_ver_len = 0x45;
+    ip->ip_len = cpu_to_be16(sizeof(*ip) + sizeof(struct tcp_header));
+    ip->ip_ttl = 64;
+    ip->ip_p = IP_PROTO_TCP;
+    memcpy(&ip->ip_src, v->src, sizeof(ip->ip_src));
+    memcpy(&ip->ip_dst, v->dst, sizeof(ip->ip_dst));
+    return build_tcp(buf, (struct tcp_header *)(ip + 1), v);
+}
+
+static size_t build_ip6(uint8_t *buf, const RssVector *v)
+{
+    struct eth_header *eh = (struct eth_header *)buf;
+    struct ip6_header *ip6 = (struct ip6_header *)(eh + 1);
+
+    memset(eh, 0, sizeof(*eh) + sizeof(*ip6));
+    eh->h_proto = cpu_to_be16(ETH_P_IPV6);
+    ip6->ip6_ctlun.ip6_un1.ip6_un1_flow = cpu_to_be32(6 << 28);
+    ip6->ip6_ctlun.ip6_un1.ip6_un1_plen =
+        cpu_to_be16(sizeof(struct tcp_header));
+    ip6->ip6_ctlun.ip6_un1.ip6_un1_nxt = IP_PROTO_TCP;
+    ip6->ip6_ctlun.ip6_un1.ip6_un1_hlim = 64;
+    memcpy(&ip6->ip6_src, v->src, sizeof(ip6->ip6_src));
+    memcpy(&ip6->ip6_dst, v->dst, sizeof(ip6->ip6_dst));
+    return build_tcp(buf, (struct tcp_header *)(ip6 + 1), v);
+}
+
+static void test_ip4(void)
+{
+    struct NetRxPkt *pkt;
+    uint8_t buf[128];
+    size_t len;
+    bool isip4, isip6, isudp, istcp;
+    int i;
+
+    net_rx_pkt_init(&pkt, false);
+    for (i = 0; i < ARRAY_SIZE(rss_ip4_vectors); i++) {
+        const RssVector *v = &rss_ip4_vectors[i];
+
+        len = build_ip4(buf, v);
+        net_rx_pkt_set_protocols(pkt, buf, len);
+        net_rx_pkt_get_protocols(pkt, &isip4, &isip6, &isudp, &istcp);
+        g_assert(isip4 && istcp);
+
+        g_assert_cmphex(net_rx_pkt_calc_rss_hash(pkt, NetPktRssIpV4, rss_key),
+                        ==, v->hash_ip);
+        g_assert_cmphex(net_rx_pkt_calc_rss_hash(pkt, NetPktRssIpV4Tcp,
+                                                 rss_key),
+                        ==, v->hash_ip_tcp);
+    }
+    net_rx_pkt_uninit(pkt);
+}
+
+static void test_ip6(void)
+{
+    struct NetRxPkt *pkt;
+    uint8_t buf[128];
+    size_t len;
+    bool isip4, isip6, isudp, istcp;
+    int i;
+
+    net_rx_pkt_init(&pkt, false);
+    for (i = 0; i < ARRAY_SIZE(rss_ip6_vectors); i++) {
+        const RssVector *v = &rss_ip6_vectors[i];
+
+        len = build_ip6(buf, v);
+        net_rx_pkt_set_protocols(pkt, buf, len);
+        net_rx_pkt_get_protocols(pkt, &isip4, &isip6, &isudp, &istcp);
+        g_assert(isip6 && istcp);
+
+        g_assert_cmphex(net_rx_pkt_calc_rss_hash(pkt, NetPktRssIpV6, rss_key),
+                        ==, v->hash_ip);
+        g_assert_cmphex(net_rx_pkt_calc_rss_hash(pkt, NetPktRssIpV6Tcp,
+                                                 rss_key),
+                        ==, v->hash_ip_tcp);
+    }
+    net_rx_pkt_uninit(pkt);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/net/rss/toeplitz-ipv4", test_ip4);
+    g_test_add_func("/net/rss/toeplitz-ipv6", test_ip6);
+    return g_test_run();
+}
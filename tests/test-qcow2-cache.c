@@ -0,0 +1,229 @@
+/*
+ * qcow2 metadata cache writeback tests
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+#include "block/block_int.h"
+#include "sysemu/block-backend.h"
+
+#define CLUSTER_SIZE    512
+/* Guest bytes mapped by one L2 table */
+#define L2_COVERAGE     (CLUSTER_SIZE / sizeof(uint64_t) * CLUSTER_SIZE)
+#define NUM_WRITES      4
+#define IMG_SIZE        (NUM_WRITES * L2_COVERAGE)
+
+static char img[] = "/tmp/qcow2-cache.XXXXXX";
+
+/*
+ * A filter that counts the flushes and writes that the format driver sends
+ * to its file.  While hold_flush is set, the next flush waits for the test
+ * to release it.
+ */
+static int flushes;
+static int writes;
+static bool hold_flush;
+static Coroutine *held_flush;
+
+static int flush_counter_open(BlockDriverState *bs, QDict *options, int flags,
+                              Error **errp)
+{
+    bs->file = bdrv_open_child(NULL, options, "file", bs, &child_file,
+                               false, errp);
+    return bs->file ? 0 : -EINVAL;
+}
+
+static int64_t flush_counter_getlength(BlockDriverState *bs)
+{
+    return bdrv_getlength(bs->file->bs);
+}
+
+static int coroutine_fn flush_counter_co_preadv(BlockDriverState *bs,
+                                                uint64_t offset,
+                                                uint64_t bytes,
+                                                QEMUIOVector *qiov, int flags)
+{
+    return bdrv_co_preadv(bs->file, offset, bytes, qiov, flags);
+}
+
+static int coroutine_fn flush_counter_co_pwritev(BlockDriverState *bs,
+                                                 uint64_t offset,
+                                                 uint64_t bytes,
+                                                 QEMUIOVector *qiov, int flags)
+{
+    int ret = bdrv_co_pwritev(bs->file, offset, bytes, qiov, flags);
+    writes++;
+    return ret;
+}
+
+/* Only called if something was written since the last flush */
+static int coroutine_fn flush_counter_co_flush_to_disk(BlockDriverState *bs)
+{
+    flushes++;
+    if (hold_flush) {
+        hold_flush = false;
+        held_flush = qemu_coroutine_self();
+        qemu_coroutine_yield();
+    }
+    return 0;
+}
+
+static BlockDriver bdrv_flush_counter = {
+    .format_name            = "flush-counter",
+    .bdrv_open              = flush_counter_open,
+    .bdrv_child_perm        = bdrv_filter_default_perms,
+    .bdrv_getlength         = flush_counter_getlength,
+    .bdrv_co_preadv         = flush_counter_co_preadv,
+    .bdrv_co_pwritev        = flush_counter_co_pwritev,
+    .bdrv_co_flush_to_disk  = flush_counter_co_flush_to_disk,
+    .is_filter              = true,
+};
+
+static BlockBackend *open_img(void)
+{
+    QDict *opts = qdict_new();
+
+    qdict_put_str(opts, "driver", "qcow2");
+    qdict_put_str(opts, "file.driver", "flush-counter");
+    qdict_put_str(opts, "file.file.driver", "file");
+    qdict_put_str(opts, "file.file.filename", img);
+
+    return blk_new_open(NULL, NULL, opts, BDRV_O_RDWR, &error_abort);
+}
+
+static void write_cluster(BlockBackend *blk, int64_t offset, int pattern)
+{
+    uint8_t buf[CLUSTER_SIZE];
+
+    memset(buf, pattern, sizeof(buf));
+    g_assert_cmpint(blk_pwrite(blk, offset, buf, sizeof(buf), 0), ==,
+                    sizeof(buf));
+}
+
+static void check_cluster(BlockBackend *blk, int64_t offset, int pattern)
+{
+    uint8_t buf[CLUSTER_SIZE], cmp[CLUSTER_SIZE];
+
+    memset(cmp, pattern, sizeof(cmp));
+    g_assert_cmpint(blk_pread(blk, offset, buf, sizeof(buf)), ==,
+                    sizeof(buf));
+    g_assert(!memcmp(buf, cmp, sizeof(buf)));
+}
+
+typedef struct {
+    uint8_t buf[CLUSTER_SIZE];
+    QEMUIOVector qiov;
+    struct iovec iov;
+    bool done;
+} WriteReq;
+
+static void write_cb(void *opaque, int ret)
+{
+    WriteReq *req = opaque;
+
+    g_assert_cmpint(ret, ==, 0);
+    req->done = true;
+}
+
+static void start_write(BlockBackend *blk, WriteReq *req, int64_t offset,
+                        int pattern)
+{
+    memset(req->buf, pattern, sizeof(req->buf));
+    req->iov = (struct iovec) {
+        .iov_base = req->buf,
+        .iov_len = sizeof(req->buf),
+    };
+    qemu_iovec_init_external(&req->qiov, &req->iov, 1);
+    req->done = false;
+    blk_aio_pwritev(blk, offset, &req->qiov, 0, write_cb, req);
+}
+
+/*
+ * Allocating writes in writethrough mode, each under its own L2 table.
+ * The first write's flush of the refcount blocks is held.  The other
+ * writes must still get to allocate, write their data and update their
+ * L2 tables meanwhile, i.e. s->lock is not held across the flush.  Once
+ * released, their refcount updates must go to disk together, with one
+ * flush: one for the first write, one for all others, and one for the
+ * L2 tables.
+ */
+static void test_group_commit(void)
+{
+    char create_opts[] = "cluster_size=" stringify(CLUSTER_SIZE);
+    AioContext *ctx = qemu_get_aio_context();
+    WriteReq reqs[NUM_WRITES];
+    BlockBackend *blk;
+    int i;
+
+    bdrv_img_create(img, "qcow2", NULL, NULL, create_opts, IMG_SIZE,
+                    BDRV_O_RDWR, true, &error_abort);
+
+    /* Allocate all L2 tables up front, so that only data clusters are
+     * allocated below and all tables stay in the cache */
+    blk = open_img();
+    for (i = 0; i < NUM_WRITES; i++) {
+        write_cluster(blk, i * L2_COVERAGE, 1);
+    }
+    g_assert_cmpint(blk_flush(blk), ==, 0);
+    blk_set_enable_write_cache(blk, false);
+
+    flushes = 0;
+    hold_flush = true;
+    start_write(blk, &reqs[0], CLUSTER_SIZE, 2);
+    while (!held_flush) {
+        aio_poll(ctx, true);
+    }
+    g_assert_cmpint(flushes, ==, 1);
+
+    writes = 0;
+    for (i = 1; i < NUM_WRITES; i++) {
+        start_write(blk, &reqs[i], i * L2_COVERAGE + CLUSTER_SIZE, 2);
+    }
+    /* Only the data writes, the metadata stays in the cache */
+    while (writes < NUM_WRITES - 1) {
+        aio_poll(ctx, true);
+    }
+    g_assert_cmpint(writes, ==, NUM_WRITES - 1);
+    g_assert_cmpint(flushes, ==, 1);
+
+    qemu_coroutine_enter(held_flush);
+    held_flush = NULL;
+    for (i = 0; i < NUM_WRITES; i++) {
+        while (!reqs[i].done) {
+            aio_poll(ctx, true);
+        }
+    }
+    g_assert_cmpint(flushes, ==, 3);
+    blk_unref(blk);
+
+    blk = open_img();
+    for (i = 0; i < NUM_WRITES; i++) {
+        check_cluster(blk, i * L2_COVERAGE, 1);
+        check_cluster(blk, i * L2_COVERAGE + CLUSTER_SIZE, 2);
+    }
+    blk_unref(blk);
+}
+
+int main(int argc, char **argv)
+{
+    int fd, ret;
+
+    qemu_init_main_loop(&error_fatal);
+    bdrv_init();
+    bdrv_register(&bdrv_flush_counter);
+
+    fd = mkstemp(img);
+    g_assert(fd >= 0);
+    close(fd);
+
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/qcow2-cache/group-commit", test_group_commit);
+    ret = g_test_run();
+
+    unlink(img);
+    return ret;
+}
@@ -0,0 +1,286 @@
+/*
+ * Test the host FPU fast paths of softfloat
+ *
+ * The fast paths are only taken when the inexact flag is already set, so
+ * running every operation once with a clear and once with a set inexact
+ * flag compares the host FPU against the pure software implementation.
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include "qemu/osdep.h"
+#include "fpu/softfloat.h"
+
+static const uint32_t f32_values[] = {
+    0x00000000, /* +0 */
+    0x80000000, /* -0 */
+    0x00000001, /* smallest subnormal */
+    0x007fffff, /* largest subnormal */
+    0x00800000, /* FLT_MIN */
+    0x80800000, /* -FLT_MIN */
+    0x00c00000, /* 1.5 * FLT_MIN */
+    0x01000000, /* 2 * FLT_MIN */
+    0x1f800000, /* 2^-64 */
+    0x3eaaaaab, /* 1/3 */
+    0x3f800000, /* 1 */
+    0xbf800000, /* -1 */
+    0x3fc00000, /* 1.5 */
+    0x40400000, /* 3 */
+    0x5f800000, /* 2^64 */
+    0x7f7fffff, /* FLT_MAX */
+    0xff7fffff, /* -FLT_MAX */
+    0x7f800000, /* +inf */
+    0xff800000, /* -inf */
+    0x7fc00000, /* quiet NaN */
+    0x7fa00000, /* signaling NaN */
+};
+
+static const uint64_t f64_values[] = {
+    0x0000000000000000ULL, /* +0 */
+    0x8000000000000000ULL, /* -0 */
+    0x0000000000000001ULL, /* smallest subnormal */
+    0x000fffffffffffffULL, /* largest subnormal */
+    0x0010000000000000ULL, /* DBL_MIN */
+    0x8010000000000000ULL, /* -DBL_MIN */
+    0x0018000000000000ULL, /* 1.5 * DBL_MIN */
+    0x0020000000000000ULL, /* 2 * DBL_MIN */
+    0x1ff0000000000000ULL, /* 2^-512 */
+    0x3fd5555555555555ULL, /* 1/3 */
+    0x3ff0000000000000ULL, /* 1 */
+    0xbff0000000000000ULL, /* -1 */
+    0x3ff8000000000000ULL, /* 1.5 */
+    0x4008000000000000ULL, /* 3 */
+    0x5ff0000000000000ULL, /* 2^512 */
+    0x7fefffffffffffffULL, /* DBL_MAX */
+    0xffefffffffffffffULL, /* -DBL_MAX */
+    0x7ff0000000000000ULL, /* +inf */
+    0xfff0000000000000ULL, /* -inf */
+    0x7ff8000000000000ULL, /* quiet NaN */
+    0x7ff4000000000000ULL, /* signaling NaN */
+};
+
+/* Bit 0 selects tininess detection, bits 1 and 2 the flush-to-zero modes */
+#define NUM_CONFIGS 8
+
+static void init_status(float_status *s, int config, int flags)
+{
+    memset(s, 0, sizeof(*s));
+    set_float_rounding_mode(float_round_nearest_even, s);
+    set_float_detect_tininess(config & 1 ? float_tininess_before_rounding
+                                         : float_tininess_after_rounding, s);
+    set_flush_to_zero(!!(config & 2), s);
+    set_flush_inputs_to_zero(!!(config & 4), s);
+    set_float_exception_flags(flags, s);
+}
+
+typedef struct F32Op {
+    const char *name;
+    float32 (*fn)(float32 a, float32 b, float_status *s);
+    bool unary;
+} F32Op;
+
+typedef struct F64Op {
+    const char *name;
+    float64 (*fn)(float64 a, float64 b, float_status *s);
+    bool unary;
+} F64Op;
+
+static float32 f32_sqrt(float32 a, float32 b, float_status *s)
+{
+    return float32_sqrt(a, s);
+}
+
+static float64 f64_sqrt(float64 a, float64 b, float_status *s)
+{
+    return float64_sqrt(a, s);
+}
+
+static const F32Op f32_ops[] = {
+    { "add", float32_add },
+    { "sub", float32_sub },
+    { "mul", float32_mul },
+    { "div", float32_div },
+    { "sqrt", f32_sqrt, true },
+};
+
+static const F64Op f64_ops[] = {
+    { "add", float64_add },
+    { "sub", float64_sub },
+    { "mul", float64_mul },
+    { "div", float64_div },
+    { "sqrt", f64_sqrt, true },
+};
+
+static void test_f32_op(gconstpointer opaque)
+{
+    const F32Op *op = opaque;
+    float_status soft, hard;
+    uint32_t a, b, rs, rh;
+    int fs, fh;
+    int i, j, config;
+
+    for (i = 0; i < ARRAY_SIZE(f32_values); i++) {
+        for (j = 0; j < (op->unary ? 1 : ARRAY_SIZE(f32_values)); j++) {
+            for (config = 0; config < NUM_CONFIGS; config++) {
+                a = f32_values[i];
+                b = f32_values[j];
+                init_status(&soft, config, 0);
+                init_status(&hard, config, float_flag_inexact);
+                rs = float32_val(op->fn(make_float32(a), make_float32(b),
+                                        &soft));
+                rh = float32_val(op->fn(make_float32(a), make_float32(b),
+                                        &hard));
+                fs = get_float_exception_flags(&soft) | float_flag_inexact;
+                fh = get_float_exception_flags(&hard);
+                if (rs != rh || fs != fh) {
+                    g_test_message("float32_%s(%#x, %#x), config %d",
+                                   op->name, a, b, config);
+                }
+                g_assert_cmphex(rh, ==, rs);
+                g_assert_cmphex(fh, ==, fs);
+            }
+        }
+    }
+}
+
+static void test_f64_op(gconstpointer opaque)
+{
+    const F64Op *op = opaque;
+    float_status soft, hard;
+    uint64_t a, b, rs, rh;
+    int fs, fh;
+    int i, j, config;
+
+    for (i = 0; i < ARRAY_SIZE(f64_values); i++) {
+        for (j = 0; j < (op->unary ? 1 : ARRAY_SIZE(f64_values)); j++) {
+            for (config = 0; config < NUM_CONFIGS; config++) {
+                a = f64_values[i];
+                b = f64_values[j];
+                init_status(&soft, config, 0);
+                init_status(&hard, config, float_flag_inexact);
+                rs = float64_val(op->fn(make_float64(a), make_float64(b),
+                                        &soft));
+                rh = float64_val(op->fn(make_float64(a), make_float64(b),
+                                        &hard));
+                fs = get_float_exception_flags(&soft) | float_flag_inexact;
+                fh = get_float_exception_flags(&hard);
+                if (rs != rh || fs != fh) {
+                    g_test_message("float64_%s(%#" PRIx64 ", %#" PRIx64
+                                   "), config %d", op->name, a, b, config);
+                }
+                g_assert_cmphex(rh, ==, rs);
+                g_assert_cmphex(fh, ==, fs);
+            }
+        }
+    }
+}
+
+/* Flags of a few operations with a known outcome, on both paths */
+static void test_flags(void)
+{
+    float_status s;
+    int inexact;
+
+    for (inexact = 0; inexact <= float_flag_inexact;
+         inexact += float_flag_inexact) {
+        /* 1.5 + 1.5 == 3 is exact */
+        init_status(&s, 0, inexact);
+        g_assert_cmphex(float32_val(float32_add(make_float32(0x3fc00000),
+                                                make_float32(0x3fc00000),
+                                                &s)), ==, 0x40400000);
+        g_assert_cmphex(get_float_exception_flags(&s), ==, inexact);
+
+        init_status(&s, 0, inexact);
+        g_assert_cmphex(float64_val(float64_add(
+                            make_float64(0x3ff8000000000000ULL),
+                            make_float64(0x3ff8000000000000ULL), &s)),
+                        ==, 0x4008000000000000ULL);
+        g_assert_cmphex(get_float_exception_flags(&s), ==, inexact);
+
+        /* 1 / 3 rounds */
+        init_status(&s, 0, inexact);
+        g_assert_cmphex(float32_val(float32_div(make_float32(0x3f800000),
+                                                make_float32(0x40400000),
+                                                &s)), ==, 0x3eaaaaab);
+        g_assert_cmphex(get_float_exception_flags(&s), ==,
+                        float_flag_inexact);
+
+        init_status(&s, 0, inexact);
+        g_assert_cmphex(float64_val(float64_div(
+                            make_float64(0x3ff0000000000000ULL),
+                            make_float64(0x4008000000000000ULL), &s)),
+                        ==, 0x3fd5555555555555ULL);
+        g_assert_cmphex(get_float_exception_flags(&s), ==,
+                        float_flag_inexact);
+
+        /* FLT_MAX * 2 and DBL_MAX * 2 overflow to infinity */
+        init_status(&s, 0, inexact);
+        g_assert_cmphex(float32_val(float32_mul(make_float32(0x7f7fffff),
+                                                make_float32(0x40000000),
+                                                &s)), ==, 0x7f800000);
+        g_assert_cmphex(get_float_exception_flags(&s), ==,
+                        float_flag_overflow | float_flag_inexact);
+
+        init_status(&s, 0, inexact);
+        g_assert_cmphex(float64_val(float64_mul(
+                            make_float64(0x7fefffffffffffffULL),
+                            make_float64(0x4000000000000000ULL), &s)),
+                        ==, 0x7ff0000000000000ULL);
+        g_assert_cmphex(get_float_exception_flags(&s), ==,
+                        float_flag_overflow | float_flag_inexact);
+
+        /* FLT_MIN / 3 and DBL_MIN / 3 underflow */
+        init_status(&s, 0, inexact);
+        g_assert_cmphex(float32_val(float32_div(make_float32(0x00800000),
+                                                make_float32(0x40400000),
+                                                &s)), ==, 0x002aaaab);
+        g_assert_cmphex(get_float_exception_flags(&s), ==,
+                        float_flag_underflow | float_flag_inexact);
+
+        init_status(&s, 0, inexact);
+        g_assert_cmphex(float64_val(float64_div(
+                            make_float64(0x0010000000000000ULL),
+                            make_float64(0x4008000000000000ULL), &s)),
+                        ==, 0x0005555555555555ULL);
+        g_assert_cmphex(get_float_exception_flags(&s), ==,
+                        float_flag_underflow | float_flag_inexact);
+
+        /* sqrt(-1) is invalid */
+        init_status(&s, 0, inexact);
+        g_assert(float32_is_any_nan(float32_sqrt(make_float32(0xbf800000),
+                                                 &s)));
+        g_assert_cmphex(get_float_exception_flags(&s), ==,
+                        float_flag_invalid | inexact);
+
+        init_status(&s, 0, inexact);
+        g_assert(float64_is_any_nan(float64_sqrt(
+                     make_float64(0xbff0000000000000ULL), &s)));
+        g_assert_cmphex(get_float_exception_flags(&s), ==,
+                        float_flag_invalid | inexact);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+
+    g_test_init(&argc, &argv, NULL);
+
+    for (i = 0; i < ARRAY_SIZE(f32_ops); i++) {
+        char *path = g_strdup_printf("/softfloat/float32/%s",
+                                     f32_ops[i].name);
+        g_test_add_data_func(path, &f32_ops[i], test_f32_op);
+        g_free(path);
+    }
+    for (i = 0; i < ARRAY_SIZE(f64_ops); i++) {
+        char *path = g_strdup_printf("/softfloat/float64/%s",
+                                     f64_ops[i].name);
+        g_test_add_data_func(path, &f64_ops[i], test_f64_op);
+        g_free(path);
+    }
+    g_test_add_func("/softfloat/flags", test_flags);
+
+    return g_test_run();
+}
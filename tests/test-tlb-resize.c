@@ -0,0 +1,82 @@
+/*
+ * Dynamic TLB sizing policy test
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "exec/tlb-resize.h"
+
+#define MIN_SIZE    (1 << 6)
+#define MAX_SIZE    (1 << 22)
+
+static size_t new_size(size_t old_size, size_t max_entries, bool expired)
+{
+    return tlb_resize_new_size(old_size, max_entries, expired,
+                               MIN_SIZE, MAX_SIZE);
+}
+
+static void test_grow(void)
+{
+    /* Above 70% the table doubles, whether or not the window is over */
+    g_assert_cmpuint(new_size(256, 182, false), ==, 512);
+    g_assert_cmpuint(new_size(256, 182, true), ==, 512);
+    g_assert_cmpuint(new_size(256, 256, false), ==, 512);
+    g_assert_cmpuint(new_size(MIN_SIZE, MIN_SIZE, false), ==, 2 * MIN_SIZE);
+
+    /* ... but not beyond the maximum */
+    g_assert_cmpuint(new_size(MAX_SIZE, MAX_SIZE, true), ==, MAX_SIZE);
+}
+
+static void test_keep(void)
+{
+    /* Between 30% and 70% the size does not change */
+    g_assert_cmpuint(new_size(256, 180, true), ==, 256);
+    g_assert_cmpuint(new_size(256, 128, true), ==, 256);
+    g_assert_cmpuint(new_size(256, 77, true), ==, 256);
+
+    /* Below 30%, only a window that is over can shrink the table */
+    g_assert_cmpuint(new_size(1024, 100, false), ==, 1024);
+    g_assert_cmpuint(new_size(1024, 0, false), ==, 1024);
+}
+
+static void test_shrink(void)
+{
+    g_assert_cmpuint(new_size(1024, 40, true), ==, 64);
+    g_assert_cmpuint(new_size(4096, 600, true), ==, 1024);
+
+    /* Just below a power of two, leave room to avoid growing right away */
+    g_assert_cmpuint(new_size(1024, 100, true), ==, 256);
+    g_assert_cmpuint(new_size(4096, 1023, true), ==, 2048);
+
+    /* Never below the minimum */
+    g_assert_cmpuint(new_size(1024, 10, true), ==, MIN_SIZE);
+    g_assert_cmpuint(new_size(1024, 0, true), ==, MIN_SIZE);
+}
+
+static void test_shrink_is_stable(void)
+{
+    size_t old_size = 1 << 16;
+    size_t max_entries, size;
+
+    /* After shrinking, the same use must not make the table grow again */
+    for (max_entries = 0; max_entries * 100 / old_size < 30; max_entries++) {
+        size = new_size(old_size, max_entries, true);
+        g_assert(is_power_of_2(size));
+        g_assert_cmpuint(size, >=, MIN_SIZE);
+        g_assert_cmpuint(size, <, old_size);
+        g_assert_cmpuint(new_size(size, max_entries, false), ==, size);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/tlb-resize/grow", test_grow);
+    g_test_add_func("/tlb-resize/keep", test_keep);
+    g_test_add_func("/tlb-resize/shrink", test_shrink);
+    g_test_add_func("/tlb-resize/shrink-is-stable", test_shrink_is_stable);
+    return g_test_run();
+}
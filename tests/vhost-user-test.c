@@ -25,6 +25,8 @@
 
 #include "libqos/malloc-pc.h"
 #include "hw/virtio/virtio-net.h"
+#include "standard-headers/linux/virtio_blk.h"
+#include "standard-headers/linux/virtio_pci.h"
 
 #include <linux/vhost.h>
 #include <linux/virtio_ids.h>
@@ -60,6 +62,7 @@
 #define VHOST_USER_F_PROTOCOL_FEATURES 30
 #define VHOST_USER_PROTOCOL_F_MQ 0
 #define VHOST_USER_PROTOCOL_F_LOG_SHMFD 1
+#define VHOST_USER_PROTOCOL_F_CONFIG 7
 
 #define VHOST_LOG_PAGE 0x1000
 
@@ -83,6 +86,8 @@ typedef enum VhostUserRequest {
     VHOST_USER_SET_PROTOCOL_FEATURES = 16,
     VHOST_USER_GET_QUEUE_NUM = 17,
     VHOST_USER_SET_VRING_ENABLE = 18,
+    VHOST_USER_GET_CONFIG = 24,
+    VHOST_USER_SET_CONFIG = 25,
     VHOST_USER_MAX
 } VhostUserRequest;
 
@@ -104,6 +109,15 @@ typedef struct VhostUserLog {
     uint64_t mmap_offset;
 } VhostUserLog;
 
+#define VHOST_USER_MAX_CONFIG_SIZE 256
+
+typedef struct VhostUserConfig {
+    uint32_t offset;
+    uint32_t size;
+    uint32_t flags;
+    uint8_t region[VHOST_USER_MAX_CONFIG_SIZE];
+} VhostUserConfig;
+
 typedef struct VhostUserMsg {
     VhostUserRequest request;
 
@@ -119,6 +133,7 @@ typedef struct VhostUserMsg {
         struct vhost_vring_addr addr;
         VhostUserMemory memory;
         VhostUserLog log;
+        VhostUserConfig config;
     } payload;
 } QEMU_PACKED VhostUserMsg;
 
@@ -129,6 +144,10 @@ static VhostUserMsg m __attribute__ ((unused));
 
 #define VHOST_USER_PAYLOAD_SIZE (sizeof(m) - VHOST_USER_HDR_SIZE)
 
+#define VHOST_USER_CONFIG_HDR_SIZE (sizeof(m.payload.config.offset) \
+                                   + sizeof(m.payload.config.size) \
+                                   + sizeof(m.payload.config.flags))
+
 /* The version of the protocol we support */
 #define VHOST_USER_VERSION    (0x1)
 /*****************************************************************************/
@@ -156,6 +175,8 @@ typedef struct TestServer {
     bool test_fail;
     int test_flags;
     int queues;
+    struct virtio_blk_config blkcfg;
+    bool set_config_seen;
 } TestServer;
 
 static const char *tmpfs;
@@ -325,7 +346,8 @@ static void chr_read(void *opaque, const uint8_t *buf, int size)
         /* send back features to qemu */
         msg.flags |= VHOST_USER_REPLY_MASK;
         msg.size = sizeof(m.payload.u64);
-        msg.payload.u64 = 1 << VHOST_USER_PROTOCOL_F_LOG_SHMFD;
+        msg.payload.u64 = 1 << VHOST_USER_PROTOCOL_F_LOG_SHMFD |
+                          1 << VHOST_USER_PROTOCOL_F_CONFIG;
         if (s->queues > 1) {
             msg.payload.u64 |= 1 << VHOST_USER_PROTOCOL_F_MQ;
         }
@@ -394,6 +416,26 @@ static void chr_read(void *opaque, const uint8_t *buf, int size)
         qemu_chr_fe_write_all(chr, p, VHOST_USER_HDR_SIZE + msg.size);
         break;
 
+    case VHOST_USER_GET_CONFIG:
+        g_assert_cmpint(msg.payload.config.offset, ==, 0);
+        g_assert_cmpint(msg.payload.config.size, <=, sizeof(s->blkcfg));
+        msg.flags |= VHOST_USER_REPLY_MASK;
+        msg.size = VHOST_USER_CONFIG_HDR_SIZE + msg.payload.config.size;
+        memcpy(msg.payload.config.region, &s->blkcfg,
+               msg.payload.config.size);
+        p = (uint8_t *) &msg;
+        qemu_chr_fe_write_all(chr, p, VHOST_USER_HDR_SIZE + msg.size);
+        break;
+
+    case VHOST_USER_SET_CONFIG:
+        g_assert_cmpint(msg.payload.config.offset +
+                        msg.payload.config.size, <=, sizeof(s->blkcfg));
+        memcpy((uint8_t *)&s->blkcfg + msg.payload.config.offset,
+               msg.payload.config.region, msg.payload.config.size);
+        s->set_config_seen = true;
+        g_cond_signal(&s->data_cond);
+        break;
+
     default:
         break;
     }
@@ -918,6 +960,74 @@ static void test_multiqueue(void)
     test_server_free(s);
 }
 
+static void test_blk_config(void)
+{
+    TestServer *s = test_server_new("blk");
+    QVirtioPCIDevice *dev;
+    QPCIBus *bus;
+    gint64 end_time;
+    char *cmd;
+
+    /* The backend owns the config space, in little-endian order */
+    s->blkcfg.capacity = cpu_to_le64(0x123456);
+    s->blkcfg.seg_max = cpu_to_le32(126);
+    s->blkcfg.blk_size = cpu_to_le32(4096);
+    s->blkcfg.wce = 1;
+    test_server_listen(s);
+
+    cmd = g_strdup_printf(QEMU_CMD_MEM QEMU_CMD_CHR
+                          " -device vhost-user-blk-pci,chardev=%s",
+                          512, 512, root, s->chr_name,
+                          s->socket_path, "", s->chr_name);
+    qtest_start(cmd);
+    g_free(cmd);
+
+    bus = qpci_init_pc(NULL);
+    dev = qvirtio_pci_device_find(bus, VIRTIO_ID_BLOCK);
+    g_assert(dev != NULL);
+    qvirtio_pci_device_enable(dev);
+
+    g_assert_cmphex(qvirtio_config_readq(&dev->vdev, 0), ==, 0x123456);
+    g_assert_cmpint(qvirtio_config_readl(&dev->vdev,
+                        offsetof(struct virtio_blk_config, seg_max)),
+                    ==, 126);
+    g_assert_cmpint(qvirtio_config_readl(&dev->vdev,
+                        offsetof(struct virtio_blk_config, blk_size)),
+                    ==, 4096);
+    g_assert_cmpint(qvirtio_config_readb(&dev->vdev,
+                        offsetof(struct virtio_blk_config, wce)),
+                    ==, 1);
+
+    /* A guest write of the cache mode is forwarded to the backend */
+    qpci_io_writeb(dev->pdev, dev->bar,
+                   VIRTIO_PCI_CONFIG_OFF(dev->pdev->msix_enabled) +
+                   offsetof(struct virtio_blk_config, wce), 0);
+
+    g_mutex_lock(&s->data_mutex);
+    end_time = g_get_monotonic_time() + 5 * G_TIME_SPAN_SECOND;
+    while (!s->set_config_seen) {
+        if (!g_cond_wait_until(&s->data_cond, &s->data_mutex, end_time)) {
+            /* timeout has passed */
+            g_assert(s->set_config_seen);
+            break;
+        }
+    }
+    g_assert_cmpint(s->blkcfg.wce, ==, 0);
+    g_mutex_unlock(&s->data_mutex);
+
+    g_assert_cmpint(qvirtio_config_readb(&dev->vdev,
+                        offsetof(struct virtio_blk_config, wce)),
+                    ==, 0);
+
+    qvirtio_pci_device_disable(dev);
+    g_free(dev->pdev);
+    g_free(dev);
+    qpci_free_pc(bus);
+    qtest_end();
+
+    test_server_free(s);
+}
+
 int main(int argc, char **argv)
 {
     QTestState *s = NULL;
@@ -964,6 +1074,7 @@ int main(int argc, char **argv)
     qtest_add_data_func("/vhost-user/read-guest-mem", server, read_guest_mem);
     qtest_add_func("/vhost-user/migrate", test_migrate);
     qtest_add_func("/vhost-user/multiqueue", test_multiqueue);
+    qtest_add_func("/vhost-user/blk-config", test_blk_config);
 
 #if VHOST_USER_NET_TESTS_WORKING && defined(CONFIG_HAS_GLIB_SUBPROCESS_TESTS)
     qtest_add_func("/vhost-user/reconnect/subprocess",
@@ -27,6 +27,7 @@
 
 #define QVIRTIO_NET_TIMEOUT_US (30 * 1000 * 1000)
 #define VNET_HDR_SIZE sizeof(struct virtio_net_hdr_mrg_rxbuf)
+#define BURST_LEN 8
 
 static void test_end(void)
 {
@@ -189,6 +190,112 @@ static void rx_stop_cont_test(QVirtioDevice *dev,
     guest_free(alloc, req_addr);
 }
 
+/* Wait until the @n buffers in @heads have been used, in order.  The
+ * device may signal a whole burst of completions only once.
+ */
+static void wait_used_burst(QVirtioDevice *dev, QVirtQueue *vq,
+                            uint32_t *heads, int n)
+{
+    gint64 start_time = g_get_monotonic_time();
+    bool notified = false;
+    uint32_t desc_idx;
+    int i = 0;
+
+    while (i < n) {
+        clock_step(100);
+        if (dev->bus->get_queue_isr_status(dev, vq)) {
+            notified = true;
+        }
+        while (i < n && qvirtqueue_get_buf(vq, &desc_idx)) {
+            g_assert_cmpint(desc_idx, ==, heads[i]);
+            i++;
+        }
+        g_assert(g_get_monotonic_time() - start_time <=
+                 QVIRTIO_NET_TIMEOUT_US);
+    }
+    g_assert(notified || dev->bus->get_queue_isr_status(dev, vq));
+}
+
+static void rx_burst_test(QVirtioDevice *dev,
+                          QGuestAllocator *alloc, QVirtQueue *vq,
+                          int socket)
+{
+    uint64_t req_addr[BURST_LEN];
+    uint32_t free_head[BURST_LEN];
+    char test[] = "TEST0";
+    char buffer[64];
+    uint8_t stream[BURST_LEN * (sizeof(uint32_t) + sizeof(test))];
+    uint8_t *p = stream;
+    uint32_t len = htonl(sizeof(test));
+    int i, ret;
+
+    for (i = 0; i < BURST_LEN; i++) {
+        req_addr[i] = guest_alloc(alloc, 64);
+        free_head[i] = qvirtqueue_add(vq, req_addr[i], 64, true, false);
+        qvirtqueue_kick(dev, vq, free_head[i]);
+
+        test[4] = '0' + i;
+        memcpy(p, &len, sizeof(len));
+        memcpy(p + sizeof(len), test, sizeof(test));
+        p += sizeof(len) + sizeof(test);
+    }
+
+    /* All packets in one write, so that the backend gets them at once */
+    ret = send(socket, stream, sizeof(stream), 0);
+    g_assert_cmpint(ret, ==, sizeof(stream));
+
+    wait_used_burst(dev, vq, free_head, BURST_LEN);
+    for (i = 0; i < BURST_LEN; i++) {
+        test[4] = '0' + i;
+        memread(req_addr[i] + VNET_HDR_SIZE, buffer, sizeof(test));
+        g_assert_cmpstr(buffer, ==, test);
+        guest_free(alloc, req_addr[i]);
+    }
+}
+
+static void tx_burst_test(QVirtioDevice *dev,
+                          QGuestAllocator *alloc, QVirtQueue *vq,
+                          int socket)
+{
+    uint64_t req_addr[BURST_LEN];
+    uint32_t free_head[BURST_LEN];
+    char test[] = "TEST0";
+    char buffer[64];
+    uint32_t len;
+    QDict *rsp;
+    int i, ret;
+
+    /* Queue the whole burst while stopped, so that it is flushed at once */
+    rsp = qmp("{ 'execute' : 'stop'}");
+    QDECREF(rsp);
+
+    for (i = 0; i < BURST_LEN; i++) {
+        test[4] = '0' + i;
+        req_addr[i] = guest_alloc(alloc, 64);
+        memwrite(req_addr[i] + VNET_HDR_SIZE, test, sizeof(test));
+        free_head[i] = qvirtqueue_add(vq, req_addr[i], 64, false, false);
+        qvirtqueue_kick(dev, vq, free_head[i]);
+    }
+
+    rsp = qmp("{ 'execute' : 'cont'}");
+    QDECREF(rsp);
+
+    wait_used_burst(dev, vq, free_head, BURST_LEN);
+    for (i = 0; i < BURST_LEN; i++) {
+        guest_free(alloc, req_addr[i]);
+
+        ret = qemu_recv(socket, &len, sizeof(len), 0);
+        g_assert_cmpint(ret, ==, sizeof(len));
+        len = ntohl(len);
+        g_assert_cmpint(len, <=, sizeof(buffer));
+
+        ret = qemu_recv(socket, buffer, len, 0);
+        g_assert_cmpint(ret, ==, len);
+        test[4] = '0' + i;
+        g_assert_cmpstr(buffer, ==, test);
+    }
+}
+
 static void send_recv_test(QVirtioDevice *dev,
                            QGuestAllocator *alloc, QVirtQueue *rvq,
                            QVirtQueue *tvq, int socket)
@@ -204,6 +311,14 @@ static void stop_cont_test(QVirtioDevice *dev,
     rx_stop_cont_test(dev, alloc, rvq, socket);
 }
 
+static void burst_test(QVirtioDevice *dev,
+                       QGuestAllocator *alloc, QVirtQueue *rvq,
+                       QVirtQueue *tvq, int socket)
+{
+    rx_burst_test(dev, alloc, rvq, socket);
+    tx_burst_test(dev, alloc, tvq, socket);
+}
+
 static void pci_basic(gconstpointer data)
 {
     QVirtioPCIDevice *dev;
@@ -237,6 +352,295 @@ static void pci_basic(gconstpointer data)
     g_free(dev);
     qtest_shutdown(qs);
 }
+
+static QOSState *pci_test_start_modern(int socket, const char *opts)
+{
+    const char *cmd = "-netdev socket,fd=%d,id=hs0 -device "
+                      "virtio-net-pci,netdev=hs0,%s";
+
+    if (strcmp(qtest_get_arch(), "i386") == 0 ||
+        strcmp(qtest_get_arch(), "x86_64") == 0) {
+        return qtest_pc_boot(cmd, socket, opts);
+    }
+    return qtest_spapr_boot(cmd, socket, opts);
+}
+
+/* Drive the device through its virtio 1.0 interface with @features */
+static QVirtioPCIDevice *virtio_net_pci_init_modern(QPCIBus *bus,
+                                                    uint64_t features)
+{
+    QVirtioPCIDevice *dev;
+
+    dev = qvirtio_pci_device_find(bus, VIRTIO_ID_NET);
+    g_assert(dev != NULL);
+
+    qvirtio_pci_device_enable_modern(dev);
+    qvirtio_reset(&dev->vdev);
+    qvirtio_set_acknowledge(&dev->vdev);
+    qvirtio_set_driver(&dev->vdev);
+
+    g_assert_cmphex(qvirtio_get_features(&dev->vdev) & features, ==,
+                    features);
+    qvirtio_set_features(&dev->vdev, features);
+
+    return dev;
+}
+
+/* The Microsoft RSS verification key and its first IPv4 vector */
+static const uint8_t hash_key[] = {
+    0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+    0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+    0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+    0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+    0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+#define HASH_SRC_IP     66, 9, 149, 187
+#define HASH_DST_IP     161, 142, 100, 80
+#define HASH_VALUE      0x323e8fc2
+
+static void ctrl_hash_config(QVirtioDevice *dev, QGuestAllocator *alloc,
+                             QVirtQueue *vq)
+{
+    struct virtio_net_ctrl_hdr hdr = {
+        .class = VIRTIO_NET_CTRL_MQ,
+        .cmd = VIRTIO_NET_CTRL_MQ_HASH_CONFIG,
+    };
+    struct virtio_net_hash_config cfg = {
+        .hash_types = cpu_to_le32(VIRTIO_NET_RSS_HASH_TYPE_IPv4),
+        .hash_key_length = sizeof(hash_key),
+    };
+    /* The key follows hash_key_length directly, without padding */
+    size_t cfg_len = offsetof(struct virtio_net_hash_config, hash_key_data);
+    size_t req_len = sizeof(hdr) + cfg_len + sizeof(hash_key);
+    uint64_t req_addr, ack_addr;
+    uint32_t free_head;
+
+    req_addr = guest_alloc(alloc, req_len);
+    ack_addr = guest_alloc(alloc, 1);
+    memwrite(req_addr, &hdr, sizeof(hdr));
+    memwrite(req_addr + sizeof(hdr), &cfg, cfg_len);
+    memwrite(req_addr + sizeof(hdr) + cfg_len, hash_key, sizeof(hash_key));
+    writeb(ack_addr, 0xff);
+
+    free_head = qvirtqueue_add(vq, req_addr, req_len, false, true);
+    qvirtqueue_add(vq, ack_addr, 1, true, false);
+    qvirtqueue_kick(dev, vq, free_head);
+
+    qvirtio_wait_used_elem(dev, vq, free_head, QVIRTIO_NET_TIMEOUT_US);
+    g_assert_cmpint(readb(ack_addr), ==, VIRTIO_NET_OK);
+
+    guest_free(alloc, ack_addr);
+    guest_free(alloc, req_addr);
+}
+
+/*
+ * Negotiate VIRTIO_NET_F_HASH_REPORT over the modern interface and check
+ * that the rx header grows to struct virtio_net_hdr_v1_hash, with the
+ * packet behind it.
+ */
+static void pci_hash_report(void)
+{
+    QVirtioPCIDevice *dev;
+    QOSState *qs;
+    QVirtQueuePCI *tx, *rx, *ctrl;
+    struct virtio_net_hdr_v1_hash hdr;
+    uint64_t req_addr;
+    uint32_t free_head;
+    uint8_t pkt[] = {
+        /* Ethernet: broadcast, IPv4 */
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0x52, 0x54, 0x00, 0x12, 0x34, 0x57,
+        0x08, 0x00,
+        /* IPv4: no options, no fragments, experimental protocol 253 */
+        0x45, 0x00, 0x00, 0x14, 0x00, 0x00, 0x00, 0x00,
+        0x40, 0xfd, 0x00, 0x00,
+        HASH_SRC_IP,
+        HASH_DST_IP,
+    };
+    uint8_t buffer[sizeof(pkt)];
+    uint32_t len = htonl(sizeof(pkt));
+    struct iovec iov[] = {
+        {
+            .iov_base = &len,
+            .iov_len = sizeof(len),
+        }, {
+            .iov_base = pkt,
+            .iov_len = sizeof(pkt),
+        },
+    };
+    int sv[2], ret;
+
+    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, sv);
+    g_assert_cmpint(ret, !=, -1);
+
+    qs = pci_test_start_modern(sv[1], "hash=on");
+    dev = virtio_net_pci_init_modern(qs->pcibus,
+                                     (1ull << VIRTIO_F_VERSION_1) |
+                                     (1ull << VIRTIO_NET_F_MRG_RXBUF) |
+                                     (1ull << VIRTIO_NET_F_CTRL_VQ) |
+                                     (1ull << VIRTIO_NET_F_HASH_REPORT));
+
+    rx = (QVirtQueuePCI *)qvirtqueue_setup(&dev->vdev, qs->alloc, 0);
+    tx = (QVirtQueuePCI *)qvirtqueue_setup(&dev->vdev, qs->alloc, 1);
+    ctrl = (QVirtQueuePCI *)qvirtqueue_setup(&dev->vdev, qs->alloc, 2);
+    qvirtio_set_driver_ok(&dev->vdev);
+
+    ctrl_hash_config(&dev->vdev, qs->alloc, &ctrl->vq);
+
+    req_addr = guest_alloc(qs->alloc, 64);
+    free_head = qvirtqueue_add(&rx->vq, req_addr, 64, true, false);
+    qvirtqueue_kick(&dev->vdev, &rx->vq, free_head);
+
+    ret = iov_send(sv[0], iov, 2, 0, sizeof(len) + sizeof(pkt));
+    g_assert_cmpint(ret, ==, sizeof(len) + sizeof(pkt));
+
+    qvirtio_wait_used_elem(&dev->vdev, &rx->vq, free_head,
+                           QVIRTIO_NET_TIMEOUT_US);
+
+    memread(req_addr, &hdr, sizeof(hdr));
+    g_assert_cmpint(le16_to_cpu(hdr.hdr.num_buffers), ==, 1);
+    g_assert_cmphex(le32_to_cpu(hdr.hash_value), ==, HASH_VALUE);
+    g_assert_cmpint(le16_to_cpu(hdr.hash_report), ==,
+                    VIRTIO_NET_HASH_REPORT_IPv4);
+    memread(req_addr + sizeof(hdr), buffer, sizeof(buffer));
+    g_assert(memcmp(buffer, pkt, sizeof(pkt)) == 0);
+
+    /* End test */
+    guest_free(qs->alloc, req_addr);
+    close(sv[0]);
+    qvirtqueue_cleanup(dev->vdev.bus, &ctrl->vq, qs->alloc);
+    qvirtqueue_cleanup(dev->vdev.bus, &tx->vq, qs->alloc);
+    qvirtqueue_cleanup(dev->vdev.bus, &rx->vq, qs->alloc);
+    qvirtio_pci_device_disable(dev);
+    g_free(dev->pdev);
+    g_free(dev);
+    qtest_shutdown(qs);
+}
+
+static void set_link(bool up)
+{
+    QDict *rsp;
+
+    rsp = qmp("{ 'execute': 'set_link',"
+              " 'arguments': { 'name': 'hs0', 'up': %i } }", up);
+    g_assert(!qdict_haskey(rsp, "error"));
+    QDECREF(rsp);
+}
+
+/* With the link down, transmitted buffers are dropped, i.e. returned to the
+ * guest without being sent.  Two descriptor buffers make the ring wrap.  */
+static void tx_drop_test(QVirtioDevice *dev,
+                         QGuestAllocator *alloc, QVirtQueue *vq,
+                         int socket)
+{
+    uint64_t req_addr;
+    uint32_t free_head;
+    int i;
+
+    set_link(false);
+
+    req_addr = guest_alloc(alloc, 64);
+    memwrite(req_addr + VNET_HDR_SIZE, "DROP", 4);
+    for (i = 0; i < vq->size / 2 + 1; i++) {
+        free_head = qvirtqueue_add(vq, req_addr, VNET_HDR_SIZE, false, true);
+        qvirtqueue_add(vq, req_addr + VNET_HDR_SIZE, 4, false, false);
+        qvirtqueue_kick(dev, vq, free_head);
+        qvirtio_wait_used_elem(dev, vq, free_head, QVIRTIO_NET_TIMEOUT_US);
+    }
+    guest_free(alloc, req_addr);
+
+    set_link(true);
+}
+
+static QVirtioPCIDevice *pci_packed_start(QOSState **qs, int *sv,
+                                          QVirtQueuePCI **rx,
+                                          QVirtQueuePCI **tx)
+{
+    QVirtioPCIDevice *dev;
+    int ret;
+
+    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, sv);
+    g_assert_cmpint(ret, !=, -1);
+
+    *qs = pci_test_start_modern(sv[1], "packed=on");
+    dev = virtio_net_pci_init_modern((*qs)->pcibus,
+                                     (1ull << VIRTIO_F_VERSION_1) |
+                                     (1ull << VIRTIO_F_RING_PACKED));
+
+    *rx = (QVirtQueuePCI *)qvirtqueue_setup(&dev->vdev, (*qs)->alloc, 0);
+    *tx = (QVirtQueuePCI *)qvirtqueue_setup(&dev->vdev, (*qs)->alloc, 1);
+    g_assert((*rx)->vq.packed && (*tx)->vq.packed);
+    qvirtio_set_driver_ok(&dev->vdev);
+
+    return dev;
+}
+
+static void pci_packed_end(QOSState *qs, QVirtioPCIDevice *dev, int *sv,
+                           QVirtQueuePCI *rx, QVirtQueuePCI *tx)
+{
+    close(sv[0]);
+    qvirtqueue_cleanup(dev->vdev.bus, &tx->vq, qs->alloc);
+    qvirtqueue_cleanup(dev->vdev.bus, &rx->vq, qs->alloc);
+    qvirtio_pci_device_disable(dev);
+    g_free(dev->pdev);
+    g_free(dev);
+    qtest_shutdown(qs);
+}
+
+/* Pop, push and drop buffers on packed rings */
+static void pci_packed(void)
+{
+    QVirtioPCIDevice *dev;
+    QOSState *qs;
+    QVirtQueuePCI *tx, *rx;
+    int sv[2];
+
+    dev = pci_packed_start(&qs, sv, &rx, &tx);
+
+    rx_test(&dev->vdev, qs->alloc, &rx->vq, sv[0]);
+    tx_test(&dev->vdev, qs->alloc, &tx->vq, sv[0]);
+    rx_burst_test(&dev->vdev, qs->alloc, &rx->vq, sv[0]);
+    tx_burst_test(&dev->vdev, qs->alloc, &tx->vq, sv[0]);
+
+    /* Nothing dropped reaches the socket, and the ring stays in sync */
+    tx_drop_test(&dev->vdev, qs->alloc, &tx->vq, sv[0]);
+    tx_test(&dev->vdev, qs->alloc, &tx->vq, sv[0]);
+
+    pci_packed_end(qs, dev, sv, rx, tx);
+}
+
+/* A chain that never ends must not hang the device when it is dropped */
+static void pci_packed_drop_loop(void)
+{
+    QVirtioPCIDevice *dev;
+    QOSState *qs;
+    QVirtQueuePCI *tx, *rx;
+    gint64 start_time;
+    uint64_t req_addr;
+    uint32_t free_head;
+    int sv[2], i;
+
+    dev = pci_packed_start(&qs, sv, &rx, &tx);
+    set_link(false);
+
+    req_addr = guest_alloc(qs->alloc, 64);
+    free_head = qvirtqueue_add(&tx->vq, req_addr, 64, false, true);
+    for (i = 1; i < tx->vq.size; i++) {
+        qvirtqueue_add(&tx->vq, req_addr, 64, false, true);
+    }
+    qvirtqueue_kick(&dev->vdev, &tx->vq, free_head);
+
+    start_time = g_get_monotonic_time();
+    while (!(dev->vdev.bus->get_status(&dev->vdev) &
+             VIRTIO_CONFIG_S_NEEDS_RESET)) {
+        clock_step(100);
+        g_assert(g_get_monotonic_time() - start_time <=
+                 QVIRTIO_NET_TIMEOUT_US);
+    }
+
+    guest_free(qs->alloc, req_addr);
+    pci_packed_end(qs, dev, sv, rx, tx);
+}
 #endif
 
 static void hotplug(void)
@@ -261,6 +665,10 @@ int main(int argc, char **argv)
     qtest_add_data_func("/virtio/net/pci/basic", send_recv_test, pci_basic);
     qtest_add_data_func("/virtio/net/pci/rx_stop_cont",
                         stop_cont_test, pci_basic);
+    qtest_add_data_func("/virtio/net/pci/burst", burst_test, pci_basic);
+    qtest_add_func("/virtio/net/pci/hash_report", pci_hash_report);
+    qtest_add_func("/virtio/net/pci/packed", pci_packed);
+    qtest_add_func("/virtio/net/pci/packed/drop_loop", pci_packed_drop_loop);
 #endif
     qtest_add_func("/virtio/net/pci/hotplug", hotplug);
 
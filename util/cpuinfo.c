@@ -0,0 +1,47 @@
+/*
+ * Host x86 ISA features used by the accelerated utility routines
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/cpuinfo.h"
+#include "qemu/cpuid.h"
+
+unsigned cpuinfo;
+
+unsigned __attribute__((constructor)) cpuinfo_init(void)
+{
+    unsigned info = cpuinfo;
+    int max, a, b, c, d;
+
+    if (info) {
+        return info;
+    }
+
+    info = CPUINFO_ALWAYS;
+    max = __get_cpuid_max(0, NULL);
+    if (max >= 1) {
+        __cpuid(1, a, b, c, d);
+        if (d & bit_SSE2) {
+            info |= CPUINFO_SSE2;
+        }
+        if (c & bit_SSE4_1) {
+            info |= CPUINFO_SSE4_1;
+        }
+
+        /* We must check that AVX is not just available, but usable.  */
+        if ((c & bit_OSXSAVE) && (c & bit_AVX) && max >= 7) {
+            int bv;
+            __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+            __cpuid_count(7, 0, a, b, c, d);
+            if ((bv & 6) == 6 && (b & bit_AVX2)) {
+                info |= CPUINFO_AVX2;
+            }
+        }
+    }
+
+    cpuinfo = info;
+    return info;
+}
@@ -569,6 +569,49 @@ void hbitmap_deserialize_ones(HBitmap *hb, uint64_t start, uint64_t count,
     }
 }
 
+void hbitmap_merge_part(HBitmap *hb, uint8_t *buf,
+                        uint64_t start, uint64_t count)
+{
+    uint64_t el_count, first, i;
+    unsigned long *cur;
+
+    if (!count) {
+        return;
+    }
+    serialization_chunk(hb, start, count, &cur, &el_count);
+    first = cur - hb->levels[HBITMAP_LEVELS - 1];
+
+    for (i = 0; i < el_count; i++, buf += sizeof(unsigned long)) {
+        unsigned long el, old = cur[i];
+
+        memcpy(&el, buf, sizeof(el));
+        el = (BITS_PER_LONG == 32 ? le32_to_cpu(el) : le64_to_cpu(el));
+
+        /* Never set bits beyond the end of the bitmap */
+        if (first + i == hb->sizes[HBITMAP_LEVELS - 1] - 1 &&
+            (hb->size & (BITS_PER_LONG - 1))) {
+            el &= (1UL << (hb->size & (BITS_PER_LONG - 1))) - 1;
+        }
+
+        cur[i] |= el;
+        if (cur[i] == old) {
+            continue;
+        }
+
+        hb->count += ctpopl(cur[i]) - ctpopl(old);
+        if (!old) {
+            hb_set_between(hb, HBITMAP_LEVELS - 2, first + i, first + i);
+        }
+        if (hb->meta) {
+            uint64_t el_start = ((first + i) << BITS_PER_LEVEL) <<
+                                hb->granularity;
+            hbitmap_set(hb->meta, el_start,
+                        MIN(UINT64_C(BITS_PER_LONG) << hb->granularity,
+                            (hb->size << hb->granularity) - el_start));
+        }
+    }
+}
+
 void hbitmap_deserialize_finish(HBitmap *bitmap)
 {
     int64_t i, size, prev_size;